@@ -25,6 +25,15 @@ _big_block_unpack(BigBlock * block, void * buf);
 
 int _dtype_normalize(char * dst, const char * src);
 
+/* The frame table of a compressed block: rows of {fileid, roffset, nelem, byte offset of the frame} */
+#define FRAME_TABLE_NCOL 4
+
+/* Copy the frame table to a malloced array. */
+int _big_block_get_frames(BigBlock * bb, uint64_t ** frames, size_t * nframes); /* raises */
+
+/* Merge frames into the frame table; of the frames starting at the same element, the last written is kept. */
+int _big_block_add_frames(BigBlock * bb, const uint64_t * frames, size_t nframes); /* raises */
+
 int _big_block_open(BigBlock * bb, const char * basename); /* raises */
 int _big_block_create(BigBlock * bb, const char * basename, const char * dtype, int nmemb, int Nfile, const size_t fsize[]); /* raises*/
 
@@ -1,4 +1,5 @@
 #include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <alloca.h>
@@ -232,6 +233,48 @@ big_block_mpi_grow_simple(BigBlock * bb, int Nfile_grow, size_t size_grow, MPI_C
 }
 
 
+/* Merge the frames written by all ranks into the frame table on the root. */
+static int
+_big_block_mpi_gather_frames(BigBlock * block, int root, MPI_Comm comm)
+{
+    int rank, NTask, i;
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &NTask);
+
+    uint64_t * frames = NULL;
+    uint64_t * all = NULL;
+    size_t nframes = 0;
+    int rt = _big_block_get_frames(block, &frames, &nframes);
+    int count = nframes * FRAME_TABLE_NCOL;
+    int * recvcounts = NULL;
+    int * recvdispls = NULL;
+
+    if(rank == root) {
+        recvcounts = malloc(sizeof(int) * NTask);
+        recvdispls = malloc(sizeof(int) * (NTask + 1));
+    }
+    MPI_Gather(&count, 1, MPI_INT, recvcounts, 1, MPI_INT, root, comm);
+    if(rank == root) {
+        recvdispls[0] = 0;
+        for(i = 0; i < NTask; i ++) {
+            recvdispls[i + 1] = recvdispls[i] + recvcounts[i];
+        }
+        all = malloc(sizeof(uint64_t) * recvdispls[NTask] + 1);
+    }
+    MPI_Gatherv(frames, count, MPI_UINT64_T,
+                all, recvcounts, recvdispls, MPI_UINT64_T, root, comm);
+
+    /* every rank has the frames of the block when opened, which merge with themselves */
+    if(rank == root && rt == 0) {
+        rt = _big_block_add_frames(block, all, recvdispls[NTask] / FRAME_TABLE_NCOL);
+    }
+    free(all);
+    free(recvdispls);
+    free(recvcounts);
+    free(frames);
+    return rt;
+}
+
 int
 big_block_mpi_flush(BigBlock * block, MPI_Comm comm)
 {
@@ -240,6 +283,11 @@ big_block_mpi_flush(BigBlock * block, MPI_Comm comm)
     int rank;
     MPI_Comm_rank(comm, &rank);
 
+    if(big_block_is_compressed(block)) {
+        int rt = _big_block_mpi_gather_frames(block, 0, comm);
+        BCAST_AND_RAISEIF(rt, comm);
+    }
+
     unsigned int * checksum = alloca(sizeof(int) * block->Nfile);
     MPI_Reduce(block->fchecksum, checksum, block->Nfile, MPI_UNSIGNED, MPI_SUM, 0, comm);
     int dirty;
@@ -12,6 +12,11 @@
 #include <sys/time.h>
 #include <unistd.h>
 #include <dirent.h>
+#include <math.h>
+
+#ifdef BIGFILE_HAVE_ZLIB
+#include <zlib.h>
+#endif
 
 #include "bigfile.h"
 #include "bigfile-internal.h"
@@ -20,6 +25,8 @@
 #define EXT_ATTR "attr"
 #define EXT_ATTR_V2 "attr-v2"
 #define EXT_DATA   "%06X"
+#define ATTR_COMPRESSION "BigFileCompression"
+#define ATTR_FRAMES "BigFileFrames"
 #define FILEID_ATTR -2
 #define FILEID_ATTR_V2 -3
 #define FILEID_HEADER -1
@@ -313,6 +320,11 @@ big_file_close(BigFile * bf)
 static void
 sysvsum(unsigned int * sum, void * buf, size_t size);
 
+static int
+_big_block_write_frame(BigBlock * bb, BigBlockPtr * ptr, void * buf, size_t nelem);
+static int
+_big_block_read_frames(BigBlock * bb, BigBlockPtr * ptr, void * buf, size_t nelem);
+
 /* Bigblock */
 
 int
@@ -386,6 +398,17 @@ _big_block_open(BigBlock * bb, const char * basename)
         }
         bb->size = bb->foffset[bb->Nfile];
 
+        /* compressed blocks record the filters and the codec as an attribute */
+        if(attrset_lookup_attr(bb->attrset, ATTR_COMPRESSION)) {
+            double desc[3];
+            RAISEIF(0 != attrset_get_attr(bb->attrset, ATTR_COMPRESSION, desc, "f8", 3),
+                    ex_fscanf1,
+                    "Malformed compression attribute of block `%s'", bb->basename);
+            bb->compression.filters = desc[0];
+            bb->compression.codec = desc[1];
+            bb->compression.error = desc[2];
+        }
+
         fclose(fheader);
 
         return 0;
@@ -850,20 +873,25 @@ big_block_read(BigBlock * bb, BigBlockPtr * ptr, BigArray * array)
         /* read to the beginning of chunk */
         big_array_iter_init(&chunk_iter, &chunk_array);
 
-        fp = _big_file_open_a_file(bb->basename, ptr->fileid, "r", 1);
-        RAISEIF(fp == NULL,
-                ex_open,
-                NULL);
-        RAISEIF(0 > fseek(fp, ptr->roffset * felsize, SEEK_SET),
-                ex_seek,
-                "Failed to seek in block `%s' at (%d:%td) (%s)", 
-                bb->basename, ptr->fileid, ptr->roffset * felsize, strerror(errno));
-        RAISEIF(chunk_size != fread(chunkbuf, felsize, chunk_size, fp),
-                ex_read,
-                "Failed to read in block `%s' at (%d:%td) (%s)",
-                bb->basename, ptr->fileid, ptr->roffset * felsize, strerror(errno));
-        fclose(fp);
-        fp = NULL;
+        if(big_block_is_compressed(bb)) {
+            RAISEIF(0 != _big_block_read_frames(bb, ptr, chunkbuf, chunk_size),
+                ex_frame, NULL);
+        } else {
+            fp = _big_file_open_a_file(bb->basename, ptr->fileid, "r", 1);
+            RAISEIF(fp == NULL,
+                    ex_open,
+                    NULL);
+            RAISEIF(0 > fseek(fp, ptr->roffset * felsize, SEEK_SET),
+                    ex_seek,
+                    "Failed to seek in block `%s' at (%d:%td) (%s)", 
+                    bb->basename, ptr->fileid, ptr->roffset * felsize, strerror(errno));
+            RAISEIF(chunk_size != fread(chunkbuf, felsize, chunk_size, fp),
+                    ex_read,
+                    "Failed to read in block `%s' at (%d:%td) (%s)",
+                    bb->basename, ptr->fileid, ptr->roffset * felsize, strerror(errno));
+            fclose(fp);
+            fp = NULL;
+        }
 
         /* now translate the data from chunkbuf to mptr */
         RAISEIF(0 != _dtype_convert(&array_iter, &chunk_iter, chunk_size * bb->nmemb),
@@ -881,6 +909,7 @@ ex_read:
 ex_seek:
     fclose(fp);
 ex_insuf:
+ex_frame:
 ex_convert:
 ex_blockseek:
 ex_open:
@@ -943,21 +972,27 @@ big_block_write(BigBlock * bb, BigBlockPtr * ptr, BigArray * array)
         RAISEIF(0 != _dtype_convert(&chunk_iter, &array_iter, chunk_size * bb->nmemb),
             ex_convert, NULL);
 
-        sysvsum(&bb->fchecksum[ptr->fileid], chunkbuf, chunk_size * felsize);
-
-        fp = _big_file_open_a_file(bb->basename, ptr->fileid, "r+", 1);
-        RAISEIF(fp == NULL,
-                ex_open,
-                NULL);
-        RAISEIF(0 > fseek(fp, ptr->roffset * felsize, SEEK_SET),
-                ex_seek,
-                "Failed to seek in block `%s' at (%d:%td) (%s)", 
-                bb->basename, ptr->fileid, ptr->roffset * felsize, strerror(errno));
-        RAISEIF(chunk_size != fwrite(chunkbuf, felsize, chunk_size, fp),
-                ex_write,
-                "Failed to write in block `%s' at (%d:%td) (%s)",
-                bb->basename, ptr->fileid, ptr->roffset * felsize, strerror(errno));
-        fclose(fp);
+        if(big_block_is_compressed(bb)) {
+            /* filtered in place; checksummed after the lossy filters */
+            RAISEIF(0 != _big_block_write_frame(bb, ptr, chunkbuf, chunk_size),
+                ex_frame, NULL);
+        } else {
+            sysvsum(&bb->fchecksum[ptr->fileid], chunkbuf, chunk_size * felsize);
+
+            fp = _big_file_open_a_file(bb->basename, ptr->fileid, "r+", 1);
+            RAISEIF(fp == NULL,
+                    ex_open,
+                    NULL);
+            RAISEIF(0 > fseek(fp, ptr->roffset * felsize, SEEK_SET),
+                    ex_seek,
+                    "Failed to seek in block `%s' at (%d:%td) (%s)", 
+                    bb->basename, ptr->fileid, ptr->roffset * felsize, strerror(errno));
+            RAISEIF(chunk_size != fwrite(chunkbuf, felsize, chunk_size, fp),
+                    ex_write,
+                    "Failed to write in block `%s' at (%d:%td) (%s)",
+                    bb->basename, ptr->fileid, ptr->roffset * felsize, strerror(errno));
+            fclose(fp);
+        }
 
         towrite -= chunk_size;
         RAISEIF(0 != big_block_seek_rel(bb, ptr, chunk_size),
@@ -968,6 +1003,7 @@ big_block_write(BigBlock * bb, BigBlockPtr * ptr, BigArray * array)
 ex_write:
 ex_seek:
     fclose(fp);
+ex_frame:
 ex_convert:
 ex_open:
 ex_blockseek:
@@ -1420,6 +1456,708 @@ ex:
     return -1;
 }
 
+/**
+ * Compression
+ *
+ * A compressed block keeps the layout of the header (fsize is still in elements),
+ * but the data of a physical file is stored in frames, one for every chunk written
+ * by big_block_write. Frames are appended to the data file, so concurrent writers of
+ * a file never overlap, and the attribute ATTR_FRAMES is the table of the frames:
+ * rows of FRAME_TABLE_NCOL uint64, sorted by file and element offset.
+ * A reader seeks to the frames covering a range through the table.
+ *
+ * A frame is FRAME_NHEADER little endian uint64 followed by the encoded data.
+ * */
+
+#define FRAME_MAGIC 0x315a4642 /* BFZ1 */
+enum {
+    FRAME_MAGIC_FIELD = 0,
+    FRAME_FILTERS = 1,  /* filters actually applied; those not applicable to the dtype are skipped */
+    FRAME_CODEC = 2,    /* codec actually used; incompressible frames are stored as is */
+    FRAME_NELEM = 3,
+    FRAME_RAWBYTES = 4,
+    FRAME_CODEDBYTES = 5,
+    FRAME_NHEADER = 6,
+};
+
+int
+big_block_is_compressed(BigBlock * bb)
+{
+    return bb->compression.filters != 0 || bb->compression.codec != BIG_BLOCK_CODEC_NONE;
+}
+
+int
+big_block_set_compression(BigBlock * bb, const BigBlockCompression * compression)
+{
+    BigBlockCompression c = {0};
+    if(compression)
+        c = *compression;
+
+    RAISEIF(c.filters & ~(BIG_BLOCK_FILTER_QUANTIZE | BIG_BLOCK_FILTER_DELTA | BIG_BLOCK_FILTER_SHUFFLE),
+            ex_invalid,
+            "Unknown compression filters %d for block `%s'", c.filters, bb->basename);
+    RAISEIF(c.codec < BIG_BLOCK_CODEC_NONE || c.codec > BIG_BLOCK_CODEC_ZLIB,
+            ex_invalid,
+            "Unknown compression codec %d for block `%s'", c.codec, bb->basename);
+    RAISEIF((c.filters & BIG_BLOCK_FILTER_QUANTIZE) && c.error == 0,
+            ex_invalid,
+            "The quantize filter of block `%s' needs a non-zero error bound", bb->basename);
+#ifndef BIGFILE_HAVE_ZLIB
+    if(c.codec == BIG_BLOCK_CODEC_ZLIB)
+        c.codec = BIG_BLOCK_CODEC_LZ;
+#endif
+    bb->compression = c;
+
+    if(!big_block_is_compressed(bb)) {
+        if(attrset_lookup_attr(bb->attrset, ATTR_COMPRESSION))
+            return attrset_remove_attr(bb->attrset, ATTR_COMPRESSION);
+        return 0;
+    }
+    double desc[3] = {c.filters, c.codec, c.error};
+    return attrset_set_attr(bb->attrset, ATTR_COMPRESSION, desc, "f8", 3);
+
+ex_invalid:
+    return -1;
+}
+
+/* Round the floats in buf to the fewest mantissa bits within the error bound.
+ * The result is still the nearest representable float, so there is nothing to undo on read;
+ * the zeroed low bits are what the shuffle filter and the codec compress.
+ * Denormals, zeros, infs and nans are kept as is.
+ * Returns 1 if the dtype allows quantization. */
+#define QUANTIZE(ftype, utype, mbits) { \
+    ftype * v = buf; \
+    for(i = 0; i < nitems; i ++) { \
+        if(fpclassify(v[i]) != FP_NORMAL) continue; \
+        int drop; \
+        if(error > 0) { \
+            if(fabs(v[i]) <= error) { v[i] = 0; continue; } \
+            drop = ilogb(error) - ilogb(v[i]) + mbits + 1; \
+        } else { \
+            drop = ilogb(-error) + mbits + 1; \
+        } \
+        if(drop <= 0) continue; \
+        if(drop > mbits) drop = mbits; \
+        utype bits, half = ((utype) 1) << (drop - 1); \
+        memcpy(&bits, &v[i], sizeof(bits)); \
+        bits = (bits + half) & ~(half * 2 - 1); \
+        ftype r; \
+        memcpy(&r, &bits, sizeof(bits)); \
+        /* rounding may carry into the exponent, but never to inf */ \
+        if(isfinite(r)) v[i] = r; \
+    } \
+}
+
+static int
+_big_block_quantize(BigBlock * bb, void * buf, size_t nitems)
+{
+    const double error = bb->compression.error;
+    const int itemsize = big_file_dtype_itemsize(bb->dtype);
+    size_t i;
+    if(bb->dtype[1] != 'f' || bb->dtype[0] != MACHINE_ENDIANNESS)
+        return 0;
+    if(itemsize == 8) {
+        QUANTIZE(double, uint64_t, 52);
+        return 1;
+    }
+    if(itemsize == 4) {
+        QUANTIZE(float, uint32_t, 23);
+        return 1;
+    }
+    return 0;
+}
+#undef QUANTIZE
+
+/* Replace the integers of each column by the difference to the previous row, or undo it.
+ * Unsigned arithmetic wraps, so this is exact for any values.
+ * Returns 1 if the dtype allows the filter. */
+#define DELTA(utype) { \
+    utype * v = buf; \
+    if(!inverse) { \
+        for(i = nelem - 1; i > 0; i --) \
+            for(j = 0; j < nmemb; j ++) \
+                v[i * nmemb + j] -= v[(i - 1) * nmemb + j]; \
+    } else { \
+        for(i = 1; i < nelem; i ++) \
+            for(j = 0; j < nmemb; j ++) \
+                v[i * nmemb + j] += v[(i - 1) * nmemb + j]; \
+    } \
+}
+
+static int
+_big_block_delta(BigBlock * bb, void * buf, size_t nelem, int inverse)
+{
+    const int itemsize = big_file_dtype_itemsize(bb->dtype);
+    const size_t nmemb = bb->nmemb ? bb->nmemb : 1;
+    size_t i, j;
+    if((bb->dtype[1] != 'i' && bb->dtype[1] != 'u') || bb->dtype[0] != MACHINE_ENDIANNESS)
+        return 0;
+    if(nelem == 0)
+        return 1;
+    if(itemsize == 8) {
+        DELTA(uint64_t);
+        return 1;
+    }
+    if(itemsize == 4) {
+        DELTA(uint32_t);
+        return 1;
+    }
+    return 0;
+}
+#undef DELTA
+
+/* Transpose nitems of itemsize bytes so that bytes of the same significance are together, or undo it. */
+static void
+_big_block_shuffle(unsigned char * dst, const unsigned char * src, size_t nitems, int itemsize, int inverse)
+{
+    size_t i;
+    int b;
+    for(b = 0; b < itemsize; b ++) {
+        for(i = 0; i < nitems; i ++) {
+            if(!inverse)
+                dst[b * nitems + i] = src[i * itemsize + b];
+            else
+                dst[i * itemsize + b] = src[b * nitems + i];
+        }
+    }
+}
+
+/* A fast LZ77 codec, the sequence format of LZ4:
+ * token (literal length : 4 bits, match length - LZ_MINMATCH : 4 bits),
+ * extra literal length bytes, literals, 2 byte offset, extra match length bytes.
+ * Lengths of 15 continue with bytes until one is not 255.
+ * The last sequence has only literals. */
+#define LZ_HASHLOG 16
+#define LZ_MINMATCH 4
+/* matches stop this far from the end, so the last sequence always has literals */
+#define LZ_LASTLITERALS 5
+#define LZ_MAXOFFSET 65535
+
+static size_t
+_lz_bound(size_t n)
+{
+    return n + n / 255 + 16;
+}
+
+static uint32_t
+_lz_read32(const unsigned char * p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static unsigned char *
+_lz_put_length(unsigned char * op, size_t len)
+{
+    for(; len >= 255; len -= 255)
+        *op++ = 255;
+    *op++ = len;
+    return op;
+}
+
+/* Returns NULL if the output does not fit in oend */
+static unsigned char *
+_lz_put_sequence(unsigned char * op, unsigned char * oend,
+    const unsigned char * lit, size_t nlit, size_t offset, size_t mlen)
+{
+    const size_t ml = mlen ? mlen - LZ_MINMATCH : 0;
+    if(oend - op < 1 + nlit / 255 + 1 + nlit + 2 + ml / 255 + 1)
+        return NULL;
+    unsigned char * token = op++;
+    *token = ((nlit < 15 ? nlit : 15) << 4) | (ml < 15 ? ml : 15);
+    if(nlit >= 15)
+        op = _lz_put_length(op, nlit - 15);
+    memcpy(op, lit, nlit);
+    op += nlit;
+    if(mlen == 0)
+        return op;
+    *op++ = offset & 0xff;
+    *op++ = offset >> 8;
+    if(ml >= 15)
+        op = _lz_put_length(op, ml - 15);
+    return op;
+}
+
+/* Returns the encoded size, or 0 if it does not fit in cap bytes. */
+static size_t
+_lz_encode(unsigned char * dst, size_t cap, const unsigned char * src, size_t n)
+{
+    size_t * table = calloc((size_t) 1 << LZ_HASHLOG, sizeof(size_t));
+    if(!table)
+        return 0;
+    unsigned char * op = dst;
+    unsigned char * oend = dst + cap;
+    size_t ip = 0, anchor = 0;
+    while(ip + LZ_MINMATCH + LZ_LASTLITERALS <= n) {
+        const uint32_t seq = _lz_read32(src + ip);
+        const size_t h = (uint32_t) (seq * 2654435761u) >> (32 - LZ_HASHLOG);
+        const size_t ref = table[h];
+        table[h] = ip;
+        if(ref >= ip || ip - ref > LZ_MAXOFFSET || _lz_read32(src + ref) != seq) {
+            /* skip faster through incompressible data */
+            ip += 1 + ((ip - anchor) >> 6);
+            continue;
+        }
+        size_t mlen = LZ_MINMATCH;
+        while(ip + mlen < n - LZ_LASTLITERALS && src[ref + mlen] == src[ip + mlen])
+            mlen ++;
+        op = _lz_put_sequence(op, oend, src + anchor, ip - anchor, ip - ref, mlen);
+        if(!op)
+            break;
+        ip += mlen;
+        anchor = ip;
+    }
+    if(op)
+        op = _lz_put_sequence(op, oend, src + anchor, n - anchor, 0, 0);
+    free(table);
+    return op ? op - dst : 0;
+}
+
+/* Returns the decoded size, or -1 if the input is corrupted or does not fit in cap bytes. */
+static ptrdiff_t
+_lz_decode(unsigned char * dst, size_t cap, const unsigned char * src, size_t n)
+{
+    const unsigned char * ip = src;
+    const unsigned char * iend = src + n;
+    unsigned char * op = dst;
+    unsigned char * oend = dst + cap;
+    while(ip < iend) {
+        const unsigned int token = *ip++;
+        unsigned int b;
+        size_t nlit = token >> 4;
+        if(nlit == 15) {
+            do {
+                if(ip >= iend) return -1;
+                b = *ip++;
+                nlit += b;
+            } while(b == 255);
+        }
+        if(nlit > (size_t) (iend - ip) || nlit > (size_t) (oend - op))
+            return -1;
+        memcpy(op, ip, nlit);
+        op += nlit;
+        ip += nlit;
+        if(ip == iend)
+            break;
+        if(iend - ip < 2)
+            return -1;
+        const size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        size_t mlen = token & 15;
+        if(mlen == 15) {
+            do {
+                if(ip >= iend) return -1;
+                b = *ip++;
+                mlen += b;
+            } while(b == 255);
+        }
+        mlen += LZ_MINMATCH;
+        if(offset == 0 || offset > (size_t) (op - dst) || mlen > (size_t) (oend - op))
+            return -1;
+        /* byte by byte: the match may overlap the output */
+        const unsigned char * ref = op - offset;
+        while(mlen --)
+            *op++ = *ref++;
+    }
+    return op - dst;
+}
+
+static size_t
+_codec_bound(int codec, size_t n)
+{
+#ifdef BIGFILE_HAVE_ZLIB
+    if(codec == BIG_BLOCK_CODEC_ZLIB)
+        return compressBound(n);
+#endif
+    return _lz_bound(n);
+}
+
+/* Returns the encoded size, or 0 on failure. */
+static size_t
+_codec_encode(int codec, unsigned char * dst, size_t cap, const unsigned char * src, size_t n)
+{
+#ifdef BIGFILE_HAVE_ZLIB
+    if(codec == BIG_BLOCK_CODEC_ZLIB) {
+        uLongf len = cap;
+        if(Z_OK != compress2(dst, &len, src, n, Z_BEST_SPEED))
+            return 0;
+        return len;
+    }
+#endif
+    return _lz_encode(dst, cap, src, n);
+}
+
+static int
+_codec_decode(int codec, unsigned char * dst, size_t rawbytes, const unsigned char * src, size_t n)
+{
+    switch(codec) {
+        case BIG_BLOCK_CODEC_NONE:
+            if(n != rawbytes)
+                return -1;
+            memcpy(dst, src, n);
+            return 0;
+        case BIG_BLOCK_CODEC_LZ:
+            return _lz_decode(dst, rawbytes, src, n) == (ptrdiff_t) rawbytes ? 0 : -1;
+#ifdef BIGFILE_HAVE_ZLIB
+        case BIG_BLOCK_CODEC_ZLIB:
+        {
+            uLongf len = rawbytes;
+            if(Z_OK != uncompress(dst, &len, src, n) || len != rawbytes)
+                return -1;
+            return 0;
+        }
+#endif
+    }
+    return -1;
+}
+
+static int
+_codec_supported(int codec)
+{
+#ifdef BIGFILE_HAVE_ZLIB
+    if(codec == BIG_BLOCK_CODEC_ZLIB)
+        return 1;
+#endif
+    return codec == BIG_BLOCK_CODEC_NONE || codec == BIG_BLOCK_CODEC_LZ;
+}
+
+enum {
+    FRAME_TABLE_FILEID = 0,
+    FRAME_TABLE_ROFFSET = 1,
+    FRAME_TABLE_NELEM = 2,
+    FRAME_TABLE_OFFSET = 3, /* bytes from the start of the data file */
+};
+
+static int
+_cmp_frame_row(const void * p1, const void * p2)
+{
+    const uint64_t * r1 = p1, * r2 = p2;
+    int i;
+    const int cols[] = {FRAME_TABLE_FILEID, FRAME_TABLE_ROFFSET, FRAME_TABLE_OFFSET};
+    for(i = 0; i < 3; i ++) {
+        const int c = cols[i];
+        if(r1[c] != r2[c])
+            return (r1[c] > r2[c]) - (r1[c] < r2[c]);
+    }
+    return 0;
+}
+
+int
+_big_block_get_frames(BigBlock * bb, uint64_t ** frames, size_t * nframes)
+{
+    BigAttr * attr = attrset_lookup_attr(bb->attrset, ATTR_FRAMES);
+    *frames = NULL;
+    *nframes = 0;
+    if(attr == NULL)
+        return 0;
+    *nframes = attr->nmemb / FRAME_TABLE_NCOL;
+    *frames = malloc(attr->nmemb * sizeof(uint64_t) + 1);
+    RAISEIF(*frames == NULL,
+        ex_malloc,
+        "Not enough memory for the frame table of block `%s'", bb->basename);
+    RAISEIF(0 != attrset_get_attr(bb->attrset, ATTR_FRAMES, *frames, "u8", attr->nmemb),
+        ex_get,
+        "Malformed frame table of block `%s'", bb->basename);
+    return 0;
+
+ex_get:
+    free(*frames);
+    *frames = NULL;
+ex_malloc:
+    *nframes = 0;
+    return -1;
+}
+
+int
+_big_block_add_frames(BigBlock * bb, const uint64_t * frames, size_t nframes)
+{
+    uint64_t * table;
+    size_t ntable, i, n;
+    RAISEIF(0 != _big_block_get_frames(bb, &table, &ntable),
+        ex_get,
+        NULL);
+    uint64_t * merged = realloc(table, (ntable + nframes) * FRAME_TABLE_NCOL * sizeof(uint64_t) + 1);
+    RAISEIF(merged == NULL,
+        ex_malloc,
+        "Not enough memory for the frame table of block `%s'", bb->basename);
+    table = merged;
+    memcpy(table + ntable * FRAME_TABLE_NCOL, frames, nframes * FRAME_TABLE_NCOL * sizeof(uint64_t));
+    ntable += nframes;
+    qsort(table, ntable, FRAME_TABLE_NCOL * sizeof(uint64_t), _cmp_frame_row);
+
+    /* a rewritten frame is appended after the old one: keep the last frame starting at an offset */
+    for(i = 0, n = 0; i < ntable; i ++) {
+        const uint64_t * row = table + i * FRAME_TABLE_NCOL;
+        if(i + 1 < ntable &&
+           row[FRAME_TABLE_FILEID] == row[FRAME_TABLE_NCOL + FRAME_TABLE_FILEID] &&
+           row[FRAME_TABLE_ROFFSET] == row[FRAME_TABLE_NCOL + FRAME_TABLE_ROFFSET])
+            continue;
+        memmove(table + n * FRAME_TABLE_NCOL, row, FRAME_TABLE_NCOL * sizeof(uint64_t));
+        n ++;
+    }
+    RAISEIF(n * FRAME_TABLE_NCOL > INT_MAX,
+        ex_malloc,
+        "Too many frames in block `%s'", bb->basename);
+    RAISEIF(0 != attrset_set_attr(bb->attrset, ATTR_FRAMES, table, "u8", n * FRAME_TABLE_NCOL),
+        ex_malloc,
+        NULL);
+    free(table);
+    return 0;
+
+ex_malloc:
+    free(table);
+ex_get:
+    return -1;
+}
+
+static int
+_big_block_write_frame(BigBlock * bb, BigBlockPtr * ptr, void * buf, size_t nelem)
+{
+    const int nmemb = bb->nmemb ? bb->nmemb : 1;
+    const int itemsize = big_file_dtype_itemsize(bb->dtype);
+    const size_t nitems = nelem * nmemb;
+    const size_t rawbytes = nitems * itemsize;
+    const size_t headerbytes = FRAME_NHEADER * 8;
+    const int want = bb->compression.filters;
+
+    uint64_t filters = 0;
+    int codec = BIG_BLOCK_CODEC_NONE;
+    unsigned char * data = buf;
+    size_t databytes = rawbytes;
+    unsigned char * shuffled = NULL;
+    unsigned char * frame = NULL;
+    FILE * fp = NULL;
+
+    if((want & BIG_BLOCK_FILTER_QUANTIZE) && _big_block_quantize(bb, data, nitems))
+        filters |= BIG_BLOCK_FILTER_QUANTIZE;
+
+    /* the checksum is of the data as it will be read back */
+    sysvsum(&bb->fchecksum[ptr->fileid], data, rawbytes);
+
+    if((want & BIG_BLOCK_FILTER_DELTA) && _big_block_delta(bb, data, nelem, 0))
+        filters |= BIG_BLOCK_FILTER_DELTA;
+
+    if((want & BIG_BLOCK_FILTER_SHUFFLE) && itemsize > 1) {
+        shuffled = malloc(rawbytes);
+        RAISEIF(shuffled == NULL,
+            ex_malloc,
+            "Not enough memory to shuffle a frame of %td bytes", rawbytes);
+        _big_block_shuffle(shuffled, data, nitems, itemsize, 0);
+        data = shuffled;
+        filters |= BIG_BLOCK_FILTER_SHUFFLE;
+    }
+
+    /* the frame is written with a single call, as its header and data must not be split by another writer */
+    size_t cap = rawbytes;
+    if(bb->compression.codec != BIG_BLOCK_CODEC_NONE) {
+        cap = _codec_bound(bb->compression.codec, rawbytes);
+        if(cap < rawbytes)
+            cap = rawbytes;
+    }
+    frame = malloc(headerbytes + cap);
+    RAISEIF(frame == NULL,
+        ex_malloc,
+        "Not enough memory to compress a frame of %td bytes", rawbytes);
+    if(bb->compression.codec != BIG_BLOCK_CODEC_NONE) {
+        const size_t n = _codec_encode(bb->compression.codec, frame + headerbytes, cap, data, rawbytes);
+        /* incompressible frames are stored as is */
+        if(n > 0 && n < rawbytes) {
+            codec = bb->compression.codec;
+            databytes = n;
+        }
+    }
+    if(codec == BIG_BLOCK_CODEC_NONE)
+        memcpy(frame + headerbytes, data, rawbytes);
+
+    uint64_t fields[FRAME_NHEADER] = {FRAME_MAGIC, filters, codec, nelem, rawbytes, databytes};
+    int i, b;
+    for(i = 0; i < FRAME_NHEADER; i ++)
+        for(b = 0; b < 8; b ++)
+            frame[i * 8 + b] = (fields[i] >> (8 * b)) & 0xff;
+
+    /* data files are unbuffered, and appends do not overlap those of other writers (O_APPEND) */
+    fp = _big_file_open_a_file(bb->basename, ptr->fileid, "a", 1);
+    RAISEIF(fp == NULL,
+            ex_open,
+            NULL);
+    RAISEIF(1 != fwrite(frame, headerbytes + databytes, 1, fp),
+            ex_write,
+            "Failed to write frame of block `%s' at (%d:%td) (%s)",
+            bb->basename, ptr->fileid, ptr->roffset, strerror(errno));
+    /* the descriptor is left at the end of this frame, even if others appended after it */
+    off_t end = lseek(fileno(fp), 0, SEEK_CUR);
+    RAISEIF(end < 0,
+            ex_write,
+            "Failed to locate frame of block `%s' at (%d:%td) (%s)",
+            bb->basename, ptr->fileid, ptr->roffset, strerror(errno));
+    fclose(fp);
+    fp = NULL;
+
+    const uint64_t row[FRAME_TABLE_NCOL] = {ptr->fileid, ptr->roffset, nelem, end - (headerbytes + databytes)};
+    RAISEIF(0 != _big_block_add_frames(bb, row, 1),
+            ex_open,
+            NULL);
+    free(frame);
+    free(shuffled);
+    return 0;
+
+ex_write:
+    fclose(fp);
+ex_open:
+ex_malloc:
+    free(frame);
+    free(shuffled);
+    return -1;
+}
+
+/* Decode the frame of the nelem items of file fileid from roffset, at offset bytes of fp; *out is malloced. */
+static int
+_big_block_decode_frame(BigBlock * bb, FILE * fp, int fileid, size_t roffset, size_t nelem, size_t offset, unsigned char ** out)
+{
+    const int nmemb = bb->nmemb ? bb->nmemb : 1;
+    const int itemsize = big_file_dtype_itemsize(bb->dtype);
+    unsigned char header[FRAME_NHEADER * 8];
+    uint64_t fields[FRAME_NHEADER] = {0};
+    unsigned char * coded = NULL;
+    unsigned char * raw = NULL;
+    unsigned char * shuffled = NULL;
+    int i, b;
+
+    RAISEIF(0 > fseeko(fp, offset, SEEK_SET),
+            ex_read,
+            "Failed to seek to frame of block `%s' at (%d:%td) (%s)",
+            bb->basename, fileid, roffset, strerror(errno));
+    RAISEIF(1 != fread(header, sizeof(header), 1, fp),
+            ex_read,
+            "Failed to read frame header of block `%s' at (%d:%td) (%s)",
+            bb->basename, fileid, roffset, strerror(errno));
+    for(i = 0; i < FRAME_NHEADER; i ++)
+        for(b = 0; b < 8; b ++)
+            fields[i] |= ((uint64_t) header[i * 8 + b]) << (8 * b);
+
+    const size_t rawbytes = fields[FRAME_RAWBYTES];
+    const size_t codedbytes = fields[FRAME_CODEDBYTES];
+    RAISEIF(fields[FRAME_MAGIC_FIELD] != FRAME_MAGIC ||
+            fields[FRAME_NELEM] != nelem ||
+            rawbytes != nelem * nmemb * itemsize,
+            ex_read,
+            "Corrupted frame header of block `%s' at (%d:%td)",
+            bb->basename, fileid, roffset);
+    RAISEIF(!_codec_supported(fields[FRAME_CODEC]),
+            ex_read,
+            "Frame of block `%s' at (%d:%td) uses codec %d, which is not in this build of bigfile",
+            bb->basename, fileid, roffset, (int) fields[FRAME_CODEC]);
+
+    coded = malloc(codedbytes + 1);
+    raw = malloc(rawbytes + 1);
+    RAISEIF(coded == NULL || raw == NULL,
+            ex_malloc,
+            "Not enough memory to decode a frame of %td bytes", rawbytes);
+    RAISEIF(codedbytes != fread(coded, 1, codedbytes, fp),
+            ex_malloc,
+            "Failed to read frame of block `%s' at (%d:%td) (%s)",
+            bb->basename, fileid, roffset, strerror(errno));
+    RAISEIF(0 != _codec_decode(fields[FRAME_CODEC], raw, rawbytes, coded, codedbytes),
+            ex_malloc,
+            "Corrupted frame of block `%s' at (%d:%td)",
+            bb->basename, fileid, roffset);
+
+    if(fields[FRAME_FILTERS] & BIG_BLOCK_FILTER_SHUFFLE) {
+        shuffled = malloc(rawbytes + 1);
+        RAISEIF(shuffled == NULL,
+            ex_malloc,
+            "Not enough memory to decode a frame of %td bytes", rawbytes);
+        _big_block_shuffle(shuffled, raw, nelem * nmemb, itemsize, 1);
+        free(raw);
+        raw = shuffled;
+    }
+    if(fields[FRAME_FILTERS] & BIG_BLOCK_FILTER_DELTA)
+        _big_block_delta(bb, raw, nelem, 1);
+
+    free(coded);
+    *out = raw;
+    return 0;
+
+ex_malloc:
+    free(coded);
+    free(raw);
+ex_read:
+    return -1;
+}
+
+/* Decode the elements [roffset, roffset + nelem) of the file of ptr from the frames overlapping them. */
+static int
+_big_block_read_frames(BigBlock * bb, BigBlockPtr * ptr, void * buf, size_t nelem)
+{
+    const int nmemb = bb->nmemb ? bb->nmemb : 1;
+    const size_t felsize = (size_t) big_file_dtype_itemsize(bb->dtype) * nmemb;
+    const size_t start = ptr->roffset;
+    const size_t end = start + nelem;
+    uint64_t * table = NULL;
+    size_t ntable = 0;
+    size_t covered = 0;
+    size_t i, first;
+    FILE * fp = NULL;
+
+    RAISEIF(0 != _big_block_get_frames(bb, &table, &ntable),
+        ex_table,
+        NULL);
+
+    /* the frames of a file are consecutive in the table and do not overlap:
+     * begin with the last one starting before the range */
+    for(first = 0; first < ntable && table[first * FRAME_TABLE_NCOL + FRAME_TABLE_FILEID] < ptr->fileid; first ++)
+        continue;
+    for(i = first; i < ntable; i ++) {
+        const uint64_t * row = table + i * FRAME_TABLE_NCOL;
+        if(row[FRAME_TABLE_FILEID] != ptr->fileid || row[FRAME_TABLE_ROFFSET] > start)
+            break;
+        first = i;
+    }
+
+    for(i = first; i < ntable; i ++) {
+        const uint64_t * row = table + i * FRAME_TABLE_NCOL;
+        const size_t roffset = row[FRAME_TABLE_ROFFSET];
+        const size_t n = row[FRAME_TABLE_NELEM];
+        if(row[FRAME_TABLE_FILEID] != ptr->fileid || roffset >= end)
+            break;
+        if(roffset + n <= start)
+            continue;
+        if(fp == NULL) {
+            fp = _big_file_open_a_file(bb->basename, ptr->fileid, "r", 1);
+            RAISEIF(fp == NULL,
+                ex_open,
+                NULL);
+        }
+        unsigned char * frame;
+        RAISEIF(0 != _big_block_decode_frame(bb, fp, ptr->fileid, roffset, n, row[FRAME_TABLE_OFFSET], &frame),
+            ex_decode,
+            NULL);
+        const size_t lo = roffset > start ? roffset : start;
+        const size_t hi = roffset + n < end ? roffset + n : end;
+        memcpy((char *) buf + (lo - start) * felsize, frame + (lo - roffset) * felsize, (hi - lo) * felsize);
+        covered += hi - lo;
+        free(frame);
+    }
+    RAISEIF(covered != nelem,
+        ex_decode,
+        "Missing compressed data of block `%s' in file %d at %td: found %td of %td items",
+        bb->basename, ptr->fileid, ptr->roffset, covered, nelem);
+
+    if(fp)
+        fclose(fp);
+    free(table);
+    return 0;
+
+ex_decode:
+    if(fp)
+        fclose(fp);
+ex_open:
+    free(table);
+ex_table:
+    return -1;
+}
+
 static void
 sysvsum(unsigned int * sum, void * buf, size_t size)
 {
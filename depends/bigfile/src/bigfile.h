@@ -21,6 +21,26 @@ struct BigAttr {
 
 typedef struct BigAttrSet BigAttrSet;
 
+/* Filters applied to the data of a compressed block, in this order, before the codec. */
+enum BigBlockFilter {
+    BIG_BLOCK_FILTER_QUANTIZE = 1, /* lossy: round floats to within the error bound of the block */
+    BIG_BLOCK_FILTER_DELTA = 2,    /* store differences of successive integers in each column */
+    BIG_BLOCK_FILTER_SHUFFLE = 4,  /* group the bytes of the elements by significance */
+};
+
+enum BigBlockCodec {
+    BIG_BLOCK_CODEC_NONE = 0,
+    BIG_BLOCK_CODEC_LZ = 1,   /* built-in fast LZ77 codec */
+    BIG_BLOCK_CODEC_ZLIB = 2, /* zlib; only if built with BIGFILE_HAVE_ZLIB, otherwise LZ is used */
+};
+
+typedef struct BigBlockCompression {
+    int filters; /* bitmask of BigBlockFilter */
+    int codec;   /* BigBlockCodec */
+    /* Error bound of the quantize filter. > 0: absolute error, < 0: relative error of -error. */
+    double error;
+} BigBlockCompression;
+
 typedef struct BigBlock {
     /* All members are readonly */
     char dtype[8]; /* numpy style
@@ -37,6 +57,7 @@ typedef struct BigBlock {
     int Nfile;
     BigAttrSet * attrset;
     int dirty;
+    BigBlockCompression compression; /* all zero if the data files are not compressed */
 } BigBlock;
 
 typedef struct BigBlockPtr BigBlockPtr;
@@ -142,6 +163,24 @@ int big_block_read_simple(BigBlock * bb, ptrdiff_t start, ptrdiff_t size, BigArr
  * @returns 0 if successful. */
 int big_block_write(BigBlock * bb, BigBlockPtr * ptr, BigArray * array); /* raisees*/
 
+/** Compress the data written to a block from now on.
+ *
+ * Every chunk passed to big_block_write is filtered, compressed and appended as a frame
+ * to the data file. The offsets of the frames are kept in the attribute `BigFileFrames',
+ * so big_block_read can seek to and decode any range independently. The settings are stored
+ * as the attribute `BigFileCompression' and picked up when the block is opened.
+ *
+ * Call before any data is written; with MPI, call on every rank holding the block,
+ * and close it with big_block_mpi_close, which merges the frames written by all ranks.
+ * Each element of the block shall be written once.
+ * Filters that do not apply to the dtype of the block are skipped.
+ * @param compression - NULL or all zero disables compression.
+ * @returns 0 if successful. */
+int big_block_set_compression(BigBlock * bb, const BigBlockCompression * compression); /* raises */
+
+/* Returns non-zero if the data files of the block are compressed */
+int big_block_is_compressed(BigBlock * bb);
+
 /** Set an attribute on a BigBlock: attributes are plaintext key-value pairs stored in a special file in the Block directory.
  * The value may be a (small) array.
  * Arguments:
@@ -20,6 +20,7 @@
 #include <libgadget/timebinmgr.h>
 #include <libgadget/petaio.h>
 #include <libgadget/cooling_qso_lightup.h>
+#include <libgadget/lightcone.h>
 
 static int
 BlackHoleFeedbackMethodAction (ParameterSet * ps, char * name, void * data)
@@ -123,6 +124,8 @@ create_gadget_parameter_set()
     /* MaxRMSDisplacementFac = 0.1 increases the power on large scales by a small constant factor of 1.0005. */
     param_declare_double(ps, "MaxRMSDisplacementFac", OPTIONAL, 0.2, "Controls the length of the PM timestep. Max RMS displacement per timestep in units of the mean particle separation.");
     param_declare_double(ps, "ArtBulkViscConst", OPTIONAL, 0.75, "Artificial viscosity constant for SPH.");
+    param_declare_int(ps, "HydroSymmetricPairs", OPTIONAL, 0, "Evaluate each pair of local active gas particles once in the hydro force, adding equal and opposite contributions to both.");
+    param_declare_int(ps, "HydroPackedNeighbours", OPTIONAL, 1, "Pack the properties of gas neighbours into one record per particle before the hydro force loop, for cache efficiency. Only done on timesteps where at least 5% of particles are active, as packing touches every gas particle.");
     param_declare_double(ps, "CourantFac", OPTIONAL, 0.15, "Courant factor for the timestepping.");
     param_declare_double(ps, "DensityResolutionEta", OPTIONAL, 1.0, "Resolution eta factor (See Price 2008) 1 = 33 for Cubic Spline");
 
@@ -136,7 +139,16 @@ create_gadget_parameter_set()
     param_declare_int(ps, "WritersPerFile", OPTIONAL, 8, "Number of Writer groups assigned to a file; total number of writers is capped by NumWriters.");
 
     param_declare_int(ps, "EnableAggregatedIO", OPTIONAL, 0, "Use the Aggregated IO policy for small data set (Experimental).");
+    param_declare_int(ps, "SnapshotCompression", OPTIONAL, 0, "Compress snapshot blocks: 0 writes raw blocks, 1 shuffles the bytes and compresses with the built-in LZ codec, 2 uses zlib instead if bigfile was built with it. Compressed snapshots can only be read by this version of bigfile.");
+    param_declare_double(ps, "CompressVelocityError", OPTIONAL, 0, "If SnapshotCompression is set, absolute error (in snapshot velocity units) allowed when compressing velocities. 0 is lossless. Restarts from these snapshots see the rounded velocities.");
+    param_declare_double(ps, "CompressSphRelError", OPTIONAL, 0, "If SnapshotCompression is set, relative error allowed when compressing the SPH fields (density, smoothing length, internal energy and ionisation state). 0 is lossless. Restarts from these snapshots see the rounded values.");
+    param_declare_int(ps, "PipelineSnapshotBlocks", OPTIONAL, 1, "When writing a snapshot, compute the next block on the other OpenMP threads while one thread writes the current block, with the usual NumWriters throttling. Needs more than one thread and free memory for two copies of the largest block; otherwise blocks are computed and written in turn.");
+    param_declare_int(ps, "RestartReadByKey", OPTIONAL, 1, "On restart, give each rank the particles of a segment of the Peano curve, using the spatial index of the snapshot, so that the domain decomposition moves few particles. Falls back to an even split of the rows if the snapshot has no index or its chunks are too coarse for the number of ranks.");
+    param_declare_int(ps, "AsyncSnapshotWrite", OPTIONAL, 0, "Copy snapshots to memory outside the main heap and write them from a background thread while the run continues. At most NumWriters ranks write at once; the next ranks start at the next timestep. If the snapshot does not fit in AsyncSnapshotMemSizePerNode or in the free memory of the node, it is written synchronously.");
+    param_declare_double(ps, "AsyncSnapshotMemSizePerNode", OPTIONAL, 0.2, "Memory for staging a snapshot written in the background, in MB per node, on top of MaxMemSizePerNode. Passing <= 1 uses this fraction of the total memory of the node.");
     param_declare_int(ps, "AggregatedIOThreshold", OPTIONAL, 1024 * 1024 * 256, "Max number of bytes on a writer before reverting to throttled IO.");
+    param_declare_int(ps, "IOCalibrate", OPTIONAL, 0, "Measure the file system throughput at startup for a few values of NumWriters and BytesPerFile, with and without aggregated IO, and use the fastest. AggregatedIOThreshold is the memory budget of aggregated IO. The choice is recorded in the snapshot Header.");
+    param_declare_int(ps, "IOCalibrateBytes", OPTIONAL, 1024 * 1024 * 32, "Bytes written by each rank in each trial of the I/O calibration.");
 
     /*Parameters of the cooling module*/
     param_declare_int(ps, "CoolingOn", REQUIRED, 0, "Enables cooling");
@@ -163,12 +175,20 @@ create_gadget_parameter_set()
     param_declare_int(ps, "SelfShieldingOn", OPTIONAL, 1, "Enable a correction in the cooling table for self-shielding.");
     param_declare_double(ps, "PhotoIonizeFactor", OPTIONAL, 1, "Scale the TreeCool table by this factor.");
     param_declare_int(ps, "PhotoIonizationOn", OPTIONAL, 1, "Should PhotoIonization be enabled.");
+    param_declare_int(ps, "CoolingRateTable", OPTIONAL, 0, "Interpolate the net cooling rate and electron abundance for the uniform UV background from a table in density and internal energy, instead of solving the rate network for every particle.");
+    param_declare_double(ps, "CoolingRateTableRedshiftTol", OPTIONAL, 0.01, "Rebuild the cooling rate table when the redshift has changed by more than this.");
     /* End cooling module parameters*/
 
     param_declare_int(ps, "HydroOn", OPTIONAL, 1, "Enables hydro force");
     param_declare_int(ps, "DensityOn", OPTIONAL, 1, "Enables SPH density computation.");
     param_declare_int(ps, "DensityIndependentSphOn", REQUIRED, 1, "Enables density-independent (pressure-entropy) SPH.");
     param_declare_int(ps, "LightconeOn", OPTIONAL, 0, "Enables a wildly experimental lightcone algorithm that writes particles crossing a lightcone boundary to a file. May not work!");
+    param_declare_int(ps, "LightconeTypes", OPTIONAL, 2, "Bit mask of the particle types written to the lightcone: 1 for gas, 2 for DM, 16 for stars, 32 for black holes.");
+    param_declare_string(ps, "LightconeFields", OPTIONAL, "", "Snapshot blocks also written for the particles crossing the lightcone, as ptype/BlockName separated by spaces, eg: 0/NeutralHydrogenFraction 0/InternalEnergy 5/BlackholeAccretionRate");
+    param_declare_int(ps, "LightconeWriteParticles", OPTIONAL, 1, "Write the particles crossing the lightcone. Set to 0 to only write the maps.");
+    param_declare_int(ps, "LightconeMapNside", OPTIONAL, 0, "If > 0, bin the lightcone crossings into HEALPix maps of this Nside (RING ordering) in shells of comoving distance, written as Maps/<shell>/Mass. The maps of the shell in progress are saved with each snapshot as PartialMaps/<snapnum>/Mass, and read back on restart from it. 0 disables the maps.");
+    param_declare_double(ps, "LightconeMapShellWidth", OPTIONAL, 100000, "Comoving width of the lightcone map shells, in internal length units (kpc/h by default). Each step is binned into the shell containing the horizon at its start.");
+    param_declare_string(ps, "LightconeMapFields", OPTIONAL, "", "Scalar snapshot blocks also mapped, weighted by mass, as ptype/BlockName separated by spaces, eg: 0/InternalEnergy 0/NeutralHydrogenFraction. Written as Maps/<shell>/<ptype>/<BlockName>.");
     param_declare_int(ps, "TreeGravOn", OPTIONAL, 1, "Enables tree gravity");
     param_declare_int(ps, "RadiationOn", OPTIONAL, 1, "Include radiation density in the background evolution.");
     param_declare_int(ps, "FastParticleType", OPTIONAL, 2, "Particles of this type will not decrease the timestep. Default neutrinos.");
@@ -186,10 +206,11 @@ create_gadget_parameter_set()
     param_declare_double(ps, "MinGasTemp", OPTIONAL, 5, "Minimum gas temperature");
 
     param_declare_int(ps, "SnapshotWithFOF", REQUIRED, 0, "Enable Friends-of-Friends halo finder.");
-    param_declare_int(ps, "FOFSaveParticles", OPTIONAL, 1, "Save particles in the FOF catalog.");
+    param_declare_int(ps, "FOFSaveParticles", OPTIONAL, 1, "Save particles in the FOF catalog of the FOF outputs whose snapshot number is a multiple of this. 0 never saves them. Halo properties are always saved.");
     param_declare_double(ps, "FOFHaloLinkingLength", OPTIONAL, 0.2, "Linking length for Friends of Friends halos.");
     param_declare_int(ps, "FOFHaloMinLength", OPTIONAL, 32, "Minimum number of particles per FOF Halo.");
     param_declare_double(ps, "MinFoFMassForNewSeed", OPTIONAL, 2, "Minimal halo mass for seeding tracer particles in internal mass units.");
+    param_declare_double(ps, "FOFSeedMinOverDensity", OPTIONAL, 0, "For black hole seeding, only link FOF groups from particles in tree leaves with at least this many times the mean particle number density. Faster, but halo masses may be slightly underestimated. 0 runs the full FOF. Values around 10 are well below the FOF boundary overdensity.");
     param_declare_double(ps, "TimeBetweenSeedingSearch", OPTIONAL, 1.04, "Scale factor fraction increase between Seeding Attempts.");
 
     /*Black holes*/
@@ -204,6 +225,7 @@ create_gadget_parameter_set()
     param_declare_double(ps, "BlackHoleFeedbackFactor", OPTIONAL, 0.05, " Fraction of the black hole luminosity to turn into thermal energy");
     param_declare_double(ps, "BlackHoleFeedbackRadius", OPTIONAL, 0, "If set, the comoving radius at which the black hole feedback energy is deposited.");
     param_declare_int(ps, "BlackHoleRepositionEnabled", OPTIONAL, 1, "Enables Black hole repositioning to the potential minimum.");
+    param_declare_int(ps, "BlackHoleAllgatherMax", OPTIONAL, 4096, "If there are at most this many active black holes, every rank evaluates every black hole against its own gas instead of exporting black holes by domain. 0 disables.");
 
     param_declare_double(ps, "BlackHoleFeedbackRadiusMaxPhys", OPTIONAL, 0, "If set, the physical radius at which the black hole feedback energy is deposited. When both this flag and BlackHoleFeedbackRadius are both set, the smaller radius is used.");
     param_declare_int(ps,"WriteBlackHoleDetails",OPTIONAL, 0, "If set, output BH details at every time step.");
@@ -270,6 +292,7 @@ create_gadget_parameter_set()
 
     param_declare_double(ps, "WindFreeTravelLength", OPTIONAL, 20, "Expected decoupling distance for the wind in internal distance units.");
     param_declare_double(ps, "WindFreeTravelDensFac", OPTIONAL, 0.1, "If the density of the wind particle drops below this factor of the star formation density threshold, the gas will recouple.");
+    param_declare_int(ps, "WindAllgatherMax", OPTIONAL, 4096, "If at most this many stars form in a step, gather them on every rank for the wind feedback walks instead of exporting them by domain. 0 disables.");
 
     param_declare_int(ps, "RandomSeed", OPTIONAL, 42, "Random number generator initial seed. Used to form stars.");
 
@@ -359,6 +382,7 @@ void read_parameter_file(char *fname, int * ShowBacktrace, double * MaxMemSizePe
     set_winds_params(ps);
     set_fof_params(ps);
     set_blackhole_params(ps);
+    set_lightcone_params(ps);
 
     parameter_set_free(ps);
 }
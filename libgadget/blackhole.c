@@ -32,6 +32,7 @@ struct BlackholeParams
     double SeedBlackHoleMass;	/*!< Seed black hole mass */
     double BlackHoleEddingtonFactor;	/*! Factor above Eddington */
     int BlackHoleRepositionEnabled; /* If true, enable repositioning the BH to the potential minimum*/
+    int BlackHoleAllgatherMax; /* Use the allgather treewalk if there are at most this many active BHs*/
 } blackhole_params;
 
 typedef struct {
@@ -104,6 +105,9 @@ struct BHPriv {
      * in the feedback treewalk*/
     MyFloat * BH_FeedbackWeightSum;
 
+    /* UV background for the optically thin feedback weighting*/
+    const struct GlobalUVBG * GlobalUVBG;
+
     /* Counters*/
     int64_t * N_sph_swallowed;
     int64_t * N_BH_swallowed;
@@ -154,6 +158,7 @@ void set_blackhole_params(ParameterSet * ps)
 
         blackhole_params.BlackHoleFeedbackMethod = param_get_enum(ps, "BlackHoleFeedbackMethod");
         blackhole_params.BlackHoleRepositionEnabled = param_get_int(ps, "BlackHoleRepositionEnabled");
+        blackhole_params.BlackHoleAllgatherMax = param_get_int(ps, "BlackHoleAllgatherMax");
     }
     MPI_Bcast(&blackhole_params, sizeof(struct BlackholeParams), MPI_BYTE, 0, MPI_COMM_WORLD);
 }
@@ -322,6 +327,8 @@ blackhole(const ActiveParticles * act, ForceTree * tree, FILE * FdBlackHoles, FI
     tw_accretion->result_type_elsize = sizeof(TreeWalkResultBHAccretion);
     tw_accretion->tree = tree;
     tw_accretion->priv = priv;
+    if(HAS(blackhole_params.BlackHoleFeedbackMethod, BH_FEEDBACK_OPTTHIN))
+        priv->GlobalUVBG = get_global_uvbg_cache(1./All.Time - 1);
 
     TreeWalk tw_feedback[1] = {{0}};
     tw_feedback->ev_label = "BH_FEEDBACK";
@@ -337,8 +344,21 @@ blackhole(const ActiveParticles * act, ForceTree * tree, FILE * FdBlackHoles, FI
     tw_feedback->tree = tree;
     tw_feedback->priv = priv;
 
+    /* With few active black holes it is cheaper to send each one to every rank
+     * than to set up export buffers for them.*/
+    int NumActiveBH = 0;
+    #pragma omp parallel for reduction(+: NumActiveBH)
+    for(i = 0; i < act->NumActiveParticle; i++) {
+        const int p_i = act->ActiveParticle ? act->ActiveParticle[i] : i;
+        if(!P[p_i].IsGarbage && blackhole_accretion_haswork(p_i, tw_accretion))
+            NumActiveBH++;
+    }
+    int64_t TotActiveBH;
+    sumup_large_ints(1, &NumActiveBH, &TotActiveBH);
+    const int allgather = TotActiveBH <= blackhole_params.BlackHoleAllgatherMax;
+
     MPIU_Barrier(MPI_COMM_WORLD);
-    message(0, "Beginning black-hole accretion\n");
+    message(0, "Beginning black-hole accretion for %ld black holes%s\n", TotActiveBH, allgather ? " on all ranks" : "");
 
     /* Let's determine which particles may be swallowed and calculate total feedback weights */
     priv->SPH_SwallowID = mymalloc("SPH_SwallowID", SlotsManager->info[0].size * sizeof(MyIDType));
@@ -355,7 +375,10 @@ blackhole(const ActiveParticles * act, ForceTree * tree, FILE * FdBlackHoles, FI
     priv->BH_SurroundingGasVel = (MyFloat (*) [3]) mymalloc("BH_SurroundVel", 3* SlotsManager->info[5].size * sizeof(priv->BH_SurroundingGasVel[0]));
 
     /* This allocates memory*/
-    treewalk_run(tw_accretion, act->ActiveParticle, act->NumActiveParticle);
+    if(allgather)
+        treewalk_run_allgather(tw_accretion, act->ActiveParticle, act->NumActiveParticle);
+    else
+        treewalk_run(tw_accretion, act->ActiveParticle, act->NumActiveParticle);
 
     MPIU_Barrier(MPI_COMM_WORLD);
     message(0, "Start swallowing of gas particles and black holes\n");
@@ -377,7 +400,10 @@ blackhole(const ActiveParticles * act, ForceTree * tree, FILE * FdBlackHoles, FI
     priv->Injected_BH_Energy = mymalloc2("Injected_BH_Energy", SlotsManager->info[0].size * sizeof(MyFloat));
     memset(priv->Injected_BH_Energy, 0, SlotsManager->info[0].size * sizeof(MyFloat));
 
-    treewalk_run(tw_feedback, act->ActiveParticle, act->NumActiveParticle);
+    if(allgather)
+        treewalk_run_allgather(tw_feedback, act->ActiveParticle, act->NumActiveParticle);
+    else
+        treewalk_run(tw_feedback, act->ActiveParticle, act->NumActiveParticle);
 
     if(FdBlackholeDetails){
         collect_BH_info(act->ActiveParticle, act->NumActiveParticle, priv, FdBlackholeDetails);
@@ -684,8 +710,7 @@ blackhole_accretion_ngbiter(TreeWalkQueryBHAccretion * I,
             /* update the feedback weighting */
             double mass_j;
             if(HAS(blackhole_params.BlackHoleFeedbackMethod, BH_FEEDBACK_OPTTHIN)) {
-                double redshift = 1./All.Time - 1;
-                double nh0 = get_neutral_fraction_sfreff(redshift, &P[other], &SPHP(other));
+                double nh0 = get_neutral_fraction_sfreff(BH_GET_PRIV(lv->tw)->GlobalUVBG, &P[other], &SPHP(other));
                 if(r2 > 0)
                     O->FeedbackWeightSum += (P[other].Mass * nh0) / r2;
             } else {
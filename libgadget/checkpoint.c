@@ -20,31 +20,65 @@
  *  This file delegates the functions to petaio and fof.
  */
 
+/* A snapshot still being written in the background. It is only added to Snapshots.txt
+ * once complete, so a restart never finds a partial snapshot. OutputDir is All.OutputDir.*/
+static struct {
+    int snapnum;
+    double Time;
+    const char * OutputDir;
+} PendingSnapshot = {-1, 0, NULL};
+
+static void
+register_snapshot(int snapnum, double Time, const char * OutputDir)
+{
+    int ThisTask;
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    if(ThisTask == 0) {
+        char * buf = fastpm_strdup_printf("%s/Snapshots.txt", OutputDir);
+        FILE * fd = fopen(buf, "a");
+        fprintf(fd, "%03d %g\n", snapnum, Time);
+        fclose(fd);
+        myfree(buf);
+    }
+}
+
+void
+finish_checkpoint(void)
+{
+    if(PendingSnapshot.snapnum < 0)
+        return;
+    walltime_measure("/Misc");
+    petaio_finish_async_write();
+    walltime_measure("/Snapshot/Wait");
+    register_snapshot(PendingSnapshot.snapnum, PendingSnapshot.Time, PendingSnapshot.OutputDir);
+    PendingSnapshot.snapnum = -1;
+}
+
 void
 write_checkpoint(int snapnum, int WriteSnapshot, int WriteGroupID, double Time, const char * OutputDir, const char * SnapshotFileBase, const int OutputDebugFields)
 {
     walltime_measure("/Misc");
     if(WriteSnapshot)
     {
+        /* The previous snapshot must be complete before the next is started*/
+        finish_checkpoint();
         /* write snapshot of particles */
         struct IOTable IOTable = {0};
         register_io_blocks(&IOTable, WriteGroupID);
         if(OutputDebugFields)
             register_debug_io_blocks(&IOTable);
-        petaio_save_snapshot(&IOTable, 1, "%s/%s_%03d", OutputDir, SnapshotFileBase, snapnum);
+        int async = petaio_save_snapshot_async(&IOTable, "%s/%s_%03d", OutputDir, SnapshotFileBase, snapnum);
 
         destroy_io_blocks(&IOTable);
         walltime_measure("/Snapshot/Write");
 
-        int ThisTask;
-        MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
-        if(ThisTask == 0) {
-            char * buf = fastpm_strdup_printf("%s/Snapshots.txt", OutputDir);
-            FILE * fd = fopen(buf, "a");
-            fprintf(fd, "%03d %g\n", snapnum, Time);
-            fclose(fd);
-            myfree(buf);
+        if(async) {
+            PendingSnapshot.snapnum = snapnum;
+            PendingSnapshot.Time = Time;
+            PendingSnapshot.OutputDir = OutputDir;
         }
+        else
+            register_snapshot(snapnum, Time, OutputDir);
      }
 }
 
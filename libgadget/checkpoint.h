@@ -1,7 +1,11 @@
 #ifndef CHECKPOINT_H
 #define CHECKPOINT_H
 
+/* Write a snapshot. With AsyncSnapshotWrite it may still be in flight on return;
+ * OutputDir must then stay valid until finish_checkpoint.*/
 void write_checkpoint(int snapnum, int WriteSnapshot, int WriteGroupID, double Time, const char * OutputDir, const char * SnapshotFileBase, const int OutputDebugFields);
+/* Wait for a snapshot written in the background and record it in Snapshots.txt. Collective.*/
+void finish_checkpoint(void);
 void dump_snapshot(const char * dump, const char * OutputDir);
 int find_last_snapnum(const char * OutputDir);
 
@@ -57,7 +57,9 @@ void init_cooling(char * TreeCoolFile, char * MetalCoolFile, char * reion_hist_f
 static double
 get_lambdanet(double rho, double u, double redshift, double Z, struct UVBG * uvbg, double * ne_guess, int isHeIIIionized)
 {
-    double LambdaNet = get_heatingcooling_rate(rho, u, 1 - HYDROGEN_MASSFRAC, redshift, Z, uvbg, ne_guess);
+    double LambdaNet;
+    if(!get_heatingcooling_rate_table(rho, u, 1 - HYDROGEN_MASSFRAC, redshift, Z, uvbg, ne_guess, &LambdaNet))
+        LambdaNet = get_heatingcooling_rate(rho, u, 1 - HYDROGEN_MASSFRAC, redshift, Z, uvbg, ne_guess);
     if(!isHeIIIionized) {
         /* get_long_mean_free_path_heating returns the heating in units of erg/s/cm^3,
          * the factor of the mean density converts from erg/s/cm^3 to erg/s/g */
@@ -66,90 +68,167 @@ get_lambdanet(double rho, double u, double redshift, double Z, struct UVBG * uvb
     return LambdaNet;
 }
 
-/* returns new internal energy per unit mass.
- * Arguments are passed in code units, density is proper density.
- */
-double DoCooling(double redshift, double u_old, double rho, double dt, struct UVBG * uvbg, double *ne_guess, double Z, double MinEgySpec, int isHeIIIionized)
-{
-    if(!coolunits.CoolingOn) return 0;
+/* State of one particle in the batched cooling solver*/
+enum CoolPhase {
+    COOL_INIT,      /* Evaluating the rate at the initial energy */
+    COOL_BRACKET_UP,    /* Heating: moving the upper bracket up */
+    COOL_BRACKET_DOWN,  /* Cooling: moving the lower bracket down */
+    COOL_BISECT,    /* Bisecting the bracket */
+    COOL_DONE,
+};
 
-    double u, du;
-    double u_lower, u_upper;
-    double LambdaNet;
-    int iter = 0;
+struct CoolLane {
+    enum CoolPhase phase;
+    double u, u_old, u_lower, u_upper;
+    /* The energy at which the rate is needed next*/
+    double ueval;
+    double rho, dt;
+    int iter;
+};
 
-    rho *= coolunits.density_in_phys_cgs / PROTONMASS;	/* convert to (physical) protons/cm^3 */
-    u_old *= coolunits.uu_in_cgs;
-    MinEgySpec *= coolunits.uu_in_cgs;
-    if(u_old < MinEgySpec)
-        u_old = MinEgySpec;
-    dt *= coolunits.tt_in_s;
-
-    u = u_old;
-    u_lower = u;
-    u_upper = u;
-
-    LambdaNet = get_lambdanet(rho, u, redshift, Z, uvbg, ne_guess, isHeIIIionized);
-
-    /* bracketing */
-    if(u - u_old - LambdaNet * dt < 0)	/* heating */
-    {
-        do
-        {
-            u_lower = u_upper;
-            u_upper *= 1.1;
-        } while(u_upper - u_old - get_lambdanet(rho, u_upper, redshift, Z, uvbg, ne_guess, isHeIIIionized) * dt < 0);
-    }
-    else
-    {
-        do {
-            u_upper = u_lower;
-            u_lower /= 1.1;
-            /* This means that we don't need an initial bracket*/
-            if(u_upper <= MinEgySpec) {
-                break;
-            }
-        } while(u_lower - u_old - get_lambdanet(rho, u_lower, redshift, Z, uvbg, ne_guess, isHeIIIionized) * dt > 0);
+/* Start (or continue) the bisection. Sets the lane to done
+ * if the new energy is known to be below the minimum.*/
+static void
+cool_bisect_step(struct CoolLane * l, double MinEgySpec)
+{
+    l->phase = COOL_BISECT;
+    l->u = 0.5 * (l->u_lower + l->u_upper);
+    /* If we know that the new energy
+     * is below the minimum gas internal energy, we are done here.*/
+    if(l->u_upper <= MinEgySpec) {
+        l->u = MinEgySpec;
+        l->phase = COOL_DONE;
     }
+    l->ueval = l->u;
+}
+
+/* Move the lower bracket down. Bisect if we don't need an initial bracket.*/
+static void
+cool_bracket_down_step(struct CoolLane * l, double MinEgySpec)
+{
+    l->phase = COOL_BRACKET_DOWN;
+    l->u_upper = l->u_lower;
+    l->u_lower /= 1.1;
+    l->ueval = l->u_lower;
+    if(l->u_upper <= MinEgySpec)
+        cool_bisect_step(l, MinEgySpec);
+}
 
-    do
-    {
-        u = 0.5 * (u_lower + u_upper);
-        /* If we know that the new energy
-         * is below the minimum gas internal energy, we are done here.*/
-        if(u_upper <= MinEgySpec) {
-            u = MinEgySpec;
+/* Advance a lane given the net heating rate at l->ueval*/
+static void
+cool_advance(struct CoolLane * l, double LambdaNet, double MinEgySpec)
+{
+    switch(l->phase) {
+        case COOL_INIT:
+            /* bracketing */
+            if(l->u - l->u_old - LambdaNet * l->dt < 0) {	/* heating */
+                l->phase = COOL_BRACKET_UP;
+                l->u_lower = l->u_upper;
+                l->u_upper *= 1.1;
+                l->ueval = l->u_upper;
+            }
+            else
+                cool_bracket_down_step(l, MinEgySpec);
             break;
-        }
+        case COOL_BRACKET_UP:
+            if(l->u_upper - l->u_old - LambdaNet * l->dt < 0) {
+                l->u_lower = l->u_upper;
+                l->u_upper *= 1.1;
+                l->ueval = l->u_upper;
+            }
+            else
+                cool_bisect_step(l, MinEgySpec);
+            break;
+        case COOL_BRACKET_DOWN:
+            if(l->u_lower - l->u_old - LambdaNet * l->dt > 0)
+                cool_bracket_down_step(l, MinEgySpec);
+            else
+                cool_bisect_step(l, MinEgySpec);
+            break;
+        case COOL_BISECT:
+            if(l->u - l->u_old - LambdaNet * l->dt > 0)
+                l->u_upper = l->u;
+            else
+                l->u_lower = l->u;
 
-        LambdaNet = get_lambdanet(rho, u, redshift, Z, uvbg, ne_guess, isHeIIIionized);
+            double du = l->u_upper - l->u_lower;
 
-        if(u - u_old - LambdaNet * dt > 0)
-        {
-            u_upper = u;
-        }
-        else
-        {
-            u_lower = u;
-        }
+            l->iter++;
 
-        du = u_upper - u_lower;
+            if(l->iter >= (MAXITER - 10))
+                message(1, "u= %g\n", l->u);
 
-        iter++;
+            if(fabs(du / l->u) > 1.0e-6 && l->iter < MAXITER)
+                cool_bisect_step(l, MinEgySpec);
+            else {
+                if(l->iter >= MAXITER)
+                    endrun(10, "failed to converge in DoCooling()\n");
+                l->phase = COOL_DONE;
+            }
+            break;
+        case COOL_DONE:
+            break;
+    }
+}
 
-        if(iter >= (MAXITER - 10))
-            message(1, "u= %g\n", u);
+/* Cools a batch of n <= COOLING_BATCH particles. The bracketing and bisection steps
+ * run in lockstep over the batch: each pass evaluates the rate for every particle
+ * which has not yet converged, then advances them all. Each particle takes the same
+ * steps as it would in DoCooling. The answers agree to round-off: the compiler may
+ * vectorise the batch differently, for example under -ffast-math.
+ * Arguments are as for DoCooling, one per particle. The new energies are stored in unew.*/
+void
+DoCoolingBatch(int n, double redshift, const double * u_old, const double * rho, const double * dt, struct UVBG * uvbg, double * ne_guess, const double * Z, double MinEgySpec, const int * isHeIIIionized, double * unew)
+{
+    int k;
+    if(!coolunits.CoolingOn) {
+        for(k = 0; k < n; k++)
+            unew[k] = 0;
+        return;
     }
-    while(fabs(du / u) > 1.0e-6 && iter < MAXITER);
+    if(n > COOLING_BATCH)
+        endrun(5, "Cooling batch of %d particles is larger than %d\n", n, COOLING_BATCH);
+
+    struct CoolLane lanes[COOLING_BATCH];
+    MinEgySpec *= coolunits.uu_in_cgs;
 
-    if(iter >= MAXITER)
-    {
-        endrun(10, "failed to converge in DoCooling()\n");
+    for(k = 0; k < n; k++) {
+        struct CoolLane * l = &lanes[k];
+        l->rho = rho[k] * coolunits.density_in_phys_cgs / PROTONMASS;	/* convert to (physical) protons/cm^3 */
+        l->u_old = u_old[k] * coolunits.uu_in_cgs;
+        if(l->u_old < MinEgySpec)
+            l->u_old = MinEgySpec;
+        l->dt = dt[k] * coolunits.tt_in_s;
+        l->u = l->u_lower = l->u_upper = l->ueval = l->u_old;
+        l->iter = 0;
+        l->phase = COOL_INIT;
     }
 
-    u /= coolunits.uu_in_cgs;   /*convert back to internal units */
+    int nactive = n;
+    while(nactive > 0) {
+        nactive = 0;
+        for(k = 0; k < n; k++) {
+            struct CoolLane * l = &lanes[k];
+            if(l->phase == COOL_DONE)
+                continue;
+            double LambdaNet = get_lambdanet(l->rho, l->ueval, redshift, Z[k], &uvbg[k], &ne_guess[k], isHeIIIionized[k]);
+            cool_advance(l, LambdaNet, MinEgySpec);
+            nactive += (l->phase != COOL_DONE);
+        }
+    }
 
-    return u;
+    for(k = 0; k < n; k++)
+        unew[k] = lanes[k].u / coolunits.uu_in_cgs;   /*convert back to internal units */
+}
+
+/* returns new internal energy per unit mass.
+ * Arguments are passed in code units, density is proper density.
+ */
+double DoCooling(double redshift, double u_old, double rho, double dt, struct UVBG * uvbg, double *ne_guess, double Z, double MinEgySpec, int isHeIIIionized)
+{
+    double unew;
+    DoCoolingBatch(1, redshift, &u_old, &rho, &dt, uvbg, ne_guess, &Z, MinEgySpec, &isHeIIIionized, &unew);
+    return unew;
 }
 
 /* returns cooling time.
@@ -164,7 +243,9 @@ double GetCoolingTime(double redshift, double u_old, double rho, struct UVBG * u
     u_old *= coolunits.uu_in_cgs;
 
     /* Note: this does not include the long mean free path heating from helium reionization*/
-    double LambdaNet = get_heatingcooling_rate(rho, u_old, 1 - HYDROGEN_MASSFRAC, redshift, Z, uvbg, ne_guess);
+    double LambdaNet;
+    if(!get_heatingcooling_rate_table(rho, u_old, 1 - HYDROGEN_MASSFRAC, redshift, Z, uvbg, ne_guess, &LambdaNet))
+        LambdaNet = get_heatingcooling_rate(rho, u_old, 1 - HYDROGEN_MASSFRAC, redshift, Z, uvbg, ne_guess);
 
     if(LambdaNet >= 0)		/* ups, we have actually heating due to UV background */
         return 0;
@@ -15,6 +15,16 @@ struct UVBG {
     double self_shield_dens;
 };
 
+/* The uniform UV background for the current timestep, computed once by set_global_uvbg.
+ * It is read-only between calls, so one pointer can be shared by all threads and particles.*/
+struct GlobalUVBG {
+    /* Redshift at which the tables were interpolated*/
+    double redshift;
+    /* True if there is no UV fluctuation table, so the local UVBG is the global UVBG everywhere*/
+    int uniform;
+    struct UVBG uvbg;
+};
+
 /*Global unit system for the cooling module*/
 struct cooling_units
 {
@@ -43,15 +53,27 @@ double GetCoolingTime(double redshift, double u_old, double rho, struct UVBG * u
 /*Get the new internal energy per unit mass. ne_guess is set to the new internal equilibrium electron density*/
 double DoCooling(double redshift, double u_old, double rho, double dt, struct UVBG * uvbg, double *ne_guess, double Z, double MinEgySpec, int isHeIIIionized);
 
+/* Maximum number of particles in a DoCoolingBatch call*/
+#define COOLING_BATCH 32
+
+/* As DoCooling for n <= COOLING_BATCH particles at once, which converge in lockstep.
+ * Array arguments have one entry per particle. The new internal energies are stored in unew.*/
+void DoCoolingBatch(int n, double redshift, const double * u_old, const double * rho, const double * dt, struct UVBG * uvbg, double * ne_guess, const double * Z, double MinEgySpec, const int * isHeIIIionized, double * unew);
+
 /*Sets the global variable corresponding to the uniform part of the UV background.*/
 void set_global_uvbg(double redshift);
 
+/* Returns the UV background cached by set_global_uvbg. Fetch it once per loop and pass it down:
+ * endrun is called if it was computed at a different redshift.*/
+const struct GlobalUVBG * get_global_uvbg_cache(double redshift);
+
 /*Interpolates the ultra-violet background tables to the desired redshift and returns a cooling rate table*/
 struct UVBG get_global_UVBG(double redshift);
 
 /* Change the ultra-violet background table according to a pre-computed table of UV fluctuations.
- * This zeros the UVBG if this particular particle has not reionized yet*/
-struct UVBG get_local_UVBG(double redshift, double * Pos, const double * PosOffset);
+ * This zeros the UVBG if this particular particle has not reionized yet.
+ * If the UV background is uniform the cached global UVBG is returned without touching Pos.*/
+struct UVBG get_local_UVBG(const struct GlobalUVBG * GlobalUVBG, const double * Pos, const double * PosOffset);
 
 /*Get the equilibrium temperature at given internal energy.
     density is total gas density in protons/cm^3
@@ -103,6 +103,32 @@ static double * cool_recombHp, * cool_recombHeP, * cool_recombHePP;
 /*For the Free-free cooling rate*/
 static double * cool_freefree1;
 
+/* Table of the primordial net heating rate, the metal cooling rate per unit metallicity
+ * and the equilibrium electron abundance, on a regular grid in log10 nH and log10 ienergy.
+ * It is built for primordial helium and the uniform UV background at one redshift,
+ * and rebuilt when the redshift has moved by more than RateTableRedshiftTol.
+ * Metallicity enters linearly and the helium reionization heating is added by the caller,
+ * so neither needs a table dimension.*/
+#define RATETAB_LOGNH_MIN (-10.)
+#define RATETAB_LOGNH_MAX 3.
+#define RATETAB_NNH 261
+#define RATETAB_LOGU_MIN 8.
+#define RATETAB_LOGU_MAX 17.5
+#define RATETAB_NU 761
+
+static struct {
+    int built;
+    /* Redshift the table was built at*/
+    double redshift;
+    /* The uniform UVBG of the current step, and its redshift.
+     * Lookups with any other UVBG use the full rate network.*/
+    struct UVBG uvbg;
+    double uvbg_redshift;
+    /* Interleaved so that each grid point is one contiguous record:
+     * primordial net rate, metal cooling rate, ne / nh.*/
+    double (*rates)[3];
+} RateTable;
+
 static void
 init_itp_type(double * xarr, struct itp_type * Gamma, int Nelem)
 {
@@ -947,6 +973,8 @@ set_cooling_params(ParameterSet * ps)
         CoolingParams.MinGasTemp = param_get_double(ps, "MinGasTemp");
         CoolingParams.UVRedshiftThreshold = param_get_double(ps, "UVRedshiftThreshold");
         CoolingParams.HydrogenHeatAmp = log10(param_get_double(ps, "HydrogenHeatAmp"));
+        CoolingParams.RateTableOn = param_get_int(ps, "CoolingRateTable");
+        CoolingParams.RateTableRedshiftTol = param_get_double(ps, "CoolingRateTableRedshiftTol");
 
         /*Helium model parameters*/
         CoolingParams.HeliumHeatOn = param_get_int(ps, "HeliumHeatOn");
@@ -1019,6 +1047,11 @@ init_cooling_rates(const char * TreeCoolFile, const char * MetalCoolFile, Cosmol
 
     /*Initialize the metal cooling table*/
     InitMetalCooling(MetalCoolFile);
+
+    RateTable.built = 0;
+    RateTable.rates = NULL;
+    if(CoolingParams.RateTableOn)
+        RateTable.rates = mymalloc("CoolingRateTable", RATETAB_NNH * RATETAB_NU * sizeof(RateTable.rates[0]));
 }
 
 /* Split out the Compton cooling*/
@@ -1084,16 +1117,11 @@ get_individual_cooling(enum CoolProcess process, double density, double ienergy,
     return Lambda * pow(1 - helium, 2) * density / PROTONMASS;
 }
 
-/*Get the total change in internal energy per unit time in erg/s/g for a given temperature (internal energy) and density.
-  density is total gas density in protons/cm^3
-  Internal energy is in ergs/g.
-  helium is a mass fraction, 1 - HYDROGEN_MASSFRAC = 0.24 for primordial gas.
-  Returns (heating - cooling) / nh^2.
-  ne_equilib is the equilibrium electron abundance in units of the hydrogen number density.
-  Note this is *not* the electron density in cgs units, as used internally.
- */
-double
-get_heatingcooling_rate(double density, double ienergy, double helium, double redshift, double metallicity, const struct UVBG * uvbg, double *ne_equilib)
+/*Get the primordial heating - cooling rate / nh^2 in erg cm^3 /s, the temperature
+  and the equilibrium electron abundance per hydrogen atom. The metal cooling and the
+  conversion to erg/s/g are applied by the callers.*/
+static double
+get_primordial_heatingcooling(double density, double ienergy, double helium, double redshift, const struct UVBG * uvbg, double *ne_equilib, double * temp_out)
 {
     double logt;
     double ne = get_equilib_ne(density, ienergy, helium, &logt, uvbg, *ne_equilib);
@@ -1143,19 +1171,116 @@ get_heatingcooling_rate(double density, double ienergy, double helium, double re
     Heat *= cool_he_reion_factor(density, helium, redshift);
     /*Set external equilibrium electron density*/
     *ne_equilib = nebynh;
+    *temp_out = temp;
+
+    //message(1, "Heat = %g Lambda = %g LC = %g LR = %g LFF = %g LCmptn = %g, ne = %g, nH0 = %g, nHp = %g, nHe0 = %g, nHep = %g, nHepp = %g, nh=%g, temp=%g, ienergy=%g\n", Heat, Lambda, LambdaCollis, LambdaRecomb, LambdaFF, LambdaCmptn, nebynh, nH0, nHp, nHe0, nHep, nHepp, nh, temp, ienergy);
+    return Heat - Lambda;
+}
+
+/*Get the total change in internal energy per unit time in erg/s/g for a given temperature (internal energy) and density.
+  density is total gas density in protons/cm^3
+  Internal energy is in ergs/g.
+  helium is a mass fraction, 1 - HYDROGEN_MASSFRAC = 0.24 for primordial gas.
+  Returns (heating - cooling) / nh^2.
+  ne_equilib is the equilibrium electron abundance in units of the hydrogen number density.
+  Note this is *not* the electron density in cgs units, as used internally.
+ */
+double
+get_heatingcooling_rate(double density, double ienergy, double helium, double redshift, double metallicity, const struct UVBG * uvbg, double *ne_equilib)
+{
+    double temp;
+    double nh = density * (1 - helium);
+    double LambdaPrim = get_primordial_heatingcooling(density, ienergy, helium, redshift, uvbg, ne_equilib, &temp);
 
     /*Apply metal cooling. Does nothing if metal cooling is disabled*/
     double MetalCooling = metallicity * TableMetalCoolingRate(redshift, temp, nh);
 
-    double LambdaNet = Heat - Lambda - MetalCooling;
-
-    //message(1, "Heat = %g Lambda = %g MetalCool = %g LC = %g LR = %g LFF = %g LCmptn = %g, ne = %g, nH0 = %g, nHp = %g, nHe0 = %g, nHep = %g, nHepp = %g, nh=%g, temp=%g, ienergy=%g\n", Heat, Lambda, MetalCooling, LambdaCollis, LambdaRecomb, LambdaFF, LambdaCmptn, nebynh, nH0, nHp, nHe0, nHep, nHepp, nh, temp, ienergy);
+    double LambdaNet = LambdaPrim - MetalCooling;
 
     /* LambdaNet in erg cm^3 /s, Density in protons/cm^3, PROTONMASS in protons/g.
      * Convert to erg/s/g*/
     return LambdaNet * pow(1 - helium, 2) * density / PROTONMASS;
 }
 
+static void
+build_heatingcooling_table(double redshift, const struct UVBG * uvbg)
+{
+    int ThisTask, NTask;
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    MPI_Comm_size(MPI_COMM_WORLD, &NTask);
+
+    const double helium = 1 - HYDROGEN_MASSFRAC;
+    const double dlognh = (RATETAB_LOGNH_MAX - RATETAB_LOGNH_MIN) / (RATETAB_NNH - 1);
+    const double dlogu = (RATETAB_LOGU_MAX - RATETAB_LOGU_MIN) / (RATETAB_NU - 1);
+
+    memset(RateTable.rates, 0, RATETAB_NNH * RATETAB_NU * sizeof(RateTable.rates[0]));
+    /* Each rank builds a strided set of density rows, then the rows are summed across ranks.*/
+    int i;
+    #pragma omp parallel for schedule(dynamic)
+    for(i = ThisTask; i < RATETAB_NNH; i += NTask) {
+        const double nh = pow(10, RATETAB_LOGNH_MIN + i * dlognh);
+        const double density = nh / (1 - helium);
+        int j;
+        for(j = 0; j < RATETAB_NU; j++) {
+            const double ienergy = pow(10, RATETAB_LOGU_MIN + j * dlogu);
+            double ne = 1.0, temp;
+            double * rates = RateTable.rates[i * RATETAB_NU + j];
+            rates[0] = get_primordial_heatingcooling(density, ienergy, helium, redshift, uvbg, &ne, &temp);
+            rates[1] = TableMetalCoolingRate(redshift, temp, nh);
+            rates[2] = ne;
+        }
+    }
+    MPI_Allreduce(MPI_IN_PLACE, RateTable.rates, 3 * RATETAB_NNH * RATETAB_NU, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+    RateTable.redshift = redshift;
+    RateTable.built = 1;
+}
+
+void
+update_heatingcooling_table(double redshift, const struct UVBG * uvbg)
+{
+    if(!CoolingParams.RateTableOn || !RateTable.rates)
+        return;
+    if(!RateTable.built || fabs(redshift - RateTable.redshift) > CoolingParams.RateTableRedshiftTol) {
+        double start = MPI_Wtime();
+        build_heatingcooling_table(redshift, uvbg);
+        message(0, "Built cooling rate table at z = %g in %g s\n", redshift, MPI_Wtime() - start);
+    }
+    RateTable.uvbg = *uvbg;
+    RateTable.uvbg_redshift = redshift;
+}
+
+int
+get_heatingcooling_rate_table(double density, double ienergy, double helium, double redshift, double metallicity, const struct UVBG * uvbg, double *ne_equilib, double * LambdaNet)
+{
+    if(!RateTable.built || redshift != RateTable.uvbg_redshift
+        || helium != 1 - HYDROGEN_MASSFRAC
+        || memcmp(uvbg, &RateTable.uvbg, sizeof(struct UVBG)) != 0)
+        return 0;
+
+    const double nh = density * (1 - helium);
+    const double x = (log10(nh) - RATETAB_LOGNH_MIN) * (RATETAB_NNH - 1) / (RATETAB_LOGNH_MAX - RATETAB_LOGNH_MIN);
+    const double y = (log10(ienergy) - RATETAB_LOGU_MIN) * (RATETAB_NU - 1) / (RATETAB_LOGU_MAX - RATETAB_LOGU_MIN);
+    if(!(x >= 0 && x < RATETAB_NNH - 1 && y >= 0 && y < RATETAB_NU - 1))
+        return 0;
+
+    const int i = x, j = y;
+    const double fx = x - i, fy = y - j;
+    const double w[4] = {(1 - fx) * (1 - fy), (1 - fx) * fy, fx * (1 - fy), fx * fy};
+    const double (*r[4])[3] = {
+        &RateTable.rates[i * RATETAB_NU + j], &RateTable.rates[i * RATETAB_NU + j + 1],
+        &RateTable.rates[(i + 1) * RATETAB_NU + j], &RateTable.rates[(i + 1) * RATETAB_NU + j + 1],
+    };
+    double out[3] = {0};
+    int k, l;
+    for(k = 0; k < 4; k++)
+        for(l = 0; l < 3; l++)
+            out[l] += w[k] * (*r[k])[l];
+
+    *ne_equilib = out[2];
+    *LambdaNet = (out[0] - metallicity * out[1]) * pow(1 - helium, 2) * density / PROTONMASS;
+    return 1;
+}
+
 /*Get the equilibrium temperature at given internal energy.
     density is total gas density in protons/cm^3
     Internal energy is in ergs/g.
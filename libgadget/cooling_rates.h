@@ -55,6 +55,11 @@ struct cooling_params
     double HeliumHeatAmp;
     double HeliumHeatExp;
     double rho_crit_baryon;
+
+    /*Interpolate the heating and cooling rates from a table for the uniform UVB. Default: off.*/
+    int RateTableOn;
+    /*Rebuild the table when the redshift has changed by more than this.*/
+    double RateTableRedshiftTol;
 };
 
 /*Set the parameters for the cooling module from the parameter file.*/
@@ -91,6 +96,14 @@ double get_ne_by_nh(double density, double ienergy, double helium, const struct
  */
 double get_heatingcooling_rate(double density, double ienergy, double helium, double redshift, double metallicity, const struct UVBG * uvbg, double * ne_equilib);
 
+/*Rebuild the heating and cooling rate table if the redshift has moved by more than the tolerance,
+  and accept lookups for this uniform UVBG. Does nothing unless the table is enabled. Call once per step.*/
+void update_heatingcooling_table(double redshift, const struct UVBG * uvbg);
+
+/*As get_heatingcooling_rate, but interpolated from the table. Sets *LambdaNet and returns 1 if the table
+  can be used for this redshift, UVBG, helium fraction, density and internal energy. Otherwise returns 0.*/
+int get_heatingcooling_rate_table(double density, double ienergy, double helium, double redshift, double metallicity, const struct UVBG * uvbg, double *ne_equilib, double * LambdaNet);
+
 enum CoolProcess {
     RECOMB,
     COLLIS,
@@ -22,15 +22,24 @@ static struct {
 } UVF;
 
 /*Global UVbackground stored to avoid extra interpolations.*/
-static struct UVBG GlobalUVBG = {0};
-static double GlobalUVRed = -1;
+static struct GlobalUVBG StepUVBG = {-1, 1, {0}};
 
 /*Sets the global variable corresponding to the uniform part of the UV background.*/
 void
 set_global_uvbg(double redshift)
 {
-    GlobalUVBG = get_global_UVBG(redshift);
-    GlobalUVRed = redshift;
+    StepUVBG.uvbg = get_global_UVBG(redshift);
+    StepUVBG.redshift = redshift;
+    StepUVBG.uniform = !UVF.enabled;
+    update_heatingcooling_table(redshift, &StepUVBG.uvbg);
+}
+
+const struct GlobalUVBG *
+get_global_uvbg_cache(double redshift)
+{
+    if(fabs(redshift - StepUVBG.redshift) > 1e-4)
+        endrun(1, "Called with redshift %g not %g expected by the UVBG cache.\n", redshift, StepUVBG.redshift);
+    return &StepUVBG;
 }
 
 /* Read a big array from filename/dataset into an array, allocating memory in buffer.
@@ -156,31 +165,27 @@ init_uvf_table(const char * UVFluctuationFile, const double BoxSize, const doubl
  * Otherwise returns the global UVBG passed in.
  *
  * */
-struct UVBG get_local_UVBG(double redshift, double * Pos, const double * PosOffset)
+struct UVBG get_local_UVBG(const struct GlobalUVBG * GlobalUVBG, const double * Pos, const double * PosOffset)
 {
-    if(fabs(redshift - GlobalUVRed) > 1e-4)
-        endrun(1, "Called with redshift %g not %g expected by the UVBG cache.\n", redshift, GlobalUVRed);
-
-    if(!UVF.enabled) {
+    if(GlobalUVBG->uniform) {
         /* directly use the TREECOOL table if UVF is disabled */
-        return GlobalUVBG;
+        return GlobalUVBG->uvbg;
     }
 
     struct UVBG uvbg = {0};
 
-    uvbg.self_shield_dens = GlobalUVBG.self_shield_dens;
+    uvbg.self_shield_dens = GlobalUVBG->uvbg.self_shield_dens;
 
     double corrpos[3];
     int i;
     for(i = 0; i < 3; i++)
         corrpos[i] = Pos[i] - PosOffset[i];
     double zreion = interp_eval_periodic(&UVF.interp, corrpos, UVF.Table);
-    if(zreion < redshift) {
+    if(zreion < GlobalUVBG->redshift) {
         return uvbg;
     }
 
-    memcpy(&uvbg, &GlobalUVBG, sizeof(struct UVBG));
-    return uvbg;
+    return GlobalUVBG->uvbg;
 }
 
 
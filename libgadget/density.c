@@ -154,6 +154,9 @@ struct DensityPriv {
      * If DensityIndependentSphOn = 1 then this is used to set DhsmlEgyDensityFactor.*/
     MyFloat * DhsmlDensityFactor;
     int NIteration;
+    /* Per-thread counters of the smoothing length updates made by
+     * Newton-Raphson and by the bisection fallback.*/
+    int64_t *NNewton, *NBisect;
     size_t *NPLeft;
     int **NPRedo;
     int update_hsml;
@@ -170,16 +173,12 @@ struct DensityPriv {
 
 #define DENSITY_GET_PRIV(tw) ((struct DensityPriv*) ((tw)->priv))
 
-static void
-density_ngbiter(
-        TreeWalkQueryDensity * I,
-        TreeWalkResultDensity * O,
-        TreeWalkNgbIterDensity * iter,
-        LocalTreeWalk * lv);
+static TreeWalkNgbIterFunction density_get_ngbiter(enum DensityKernelType type);
 
 static int density_haswork(int n, TreeWalk * tw);
 static void density_postprocess(int i, TreeWalk * tw);
 static void density_check_neighbours(int i, TreeWalk * tw);
+static void density_report_iterations(int64_t NQueried, const int64_t * NRedoHist, int NIteration, const int64_t * NNewton, const int64_t * NBisect, int NumThreads);
 
 static void density_reduce(int place, TreeWalkResultDensity * remote, enum TreeWalkReduceMode mode, TreeWalk * tw);
 static void density_copy(int place, TreeWalkQueryDensity * I, TreeWalk * tw);
@@ -214,7 +213,7 @@ density(const ActiveParticles * act, int update_hsml, int DoEgyDensity, int Blac
     tw->ev_label = "DENSITY";
     tw->visit = (TreeWalkVisitFunction) treewalk_visit_ngbiter;
     tw->ngbiter_type_elsize = sizeof(TreeWalkNgbIterDensity);
-    tw->ngbiter = (TreeWalkNgbIterFunction) density_ngbiter;
+    tw->ngbiter = density_get_ngbiter(DensityParams.DensityKernelType);
     tw->haswork = density_haswork;
     tw->fill = (TreeWalkFillQueryFunction) density_copy;
     tw->reduce = (TreeWalkReduceResultFunction) density_reduce;
@@ -280,6 +279,13 @@ density(const ActiveParticles * act, int update_hsml, int DoEgyDensity, int Blac
     int NumThreads = omp_get_max_threads();
     DENSITY_GET_PRIV(tw)->NPLeft = ta_malloc("NPLeft", size_t, NumThreads);
     DENSITY_GET_PRIV(tw)->NPRedo = ta_malloc("NPRedo", int *, NumThreads);
+    DENSITY_GET_PRIV(tw)->NNewton = ta_malloc("NNewton", int64_t, NumThreads);
+    DENSITY_GET_PRIV(tw)->NBisect = ta_malloc("NBisect", int64_t, NumThreads);
+    memset(DENSITY_GET_PRIV(tw)->NNewton, 0, NumThreads * sizeof(int64_t));
+    memset(DENSITY_GET_PRIV(tw)->NBisect, 0, NumThreads * sizeof(int64_t));
+    /* Number of particles still unconverged after each iteration, for the histogram*/
+    int64_t NRedoHist[MAXITER + 2] = {0};
+    int64_t NQueried = 0;
     int alloc_high = 0;
     int * ReDoQueue = act->ActiveParticle;
     int size = SlotsManager->info[0].size + SlotsManager->info[5].size;
@@ -310,6 +316,9 @@ density(const ActiveParticles * act, int update_hsml, int DoEgyDensity, int Blac
         if(!update_hsml)
             break;
 
+        if(DENSITY_GET_PRIV(tw)->NIteration == 0)
+            sumup_large_ints(1, &tw->WorkSetSize, &NQueried);
+
         tw->haswork = NULL;
         /* Now done with the current queue*/
         if(DENSITY_GET_PRIV(tw)->NIteration > 0)
@@ -319,6 +328,7 @@ density(const ActiveParticles * act, int update_hsml, int DoEgyDensity, int Blac
         size = gadget_compact_thread_arrays(ReDoQueue, DENSITY_GET_PRIV(tw)->NPRedo, DENSITY_GET_PRIV(tw)->NPLeft, NumThreads);
 
         sumup_large_ints(1, &size, &ntot);
+        NRedoHist[DENSITY_GET_PRIV(tw)->NIteration] = ntot;
         if(ntot == 0){
             myfree(ReDoQueue);
             break;
@@ -359,6 +369,11 @@ density(const ActiveParticles * act, int update_hsml, int DoEgyDensity, int Blac
         }
     } while(1);
 
+    if(update_hsml)
+        density_report_iterations(NQueried, NRedoHist, DENSITY_GET_PRIV(tw)->NIteration, DENSITY_GET_PRIV(tw)->NNewton, DENSITY_GET_PRIV(tw)->NBisect, NumThreads);
+
+    ta_free(DENSITY_GET_PRIV(tw)->NBisect);
+    ta_free(DENSITY_GET_PRIV(tw)->NNewton);
     ta_free(DENSITY_GET_PRIV(tw)->NPRedo);
     ta_free(DENSITY_GET_PRIV(tw)->NPLeft);
     if(DoEgyDensity)
@@ -457,18 +472,23 @@ density_reduce(int place, TreeWalkResultDensity * remote, enum TreeWalkReduceMod
  *  the computation. The assumption is the density kernels are slow to
  *  initialize.
  *
+ *  The kernel type is a compile time constant in each of the
+ *  density_ngbiter_* wrappers below, so the kernel evaluation is inlined
+ *  into the neighbour loop. density_get_ngbiter picks the wrapper once per treewalk.
+ *
  */
 
-static void
-density_ngbiter(
+static inline void
+density_ngbiter_kernel(
         TreeWalkQueryDensity * I,
         TreeWalkResultDensity * O,
         TreeWalkNgbIterDensity * iter,
-        LocalTreeWalk * lv)
+        LocalTreeWalk * lv,
+        const enum DensityKernelType type)
 {
     if(iter->base.other == -1) {
         const double h = I->Hsml;
-        density_kernel_init(&iter->kernel, h, DensityParams.DensityKernelType);
+        density_kernel_init(&iter->kernel, h, type);
         iter->kernel_volume = density_kernel_volume(&iter->kernel);
 
         iter->base.Hsml = h;
@@ -492,10 +512,10 @@ density_ngbiter(
     if(r2 < iter->kernel.HH)
     {
         const double u = r * iter->kernel.Hinv;
-        const double wk = density_kernel_wk(&iter->kernel, u);
+        const double wk = density_kernel_wk_type(&iter->kernel, u, type);
         O->Ngb += wk * iter->kernel_volume;
 
-        const double dwk = density_kernel_dwk(&iter->kernel, u);
+        const double dwk = density_kernel_dwk_type(&iter->kernel, u, type);
 
         const double mass_j = P[other].Mass;
 
@@ -548,6 +568,38 @@ density_ngbiter(
     }
 }
 
+static void
+density_ngbiter_cubic(TreeWalkQueryDensity * I, TreeWalkResultDensity * O, TreeWalkNgbIterDensity * iter, LocalTreeWalk * lv)
+{
+    density_ngbiter_kernel(I, O, iter, lv, DENSITY_KERNEL_CUBIC_SPLINE);
+}
+
+static void
+density_ngbiter_quintic(TreeWalkQueryDensity * I, TreeWalkResultDensity * O, TreeWalkNgbIterDensity * iter, LocalTreeWalk * lv)
+{
+    density_ngbiter_kernel(I, O, iter, lv, DENSITY_KERNEL_QUINTIC_SPLINE);
+}
+
+static void
+density_ngbiter_quartic(TreeWalkQueryDensity * I, TreeWalkResultDensity * O, TreeWalkNgbIterDensity * iter, LocalTreeWalk * lv)
+{
+    density_ngbiter_kernel(I, O, iter, lv, DENSITY_KERNEL_QUARTIC_SPLINE);
+}
+
+static TreeWalkNgbIterFunction
+density_get_ngbiter(enum DensityKernelType type)
+{
+    switch(type) {
+        case DENSITY_KERNEL_CUBIC_SPLINE:
+            return (TreeWalkNgbIterFunction) density_ngbiter_cubic;
+        case DENSITY_KERNEL_QUINTIC_SPLINE:
+            return (TreeWalkNgbIterFunction) density_ngbiter_quintic;
+        case DENSITY_KERNEL_QUARTIC_SPLINE:
+            return (TreeWalkNgbIterFunction) density_ngbiter_quartic;
+    }
+    endrun(1, "Density Kernel type %d is unknown\n", type);
+}
+
 static int
 density_haswork(int n, TreeWalk * tw)
 {
@@ -603,6 +655,33 @@ density_postprocess(int i, TreeWalk * tw)
         density_check_neighbours(i, tw);
 }
 
+/* Newton-Raphson estimate of the smoothing length which gives the desired number of neighbours.
+ * The neighbour number scales as N ~ rho h^3, so dN/dh = 3 N / (h * DhsmlDensityFactor),
+ * where DhsmlDensityFactor = 1 / (1 + h/(3 rho) drho/dh) was computed in density_postprocess.
+ * Returns -1 if no estimate is available: this happens for black holes, which do not compute
+ * the density derivative, and when the neighbour number is too far from the target for a
+ * linear extrapolation to be trusted.*/
+static double
+density_newton_hsml(int i, double numngb, double desnumngb, TreeWalk * tw)
+{
+    if(P[i].Type != 0 || numngb <= 0 || fabs(numngb - desnumngb) >= 0.5 * desnumngb)
+        return -1;
+
+    MyFloat DensFac;
+    if(DENSITY_GET_PRIV(tw)->DoEgyDensity)
+        DensFac = DENSITY_GET_PRIV(tw)->DhsmlDensityFactor[P[i].PI];
+    else
+        DensFac = SPHP(i).DhsmlEgyDensityFactor;
+
+    if(!isfinite(DensFac) || DensFac <= 0)
+        return -1;
+
+    const double fac = 1 - (numngb - desnumngb) / (NUMDIMS * numngb) * DensFac;
+    if(fac <= 0)
+        return -1;
+    return P[i].Hsml * fac;
+}
+
 void density_check_neighbours (int i, TreeWalk * tw)
 {
     /* now check whether we had enough neighbours */
@@ -638,9 +717,23 @@ void density_check_neighbours (int i, TreeWalk * tw)
                 Right[i] = P[i].Hsml;
         }
 
-        /* Next step is geometric mean of previous. */
-        if(Right[i] < tw->tree->BoxSize && Left[i] > 0)
-            P[i].Hsml = pow(0.5 * (pow(Left[i], 3) + pow(Right[i], 3)), 1.0 / 3);
+        /* The Newton-Raphson estimate for the new smoothing length, using the derivative of the
+         * number of neighbours computed during the treewalk. Negative if no estimate is available.*/
+        const double newhsml = density_newton_hsml(i, NumNgb[i], desnumngb, tw);
+        int tid = omp_get_thread_num();
+
+        if(Right[i] < tw->tree->BoxSize && Left[i] > 0) {
+            /* Safeguarded Newton-Raphson: take the Newton step if it stays inside the bracket,
+             * otherwise bisect on the volume. */
+            if(newhsml > Left[i] && newhsml < Right[i]) {
+                P[i].Hsml = newhsml;
+                DENSITY_GET_PRIV(tw)->NNewton[tid]++;
+            }
+            else {
+                P[i].Hsml = pow(0.5 * (pow(Left[i], 3) + pow(Right[i], 3)), 1.0 / 3);
+                DENSITY_GET_PRIV(tw)->NBisect[tid]++;
+            }
+        }
         else
         {
             if(!(Right[i] < tw->tree->BoxSize) && Left[i] == 0)
@@ -649,19 +742,9 @@ void density_check_neighbours (int i, TreeWalk * tw)
             /* If this is the first step we can be faster by increasing or decreasing current Hsml by a constant factor*/
             if(Right[i] > 0.99 * tw->tree->BoxSize && Left[i] > 0)
             {
-                if(P[i].Type == 0 && fabs(NumNgb[i] - desnumngb) < 0.5 * desnumngb)
-                {
-                    MyFloat DensFac;
-                    if(DENSITY_GET_PRIV(tw)->DoEgyDensity)
-                        DensFac = DENSITY_GET_PRIV(tw)->DhsmlDensityFactor[P[i].PI];
-                    else
-                        DensFac = SPHP(i).DhsmlEgyDensityFactor;
-                    double fac = 1 - (NumNgb[i] - desnumngb) / (NUMDIMS * NumNgb[i]) * DensFac;
-
-                    if(fac < 1.26)
-                        P[i].Hsml *= fac;
-                    else
-                        P[i].Hsml *= 1.26;
+                if(newhsml > 0 && newhsml < 1.26 * P[i].Hsml) {
+                    P[i].Hsml = newhsml;
+                    DENSITY_GET_PRIV(tw)->NNewton[tid]++;
                 }
                 else
                     P[i].Hsml *= 1.26;
@@ -669,20 +752,9 @@ void density_check_neighbours (int i, TreeWalk * tw)
 
             if(Right[i] < 0.99*tw->tree->BoxSize && Left[i] == 0)
             {
-                if(P[i].Type == 0 && fabs(NumNgb[i] - desnumngb) < 0.5 * desnumngb)
-                {
-                    MyFloat DensFac;
-                    if(DENSITY_GET_PRIV(tw)->DoEgyDensity)
-                        DensFac = DENSITY_GET_PRIV(tw)->DhsmlDensityFactor[P[i].PI];
-                    else
-                        DensFac = SPHP(i).DhsmlEgyDensityFactor;
-
-                    double fac = 1 - (NumNgb[i] - desnumngb) / (NUMDIMS * NumNgb[i]) * DensFac;
-
-                    if(fac > 1 / 1.26)
-                        P[i].Hsml *= fac;
-                    else
-                        P[i].Hsml /= 1.26;
+                if(newhsml > P[i].Hsml / 1.26) {
+                    P[i].Hsml = newhsml;
+                    DENSITY_GET_PRIV(tw)->NNewton[tid]++;
                 }
                 else
                     P[i].Hsml /= 1.26;
@@ -701,7 +773,6 @@ void density_check_neighbours (int i, TreeWalk * tw)
             return;
         }
         /* More work needed: add this particle to the redo queue*/
-        int tid = omp_get_thread_num();
         DENSITY_GET_PRIV(tw)->NPRedo[tid][DENSITY_GET_PRIV(tw)->NPLeft[tid]] = i;
         DENSITY_GET_PRIV(tw)->NPLeft[tid] ++;
     }
@@ -722,6 +793,34 @@ void density_check_neighbours (int i, TreeWalk * tw)
     }
 }
 
+/* Print a histogram of the number of treewalks needed for the smoothing lengths to converge,
+ * and how many of the updates were Newton-Raphson steps rather than bisections.*/
+static void
+density_report_iterations(int64_t NQueried, const int64_t * NRedoHist, int NIteration, const int64_t * NNewton, const int64_t * NBisect, int NumThreads)
+{
+    /* Bins are 1, 2, 3, 4, 5-8, 9-16 and > 16 treewalks*/
+    int64_t hist[7] = {0};
+    int64_t nsteps[2] = {0}, totsteps[2] = {0};
+    int k;
+    for(k = 0; k <= NIteration; k++) {
+        const int64_t before = (k == 0) ? NQueried : NRedoHist[k-1];
+        int bin = k;
+        if(k >= 16)
+            bin = 6;
+        else if(k >= 8)
+            bin = 5;
+        else if(k >= 4)
+            bin = 4;
+        hist[bin] += before - NRedoHist[k];
+    }
+    for(k = 0; k < NumThreads; k++) {
+        nsteps[0] += NNewton[k];
+        nsteps[1] += NBisect[k];
+    }
+    MPI_Reduce(nsteps, totsteps, 2, MPI_INT64, MPI_SUM, 0, MPI_COMM_WORLD);
+    message(0, "Hsml converged after 1: %ld 2: %ld 3: %ld 4: %ld 5-8: %ld 9-16: %ld >16: %ld iterations. Newton steps: %ld bisections: %ld\n",
+            hist[0], hist[1], hist[2], hist[3], hist[4], hist[5], hist[6], totsteps[0], totsteps[1]);
+}
 
 struct sph_pred_data
 slots_allocate_sph_pred_data(int nsph)
@@ -28,10 +28,154 @@ typedef struct {
     double support;
     char * name;
     /* private: */
+    double sigma;
     double Wknorm;
     double dWknorm;
 } DensityKernel;
 
+/* The kernel shapes are Price 1012.1885 eq 6, 7, 8, without sigma,
+ * as a function of q = r / h. They are inline so that a caller which
+ * passes a compile time constant type gets the kernel folded into its loop.*/
+static inline double
+density_kernel_support_type(const enum DensityKernelType type)
+{
+    switch(type) {
+        case DENSITY_KERNEL_QUINTIC_SPLINE:
+            return 3.;
+        case DENSITY_KERNEL_QUARTIC_SPLINE:
+            return 2.5;
+        case DENSITY_KERNEL_CUBIC_SPLINE:
+        default:
+            return 2.;
+    }
+}
+
+static inline double
+density_kernel_wk_shape(const enum DensityKernelType type, const double q)
+{
+    switch(type) {
+        case DENSITY_KERNEL_QUINTIC_SPLINE:
+        {
+            const double a = 3 - q, b = 2 - q, c = 1 - q;
+            const double a5 = (a * a) * (a * a) * a;
+            const double b5 = (b * b) * (b * b) * b;
+            const double c5 = (c * c) * (c * c) * c;
+            if(q < 1.0)
+                return a5 - 6 * b5 + 15 * c5;
+            if(q < 2.0)
+                return a5 - 6 * b5;
+            if(q < 3.0)
+                return a5;
+            return 0.0;
+        }
+        case DENSITY_KERNEL_QUARTIC_SPLINE:
+        {
+            const double a = 2.5 - q, b = 1.5 - q, c = 0.5 - q;
+            const double a4 = (a * a) * (a * a);
+            const double b4 = (b * b) * (b * b);
+            const double c4 = (c * c) * (c * c);
+            if(q < 0.5)
+                return a4 - 5 * b4 + 10 * c4;
+            if(q < 1.5)
+                return a4 - 5 * b4;
+            if(q < 2.5)
+                return a4;
+            return 0.0;
+        }
+        case DENSITY_KERNEL_CUBIC_SPLINE:
+        default:
+        {
+            const double a = 2 - q, b = 1 - q;
+            const double a3 = a * a * a;
+            const double b3 = b * b * b;
+            if(q < 1.0)
+                return 0.25 * a3 - b3;
+            if(q < 2.0)
+                return 0.25 * a3;
+            return 0.0;
+        }
+    }
+}
+
+static inline double
+density_kernel_dwk_shape(const enum DensityKernelType type, const double q)
+{
+    switch(type) {
+        case DENSITY_KERNEL_QUINTIC_SPLINE:
+        {
+            const double a = 3 - q, b = 2 - q, c = 1 - q;
+            const double a4 = (a * a) * (a * a);
+            const double b4 = (b * b) * (b * b);
+            const double c4 = (c * c) * (c * c);
+            if(q < 1.0)
+                return -5 * a4 + 30 * b4 - 75 * c4;
+            if(q < 2.0)
+                return -5 * a4 + 30 * b4;
+            if(q < 3.0)
+                return -5 * a4;
+            return 0.0;
+        }
+        case DENSITY_KERNEL_QUARTIC_SPLINE:
+        {
+            const double a = 2.5 - q, b = 1.5 - q, c = 0.5 - q;
+            const double a3 = a * a * a;
+            const double b3 = b * b * b;
+            const double c3 = c * c * c;
+            if(q < 0.5)
+                return -4 * a3 + 20 * b3 - 40 * c3;
+            if(q < 1.5)
+                return -4 * a3 + 20 * b3;
+            if(q < 2.5)
+                return -4 * a3;
+            return 0.0;
+        }
+        case DENSITY_KERNEL_CUBIC_SPLINE:
+        default:
+        {
+            const double a = 2 - q, b = 1 - q;
+            if(q < 1.0)
+                return - 0.25 * 3 * a * a + 3 * b * b;
+            if(q < 2.0)
+                return -0.25 * 3 * a * a;
+            return 0.0;
+        }
+    }
+}
+
+/* Kernel value and derivative for a kernel of known type.
+ * kernel must have been initialized with the same type. */
+static inline double
+density_kernel_wk_type(const DensityKernel * kernel, const double u, const enum DensityKernelType type)
+{
+    return kernel->Wknorm * density_kernel_wk_shape(type, u * density_kernel_support_type(type));
+}
+
+static inline double
+density_kernel_dwk_type(const DensityKernel * kernel, const double u, const enum DensityKernelType type)
+{
+    return kernel->dWknorm * density_kernel_dwk_shape(type, u * density_kernel_support_type(type));
+}
+
+/* Re-initialize a kernel that was already initialized by density_kernel_init
+ * to a new smoothing length, keeping the type. Cheap enough to be done per neighbour. */
+static inline void
+density_kernel_reinit(DensityKernel * kernel, const double H)
+{
+    const double hinv = kernel->support / H;
+    double hinvd = hinv;
+#if NUMDIMS > 1
+    hinvd *= hinv;
+#endif
+#if NUMDIMS > 2
+    hinvd *= hinv;
+#endif
+    kernel->H = H;
+    kernel->HH = H * H;
+    kernel->Hinv = 1. / H;
+    kernel->Wknorm = kernel->sigma * hinvd;
+    kernel->dWknorm = kernel->Wknorm * hinv;
+}
+
 double
 density_kernel_desnumngb(DensityKernel * kernel, double eta);
 void
@@ -39,13 +39,20 @@
 #define LARGE 1e29
 #define MAXITER 400
 
+/* Radial bins for the spherical overdensity profiles, log spaced
+ * between FOF_SO_RMIN and 1 in units of the largest possible SO radius.*/
+#define FOF_SO_NBINS 64
+#define FOF_SO_RMIN 1e-3
+
 struct FOFParams
 {
-    int FOFSaveParticles ; /* saving particles in the fof group */
+    int FOFSaveParticles ; /* save the particles of FOF outputs whose snapshot number is a multiple of this */
     double MinFoFMassForNewSeed;	/* Halo mass required before new seed is put in */
     double FOFHaloLinkingLength;
     double FOFHaloComovingLinkingLength; /* in code units */
     int FOFHaloMinLength;
+    double FOFSeedMinOverDensity; /* Seeding FOF only links from particles in tree leaves at least this overdense */
+    double GravConst; /* G in internal units, for the spherical overdensity densities */
 } fof_params;
 
 /*Set the parameters of the BH module*/
@@ -58,13 +65,15 @@ void set_fof_params(ParameterSet * ps)
         fof_params.FOFHaloLinkingLength = param_get_double(ps, "FOFHaloLinkingLength");
         fof_params.FOFHaloMinLength = param_get_int(ps, "FOFHaloMinLength");
         fof_params.MinFoFMassForNewSeed = param_get_double(ps, "MinFoFMassForNewSeed");
+        fof_params.FOFSeedMinOverDensity = param_get_double(ps, "FOFSeedMinOverDensity");
     }
     MPI_Bcast(&fof_params, sizeof(struct FOFParams), MPI_BYTE, 0, MPI_COMM_WORLD);
 }
 
-void fof_init(double DMMeanSeparation)
+void fof_init(double DMMeanSeparation, double GravConst)
 {
     fof_params.FOFHaloComovingLinkingLength = fof_params.FOFHaloLinkingLength * DMMeanSeparation;
+    fof_params.GravConst = GravConst;
 }
 
 static double fof_periodic(double x, double BoxSize)
@@ -102,6 +111,7 @@ static void fof_finish_group_properties(FOFGroups * fof, double BoxSize);
 
 static int fof_compile_base(struct BaseGroup * base, int NgroupsExt, MPI_Comm Comm);
 static void fof_compile_catalogue(FOFGroups * fof, const int NgroupsExt, double BoxSize, MPI_Comm Comm);
+static void fof_compile_so(FOFGroups * fof, const int NgroupsExt, double BoxSize, const Cosmology * CP, const double atime, MPI_Comm Comm);
 
 static struct Group *
 fof_alloc_group(const struct BaseGroup * base, const int NgroupsExt);
@@ -139,14 +149,85 @@ static struct fof_particle_list
 
 static MPI_Datatype MPI_TYPE_GROUP;
 
+/* If not NULL, only particles with Selected[i] set start links or look for a nearest primary.
+ * Other particles can still be linked to by selected particles.*/
+static unsigned char * Selected;
+
+static int
+fof_is_selected(const int i)
+{
+    return !Selected || Selected[i];
+}
+
 /*
  * The FOF finder will produce Group[], which is allocated to the top side of the
  * main heap.
  *
  **/
 
+static FOFGroups fof_find_groups(ForceTree * tree, const Cosmology * CP, const double atime, MPI_Comm Comm);
+
 FOFGroups
-fof_fof(ForceTree * tree, MPI_Comm Comm)
+fof_fof(ForceTree * tree, const Cosmology * CP, const double atime, MPI_Comm Comm)
+{
+    Selected = NULL;
+    return fof_find_groups(tree, CP, atime, Comm);
+}
+
+/* Select the particles whose tree leaf holds at least MinOverDensity times
+ * the mean number density of particles. Returns the number selected.*/
+static int64_t
+fof_select_dense(const ForceTree * tree, const double MinOverDensity, MPI_Comm Comm)
+{
+    int64_t NumPart = PartManager->NumPart, TotNumPart, nsel = 0, TotNSel;
+    MPI_Allreduce(&NumPart, &TotNumPart, 1, MPI_INT64, MPI_SUM, Comm);
+    const double nmean = TotNumPart / pow(tree->BoxSize, 3);
+    int i;
+    #pragma omp parallel for reduction(+: nsel)
+    for(i = 0; i < PartManager->NumPart; i++) {
+        const int no = tree->Father[i];
+        Selected[i] = 0;
+        if(no < tree->firstnode || P[i].IsGarbage || P[i].Swallowed)
+            continue;
+        const struct NODE * leaf = &tree->Nodes[no];
+        const double len3 = pow(leaf->len, 3);
+        if(leaf->s.noccupied >= MinOverDensity * nmean * len3) {
+            Selected[i] = 1;
+            nsel++;
+        }
+    }
+    MPI_Allreduce(&nsel, &TotNSel, 1, MPI_INT64, MPI_SUM, Comm);
+    return TotNSel;
+}
+
+/* FOF for black hole seeding. With FOFSeedMinOverDensity > 0, links start only from particles in overdense
+ * tree leaves, and only those particles look for a nearest primary. Every link made is also made by the full FOF,
+ * so each group found is part of a full FOF group: masses can only be underestimated, by the mass of
+ * members in underdense leaves which are not within a linking length of a selected particle.
+ * These are halo outskirts: the FOF boundary is at an overdensity of ~80 for a linking length of 0.2,
+ * so thresholds well below that lose little mass: an overdensity of 10 loses under 1% in test_fof.
+ * A halo just above MinFoFMassForNewSeed may then be seeded at a later search. Groups are never merged
+ * that the full FOF would keep apart, and the seed still goes to the densest gas particle attached,
+ * which is in the halo core.*/
+FOFGroups
+fof_fof_seed(ForceTree * tree, MPI_Comm Comm)
+{
+    if(fof_params.FOFSeedMinOverDensity <= 0)
+        return fof_fof(tree, NULL, 0, Comm);
+
+    Selected = (unsigned char *) mymalloc("FOFSelected", PartManager->NumPart * sizeof(unsigned char));
+    const int64_t nsel = fof_select_dense(tree, fof_params.FOFSeedMinOverDensity, Comm);
+    message(0, "Seeding FOF: %ld particles above overdensity %g.\n", nsel, fof_params.FOFSeedMinOverDensity);
+
+    FOFGroups fof = fof_find_groups(tree, NULL, 0, Comm);
+
+    myfree(Selected);
+    Selected = NULL;
+    return fof;
+}
+
+static FOFGroups
+fof_find_groups(ForceTree * tree, const Cosmology * CP, const double atime, MPI_Comm Comm)
 {
     int i;
 
@@ -217,6 +298,12 @@ fof_fof(ForceTree * tree, MPI_Comm Comm)
 
     walltime_measure("/FOF/Prop");
 
+    if(CP) {
+        fof_compile_so(&fof, NgroupsExt, tree->BoxSize, CP, atime, Comm);
+        message(0, "Computed spherical overdensity properties.\n");
+        walltime_measure("/FOF/SO");
+    }
+
     myfree(HaloLabel);
 
     return fof;
@@ -235,14 +322,55 @@ fof_finish(FOFGroups * fof)
     MPI_Type_free(&MPI_TYPE_GROUP);
 }
 
+/* A primary particle within one linking length of the domain of another rank,
+ * which is sent to that rank once to find its neighbours there.*/
+struct fof_boundary_export {
+    int task;
+    int index;
+};
+
+/* An exported particle, ordered by the head of its local group.*/
+struct fof_boundary {
+    int root;
+    int index;
+};
+
+/* A halo label as exchanged between ranks*/
+struct fof_label {
+    MyIDType MinID;
+    MyIDType MinIDTask;
+};
+
 struct FOFPrimaryPriv {
     int * Head;
-    struct SpinLocks * spin;
-    char * PrimaryActive;
-    MyIDType * OldMinID;
 };
 #define FOF_PRIMARY_GET_PRIV(tw) ((struct FOFPrimaryPriv *) (tw->priv))
 
+typedef struct {
+    TreeWalkResultBase base;
+    /* A local neighbour of an imported particle, or -1*/
+    int Other;
+} TreeWalkResultFOFPrimary;
+
+/* Order on local particles used to pick the head of a merged group:
+ * the particle with the smallest ID, so that the head carries the MinID of its group.*/
+static inline int
+fof_primary_less(const int a, const int b)
+{
+    if(P[a].ID != P[b].ID)
+        return P[a].ID < P[b].ID;
+    return a < b;
+}
+
+/* Order on halo labels*/
+static inline int
+fof_label_less(const struct fof_label * a, const struct fof_particle_list * b)
+{
+    if(a->MinID != b->MinID)
+        return a->MinID < b->MinID;
+    return a->MinIDTask < b->MinIDTask;
+}
+
 /* This function walks the particle tree starting at particle i until it reaches
  * a particle which has Head[i] = i, the root node (particles are initialised in
  * this state, so this is equivalent to finding a particle which has yet to be merged).
@@ -290,9 +418,9 @@ update_root(int i, const int r, int * Head)
             Head[i]= r;
         }
         /* Stop if we reached the top (new head is the same as the old)
-         * or if the new head is less than or equal to the desired head, indicating
+         * or if the new head is before the desired head, indicating
          * another thread changed us*/
-    } while(t != i && (t > r));
+    } while(t != i && fof_primary_less(r, t));
 }
 
 /* Find the current head particle by walking the tree. No updates are done
@@ -307,32 +435,143 @@ HEAD(int i, const int * const Head)
     return r;
 }
 
-static void fof_primary_copy(int place, TreeWalkQueryFOF * I, TreeWalk * tw) {
-    int head = HEAD(place, FOF_PRIMARY_GET_PRIV(tw)->Head);
-    I->MinID = HaloLabel[head].MinID;
-    I->MinIDTask = HaloLabel[head].MinIDTask;
+/* The primary walk only needs the position, which the treewalk copies.*/
+static void fof_primary_copy(int place, TreeWalkQueryBase * I, TreeWalk * tw) {
 }
 
 static int fof_primary_haswork(int n, TreeWalk * tw) {
-    if(P[n].IsGarbage || P[n].Swallowed)
+    if(P[n].IsGarbage || P[n].Swallowed || !fof_is_selected(n))
         return 0;
-    return (((1 << P[n].Type) & (FOF_PRIMARY_LINK_TYPES))) && FOF_PRIMARY_GET_PRIV(tw)->PrimaryActive[n];
+    return (((1 << P[n].Type) & (FOF_PRIMARY_LINK_TYPES)));
 }
 
 static void
-fof_primary_ngbiter(TreeWalkQueryFOF * I,
-        TreeWalkResultFOF * O,
+fof_primary_ngbiter(TreeWalkQueryBase * I,
+        TreeWalkResultFOFPrimary * O,
         TreeWalkNgbIterFOF * iter,
         LocalTreeWalk * lv);
 
+/* Does a tree node come within dist of Pos? Same test as the treewalk uses to open nodes.*/
+static int
+fof_node_overlaps(const struct NODE * current, const double * Pos, const double dist, const double BoxSize)
+{
+    const double cubedist = dist + 0.5 * current->len;
+    double r2 = 0;
+    int d;
+    for(d = 0; d < 3; d ++) {
+        const double dx = NEAREST(current->center[d] - Pos[d], BoxSize);
+        if(fabs(dx) > cubedist)
+            return 0;
+        r2 += dx * dx;
+    }
+    /* now test against the minimal sphere enclosing everything */
+    const double spheredist = cubedist + 0.366025403785 * current->len;
+    return r2 <= spheredist * spheredist;
+}
+
+/* Find the top-level leaves on other ranks within one linking length of particle i.
+ * Only the top-level tree is walked. If exports is not NULL, one entry is stored
+ * for each of them; a rank may appear more than once.
+ * Returns the number of such leaves.*/
+static int
+fof_primary_boundary(const int i, const ForceTree * tree, struct fof_boundary_export * exports)
+{
+    const double LinkL = fof_params.FOFHaloComovingLinkingLength;
+    int n = 0;
+    int no = tree->firstnode;
+    while(no >= 0) {
+        const struct NODE * current = &tree->Nodes[no];
+        if(!fof_node_overlaps(current, P[i].Pos, LinkL, tree->BoxSize)) {
+            no = current->sibling;
+            continue;
+        }
+        if(current->f.ChildType == PSEUDO_NODE_TYPE) {
+            if(exports) {
+                exports[n].task = tree->TopLeaves[current->s.suns[0] - tree->lastnode].Task;
+                exports[n].index = i;
+            }
+            n++;
+            no = current->sibling;
+            continue;
+        }
+        /* A local top-level leaf: everything below it is on this rank*/
+        if(!current->f.InternalTopLevel) {
+            no = current->sibling;
+            continue;
+        }
+        no = current->s.suns[0];
+    }
+    return n;
+}
+
+static int
+fof_compare_boundary_export(const void * a, const void * b)
+{
+    const struct fof_boundary_export * ea = a;
+    const struct fof_boundary_export * eb = b;
+    if(ea->task != eb->task)
+        return (ea->task > eb->task) - (ea->task < eb->task);
+    return (ea->index > eb->index) - (ea->index < eb->index);
+}
+
+static int
+fof_compare_boundary_root(const void * a, const void * b)
+{
+    const struct fof_boundary * ba = a;
+    const struct fof_boundary * bb = b;
+    if(ba->root != bb->root)
+        return (ba->root > bb->root) - (ba->root < bb->root);
+    return (ba->index > bb->index) - (ba->index < bb->index);
+}
+
+/* Give each local group the smallest label that other ranks reported for its exported particles.
+ * Boundary is sorted by root, and each root is updated by the thread
+ * which owns its first entry, so no locking is needed.
+ * Returns the number of groups whose label changed.*/
+static int64_t
+fof_primary_merge_boundary(const struct fof_boundary * Boundary, const int64_t NBoundary, const struct fof_label * Label)
+{
+    int64_t changed = 0;
+    int64_t j;
+    #pragma omp parallel for reduction(+: changed)
+    for(j = 0; j < NBoundary; j++) {
+        if(j > 0 && Boundary[j].root == Boundary[j-1].root)
+            continue;
+        const int root = Boundary[j].root;
+        int64_t k;
+        int newlabel = 0;
+        for(k = j; k < NBoundary && Boundary[k].root == root; k++) {
+            const struct fof_label * label = &Label[Boundary[k].index];
+            if(fof_label_less(label, &HaloLabel[root])) {
+                HaloLabel[root].MinID = label->MinID;
+                HaloLabel[root].MinIDTask = label->MinIDTask;
+                newlabel = 1;
+            }
+        }
+        changed += newlabel;
+    }
+    return changed;
+}
+
+/* Link the primary particles into groups. This is done in three phases.
+ * 1. A treewalk over the local tree only links the particles on this rank,
+ *    with a lock-free union-find where the head of each group is the particle with the smallest ID.
+ * 2. The top-level tree gives the particles within one linking length of another rank's domain.
+ *    These are sent, once, to those ranks, which link them to their local particles.
+ *    Local groups joined through one imported particle are merged there and then.
+ * 3. Each rank reports back the label of the group every imported particle joins,
+ *    and the exporting rank lowers the label of its own group to match.
+ *    This repeats until no label changes. Only labels are sent, one for each exported particle.*/
 void fof_label_primary(ForceTree * tree, MPI_Comm Comm)
 {
     int i;
+    int64_t k;
     int64_t link_across;
     int64_t link_across_tot;
     double t0, t1;
-    int ThisTask;
+    int ThisTask, NTask;
     MPI_Comm_rank(Comm, &ThisTask);
+    MPI_Comm_size(Comm, &NTask);
 
     message(0, "Start linking particles (presently allocated=%g MB)\n", mymalloc_usedbytes() / (1024.0 * 1024.0));
 
@@ -346,91 +585,170 @@ void fof_label_primary(ForceTree * tree, MPI_Comm Comm)
     tw->fill = (TreeWalkFillQueryFunction) fof_primary_copy;
     tw->reduce = NULL;
     tw->type = TREEWALK_ALL;
-    tw->query_type_elsize = sizeof(TreeWalkQueryFOF);
-    tw->result_type_elsize = sizeof(TreeWalkResultFOF);
+    tw->query_type_elsize = sizeof(TreeWalkQueryBase);
+    tw->result_type_elsize = sizeof(TreeWalkResultFOFPrimary);
     tw->tree = tree;
     struct FOFPrimaryPriv priv[1];
     tw->priv = priv;
 
-    FOF_PRIMARY_GET_PRIV(tw)->Head = (int*) mymalloc("FOF_Links", PartManager->NumPart * sizeof(int));
-    FOF_PRIMARY_GET_PRIV(tw)->PrimaryActive = (char*) mymalloc("FOFActive", PartManager->NumPart * sizeof(char));
-    FOF_PRIMARY_GET_PRIV(tw)->OldMinID = (MyIDType *) mymalloc("FOFActive", PartManager->NumPart * sizeof(MyIDType));
-
-    /* allocate buffers to arrange communication */
-
-    t0 = second();
+    int * Head = (int*) mymalloc("FOF_Links", PartManager->NumPart * sizeof(int));
+    FOF_PRIMARY_GET_PRIV(tw)->Head = Head;
 
     #pragma omp parallel for
     for(i = 0; i < PartManager->NumPart; i++)
     {
-        FOF_PRIMARY_GET_PRIV(tw)->Head[i] = i;
-        FOF_PRIMARY_GET_PRIV(tw)->OldMinID[i]= P[i].ID;
-        FOF_PRIMARY_GET_PRIV(tw)->PrimaryActive[i] = 1;
-
+        Head[i] = i;
         HaloLabel[i].MinID = P[i].ID;
         HaloLabel[i].MinIDTask = ThisTask;
     }
 
-    /* The lock is used to protect MinID*/
-    priv[0].spin = init_spinlocks(PartManager->NumPart);
-    do
-    {
-        t0 = second();
-
-        treewalk_run(tw, NULL, PartManager->NumPart);
+    t0 = second();
+    treewalk_run_local(tw, NULL, PartManager->NumPart);
+    t1 = second();
+    message(0, "Local groups found in %g seconds.\n", t1 - t0);
 
-        t1 = second();
-        /* This sets the MinID of the head particle to the minimum ID
-         * of the child particles. We set this inside the treewalk,
-         * but the locking allows a race, where the particle with MinID set
-         * is no longer the one which is the true Head of the group.
-         * So we must check it again here.*/
-        for(i = 0; i < PartManager->NumPart; i++) {
-            int head = HEAD(i, FOF_PRIMARY_GET_PRIV(tw)->Head);
-            if(HaloLabel[head].MinID > HaloLabel[i].MinID) {
-                HaloLabel[head].MinID = HaloLabel[i].MinID;
-                HaloLabel[head].MinIDTask = HaloLabel[i].MinIDTask;
-            }
+    /* Find the particles to export: count first, then fill, as a particle may go to several ranks*/
+    t0 = second();
+    int * Nremote = (int *) mymalloc2("FOFNremote", PartManager->NumPart * sizeof(int));
+    int64_t NExport = 0;
+    #pragma omp parallel for reduction(+: NExport)
+    for(i = 0; i < PartManager->NumPart; i++) {
+        Nremote[i] = 0;
+        if(fof_primary_haswork(i, tw))
+            Nremote[i] = fof_primary_boundary(i, tree, NULL);
+        NExport += Nremote[i];
+    }
+    struct fof_boundary_export * Export = (struct fof_boundary_export *) mymalloc("FOFExport", NExport * sizeof(struct fof_boundary_export));
+    int64_t nfilled = 0;
+    #pragma omp parallel for
+    for(i = 0; i < PartManager->NumPart; i++) {
+        if(Nremote[i] == 0)
+            continue;
+        int64_t start;
+        #pragma omp atomic capture
+        {
+            start = nfilled;
+            nfilled += Nremote[i];
         }
-        /* let's check out which particles have changed their MinID,
-         * mark them for next round. */
-        link_across = 0;
-#pragma omp parallel for reduction(+: link_across)
-        for(i = 0; i < PartManager->NumPart; i++) {
-            int head = HEAD(i, FOF_PRIMARY_GET_PRIV(tw)->Head);
-            /* This loop sets the MinID of the children to the minID of the head.
-             * The minID of the head is set above and is stable at this point.*/
-            if(i != head) {
-                HaloLabel[i].MinID = HaloLabel[head].MinID;
-                HaloLabel[i].MinIDTask = HaloLabel[head].MinIDTask;
-            }
-            MyIDType newMinID = HaloLabel[head].MinID;
-            if(newMinID != FOF_PRIMARY_GET_PRIV(tw)->OldMinID[i]) {
-                FOF_PRIMARY_GET_PRIV(tw)->PrimaryActive[i] = 1;
-                link_across ++;
-            } else {
-                FOF_PRIMARY_GET_PRIV(tw)->PrimaryActive[i] = 0;
-            }
-            FOF_PRIMARY_GET_PRIV(tw)->OldMinID[i] = newMinID;
+        fof_primary_boundary(i, tree, Export + start);
+    }
+    myfree(Nremote);
+    /* Group by rank and send each particle to each rank only once*/
+    qsort_openmp(Export, NExport, sizeof(struct fof_boundary_export), fof_compare_boundary_export);
+    int64_t nunique = 0;
+    for(k = 0; k < NExport; k++) {
+        if(k > 0 && Export[k].task == Export[nunique-1].task && Export[k].index == Export[nunique-1].index)
+            continue;
+        Export[nunique++] = Export[k];
+    }
+    NExport = nunique;
+    Export = (struct fof_boundary_export *) myrealloc(Export, NExport * sizeof(struct fof_boundary_export));
+
+    int * Send_count = ta_malloc("Send_count", int, 2 * NTask);
+    int * Recv_count = Send_count + NTask;
+    memset(Send_count, 0, sizeof(int) * NTask);
+    for(k = 0; k < NExport; k++)
+        Send_count[Export[k].task]++;
+    MPI_Alltoall(Send_count, 1, MPI_INT, Recv_count, 1, MPI_INT, Comm);
+    int64_t NImport = 0;
+    for(i = 0; i < NTask; i++)
+        NImport += Recv_count[i];
+
+    MPI_Datatype query_type, label_type;
+    MPI_Type_contiguous(sizeof(TreeWalkQueryBase), MPI_BYTE, &query_type);
+    MPI_Type_commit(&query_type);
+    MPI_Type_contiguous(sizeof(struct fof_label), MPI_BYTE, &label_type);
+    MPI_Type_commit(&label_type);
+
+    /* Local group joined by each imported particle, or -1*/
+    int * ImportRoot = (int *) mymalloc("FOFImportRoot", NImport * sizeof(int));
+
+    TreeWalkQueryBase * ExportQuery = (TreeWalkQueryBase *) mymalloc("FOFExportQuery", NExport * sizeof(TreeWalkQueryBase));
+    #pragma omp parallel for
+    for(k = 0; k < NExport; k++) {
+        memset(&ExportQuery[k], 0, sizeof(TreeWalkQueryBase));
+        int d;
+        for(d = 0; d < 3; d++)
+            ExportQuery[k].Pos[d] = P[Export[k].index].Pos[d];
+    }
+    TreeWalkQueryBase * ImportQuery = (TreeWalkQueryBase *) mymalloc("FOFImportQuery", NImport * sizeof(TreeWalkQueryBase));
+    MPI_Alltoallv_smart(ExportQuery, Send_count, NULL, query_type,
+                        ImportQuery, Recv_count, NULL, query_type, Comm);
+
+    TreeWalkResultFOFPrimary * ImportResult = (TreeWalkResultFOFPrimary *) mymalloc("FOFImportResult", NImport * sizeof(TreeWalkResultFOFPrimary));
+    treewalk_visit_local(tw, (char *) ImportQuery, (char *) ImportResult, NImport);
+    /* Head is now final*/
+    #pragma omp parallel for
+    for(k = 0; k < NImport; k++)
+        ImportRoot[k] = ImportResult[k].Other >= 0 ? HEAD(ImportResult[k].Other, Head) : -1;
+
+    myfree(ImportResult);
+    myfree(ImportQuery);
+    myfree(ExportQuery);
+
+    int64_t NExport_tot;
+    MPI_Allreduce(&NExport, &NExport_tot, 1, MPI_INT64, MPI_SUM, Comm);
+    t1 = second();
+    message(0, "Exchanged %ld boundary particles in %g seconds.\n", NExport_tot, t1 - t0);
+
+    struct fof_boundary * Boundary = (struct fof_boundary *) mymalloc("FOFBoundary", NExport * sizeof(struct fof_boundary));
+    #pragma omp parallel for
+    for(k = 0; k < NExport; k++) {
+        Boundary[k].root = HEAD(Export[k].index, Head);
+        Boundary[k].index = k;
+    }
+    qsort_openmp(Boundary, NExport, sizeof(struct fof_boundary), fof_compare_boundary_root);
+
+    struct fof_label * ExportLabel = (struct fof_label *) mymalloc("FOFExportLabel", NExport * sizeof(struct fof_label));
+    struct fof_label * ImportLabel = (struct fof_label *) mymalloc("FOFImportLabel", NImport * sizeof(struct fof_label));
+
+    int iter = 0;
+    do {
+        t0 = second();
+        #pragma omp parallel for
+        for(k = 0; k < NImport; k++) {
+            const int root = ImportRoot[k];
+            /* An imported particle with no neighbours here never lowers a label*/
+            ImportLabel[k].MinID = root >= 0 ? HaloLabel[root].MinID : (MyIDType) -1;
+            ImportLabel[k].MinIDTask = root >= 0 ? HaloLabel[root].MinIDTask : (MyIDType) -1;
         }
+        MPI_Alltoallv_smart(ImportLabel, Recv_count, NULL, label_type,
+                            ExportLabel, Send_count, NULL, label_type, Comm);
+        link_across = fof_primary_merge_boundary(Boundary, NExport, ExportLabel);
         MPI_Allreduce(&link_across, &link_across_tot, 1, MPI_INT64, MPI_SUM, Comm);
-        message(0, "Linked %ld particles %g seconds\n", link_across_tot, t1 - t0);
-    }
-    while(link_across_tot > 0);
+        t1 = second();
+        iter++;
+        message(0, "Relabelled %ld groups %g seconds\n", link_across_tot, t1 - t0);
+    } while(link_across_tot > 0);
 
-    free_spinlocks(priv[0].spin);
+    /* Every particle takes the label of its group*/
+    #pragma omp parallel for
+    for(i = 0; i < PartManager->NumPart; i++) {
+        int head = HEAD(i, Head);
+        if(i != head) {
+            HaloLabel[i].MinID = HaloLabel[head].MinID;
+            HaloLabel[i].MinIDTask = HaloLabel[head].MinIDTask;
+        }
+    }
 
-    message(0, "Local groups found.\n");
+    message(0, "Groups linked across ranks after %d iterations.\n", iter);
 
-    myfree(FOF_PRIMARY_GET_PRIV(tw)->OldMinID);
-    myfree(FOF_PRIMARY_GET_PRIV(tw)->PrimaryActive);
-    myfree(FOF_PRIMARY_GET_PRIV(tw)->Head);
+    myfree(ImportLabel);
+    myfree(ExportLabel);
+    myfree(Boundary);
+    myfree(ImportRoot);
+    MPI_Type_free(&label_type);
+    MPI_Type_free(&query_type);
+    ta_free(Send_count);
+    myfree(Export);
+    myfree(Head);
 }
 
+/* Lock-free union of the groups of target and other.
+ * The group with the smaller head, in the order of fof_primary_less, absorbs the other.*/
 static void
 fofp_merge(int target, int other, TreeWalk * tw)
 {
-    /* this will lock h1 */
     int * Head = FOF_PRIMARY_GET_PRIV(tw)->Head;
     int h1, h2;
     do {
@@ -443,7 +761,7 @@ fofp_merge(int target, int other, TreeWalk * tw)
         /* Ensure that we always merge to the lower entry.
          * This avoids circular loops in the Head entries:
          * a -> b -> a */
-        if(h1 > h2) {
+        if(fof_primary_less(h2, h1)) {
             int tmp = h2;
             h2 = h1;
             h1 = tmp;
@@ -452,34 +770,16 @@ fofp_merge(int target, int other, TreeWalk * tw)
       * Set Head[h2] = h1 iff Head[h2] is still h2. Otherwise loop.*/
     } while(!__atomic_compare_exchange(&Head[h2], &h2, &h1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
 
-    struct SpinLocks * spin = FOF_PRIMARY_GET_PRIV(tw)->spin;
-
-    /* update MinID of h1: h2 is now just another child of h1
-     * so h2 does not need to be locked.
-     * h1 may not be its own head anymore,
-     * so we need to double check later.
-     * lock h1 so we don't change MinID but not MinIDTask.*/
-    lock_spinlock(h1, spin);
-    if(HaloLabel[h1].MinID > HaloLabel[h2].MinID)
-    {
-        HaloLabel[h1].MinID = HaloLabel[h2].MinID;
-        HaloLabel[h1].MinIDTask = HaloLabel[h2].MinIDTask;
-    }
-    unlock_spinlock(h1, spin);
-
     /* h1 must be the root of other and target both:
      * do the splay to speed up future accesses.
-     * We do not need to have h2 locked, because h2 is
-     * now just another child of h1: these do not change the root,
-     * they make the tree shallow.*/
+     * These only make the tree shallow, they do not change the root.*/
     update_root(target, h1, Head);
     update_root(other, h1, Head);
-
 }
 
 static void
-fof_primary_ngbiter(TreeWalkQueryFOF * I,
-        TreeWalkResultFOF * O,
+fof_primary_ngbiter(TreeWalkQueryBase * I,
+        TreeWalkResultFOFPrimary * O,
         TreeWalkNgbIterFOF * iter,
         LocalTreeWalk * lv)
 {
@@ -488,30 +788,23 @@ fof_primary_ngbiter(TreeWalkQueryFOF * I,
         iter->base.Hsml = fof_params.FOFHaloComovingLinkingLength;
         iter->base.symmetric = NGB_TREEFIND_ASYMMETRIC;
         iter->base.mask = FOF_PRIMARY_LINK_TYPES;
+        O->Other = -1;
         return;
     }
     int other = iter->base.other;
 
     if(lv->mode == 0) {
-        /* Local FOF */
-        if(lv->target <= other) {
-            // printf("locked merge %d %d by %d\n", lv->target, other, omp_get_thread_num());
+        /* Local FOF. Each pair is seen from both ends, unless other does not start links.*/
+        if(lv->target <= other || !fof_is_selected(other)) {
             fofp_merge(lv->target, other, tw);
         }
     }
-    else /* mode is 1, target is a ghost */
+    else /* mode is 1, target is imported: all its neighbours here are in one group.*/
     {
-        int head = HEAD(other, FOF_PRIMARY_GET_PRIV(tw)->Head);
-        struct SpinLocks * spin = FOF_PRIMARY_GET_PRIV(tw)->spin;
-//        printf("locking %d by %d in ngbiter\n", other, omp_get_thread_num());
-        lock_spinlock(head, spin);
-        if(HaloLabel[head].MinID > I->MinID)
-        {
-            HaloLabel[head].MinID = I->MinID;
-            HaloLabel[head].MinIDTask = I->MinIDTask;
-        }
-//        printf("unlocking %d by %d in ngbiter\n", other, omp_get_thread_num());
-        unlock_spinlock(head, spin);
+        if(O->Other < 0)
+            O->Other = other;
+        else
+            fofp_merge(O->Other, other, tw);
     }
 }
 
@@ -544,6 +837,12 @@ static void fof_reduce_group(void * pdst, void * psrc) {
         gdst->seed_index = gsrc->seed_index;
         gdst->seed_task = gsrc->seed_task;
     }
+    gdst->VelDisp += gsrc->VelDisp;
+    if(gsrc->MinPot < gdst->MinPot)
+    {
+        gdst->MinPot = gsrc->MinPot;
+        memcpy(gdst->MinPotPos, gsrc->MinPotPos, 3 * sizeof(gsrc->MinPotPos[0]));
+    }
 
     int d1, d2;
     for(d1 = 0; d1 < 3; d1++)
@@ -567,6 +866,7 @@ static void add_particle_to_group(struct Group * gdst, int i, double BoxSize, in
         memset(gdst, 0, sizeof(gdst[0]));
         gdst->base = base;
         gdst->seed_index = gdst->seed_task = -1;
+        gdst->MinPot = LARGE;
     }
 
     gdst->Length ++;
@@ -595,6 +895,12 @@ static void add_particle_to_group(struct Group * gdst, int i, double BoxSize, in
         }
 
     int d1, d2;
+    if(P[index].Potential < gdst->MinPot) {
+        gdst->MinPot = P[index].Potential;
+        for(d1 = 0; d1 < 3; d1++)
+            gdst->MinPotPos[d1] = P[index].Pos[d1];
+    }
+
     double xyz[3];
     double rel[3];
     double vel[3];
@@ -613,6 +919,7 @@ static void add_particle_to_group(struct Group * gdst, int i, double BoxSize, in
     for(d1 = 0; d1 < 3; d1++) {
         gdst->CM[d1] += P[index].Mass * xyz[d1];
         gdst->Vel[d1] += P[index].Mass * vel[d1];
+        gdst->VelDisp += P[index].Mass * vel[d1] * vel[d1];
         gdst->Jmom[d1] += P[index].Mass * jmom[d1];
 
         for(d2 = 0; d2 < 3; d2++) {
@@ -649,9 +956,13 @@ fof_finish_group_properties(struct FOFGroups * fof, double BoxSize)
         }
         crossproduct(rel, vcm, jcm);
 
+        /* sigma^2 = <V^2> - <V>^2, which may round to slightly below zero for a cold group.*/
+        double vdisp2 = gdst->VelDisp / gdst->Mass;
         for(d1 = 0; d1 < 3; d1 ++) {
             gdst->Jmom[d1] -= jcm[d1] * gdst->Mass;
+            vdisp2 -= vcm[d1] * vcm[d1];
         }
+        gdst->VelDisp = sqrt(DMAX(vdisp2, 0));
 
         for(d1 = 0; d1 < 3; d1 ++) {
             for(d2 = 0; d2 < 3; d2++) {
@@ -820,6 +1131,134 @@ fof_compile_catalogue(struct FOFGroups * fof, const int NgroupsExt, double BoxSi
 }
 
 
+/* Mass profile of a group around its potential minimum, which is reduced
+ * across ranks like the Group itself.*/
+struct SOProfile {
+    struct BaseGroup base;
+    int GroupIndex; /* index of the local Group entry; unchanged by the reduction for hosted groups */
+    double Mass[FOF_SO_NBINS];
+};
+
+static void fof_reduce_so_profile(void * pdst, void * psrc) {
+    struct SOProfile * gdst = pdst;
+    struct SOProfile * gsrc = psrc;
+    int j;
+    for(j = 0; j < FOF_SO_NBINS; j++)
+        gdst->Mass[j] += gsrc->Mass[j];
+}
+
+/* Outer edge of profile bin j. Bin 0 also holds everything within FOF_SO_RMIN.*/
+static double
+fof_so_bin_edge(const int j, const double Rmax)
+{
+    return Rmax * pow(FOF_SO_RMIN, 1 - j / (FOF_SO_NBINS - 1.));
+}
+
+/* Find the radius where the mean enclosed density first falls below rho,
+ * interpolating log density linearly in log radius between bin edges.*/
+static double
+fof_so_radius(const double * Menc, const double Rmax, const double rho)
+{
+    double r1 = 0, rho1 = 0;
+    int j;
+    for(j = 0; j < FOF_SO_NBINS; j++) {
+        const double r2 = fof_so_bin_edge(j, Rmax);
+        const double rho2 = Menc[j] / (4 * M_PI / 3. * r2 * r2 * r2);
+        if(rho2 <= rho) {
+            /* Even the innermost bin is not dense enough*/
+            if(j == 0)
+                return 0;
+            const double t = log(rho / rho1) / log(rho2 / rho1);
+            return r1 * pow(r2 / r1, t);
+        }
+        r1 = r2;
+        rho1 = rho2;
+    }
+    return Rmax;
+}
+
+/* Compute spherical overdensity masses and radii around the potential minimum of each group.
+ * Every rank bins its own group members in radius; the profiles are then summed on the rank
+ * hosting the group, as for the other group properties. The enclosed mass cannot exceed the group
+ * mass, so no SO radius is larger than the radius of a sphere of the group mass at the lowest reference density.*/
+static void
+fof_compile_so(struct FOFGroups * fof, const int NgroupsExt, double BoxSize, const Cosmology * CP, const double atime, MPI_Comm Comm)
+{
+    int i;
+    /* Reference densities are comoving, as are the positions*/
+    const double hubble = hubble_function(CP, atime);
+    const double rhocrit = 3 * hubble * hubble / (8 * M_PI * fof_params.GravConst) * pow(atime, 3);
+    const double rhomean = CP->Omega0 * 3 * CP->Hubble * CP->Hubble / (8 * M_PI * fof_params.GravConst);
+    double rhoso[FOF_SO_NDEF];
+    rhoso[FOF_SO_CRIT200] = 200 * rhocrit;
+    rhoso[FOF_SO_MEAN200] = 200 * rhomean;
+    rhoso[FOF_SO_CRIT500] = 500 * rhocrit;
+    const double rhomin = DMIN(rhoso[FOF_SO_CRIT200], rhoso[FOF_SO_MEAN200]);
+
+    struct SOProfile * prof = (struct SOProfile *) mymalloc("SOProfile", sizeof(struct SOProfile) * NgroupsExt);
+    memset(prof, 0, sizeof(prof[0]) * NgroupsExt);
+
+    #pragma omp parallel for
+    for(i = 0; i < NgroupsExt; i++) {
+        prof[i].base = fof->Group[i].base;
+        prof[i].GroupIndex = i;
+    }
+
+    /* The reduction in fof_compile_catalogue put hosted groups first, so sort by MinID again to walk HaloLabel.*/
+    qsort_openmp(prof, NgroupsExt, sizeof(prof[0]), fof_compare_Group_MinID);
+
+    int start = 0;
+    for(i = 0; i < NgroupsExt; i++)
+    {
+        const struct Group * grp = &fof->Group[prof[i].GroupIndex];
+        const double Rmax = cbrt(3 * grp->Mass / (4 * M_PI * rhomin));
+        for(;start < PartManager->NumPart; start++) {
+            if(HaloLabel[start].MinID >= grp->base.MinID) break;
+        }
+        for(;start < PartManager->NumPart; start++) {
+            if(HaloLabel[start].MinID != grp->base.MinID)
+                break;
+            const int index = HaloLabel[start].Pindex;
+            double r2 = 0;
+            int d;
+            for(d = 0; d < 3; d++) {
+                const double dx = fof_periodic(P[index].Pos[d] - grp->MinPotPos[d], BoxSize);
+                r2 += dx * dx;
+            }
+            if(r2 > Rmax * Rmax)
+                continue;
+            /* Position of the particle on the log radius axis: 0 at Rmax, FOF_SO_NBINS - 1 at FOF_SO_RMIN*Rmax*/
+            const double s = r2 > 0 ? 0.5 * log(r2 / (Rmax * Rmax)) / log(FOF_SO_RMIN) * (FOF_SO_NBINS - 1) : FOF_SO_NBINS;
+            const int bin = DMAX(ceil(FOF_SO_NBINS - 1 - s), 0);
+            prof[i].Mass[bin] += P[index].Mass;
+        }
+    }
+
+    fof_reduce_groups(prof, NgroupsExt, sizeof(prof[0]), fof_reduce_so_profile, Comm);
+
+    /* Now the first Ngroups profiles are the complete profiles of the groups hosted here.*/
+    #pragma omp parallel for
+    for(i = 0; i < fof->Ngroups; i++)
+    {
+        struct Group * grp = &fof->Group[prof[i].GroupIndex];
+        if(prof[i].base.MinID != grp->base.MinID || grp->base.MinIDTask != prof[i].base.MinIDTask)
+            endrun(3333, "Group %d has MinID %lu but SO profile has MinID %lu\n", i, grp->base.MinID, prof[i].base.MinID);
+        const double Rmax = cbrt(3 * grp->Mass / (4 * M_PI * rhomin));
+        double Menc[FOF_SO_NBINS];
+        int j;
+        Menc[0] = prof[i].Mass[0];
+        for(j = 1; j < FOF_SO_NBINS; j++)
+            Menc[j] = Menc[j-1] + prof[i].Mass[j];
+        for(j = 0; j < FOF_SO_NDEF; j++) {
+            const double r = fof_so_radius(Menc, Rmax, rhoso[j]);
+            grp->SORadius[j] = r;
+            grp->SOMass[j] = 4 * M_PI / 3. * r * r * r * rhoso[j];
+        }
+    }
+    myfree(prof);
+}
+
+
 static void fof_reduce_groups(
     void * groups,
     int nmemb,
@@ -1066,7 +1505,7 @@ static void fof_secondary_copy(int place, TreeWalkQueryFOF * I, TreeWalk * tw) {
     I->Hsml = FOF_SECONDARY_GET_PRIV(tw)->hsml[place];
 }
 static int fof_secondary_haswork(int n, TreeWalk * tw) {
-    if(P[n].IsGarbage || P[n].Swallowed)
+    if(P[n].IsGarbage || P[n].Swallowed || !fof_is_selected(n))
         return 0;
     /* Exclude particles where we already found a neighbour*/
     if(FOF_SECONDARY_GET_PRIV(tw)->distance[n] < 0.5 * LARGE)
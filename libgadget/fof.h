@@ -4,10 +4,21 @@
 #include "forcetree.h"
 #include "utils/paramset.h"
 #include "timestep.h"
+#include "cosmology.h"
 
 void set_fof_params(ParameterSet * ps);
 
-void fof_init(double DMMeanSeparation);
+/* GravConst is G in internal units, used for the spherical overdensity reference densities.*/
+void fof_init(double DMMeanSeparation, double GravConst);
+
+/* Spherical overdensity definitions computed for each group:
+ * 200 x critical, 200 x mean matter and 500 x critical density.*/
+enum FOFSODef {
+    FOF_SO_CRIT200 = 0,
+    FOF_SO_MEAN200 = 1,
+    FOF_SO_CRIT500 = 2,
+    FOF_SO_NDEF = 3,
+};
 
 struct BaseGroup {
     int OriginalTask;
@@ -44,6 +55,17 @@ struct Group
 
     int seed_index;
     int seed_task;
+
+    /* Position of the particle with the lowest potential, the halo centre.
+     * This is in the translated frame, as FirstPos.*/
+    double MinPot;
+    double MinPotPos[3];
+    /* Accumulates sum M V^2, then holds the 3D velocity dispersion about Vel.*/
+    double VelDisp;
+    /* Spherical overdensity masses and radii around MinPotPos, indexed by FOFSODef.
+     * Only group members are counted.*/
+    double SOMass[FOF_SO_NDEF];
+    double SORadius[FOF_SO_NDEF];
 };
 
 /* Structure to hold all allocated FOF groups*/
@@ -56,8 +78,15 @@ typedef struct FOFGroups
     int64_t TotNgroups;
 } FOFGroups;
 
-/*Computes the Group structure, saved as a global array below*/
-FOFGroups fof_fof(ForceTree * tree, MPI_Comm Comm);
+/*Computes the Group structure, saved as a global array below.
+ * If CP is not NULL the spherical overdensity properties of the groups
+ * are also computed, at scale factor atime. These are only needed for output.*/
+FOFGroups fof_fof(ForceTree * tree, const Cosmology * CP, const double atime, MPI_Comm Comm);
+
+/*Computes a cheaper Group structure for black hole seeding, which only links
+ * from particles in tree leaves above FOFSeedMinOverDensity. Each group is a part of
+ * the full FOF group and may miss some of its low density outskirts.*/
+FOFGroups fof_fof_seed(ForceTree * tree, MPI_Comm Comm);
 
 /*Frees the Group structure*/
 void fof_finish(FOFGroups * fof);
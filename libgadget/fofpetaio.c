@@ -62,14 +62,16 @@ void fof_save_particles(FOFGroups * fof, int num, int SaveParticles, MPI_Comm Co
             build_buffer_fof(fof, &array, &FOFIOTable.ent[i]);
             message(0, "Writing Block %s\n", blockname);
 
-            petaio_save_block(&bf, blockname, &array, 1);
+            petaio_save_iotable_block(&bf, blockname, &array, &FOFIOTable.ent[i], 1);
             petaio_destroy_buffer(&array);
         }
     }
     destroy_io_blocks(&FOFIOTable);
     walltime_measure("/FOF/IO/WriteFOF");
 
-    if(SaveParticles) {
+    /* The halo properties are in the group table, so the particles are usually only needed on some outputs.
+     * num is the snapshot number, which also counts snapshots written without FOF.*/
+    if(SaveParticles > 0 && num % SaveParticles == 0) {
         struct IOTable IOTable = {0};
         register_io_blocks(&IOTable, 1);
         struct part_manager_type halo_pman = {0};
@@ -101,7 +103,7 @@ void fof_save_particles(FOFGroups * fof, int num, int SaveParticles, MPI_Comm Co
 
                 message(0, "Writing Block %s\n", blockname);
 
-                petaio_save_block(&bf, blockname, &array, 1);
+                petaio_save_iotable_block(&bf, blockname, &array, &IOTable.ent[i], 1);
                 petaio_destroy_buffer(&array);
             }
         }
@@ -426,6 +428,26 @@ static void GTMassCenterVelocity(int i, float * out, void * baseptr, void * slot
         out[d] = fac * Group[i].Vel[d];
     }
 }
+static void GTPotentialMinimumPosition(int i, double * out, void * baseptr, void * smanptr) {
+    /* Remove the particle offset before saving*/
+    struct Group * grp = (struct Group *) baseptr;
+    int d;
+    for(d = 0; d < 3; d ++) {
+        out[d] = grp[i].MinPotPos[d] - PartManager->CurrentParticleOffset[d];
+        while(out[d] > All.BoxSize) out[d] -= All.BoxSize;
+        while(out[d] <= 0) out[d] += All.BoxSize;
+    }
+}
+
+static void GTVelocityDispersion(int i, float * out, void * baseptr, void * slotptr) {
+    struct Group * Group = (struct Group *) baseptr;
+    /* Same units as MassCenterVelocity*/
+    double fac = GetUsePeculiarVelocity() ? 1.0 / All.Time : 1.0;
+    *out = fac * Group[i].VelDisp;
+}
+
+SIMPLE_GETTER(GTSOMass, SOMass[0], float, FOF_SO_NDEF, struct Group)
+SIMPLE_GETTER(GTSORadius, SORadius[0], float, FOF_SO_NDEF, struct Group)
 SIMPLE_PROPERTY_FOF(Mass, Mass, float, 1)
 SIMPLE_PROPERTY_FOF(MassByType, MassType[0], float, 6)
 SIMPLE_PROPERTY_FOF(LengthByType, LenType[0], uint32_t , 6)
@@ -450,6 +472,11 @@ static void fof_register_io_blocks(struct IOTable * IOTable) {
     IO_REG_WRONLY(MassCenterVelocity, "f4", 3, PTYPE_FOF_GROUP, IOTable);
     IO_REG(LengthByType, "u4", 6, PTYPE_FOF_GROUP, IOTable);
     IO_REG(MassByType, "f4", 6, PTYPE_FOF_GROUP, IOTable);
+    IO_REG_WRONLY(PotentialMinimumPosition, "f8", 3, PTYPE_FOF_GROUP, IOTable);
+    IO_REG_WRONLY(VelocityDispersion, "f4", 1, PTYPE_FOF_GROUP, IOTable);
+    /* Columns are 200 x critical, 200 x mean, 500 x critical density, as enum FOFSODef. */
+    IO_REG_WRONLY(SOMass, "f4", FOF_SO_NDEF, PTYPE_FOF_GROUP, IOTable);
+    IO_REG_WRONLY(SORadius, "f4", FOF_SO_NDEF, PTYPE_FOF_GROUP, IOTable);
     if(All.StarformationOn)
         IO_REG(StarFormationRate, "f4", 1, PTYPE_FOF_GROUP, IOTable);
     if(All.BlackHoleOn) {
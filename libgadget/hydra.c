@@ -3,6 +3,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <omp.h>
 #include <gsl/gsl_math.h>
 
 #include "physconst.h"
@@ -22,15 +23,12 @@
  *  (via artificial viscosity) is computed.
  */
 
-static struct hydro_params
-{
-    /* Enables density independent (Pressure-entropy) SPH */
-    int DensityIndependentSphOn;
-    /* limit of density contrast ratio for hydro force calculation (only effective with Density Indep. Sph) */
-    double DensityContrastLimit;
-    /*!< Sets the parameter \f$\alpha\f$ of the artificial viscosity */
-    double ArtBulkViscConst;
-} HydroParams;
+static struct hydro_params HydroParams;
+
+/* Neighbour records are packed only when at least this fraction of the particles is active.
+ * Packing is a pass over all gas particles, which pays off once the active particles,
+ * with O(50) neighbours each, visit every gas particle about once.*/
+#define PACKED_NGB_MIN_ACTIVE_FRACTION 0.05
 
 /*Set the parameters of the hydro module*/
 void
@@ -42,10 +40,19 @@ set_hydro_params(ParameterSet * ps)
         HydroParams.ArtBulkViscConst = param_get_double(ps, "ArtBulkViscConst");
         HydroParams.DensityContrastLimit = param_get_double(ps, "DensityContrastLimit");
         HydroParams.DensityIndependentSphOn= param_get_int(ps, "DensityIndependentSphOn");
+        HydroParams.SymmetricPairs = param_get_int(ps, "HydroSymmetricPairs");
+        HydroParams.PackedNeighbours = param_get_int(ps, "HydroPackedNeighbours");
     }
     MPI_Bcast(&HydroParams, sizeof(struct hydro_params), MPI_BYTE, 0, MPI_COMM_WORLD);
 }
 
+/*Set the hydro parameters from a hydro_params struct for the tests*/
+void
+set_hydropar(struct hydro_params hp)
+{
+    HydroParams = hp;
+}
+
 int DensityIndependentSphOn(void)
 {
     return HydroParams.DensityIndependentSphOn;
@@ -70,8 +77,46 @@ PressurePred(int PI, double EntVarPred)
     return pow(EntVarPred * EOMDensity, GAMMA);
 }
 
+/* The properties of a gas particle needed when it is a neighbour in the hydro loop.
+ * Packed together so that a neighbour visit touches one or two cache lines,
+ * instead of P, SphP and each of the predicted arrays.*/
+struct HydroNgbRecord {
+    MyFloat VelPred[3];
+    MyFloat Hsml;
+    MyFloat Mass;
+    MyFloat Density;
+    MyFloat EntVarPred;
+    MyFloat DhsmlEgyDensityFactor;
+    double SoundSpeed;
+    double POverRho2;
+    /* Balsara switch, Gadget-2 paper eq. 14*/
+    double F2;
+    /* Density contrast ratio for the grad-h correction*/
+    double DensityContrast;
+    signed char TimeBin;
+    char Decoupled;
+};
+
+/* A contribution from a pair to the neighbour of the query*/
+struct HydroPairDeposit {
+    int PI;
+    double Acc[3];
+    double DtEntropy;
+    double MaxSignalVel;
+};
+
+struct HydroPairBuffer {
+    struct HydroPairDeposit * dep;
+    int n;
+    int size;
+    /* Particle whose walk generated the deposits*/
+    int target;
+};
+
 struct HydraPriv {
     double * PressurePred;
+    /* Neighbour records indexed by PI. NULL if PackedNeighbours is off.*/
+    struct HydroNgbRecord * NgbRecord;
     struct sph_pred_data * SPH_predicted;
     /* Time-dependent constant factors, brought out here because
      * they need an expensive pow().*/
@@ -81,10 +126,90 @@ struct HydraPriv {
     double hubble_a2;
     double atime;
     int WindOn;
+    /* State of each particle for the symmetric pair evaluation. NULL if it is disabled.
+     * 0 if the particle is not part of a symmetric pair: it is inactive, not gas or decoupled.
+     * 1 if the particle is active and its own treewalk has not yet completed.
+     * 2 if the particle is active and its treewalk has completed. If it is walked again
+     *   because the export buffer filled, it must not add to its neighbours a second time.*/
+    char * PairState;
+    /* Contributions from pairs evaluated by the neighbour, indexed by PI.
+     * Added to the particle in postprocess.*/
+    double (*PairAcc)[3];
+    double * PairDtEntropy;
+    double * PairMaxSignalVel;
+    /* Pair contributions of the query currently walked by each thread.
+     * They are added to PairAcc only once the walk of the query has completed,
+     * so that a walk abandoned when the export buffer fills adds nothing.*/
+    struct HydroPairBuffer * PairBuffer;
 };
 
 #define HYDRA_GET_PRIV(tw) ((struct HydraPriv*) ((tw)->priv))
 
+/* Atomically set *ptr = max(*ptr, value)*/
+static void
+hydro_atomic_max(double * ptr, double value)
+{
+    double old;
+    #pragma omp atomic read
+    old = *ptr;
+    do {
+        if(value <= old)
+            return;
+    } while(!__atomic_compare_exchange(ptr, &old, &value, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/* Fill the part of the neighbour record of gas particle i
+ * needed to decide whether it interacts with the query*/
+static void
+hydro_fill_ngb_record_cut(int i, struct HydroNgbRecord * ngb, struct HydraPriv * priv)
+{
+    ngb->Hsml = P[i].Hsml;
+    ngb->Mass = P[i].Mass;
+    ngb->Decoupled = priv->WindOn && winds_is_particle_decoupled(i);
+}
+
+/* Fill the rest of the neighbour record of gas particle i, used to compute the force*/
+static void
+hydro_fill_ngb_record_force(int i, struct HydroNgbRecord * ngb, struct HydraPriv * priv)
+{
+    const int PI = P[i].PI;
+    int d;
+    for(d = 0; d < 3; d++)
+        ngb->VelPred[d] = priv->SPH_predicted->VelPred[3 * PI + d];
+    ngb->TimeBin = P[i].TimeBin;
+    ngb->Density = SPHP(i).Density;
+    if(HydroParams.DensityIndependentSphOn)
+        ngb->EntVarPred = priv->SPH_predicted->EntVarPred[PI];
+    ngb->DhsmlEgyDensityFactor = SPHP(i).DhsmlEgyDensityFactor;
+
+    const double Pressure_j = priv->PressurePred[PI];
+    ngb->POverRho2 = Pressure_j / (SPH_EOMDensity(i) * SPH_EOMDensity(i));
+    ngb->SoundSpeed = sqrt(GAMMA * Pressure_j / SPH_EOMDensity(i));
+    /* Note this uses the CurlVel of an inactive particle, which may not be
+     * at the present drift time*/
+    ngb->F2 = fabs(SPHP(i).DivVel) / (fabs(SPHP(i).DivVel) +
+            SPHP(i).CurlVel + 0.0001 * ngb->SoundSpeed / priv->fac_mu / P[i].Hsml);
+
+    /* grad-h corrections: enabled if DensityIndependentSphOn = 0, or DensityConstrastLimit >= 0 */
+    ngb->DensityContrast = 1;
+    if(HydroParams.DensityIndependentSphOn) {
+        ngb->DensityContrast = 0;
+        if(HydroParams.DensityContrastLimit >= 0) {
+            ngb->DensityContrast = SPHP(i).EgyWtDensity / SPHP(i).Density;
+            if(HydroParams.DensityContrastLimit > 0)
+                ngb->DensityContrast = DMIN(ngb->DensityContrast, HydroParams.DensityContrastLimit);
+        }
+    }
+}
+
+/* Fill the neighbour record of gas particle i*/
+static void
+hydro_fill_ngb_record(int i, struct HydroNgbRecord * ngb, struct HydraPriv * priv)
+{
+    hydro_fill_ngb_record_cut(i, ngb, priv);
+    hydro_fill_ngb_record_force(i, ngb, priv);
+}
+
 typedef struct {
     TreeWalkQueryBase base;
     /* These are only used for DensityIndependentSphOn*/
@@ -114,6 +239,11 @@ typedef struct {
     TreeWalkNgbIterBase base;
     double p_over_rho2_i;
     double soundspeed_i;
+    /* Particle index of the query if it is a local active particle evaluating pairs
+     * symmetrically, -1 otherwise.*/
+    int pair_i;
+    /* Buffer for the pair contributions to the neighbours, NULL if they are not sent.*/
+    struct HydroPairBuffer * pair_buf;
 
     DensityKernel kernel_i;
 } TreeWalkNgbIterHydro;
@@ -125,12 +255,10 @@ static void
 hydro_postprocess(int i, TreeWalk * tw);
 
 static void
-hydro_ngbiter(
-    TreeWalkQueryHydro * I,
-    TreeWalkResultHydro * O,
-    TreeWalkNgbIterHydro * iter,
-    LocalTreeWalk * lv
-   );
+hydro_preprocess(int i, TreeWalk * tw);
+
+static TreeWalkNgbIterFunction
+hydro_get_ngbiter(enum DensityKernelType type);
 
 static void
 hydro_copy(int place, TreeWalkQueryHydro * input, TreeWalk * tw);
@@ -152,7 +280,7 @@ hydro_force(const ActiveParticles * act, int WindOn, const double HydroCostFacto
 
     tw->ev_label = "HYDRO";
     tw->visit = (TreeWalkVisitFunction) treewalk_visit_ngbiter;
-    tw->ngbiter = (TreeWalkNgbIterFunction) hydro_ngbiter;
+    tw->ngbiter = hydro_get_ngbiter(GetDensityKernelType());
     tw->ngbiter_type_elsize = sizeof(TreeWalkNgbIterHydro);
     tw->haswork = hydro_haswork;
     tw->fill = (TreeWalkFillQueryFunction) hydro_copy;
@@ -186,8 +314,55 @@ hydro_force(const ActiveParticles * act, int WindOn, const double HydroCostFacto
     HYDRA_GET_PRIV(tw)->atime = atime;
     HYDRA_GET_PRIV(tw)->hubble_a2 = hubble * atime * atime;
 
+    /* Pack the neighbour records. Particles are sorted in Peano order,
+     * so neighbours in space are close together in the array.
+     * Skipped on deep timesteps with few active particles.*/
+    HYDRA_GET_PRIV(tw)->NgbRecord = NULL;
+    if(HydroParams.PackedNeighbours && act->NumActiveParticle >= PACKED_NGB_MIN_ACTIVE_FRACTION * PartManager->NumPart) {
+        struct HydroNgbRecord * NgbRecord = (struct HydroNgbRecord *) mymalloc("HydroNgbRecord", SlotsManager->info[0].size * sizeof(struct HydroNgbRecord));
+        #pragma omp parallel for
+        for(i = 0; i < PartManager->NumPart; i++) {
+            if(P[i].Type != 0 || P[i].IsGarbage)
+                continue;
+            hydro_fill_ngb_record(i, &NgbRecord[P[i].PI], HYDRA_GET_PRIV(tw));
+        }
+        HYDRA_GET_PRIV(tw)->NgbRecord = NgbRecord;
+    }
+
+    HYDRA_GET_PRIV(tw)->PairState = NULL;
+    if(HydroParams.SymmetricPairs) {
+        const int nsph = SlotsManager->info[0].size;
+        HYDRA_GET_PRIV(tw)->PairState = (char *) mymalloc("PairState", PartManager->NumPart * sizeof(char));
+        HYDRA_GET_PRIV(tw)->PairAcc = (double (*) [3]) mymalloc("PairAcc", nsph * sizeof(HYDRA_GET_PRIV(tw)->PairAcc[0]));
+        HYDRA_GET_PRIV(tw)->PairDtEntropy = (double *) mymalloc("PairDtEntropy", nsph * sizeof(double));
+        HYDRA_GET_PRIV(tw)->PairMaxSignalVel = (double *) mymalloc("PairMaxSignalVel", nsph * sizeof(double));
+        memset(HYDRA_GET_PRIV(tw)->PairState, 0, PartManager->NumPart * sizeof(char));
+        memset(HYDRA_GET_PRIV(tw)->PairAcc, 0, nsph * sizeof(HYDRA_GET_PRIV(tw)->PairAcc[0]));
+        memset(HYDRA_GET_PRIV(tw)->PairDtEntropy, 0, nsph * sizeof(double));
+        memset(HYDRA_GET_PRIV(tw)->PairMaxSignalVel, 0, nsph * sizeof(double));
+        const int NumThreads = omp_get_max_threads();
+        HYDRA_GET_PRIV(tw)->PairBuffer = (struct HydroPairBuffer *) mymalloc("PairBuffer", NumThreads * sizeof(struct HydroPairBuffer));
+        memset(HYDRA_GET_PRIV(tw)->PairBuffer, 0, NumThreads * sizeof(struct HydroPairBuffer));
+        for(i = 0; i < NumThreads; i++)
+            HYDRA_GET_PRIV(tw)->PairBuffer[i].target = -1;
+        tw->preprocess = hydro_preprocess;
+    }
+
     treewalk_run(tw, act->ActiveParticle, act->NumActiveParticle);
 
+    if(HYDRA_GET_PRIV(tw)->PairState) {
+        for(i = 0; i < omp_get_max_threads(); i++)
+            free(HYDRA_GET_PRIV(tw)->PairBuffer[i].dep);
+        myfree(HYDRA_GET_PRIV(tw)->PairBuffer);
+        myfree(HYDRA_GET_PRIV(tw)->PairMaxSignalVel);
+        myfree(HYDRA_GET_PRIV(tw)->PairDtEntropy);
+        myfree(HYDRA_GET_PRIV(tw)->PairAcc);
+        myfree(HYDRA_GET_PRIV(tw)->PairState);
+    }
+
+    if(HYDRA_GET_PRIV(tw)->NgbRecord)
+        myfree(HYDRA_GET_PRIV(tw)->NgbRecord);
+
     myfree(HYDRA_GET_PRIV(tw)->PressurePred);
     /* collect some timing information */
 
@@ -249,18 +424,44 @@ hydro_reduce(int place, TreeWalkResultHydro * result, enum TreeWalkReduceMode mo
     if(mode == TREEWALK_PRIMARY || SPHP(place).MaxSignalVel < result->MaxSignalVel)
         SPHP(place).MaxSignalVel = result->MaxSignalVel;
 
+    /* The local walk of this particle is complete: add the pair contributions
+     * to the neighbours. If the walk is repeated do not add them again.
+     * The primary reduction is done by the thread which walked the particle.*/
+    char * PairState = HYDRA_GET_PRIV(tw)->PairState;
+    if(mode == TREEWALK_PRIMARY && PairState && PairState[place] == 1) {
+        struct HydroPairBuffer * buf = &HYDRA_GET_PRIV(tw)->PairBuffer[omp_get_thread_num()];
+        if(buf->target == place) {
+            int i;
+            for(i = 0; i < buf->n; i++) {
+                const struct HydroPairDeposit * dep = &buf->dep[i];
+                for(k = 0; k < 3; k++) {
+                    #pragma omp atomic update
+                    HYDRA_GET_PRIV(tw)->PairAcc[dep->PI][k] += dep->Acc[k];
+                }
+                #pragma omp atomic update
+                HYDRA_GET_PRIV(tw)->PairDtEntropy[dep->PI] += dep->DtEntropy;
+                hydro_atomic_max(&HYDRA_GET_PRIV(tw)->PairMaxSignalVel[dep->PI], dep->MaxSignalVel);
+            }
+            buf->n = 0;
+            buf->target = -1;
+        }
+        #pragma omp atomic write
+        PairState[place] = 2;
+    }
 }
 
 /*! This function is the 'core' of the SPH force computation. A target
  *  particle is specified which may either be local, or reside in the
- *  communication buffer.
+ *  communication buffer. The kernel type is a compile time constant in
+ *  each of the hydro_ngbiter_* wrappers, so that the kernel is inlined.
  */
-static void
-hydro_ngbiter(
+static inline void
+hydro_ngbiter_kernel(
     TreeWalkQueryHydro * I,
     TreeWalkResultHydro * O,
     TreeWalkNgbIterHydro * iter,
-    LocalTreeWalk * lv
+    LocalTreeWalk * lv,
+    const enum DensityKernelType type
    )
 {
     if(iter->base.other == -1) {
@@ -276,7 +477,7 @@ hydro_ngbiter(
         /* initialize variables before SPH loop is started */
 
         O->Acc[0] = O->Acc[1] = O->Acc[2] = O->DtEntropy = 0;
-        density_kernel_init(&iter->kernel_i, I->Hsml, GetDensityKernelType());
+        density_kernel_init(&iter->kernel_i, I->Hsml, type);
 
         if(HydroParams.DensityIndependentSphOn)
             iter->p_over_rho2_i = I->Pressure / (I->EgyRho * I->EgyRho);
@@ -284,6 +485,24 @@ hydro_ngbiter(
             iter->p_over_rho2_i = I->Pressure / (I->Density * I->Density);
 
         O->MaxSignalVel = iter->soundspeed_i;
+
+        iter->pair_i = -1;
+        iter->pair_buf = NULL;
+        char * PairState = HYDRA_GET_PRIV(lv->tw)->PairState;
+        if(PairState && lv->mode == 0) {
+            char state;
+            #pragma omp atomic read
+            state = PairState[lv->target];
+            if(state) {
+                iter->pair_i = lv->target;
+            }
+            /* Start a new set of deposits, discarding any from an abandoned walk.*/
+            if(state == 1) {
+                iter->pair_buf = &HYDRA_GET_PRIV(lv->tw)->PairBuffer[omp_get_thread_num()];
+                iter->pair_buf->n = 0;
+                iter->pair_buf->target = lv->target;
+            }
+        }
         return;
     }
 
@@ -292,40 +511,69 @@ hydro_ngbiter(
     double * dist = iter->base.dist;
     double r = iter->base.r;
 
-    if(P[other].Mass == 0) {
+    /* Without packed records, only the properties needed before the kernel cut
+     * are read here: most candidates are outside the kernel.*/
+    struct HydroNgbRecord ngb_local;
+    const struct HydroNgbRecord * ngb = &ngb_local;
+    if(HYDRA_GET_PRIV(lv->tw)->NgbRecord)
+        ngb = &HYDRA_GET_PRIV(lv->tw)->NgbRecord[P[other].PI];
+    else
+        hydro_fill_ngb_record_cut(other, &ngb_local, HYDRA_GET_PRIV(lv->tw));
+
+    if(ngb->Mass == 0) {
         endrun(12, "Encountered zero mass particle during hydro;"
                   " We haven't implemented tracer particles and this shall not happen\n");
     }
 
     /* Wind particles do not interact hydrodynamically: don't produce hydro acceleration
      * or change the signalvel.*/
-    if(HYDRA_GET_PRIV(lv->tw)->WindOn && winds_is_particle_decoupled(other))
+    if(ngb->Decoupled)
         return;
 
-    DensityKernel kernel_j;
+    /* In symmetric mode, a pair of local active particles is evaluated by the particle
+     * with the larger smoothing length, as the tree search from that particle is guaranteed
+     * to find the other. Ties are broken by the particle index.*/
+    struct HydroPairDeposit * dep = NULL;
+    if(iter->pair_i >= 0 && HYDRA_GET_PRIV(lv->tw)->PairState[other]) {
+        if(ngb->Hsml > I->Hsml || (ngb->Hsml == I->Hsml && other < iter->pair_i))
+            return;
+        if(iter->pair_buf) {
+            struct HydroPairBuffer * buf = iter->pair_buf;
+            if(buf->n == buf->size) {
+                buf->size = buf->size ? 2 * buf->size : 256;
+                buf->dep = realloc(buf->dep, sizeof(struct HydroPairDeposit) * buf->size);
+                if(!buf->dep)
+                    endrun(1, "Failed to allocate %d hydro pair deposits\n", buf->size);
+            }
+            dep = &buf->dep[buf->n];
+            dep->PI = P[other].PI;
+            dep->MaxSignalVel = 0;
+        }
+    }
 
-    density_kernel_init(&kernel_j, P[other].Hsml, GetDensityKernelType());
+    DensityKernel kernel_j = iter->kernel_i;
+
+    density_kernel_reinit(&kernel_j, ngb->Hsml);
 
     if(r2 > 0 && (r2 < iter->kernel_i.HH || r2 < kernel_j.HH))
     {
+        if(!HYDRA_GET_PRIV(lv->tw)->NgbRecord)
+            hydro_fill_ngb_record_force(other, &ngb_local, HYDRA_GET_PRIV(lv->tw));
 
-        double Pressure_j = HYDRA_GET_PRIV(lv->tw)->PressurePred[P[other].PI];
-        double p_over_rho2_j = Pressure_j / (SPH_EOMDensity(other) * SPH_EOMDensity(other));
-        double soundspeed_j = sqrt(GAMMA * Pressure_j / SPH_EOMDensity(other));
-
-        MyFloat * velpred = HYDRA_GET_PRIV(lv->tw)->SPH_predicted->VelPred;
+        const double p_over_rho2_j = ngb->POverRho2;
+        const double soundspeed_j = ngb->SoundSpeed;
 
         double dv[3];
         int d;
         for(d = 0; d < 3; d++) {
-            dv[d] = I->Vel[d] - velpred[3 * P[other].PI + d];
+            dv[d] = I->Vel[d] - ngb->VelPred[d];
         }
 
         double vdotr = dotproduct(dist, dv);
         double vdotr2 = vdotr + HYDRA_GET_PRIV(lv->tw)->hubble_a2 * r2;
 
-        double dwk_i = density_kernel_dwk(&iter->kernel_i, r * iter->kernel_i.Hinv);
-        double dwk_j = density_kernel_dwk(&kernel_j, r * kernel_j.Hinv);
+        double dwk_i = density_kernel_dwk_type(&iter->kernel_i, r * iter->kernel_i.Hinv, type);
+        double dwk_j = density_kernel_dwk_type(&kernel_j, r * kernel_j.Hinv, type);
 
         double visc = 0;
 
@@ -333,7 +581,7 @@ hydro_ngbiter(
         {
             /*See Gadget-2 paper: eq. 13*/
             const double mu_ij = HYDRA_GET_PRIV(lv->tw)->fac_mu * vdotr2 / r;	/* note: this is negative! */
-            const double rho_ij = 0.5 * (I->Density + SPHP(other).Density);
+            const double rho_ij = 0.5 * (I->Density + ngb->Density);
             double vsig = iter->soundspeed_i + soundspeed_j;
 
             vsig -= 3 * mu_ij;
@@ -341,10 +589,10 @@ hydro_ngbiter(
             if(vsig > O->MaxSignalVel)
                 O->MaxSignalVel = vsig;
 
-            /* Note this uses the CurlVel of an inactive particle, which may not be
-             * at the present drift time*/
-            const double f2 = fabs(SPHP(other).DivVel) / (fabs(SPHP(other).DivVel) +
-                    SPHP(other).CurlVel + 0.0001 * soundspeed_j / HYDRA_GET_PRIV(lv->tw)->fac_mu / P[other].Hsml);
+            if(dep)
+                dep->MaxSignalVel = vsig;
+
+            const double f2 = ngb->F2;
 
             /*Gadget-2 paper, eq. 14*/
             visc = 0.25 * HydroParams.ArtBulkViscConst * vsig * (-mu_ij) / rho_ij * (I->F1 + f2);
@@ -352,67 +600,126 @@ hydro_ngbiter(
             /* now make sure that viscous acceleration is not too large */
 
             /*XXX: why is this dloga ?*/
-            double dloga = 2 * get_dloga_for_bin(IMAX(I->TimeBin, P[other].TimeBin));
+            double dloga = 2 * get_dloga_for_bin(IMAX(I->TimeBin, ngb->TimeBin));
             if(dloga > 0 && (dwk_i + dwk_j) < 0)
             {
-                if((I->Mass + P[other].Mass) > 0) {
+                if((I->Mass + ngb->Mass) > 0) {
                     visc = DMIN(visc, 0.5 * HYDRA_GET_PRIV(lv->tw)->fac_vsic_fix * vdotr2 /
-                            (0.5 * (I->Mass + P[other].Mass) * (dwk_i + dwk_j) * r * dloga));
+                            (0.5 * (I->Mass + ngb->Mass) * (dwk_i + dwk_j) * r * dloga));
                 }
             }
         }
-        const double hfc_visc = 0.5 * P[other].Mass * visc * (dwk_i + dwk_j) / r;
+        const double hfc_visc = 0.5 * ngb->Mass * visc * (dwk_i + dwk_j) / r;
         double hfc = hfc_visc;
-        double r1 = 1, r2 = 1;
+        double r1 = 1, r2 = ngb->DensityContrast;
 
         if(HydroParams.DensityIndependentSphOn) {
             /*This enables the grad-h corrections*/
-            r1 = 0, r2 = 0;
-            MyFloat * entvarpred = HYDRA_GET_PRIV(lv->tw)->SPH_predicted->EntVarPred;
+            r1 = 0;
             /* leading-order term */
-            double EntOther = entvarpred[P[other].PI];
+            double EntOther = ngb->EntVarPred;
 
-            hfc += P[other].Mass *
+            hfc += ngb->Mass *
                 (dwk_i*iter->p_over_rho2_i*EntOther/I->EntVarPred +
                 dwk_j*p_over_rho2_j*I->EntVarPred/EntOther) / r;
 
             /* enable grad-h corrections only if contrastlimit is non negative */
             if(HydroParams.DensityContrastLimit >= 0) {
                 r1 = I->EgyRho / I->Density;
-                r2 = SPHP(other).EgyWtDensity / SPHP(other).Density;
                 if(HydroParams.DensityContrastLimit > 0) {
                     /* apply the limit if it is enabled > 0*/
                     r1 = DMIN(r1, HydroParams.DensityContrastLimit);
-                    r2 = DMIN(r2, HydroParams.DensityContrastLimit);
                 }
             }
         }
 
         /* grad-h corrections: enabled if DensityIndependentSphOn = 0, or DensityConstrastLimit >= 0 */
         /* Formulation derived from the Lagrangian */
-        hfc += P[other].Mass * (iter->p_over_rho2_i*I->SPH_DhsmlDensityFactor * dwk_i * r1
-                 + p_over_rho2_j*SPHP(other).DhsmlEgyDensityFactor * dwk_j * r2) / r;
+        hfc += ngb->Mass * (iter->p_over_rho2_i*I->SPH_DhsmlDensityFactor * dwk_i * r1
+                 + p_over_rho2_j*ngb->DhsmlEgyDensityFactor * dwk_j * r2) / r;
 
         for(d = 0; d < 3; d ++)
             O->Acc[d] += (-hfc * dist[d]);
 
         O->DtEntropy += (0.5 * hfc_visc * vdotr2);
 
+        /* hfc / m_j is symmetric in i and j, and dist changes sign.*/
+        if(dep) {
+            const double mfac = I->Mass / ngb->Mass;
+            for(d = 0; d < 3; d ++)
+                dep->Acc[d] = mfac * hfc * dist[d];
+            dep->DtEntropy = 0.5 * mfac * hfc_visc * vdotr2;
+            iter->pair_buf->n++;
+        }
     }
     O->Ninteractions++;
 }
 
+static void
+hydro_ngbiter_cubic(TreeWalkQueryHydro * I, TreeWalkResultHydro * O, TreeWalkNgbIterHydro * iter, LocalTreeWalk * lv)
+{
+    hydro_ngbiter_kernel(I, O, iter, lv, DENSITY_KERNEL_CUBIC_SPLINE);
+}
+
+static void
+hydro_ngbiter_quintic(TreeWalkQueryHydro * I, TreeWalkResultHydro * O, TreeWalkNgbIterHydro * iter, LocalTreeWalk * lv)
+{
+    hydro_ngbiter_kernel(I, O, iter, lv, DENSITY_KERNEL_QUINTIC_SPLINE);
+}
+
+static void
+hydro_ngbiter_quartic(TreeWalkQueryHydro * I, TreeWalkResultHydro * O, TreeWalkNgbIterHydro * iter, LocalTreeWalk * lv)
+{
+    hydro_ngbiter_kernel(I, O, iter, lv, DENSITY_KERNEL_QUARTIC_SPLINE);
+}
+
+/* Select the neighbour loop specialised for the kernel type once per treewalk*/
+static TreeWalkNgbIterFunction
+hydro_get_ngbiter(enum DensityKernelType type)
+{
+    switch(type) {
+        case DENSITY_KERNEL_CUBIC_SPLINE:
+            return (TreeWalkNgbIterFunction) hydro_ngbiter_cubic;
+        case DENSITY_KERNEL_QUINTIC_SPLINE:
+            return (TreeWalkNgbIterFunction) hydro_ngbiter_quintic;
+        case DENSITY_KERNEL_QUARTIC_SPLINE:
+            return (TreeWalkNgbIterFunction) hydro_ngbiter_quartic;
+    }
+    endrun(1, "Density Kernel type %d is unknown\n", type);
+}
+
 static int
 hydro_haswork(int i, TreeWalk * tw)
 {
     return P[i].Type == 0;
 }
 
+/* Mark the particles which can take part in a symmetric pair evaluation.
+ * Decoupled wind particles do not exert hydro forces, so their pairs are not symmetric.*/
+static void
+hydro_preprocess(int i, TreeWalk * tw)
+{
+    if(HYDRA_GET_PRIV(tw)->WindOn && winds_is_particle_decoupled(i))
+        return;
+    HYDRA_GET_PRIV(tw)->PairState[i] = 1;
+}
+
 static void
 hydro_postprocess(int i, TreeWalk * tw)
 {
     if(P[i].Type == 0)
     {
+        /* Add the contributions from pairs evaluated by the neighbours*/
+        if(HYDRA_GET_PRIV(tw)->PairState) {
+            const int pi = P[i].PI;
+            int k;
+            for(k = 0; k < 3; k++)
+                SPHP(i).HydroAccel[k] += HYDRA_GET_PRIV(tw)->PairAcc[pi][k];
+            SPHP(i).DtEntropy += HYDRA_GET_PRIV(tw)->PairDtEntropy[pi];
+            if(SPHP(i).MaxSignalVel < HYDRA_GET_PRIV(tw)->PairMaxSignalVel[pi])
+                SPHP(i).MaxSignalVel = HYDRA_GET_PRIV(tw)->PairMaxSignalVel[pi];
+        }
+
         /* Translate energy change rate into entropy change rate */
         SPHP(i).DtEntropy *= GAMMA_MINUS1 / (HYDRA_GET_PRIV(tw)->hubble_a2 * pow(SPH_EOMDensity(i), GAMMA_MINUS1));
 
@@ -7,6 +7,22 @@
 #include "density.h"
 #include "utils/paramset.h"
 
+struct hydro_params
+{
+    /* Enables density independent (Pressure-entropy) SPH */
+    int DensityIndependentSphOn;
+    /* limit of density contrast ratio for hydro force calculation (only effective with Density Indep. Sph) */
+    double DensityContrastLimit;
+    /*!< Sets the parameter \f$\alpha\f$ of the artificial viscosity */
+    double ArtBulkViscConst;
+    /* If true, pairs of local active particles are evaluated only once,
+     * with equal and opposite contributions added to both particles.*/
+    int SymmetricPairs;
+    /* If true, the neighbour properties used by the hydro loop are packed
+     * into one record per gas particle before the treewalk.*/
+    int PackedNeighbours;
+};
+
 /* Function to get the center of mass density and HSML correction factor for an SPH particle with index i.
  * Encodes the main difference between pressure-entropy SPH and regular SPH.*/
 MyFloat SPH_EOMDensity(int i);
@@ -15,6 +31,8 @@ MyFloat SPH_EOMDensity(int i);
 void hydro_force(const ActiveParticles * act, int WindOn, const double HydroCostFactor, const double hubble, const double atime, struct sph_pred_data * SPH_predicted, const ForceTree * const tree);
 
 void set_hydro_params(ParameterSet * ps);
+/*Set the hydro parameters from a hydro_params struct for the tests*/
+void set_hydropar(struct hydro_params hp);
 
 /* Gets whether we are using Density Independent Sph*/
 int DensityIndependentSphOn(void);
@@ -183,7 +183,7 @@ void init(int RestartSnapNum, DomainDecomp * ddecomp)
      * on Task 0, there will be a lot of imbalance*/
     MPIU_Barrier(MPI_COMM_WORLD);
 
-    fof_init(All.MeanSeparation[1]);
+    fof_init(All.MeanSeparation[1], All.G);
 
     #pragma omp parallel for
     for(i = 0; i < PartManager->NumPart; i++)	/* initialize sph_properties */
@@ -5,16 +5,20 @@
 #include <math.h>
 #include <gsl/gsl_math.h>
 #include <gsl/gsl_integration.h>
-/*For mkdir*/
-#include <sys/stat.h>
-#include <sys/types.h>
+#include <omp.h>
+#include <bigfile-mpi.h>
 
 #include "utils.h"
 
 #include "allvars.h"
 #include "timefac.h"
+#include "timebinmgr.h"
 #include "partmanager.h"
 #include "cosmology.h"
+#include "domain.h"
+#include "petaio.h"
+#include "lightcone.h"
+#include "utils/peano.h"
 
 #define NENTRY 4096
 static double tab_loga[NENTRY];
@@ -31,9 +35,10 @@ static double tab_Dc[NENTRY];
  * replicas to consider, function of redshift;
  *
  * */
+#define MAXREPLICA 1000
 static int Nreplica;
 static int BoxBoost = 20;
-static double Reps[8192][3];
+static double Reps[MAXREPLICA][3];
 static double HorizonDistance2;
 static double HorizonDistance;
 static double HorizonDistancePrev;
@@ -43,11 +48,166 @@ static double zmin = 0.1;
 static double zmax = 80.0;
 static double ReferenceRedshift = 2.0; /* write all particles below this redshift; write a fraction above this. */
 static double SampleFraction; /* current fraction of particle gets written */
-static FILE * fd_lightcone;
+static BigFile lightcone_bf;
+
+#define MAXFIELDS 32
+/* A list of snapshot blocks, given as ptype/BlockName*/
+struct LightconeFieldList {
+    int NFields;
+    struct {
+        int ptype;
+        char name[64];
+    } Fields[MAXFIELDS];
+};
+
+static struct lightcone_params {
+    int Types; /* Bit mask of the particle types written to the lightcone */
+    int WriteParticles; /* Write the crossing particles; otherwise only the maps */
+    struct LightconeFieldList Fields; /* Snapshot blocks also written for the crossing particles */
+    int MapNside; /* HEALPix resolution of the maps of each shell; 0 disables the maps */
+    double MapShellWidth; /* Comoving width of the map shells, in internal length units */
+    struct LightconeFieldList MapFields; /* Scalar snapshot blocks also mapped, weighted by mass */
+} LightconeParams;
+
+/* The maps of the current shell on this rank, summed over ranks when the lightcone leaves the shell.
+ * They live for many steps, so they are allocated outside the main heap.
+ * Map 0 is the mass, map 1 + i the mass times MapFields i. */
+static struct {
+    int64_t npix;
+    int nmaps;
+    double * map;
+    /* Current shell, or -1*/
+    int shell;
+    /* Scale factors of the first and last steps binned in the shell*/
+    double TimeFirst;
+    double TimeLast;
+} LightconeMaps;
+
+/* A particle crossing the lightcone*/
+struct LightconeParticle {
+    double Pos[3];
+    float Vel[3];
+    MyIDType ID;
+    /* Index in P, for the snapshot getters of the extra fields*/
+    int Index;
+};
+
+/* The drift factor of a step and the horizon as a function of it.
+ * A particle is at Pos + Vel * D at drift factor D from the start of the step,
+ * and the horizon is at chi[0] + chi[1] D + chi[2] D^2, exact at the start, middle and end.
+ * Computed once per step.*/
+struct LightconeStep {
+    inttime_t ti0, ti1;
+    double ddrift;
+    double chi[3];
+};
+static struct LightconeStep Step = {-1, -1};
+
+/* Crossings found by one thread during a step.
+ * Threads grow their buffers independently, so they live outside the main heap.*/
+struct LightconeBuffer {
+    struct LightconeParticle * part;
+    size_t n;
+    size_t size;
+};
+
+/* Parse the list of blocks in the parameter param*/
+static void
+lightcone_parse_fields(ParameterSet * ps, char * param, struct LightconeFieldList * list)
+{
+    char fields[1024];
+    param_get_string2(ps, param, fields, sizeof(fields));
+    char * saveptr = NULL;
+    char * tok;
+    list->NFields = 0;
+    for(tok = strtok_r(fields, " ,", &saveptr); tok; tok = strtok_r(NULL, " ,", &saveptr)) {
+        int ptype;
+        char name[64];
+        if(2 != sscanf(tok, "%d/%63s", &ptype, name) || ptype < 0 || ptype >= 6)
+            endrun(0, "%s entry %s is not of the form ptype/BlockName\n", param, tok);
+        if(list->NFields >= MAXFIELDS)
+            endrun(0, "More than %d %s\n", MAXFIELDS, param);
+        if(!(LightconeParams.Types & (1 << ptype)))
+            message(0, "%s entry %s is for a type not in LightconeTypes.\n", param, tok);
+        list->Fields[list->NFields].ptype = ptype;
+        snprintf(list->Fields[list->NFields].name, sizeof(list->Fields[0].name), "%s", name);
+        list->NFields++;
+    }
+}
+
+/*Set the parameters of the lightcone module*/
+void
+set_lightcone_params(ParameterSet * ps)
+{
+    int ThisTask;
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    if(ThisTask == 0) {
+        LightconeParams.Types = param_get_int(ps, "LightconeTypes");
+        LightconeParams.WriteParticles = param_get_int(ps, "LightconeWriteParticles");
+        lightcone_parse_fields(ps, "LightconeFields", &LightconeParams.Fields);
+        LightconeParams.MapNside = param_get_int(ps, "LightconeMapNside");
+        LightconeParams.MapShellWidth = param_get_double(ps, "LightconeMapShellWidth");
+        lightcone_parse_fields(ps, "LightconeMapFields", &LightconeParams.MapFields);
+    }
+    MPI_Bcast(&LightconeParams, sizeof(struct lightcone_params), MPI_BYTE, 0, MPI_COMM_WORLD);
+}
+
+/* Find the snapshot block of entry field of list in the IOTable, or -1*/
+static int
+lightcone_find_field(const struct IOTable * IOTable, const struct LightconeFieldList * list, int field)
+{
+    int i;
+    for(i = 0; i < IOTable->used; i++) {
+        if(IOTable->ent[i].ptype == list->Fields[field].ptype &&
+           0 == strcmp(IOTable->ent[i].name, list->Fields[field].name))
+            return i;
+    }
+    return -1;
+}
+
+/* HEALPix pixel in the RING scheme of the direction vec, following ang2pix_ring of the HEALPix library.*/
+static int64_t
+healpix_vec2pix_ring(const int64_t nside, const double * vec)
+{
+    const double len = sqrt(vec[0] * vec[0] + vec[1] * vec[1] + vec[2] * vec[2]);
+    if(len == 0)
+        return 0;
+    const double z = vec[2] / len;
+    const double za = fabs(z);
+    /* Azimuth in units of pi/2, in [0, 4)*/
+    double tt = atan2(vec[1], vec[0]) * 2 / M_PI;
+    if(tt < 0)
+        tt += 4;
+    if(tt >= 4)
+        tt -= 4;
+    if(za <= 2. / 3) {
+        /* Equatorial region*/
+        const double temp1 = nside * (0.5 + tt);
+        const double temp2 = nside * z * 0.75;
+        const int64_t jp = temp1 - temp2;
+        const int64_t jm = temp1 + temp2;
+        const int64_t ir = nside + 1 + jp - jm;
+        const int64_t kshift = 1 - (ir & 1);
+        const int64_t ip = ((jp + jm - nside + kshift + 1) / 2) % (4 * nside);
+        return 2 * nside * (nside - 1) + (ir - 1) * 4 * nside + ip;
+    } else {
+        /* Polar caps*/
+        const double tp = tt - (int) tt;
+        const double tmp = nside * sqrt(3 * (1 - za));
+        const int64_t jp = tp * tmp;
+        const int64_t jm = (1.0 - tp) * tmp;
+        const int64_t ir = jp + jm + 1;
+        const int64_t ip = ((int64_t) (tt * ir)) % (4 * ir);
+        if(z > 0)
+            return 2 * ir * (ir - 1) + ip;
+        return 12 * nside * nside - 2 * ir * (ir + 1) + ip;
+    }
+}
 
 static double lightcone_get_horizon(double a);
-static void lightcone_cross(int p, double ddrift);
-static void lightcone_set_time(double a);
+static void lightcone_restore_maps(int snapnum);
+static void lightcone_cross(int p, const int * reps, int nrep, const struct LightconeStep * step, double velfac, struct LightconeBuffer * buf);
+static void lightcone_set_time(double a0, double a1);
 /*
 M, L = self.M, self.L
   logx = numpy.linspace(log10amin, 0, Np)
@@ -88,30 +248,47 @@ static void lightcone_init_entry(Cosmology * CP, int i) {
 //    printf("a = %g z = %g Dc = %g\n", a, z, result);
 }
 
-void lightcone_init(Cosmology * CP, double timeBegin)
+void lightcone_init(Cosmology * CP, double timeBegin, int RestartSnapNum)
 {
     int i;
     dloga = (0.0 - log(timeBegin)) / (NENTRY - 1);
     for(i = 0; i < NENTRY; i ++) {
         lightcone_init_entry(CP, i);
     };
-    char buf[1024];
-    int chunk = 100;
-    int ThisTask;
-    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    char * fname = fastpm_strdup_printf("%s/lightcone", All.OutputDir);
+    /* Each step is a new group of blocks, so a restarted run adds to the existing file*/
+    if(0 != big_file_mpi_create(&lightcone_bf, fname, MPI_COMM_WORLD)) {
+        endrun(1, "failed to create lightcone at %s: %s\n", fname, big_file_get_error_message());
+    }
+    myfree(fname);
 
-    sprintf(buf, "%s/lightcone/", All.OutputDir);
-    mkdir(buf, 02755);
-    sprintf(buf, "%s/lightcone/%03d/", All.OutputDir, (int)(ThisTask / chunk));
-    mkdir(buf, 02755);
-    sprintf(buf, "%s/lightcone/%03d/lightcone-%05d.raw", All.OutputDir, (int)(ThisTask / chunk), ThisTask);
+    /* Check the fields now, rather than on the first crossing*/
+    struct IOTable IOTable = {0};
+    register_io_blocks(&IOTable, 0);
+    for(i = 0; i < LightconeParams.Fields.NFields; i++) {
+        if(lightcone_find_field(&IOTable, &LightconeParams.Fields, i) < 0)
+            endrun(0, "LightconeFields: no snapshot block %d/%s\n", LightconeParams.Fields.Fields[i].ptype, LightconeParams.Fields.Fields[i].name);
+    }
+    for(i = 0; i < LightconeParams.MapFields.NFields; i++) {
+        const int j = lightcone_find_field(&IOTable, &LightconeParams.MapFields, i);
+        if(j < 0 || IOTable.ent[j].items != 1 || IOTable.ent[j].dtype[0] != 'f')
+            endrun(0, "LightconeMapFields: no scalar floating point snapshot block %d/%s\n", LightconeParams.MapFields.Fields[i].ptype, LightconeParams.MapFields.Fields[i].name);
+    }
+    destroy_io_blocks(&IOTable);
 
-    fd_lightcone = fopen(buf, "a+");
-    if(fd_lightcone == NULL) {
-        endrun(1, "failed to open %s\n", buf);
+    LightconeMaps.shell = -1;
+    if(LightconeParams.MapNside > 0) {
+        LightconeMaps.npix = 12 * (int64_t) LightconeParams.MapNside * LightconeParams.MapNside;
+        LightconeMaps.nmaps = 1 + LightconeParams.MapFields.NFields;
+        LightconeMaps.map = calloc(LightconeMaps.npix * LightconeMaps.nmaps, sizeof(double));
+        if(!LightconeMaps.map)
+            endrun(1, "Failed to allocate %d lightcone maps of %ld pixels\n", LightconeMaps.nmaps, LightconeMaps.npix);
+        if(RestartSnapNum >= 0)
+            lightcone_restore_maps(RestartSnapNum);
     }
+
     HorizonDistanceRef = lightcone_get_horizon(1 / (1 + ReferenceRedshift));
-    printf("lightcone reference redshift = %g distance = %g\n",
+    message(0, "lightcone reference redshift = %g distance = %g\n",
             ReferenceRedshift, HorizonDistanceRef);
 }
 
@@ -150,12 +327,13 @@ static void update_replicas(double a) {
         dy += All.BoxSize;
         dz += All.BoxSize;
         d2 = dx * dx + dy * dy + dz * dz;
-        if(d1 <= HorizonDistance2 && d2 >= HorizonDistance2) {
+        /* The replica overlaps the shell swept by the horizon this step*/
+        if(d1 <= HorizonDistance2Prev && d2 >= HorizonDistance2) {
             Reps[Nreplica][0] = rx * All.BoxSize;
             Reps[Nreplica][1] = ry * All.BoxSize;
             Reps[Nreplica][2] = rz * All.BoxSize;
             Nreplica ++;
-            if(Nreplica > 1000) {
+            if(Nreplica >= MAXREPLICA) {
                 endrun(951234, "too many replica");
             }
         }
@@ -171,99 +349,609 @@ static void update_replicas(double a) {
     }
 }
 
-/* Compute a list of particles which crossed
- * the lightcone boundaries on this timestep and
- * write them to the lightcone file*/
-void lightcone_compute(double a, Cosmology * CP, inttime_t ti_curr, inttime_t ti_next)
+/* Counting sort of the local DM particles by the top leaf containing them.
+ * The particles of leaf i are order[leafstart[i]] to order[leafstart[i+1]-1].*/
+static void
+lightcone_sort_by_leaf(const DomainDecomp * ddecomp, int * leafstart, int * order)
 {
+    const int NLeaf = ddecomp->NTopLeaves;
+    int * leafof = mymalloc("LeafOf", sizeof(int) * (PartManager->NumPart + 1));
     int i;
-    lightcone_set_time(a);
-    const double ddrift = get_exact_drift_factor(CP, ti_curr, ti_next);
     #pragma omp parallel for
+    for(i = 0; i < PartManager->NumPart; i++) {
+        if(P[i].IsGarbage || !(LightconeParams.Types & (1 << P[i].Type)))
+            leafof[i] = -1;
+        else
+            leafof[i] = domain_get_topleaf(PEANO(P[i].Pos, All.BoxSize), ddecomp);
+    }
+    memset(leafstart, 0, sizeof(int) * (NLeaf + 1));
     for(i = 0; i < PartManager->NumPart; i++)
+        if(leafof[i] >= 0)
+            leafstart[leafof[i] + 1]++;
+    for(i = 0; i < NLeaf; i++)
+        leafstart[i + 1] += leafstart[i];
+    /* Fill using leafstart as a cursor, then shift it back*/
+    for(i = 0; i < PartManager->NumPart; i++)
+        if(leafof[i] >= 0)
+            order[leafstart[leafof[i]]++] = i;
+    for(i = NLeaf; i > 0; i--)
+        leafstart[i] = leafstart[i - 1];
+    leafstart[0] = 0;
+    myfree(leafof);
+}
+
+/* Find the replicas for which the particles of a leaf may cross the lightcone this step.
+ * A particle crosses if it starts inside the previous horizon and ends outside the current one,
+ * so the bounding sphere of the leaf must reach inside the former and, grown by the largest
+ * drift, outside the latter. Returns the number of replicas, stored in reps.*/
+static int
+lightcone_leaf_replicas(const int * part, const int npart, const double ddrift, int * reps)
+{
+    if(npart == 0)
+        return 0;
+    double min[3], max[3], maxvel2 = 0;
+    int j, k;
+    for(k = 0; k < 3; k++) {
+        min[k] = max[k] = P[part[0]].Pos[k];
+    }
+    for(j = 0; j < npart; j++) {
+        const int p = part[j];
+        double vel2 = 0;
+        for(k = 0; k < 3; k++) {
+            min[k] = DMIN(min[k], P[p].Pos[k]);
+            max[k] = DMAX(max[k], P[p].Pos[k]);
+            vel2 += P[p].Vel[k] * P[p].Vel[k];
+        }
+        maxvel2 = DMAX(maxvel2, vel2);
+    }
+    double center[3], radius2 = 0;
+    for(k = 0; k < 3; k++) {
+        center[k] = (min[k] + max[k]) / 2 - PartManager->CurrentParticleOffset[k];
+        radius2 += (max[k] - min[k]) * (max[k] - min[k]) / 4;
+    }
+    const double radius = sqrt(radius2);
+    const double drift = sqrt(maxvel2) * fabs(ddrift);
+
+    int i, nrep = 0;
+    for(i = 0; i < Nreplica; i++) {
+        double d2 = 0;
+        for(k = 0; k < 3; k++) {
+            const double dx = center[k] + Reps[i][k];
+            d2 += dx * dx;
+        }
+        const double d = sqrt(d2);
+        if(d - radius <= HorizonDistancePrev && d + radius + drift >= HorizonDistance)
+            reps[nrep++] = i;
+    }
+    return nrep;
+}
+
+/* Create a block of the lightcone file and write an array to it. The caller sets attributes and closes it. Collective.*/
+static void
+lightcone_write_array(BigBlock * bb, char * blockname, BigArray * array, int64_t ntot)
+{
+    BigBlockPtr ptr;
+
+    int NTask;
+    MPI_Comm_size(MPI_COMM_WORLD, &NTask);
+    if(0 != big_file_mpi_create_block(&lightcone_bf, bb, blockname, array->dtype, array->dims[1], 1, ntot, MPI_COMM_WORLD)) {
+        endrun(0, "Failed to create block at %s:%s\n", blockname, big_file_get_error_message());
+    }
+    if(0 != big_block_seek(bb, &ptr, 0)) {
+        endrun(0, "Failed to seek:%s\n", big_file_get_error_message());
+    }
+    if(0 != big_block_mpi_write(bb, &ptr, array, NTask, MPI_COMM_WORLD)) {
+        endrun(0, "Failed to write :%s\n", big_file_get_error_message());
+    }
+}
+
+static void
+lightcone_close_block(BigBlock * bb, char * blockname)
+{
+    if(0 != big_block_mpi_close(bb, MPI_COMM_WORLD)) {
+        endrun(0, "Failed to close block at %s:%s\n", blockname, big_file_get_error_message());
+    }
+}
+
+/* Write an array of crossings of this step as a block of the lightcone file. Collective.*/
+static void
+lightcone_write_step_array(char * blockname, BigArray * array, int64_t ntot, double a)
+{
+    BigBlock bb;
+    lightcone_write_array(&bb, blockname, array, ntot);
+    if((0 != big_block_set_attr(&bb, "Time", &a, "f8", 1)) ||
+       (0 != big_block_set_attr(&bb, "SampleFraction", &SampleFraction, "f8", 1)) ||
+       (0 != big_block_set_attr(&bb, "HorizonDistance", &HorizonDistance, "f8", 1))) {
+        endrun(0, "Failed to write attributes %s\n", big_file_get_error_message());
+    }
+    lightcone_close_block(&bb, blockname);
+}
+
+/* Sum the maps over ranks onto rank 0, leaving the other ranks with empty maps, so that
+ * binning can carry on. Collective.*/
+static void
+lightcone_reduce_maps(void)
+{
+    int ThisTask;
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    const int64_t npix = LightconeMaps.npix;
+    int m;
+    for(m = 0; m < LightconeMaps.nmaps; m++) {
+        double * map = LightconeMaps.map + m * npix;
+        int64_t off;
+        /* MPI counts are int*/
+        for(off = 0; off < npix; off += (1 << 28)) {
+            const int count = DMIN(npix - off, 1 << 28);
+            if(ThisTask == 0)
+                MPI_Reduce(MPI_IN_PLACE, map + off, count, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+            else
+                MPI_Reduce(map + off, NULL, count, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+        }
+    }
+    if(ThisTask != 0)
+        memset(LightconeMaps.map, 0, sizeof(double) * npix * LightconeMaps.nmaps);
+}
+
+/* Name of map m under the group prefix: prefix/Mass or prefix/<ptype>/<MapField>*/
+static void
+lightcone_map_name(char * blockname, size_t size, const char * prefix, int m)
+{
+    if(m == 0)
+        snprintf(blockname, size, "%s/Mass", prefix);
+    else
+        snprintf(blockname, size, "%s/%d/%s", prefix,
+                LightconeParams.MapFields.Fields[m-1].ptype, LightconeParams.MapFields.Fields[m-1].name);
+}
+
+/* Write the maps of the current shell, already reduced to rank 0, under the group prefix. Collective.*/
+static void
+lightcone_write_maps(const char * prefix)
+{
+    int ThisTask;
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    const int64_t npix = LightconeMaps.npix;
+    const double inner = LightconeMaps.shell * LightconeParams.MapShellWidth;
+    const double outer = inner + LightconeParams.MapShellWidth;
+    int m;
+    for(m = 0; m < LightconeMaps.nmaps; m++) {
+        char blockname[128];
+        lightcone_map_name(blockname, sizeof(blockname), prefix, m);
+        BigArray array = {0};
+        size_t dims[2] = {ThisTask == 0 ? npix : 0, 1};
+        ptrdiff_t strides[2] = {sizeof(double), sizeof(double)};
+        big_array_init(&array, LightconeMaps.map + m * npix, "f8", 2, dims, strides);
+        BigBlock bb;
+        lightcone_write_array(&bb, blockname, &array, npix);
+        if((0 != big_block_set_attr(&bb, "Nside", &LightconeParams.MapNside, "i4", 1)) ||
+           (0 != big_block_set_attr(&bb, "Shell", &LightconeMaps.shell, "i4", 1)) ||
+           (0 != big_block_set_attr(&bb, "ShellInner", &inner, "f8", 1)) ||
+           (0 != big_block_set_attr(&bb, "ShellOuter", &outer, "f8", 1)) ||
+           (0 != big_block_set_attr(&bb, "TimeFirst", &LightconeMaps.TimeFirst, "f8", 1)) ||
+           (0 != big_block_set_attr(&bb, "TimeLast", &LightconeMaps.TimeLast, "f8", 1))) {
+            endrun(0, "Failed to write attributes %s\n", big_file_get_error_message());
+        }
+        lightcone_close_block(&bb, blockname);
+    }
+}
+
+/* Sum the maps of the finished shell over ranks and write them from rank 0,
+ * as Maps/<shell>/Mass and Maps/<shell>/<ptype>/<MapField>. Collective.*/
+static void
+lightcone_flush_maps(void)
+{
+    char prefix[64];
+    snprintf(prefix, sizeof(prefix), "Maps/%04d", LightconeMaps.shell);
+    lightcone_reduce_maps();
+    lightcone_write_maps(prefix);
+    memset(LightconeMaps.map, 0, sizeof(double) * LightconeMaps.npix * LightconeMaps.nmaps);
+    message(0, "Wrote lightcone maps of shell %d, from %g to %g\n", LightconeMaps.shell,
+            LightconeMaps.shell * LightconeParams.MapShellWidth, (LightconeMaps.shell + 1) * LightconeParams.MapShellWidth);
+}
+
+/* Save the maps of the shell in progress with the snapshot snapnum, as PartialMaps/<snapnum>,
+ * so that a run restarted from the snapshot carries on with them. Collective.*/
+void
+lightcone_save_maps(int snapnum)
+{
+    if(!LightconeMaps.map || LightconeMaps.shell < 0)
+        return;
+    char prefix[64];
+    snprintf(prefix, sizeof(prefix), "PartialMaps/%03d", snapnum);
+    lightcone_reduce_maps();
+    lightcone_write_maps(prefix);
+    message(0, "Saved the partial lightcone maps of shell %d with snapshot %d\n", LightconeMaps.shell, snapnum);
+}
+
+/* Read back the maps of the shell in progress saved with the snapshot snapnum onto rank 0.
+ * Keeps empty maps if there are none, eg for a snapshot written before the first shell. Collective.*/
+static void
+lightcone_restore_maps(int snapnum)
+{
+    int ThisTask, NTask;
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    MPI_Comm_size(MPI_COMM_WORLD, &NTask);
+    char prefix[64];
+    snprintf(prefix, sizeof(prefix), "PartialMaps/%03d", snapnum);
+    int m;
+    for(m = 0; m < LightconeMaps.nmaps; m++) {
+        char blockname[128];
+        lightcone_map_name(blockname, sizeof(blockname), prefix, m);
+        BigBlock bb;
+        BigBlockPtr ptr;
+        if(0 != big_file_mpi_open_block(&lightcone_bf, &bb, blockname, MPI_COMM_WORLD)) {
+            if(m == 0) {
+                message(0, "No partial lightcone maps saved with snapshot %d.\n", snapnum);
+                return;
+            }
+            endrun(0, "Partial lightcone map %s is missing: LightconeMapFields changed?\n", blockname);
+        }
+        int nside;
+        if((0 != big_block_get_attr(&bb, "Nside", &nside, "i4", 1)) ||
+           (0 != big_block_get_attr(&bb, "Shell", &LightconeMaps.shell, "i4", 1)) ||
+           (0 != big_block_get_attr(&bb, "TimeFirst", &LightconeMaps.TimeFirst, "f8", 1)) ||
+           (0 != big_block_get_attr(&bb, "TimeLast", &LightconeMaps.TimeLast, "f8", 1))) {
+            endrun(0, "Failed to read attributes of %s: %s\n", blockname, big_file_get_error_message());
+        }
+        if(nside != LightconeParams.MapNside)
+            endrun(0, "Partial lightcone map %s has Nside %d, not LightconeMapNside %d\n", blockname, nside, LightconeParams.MapNside);
+        BigArray array = {0};
+        size_t dims[2] = {ThisTask == 0 ? LightconeMaps.npix : 0, 1};
+        ptrdiff_t strides[2] = {sizeof(double), sizeof(double)};
+        big_array_init(&array, LightconeMaps.map + m * LightconeMaps.npix, "f8", 2, dims, strides);
+        if(0 != big_block_seek(&bb, &ptr, 0) ||
+           0 != big_block_mpi_read(&bb, &ptr, &array, NTask, MPI_COMM_WORLD)) {
+            endrun(0, "Failed to read %s: %s\n", blockname, big_file_get_error_message());
+        }
+        lightcone_close_block(&bb, blockname);
+    }
+    message(0, "Restored the partial lightcone maps of shell %d from snapshot %d\n", LightconeMaps.shell, snapnum);
+}
+
+/* Move to the shell containing the horizon, writing the maps of the previous shell if it changed.
+ * The crossings of a step go to one shell, so shell edges are as sharp as the steps. Collective.*/
+static void
+lightcone_update_shell(double a)
+{
+    const int shell = SampleFraction > 0 ? HorizonDistancePrev / LightconeParams.MapShellWidth : -1;
+    if(shell != LightconeMaps.shell) {
+        if(LightconeMaps.shell >= 0)
+            lightcone_flush_maps();
+        LightconeMaps.shell = shell;
+        LightconeMaps.TimeFirst = a;
+    }
+    LightconeMaps.TimeLast = a;
+}
+
+/* Add the crossings of a type to the maps of the current shell.
+ * selection holds the particle index of each crossing.*/
+static void
+lightcone_bin_crossings(int ptype, const struct LightconeParticle * crossing, const int * selection, const int64_t n, const struct IOTable * IOTable)
+{
+    /* A subsampled crossing stands for 1 / SampleFraction particles*/
+    const double weight = 1.0 / SampleFraction;
+    int64_t * pix = mymalloc("LightconePixels", sizeof(int64_t) * (n + 1));
+    int64_t i;
+    #pragma omp parallel for
+    for(i = 0; i < n; i++) {
+        pix[i] = healpix_vec2pix_ring(LightconeParams.MapNside, crossing[i].Pos);
+        #pragma omp atomic
+        LightconeMaps.map[pix[i]] += weight * P[selection[i]].Mass;
+    }
+    int f;
+    for(f = 0; f < LightconeParams.MapFields.NFields; f++) {
+        if(LightconeParams.MapFields.Fields[f].ptype != ptype)
+            continue;
+        IOTableEntry * ent = &IOTable->ent[lightcone_find_field(IOTable, &LightconeParams.MapFields, f)];
+        BigArray array = {0};
+        petaio_build_buffer(&array, ent, selection, n, P, SlotsManager);
+        double * map = LightconeMaps.map + (1 + f) * LightconeMaps.npix;
+        const int isfloat = ent->dtype[1] == '4';
+        #pragma omp parallel for
+        for(i = 0; i < n; i++) {
+            const double value = isfloat ? ((float *) array.data)[i] : ((double *) array.data)[i];
+            #pragma omp atomic
+            map[pix[i]] += weight * P[selection[i]].Mass * value;
+        }
+        petaio_destroy_buffer(&array);
+    }
+    myfree(pix);
+}
+
+/* Write one column of the crossings as a block of the lightcone file. Collective.*/
+static void
+lightcone_write_column(char * blockname, char * dtype, int nmemb, void * data, size_t n, int64_t ntot, double a)
+{
+    BigArray array = {0};
+    size_t dims[2] = {n, nmemb};
+    ptrdiff_t strides[2] = {sizeof(struct LightconeParticle), big_file_dtype_itemsize(dtype)};
+    big_array_init(&array, data, dtype, 2, dims, strides);
+    lightcone_write_step_array(blockname, &array, ntot, a);
+}
+
+/* Merge the thread buffers of one type, write the crossings with their extra fields and add them to the maps. Collective.*/
+static void
+lightcone_write_type(int ptype, struct LightconeBuffer * buffers, int NumThreads, const struct IOTable * IOTable, inttime_t ti_curr, double a)
+{
+    int i;
+    size_t n = 0;
+    for(i = 0; i < NumThreads; i++)
+        n += buffers[6 * i + ptype].n;
+    struct LightconeParticle * crossing = mymalloc("LightconeCrossing", sizeof(struct LightconeParticle) * (n + 1));
+    n = 0;
+    for(i = 0; i < NumThreads; i++) {
+        struct LightconeBuffer * buf = &buffers[6 * i + ptype];
+        if(buf->n > 0)
+            memcpy(crossing + n, buf->part, sizeof(struct LightconeParticle) * buf->n);
+        n += buf->n;
+        free(buf->part);
+    }
+
+    int64_t ntot = n;
+    MPI_Allreduce(MPI_IN_PLACE, &ntot, 1, MPI_INT64, MPI_SUM, MPI_COMM_WORLD);
+    if(ntot == 0) {
+        myfree(crossing);
+        return;
+    }
+    /* The extra fields are those of the particle at the start of the step*/
+    int * selection = mymalloc("LightconeSelection", sizeof(int) * (n + 1));
+    for(i = 0; i < (int) n; i++)
+        selection[i] = crossing[i].Index;
+
+    if(LightconeParams.WriteParticles) {
+        char blockname[128];
+        snprintf(blockname, sizeof(blockname), "%010d/%d/Position", ti_curr, ptype);
+        lightcone_write_column(blockname, "f8", 3, crossing[0].Pos, n, ntot, a);
+        snprintf(blockname, sizeof(blockname), "%010d/%d/Velocity", ti_curr, ptype);
+        lightcone_write_column(blockname, "f4", 3, crossing[0].Vel, n, ntot, a);
+        snprintf(blockname, sizeof(blockname), "%010d/%d/ID", ti_curr, ptype);
+        lightcone_write_column(blockname, "u8", 1, &crossing[0].ID, n, ntot, a);
+
+        for(i = 0; i < LightconeParams.Fields.NFields; i++) {
+            if(LightconeParams.Fields.Fields[i].ptype != ptype)
+                continue;
+            IOTableEntry * ent = &IOTable->ent[lightcone_find_field(IOTable, &LightconeParams.Fields, i)];
+            BigArray array = {0};
+            petaio_build_buffer(&array, ent, selection, n, P, SlotsManager);
+            snprintf(blockname, sizeof(blockname), "%010d/%d/%s", ti_curr, ptype, ent->name);
+            lightcone_write_step_array(blockname, &array, ntot, a);
+            petaio_destroy_buffer(&array);
+        }
+        message(0, "Wrote %ld lightcone particles of type %d at a = %g\n", ntot, ptype, a);
+    }
+    if(LightconeMaps.map)
+        lightcone_bin_crossings(ptype, crossing, selection, n, IOTable);
+
+    myfree(selection);
+    myfree(crossing);
+}
+
+/* Integrand of the drift factor, 1 / (a^3 H)*/
+static double
+lightcone_drift_integ(Cosmology * CP, double a)
+{
+    return 1 / (hubble_function(CP, a) * a * a * a);
+}
+
+/* Simpson integral of the drift factor from a0 to a1*/
+static double
+lightcone_drift_simpson(Cosmology * CP, double a0, double a1)
+{
+    const int n = 16;
+    const double h = (a1 - a0) / n;
+    double sum = lightcone_drift_integ(CP, a0) + lightcone_drift_integ(CP, a1);
+    int i;
+    for(i = 1; i < n; i++)
+        sum += (i % 2 ? 4 : 2) * lightcone_drift_integ(CP, a0 + i * h);
+    return sum * h / 3;
+}
+
+/* Compute the drift factor of the step and the horizon as a quadratic in it, once per step.
+ * The drift factor of the whole step is exact; the middle point only shapes the quadratic,
+ * so a short Simpson rule, scaled to the exact total, is enough.*/
+static void
+lightcone_set_step(Cosmology * CP, inttime_t ti_curr, inttime_t ti_next)
+{
+    if(Step.ti0 == ti_curr && Step.ti1 == ti_next)
+        return;
+    Step.ti0 = ti_curr;
+    Step.ti1 = ti_next;
+    Step.ddrift = get_exact_drift_factor(CP, ti_curr, ti_next);
+
+    const double a0 = exp(loga_from_ti(ti_curr));
+    const double a1 = exp(loga_from_ti(ti_next));
+    const double am = sqrt(a0 * a1);
+    const double d1 = Step.ddrift;
+    const double simpson = lightcone_drift_simpson(CP, a0, a1);
+    const double dm = simpson > 0 ? lightcone_drift_simpson(CP, a0, am) * d1 / simpson : 0;
+    const double c0 = lightcone_get_horizon(a0);
+    const double cm = lightcone_get_horizon(am);
+    const double c1 = lightcone_get_horizon(a1);
+    Step.chi[0] = c0;
+    Step.chi[1] = Step.chi[2] = 0;
+    if(d1 > 0 && dm > 0 && dm < d1) {
+        /* Quadratic through (0, c0), (dm, cm), (d1, c1)*/
+        const double sm = (cm - c0) / dm;
+        const double s1 = (c1 - c0) / d1;
+        Step.chi[2] = (s1 - sm) / (d1 - dm);
+        Step.chi[1] = sm - Step.chi[2] * dm;
+    }
+}
+
+/* Compute a list of particles which crossed
+ * the lightcone boundaries on this timestep and
+ * write them to the lightcone file, as the blocks
+ * <ti_curr>/<ptype>/Position, Velocity, ID and the LightconeFields,
+ * and add them to the HEALPix maps of the current shell. */
+void lightcone_compute(double a, Cosmology * CP, inttime_t ti_curr, inttime_t ti_next, const DomainDecomp * ddecomp)
+{
+    int i;
+    lightcone_set_time(a, exp(loga_from_ti(ti_next)));
+    if(LightconeMaps.map)
+        lightcone_update_shell(a);
+    if(SampleFraction <= 0.0)
+        return;
+    lightcone_set_step(CP, ti_curr, ti_next);
+    /* Peculiar velocity, as in snapshots with UsePeculiarVelocity*/
+    const double velfac = 1.0 / a;
+
+    /* Group the particles by top leaf of the domain, so that whole groups can be culled*/
+    const int NLeaf = ddecomp->NTopLeaves;
+    int * leafstart = mymalloc("LeafStart", sizeof(int) * (NLeaf + 1));
+    int * order = mymalloc("LeafOrder", sizeof(int) * (PartManager->NumPart + 1));
+    lightcone_sort_by_leaf(ddecomp, leafstart, order);
+
+    const int NumThreads = omp_get_max_threads();
+    /* One buffer per thread and type*/
+    struct LightconeBuffer * buffers = ta_malloc("LightconeBuffers", struct LightconeBuffer, 6 * NumThreads);
+    memset(buffers, 0, sizeof(struct LightconeBuffer) * 6 * NumThreads);
+
+    int64_t ntested = 0;
+    /* A static schedule gives each thread a contiguous range of leaves,
+     * so the order of the merged crossings is fixed*/
+    #pragma omp parallel for schedule(static) reduction(+: ntested)
+    for(i = 0; i < NLeaf; i++)
     {
-        lightcone_cross(i, ddrift);
+        int reps[MAXREPLICA];
+        const int nrep = lightcone_leaf_replicas(order + leafstart[i], leafstart[i+1] - leafstart[i], Step.ddrift, reps);
+        int j;
+        for(j = leafstart[i]; j < leafstart[i+1] && nrep > 0; j++)
+            lightcone_cross(order[j], reps, nrep, &Step, velfac, &buffers[6 * omp_get_thread_num() + P[order[j]].Type]);
+        ntested += (int64_t) nrep * (leafstart[i+1] - leafstart[i]);
+    }
+    myfree(order);
+    myfree(leafstart);
+    MPI_Allreduce(MPI_IN_PLACE, &ntested, 1, MPI_INT64, MPI_SUM, MPI_COMM_WORLD);
+    message(0, "Lightcone tested %ld particle replicas out of %d replicas.\n", ntested, Nreplica);
+
+    struct IOTable IOTable = {0};
+    register_io_blocks(&IOTable, 0);
+    int ptype;
+    for(ptype = 0; ptype < 6; ptype++) {
+        if(LightconeParams.Types & (1 << ptype))
+            lightcone_write_type(ptype, buffers, NumThreads, &IOTable, ti_curr, a);
     }
+    destroy_io_blocks(&IOTable);
+    ta_free(buffers);
 }
 
-void lightcone_set_time(double a) {
-    double z = 1 / a - 1;
+/* Set the horizon at the start (HorizonDistancePrev) and end (HorizonDistance) of a step from a0 to a1.
+ * The particles crossing during the step are between the two.*/
+void lightcone_set_time(double a0, double a1) {
+    double z = 1 / a0 - 1;
     if(z > zmin && z < zmax) {
-        HorizonDistancePrev = HorizonDistance;
-        HorizonDistance2Prev = HorizonDistance2;
-        HorizonDistance = lightcone_get_horizon(a);
+        HorizonDistancePrev = lightcone_get_horizon(a0);
+        HorizonDistance2Prev = HorizonDistancePrev * HorizonDistancePrev;
+        HorizonDistance = lightcone_get_horizon(a1);
         HorizonDistance2 = HorizonDistance * HorizonDistance;
-        update_replicas(a);
-        fflush(fd_lightcone);
+        update_replicas(a0);
         if (z < ReferenceRedshift) {
             SampleFraction = 1.0;
         } else {
             /* write a smaller fraction of the points at high redshift
              */
             /* This is the angular resolution rule */
-            SampleFraction = HorizonDistanceRef / HorizonDistance;
+            SampleFraction = HorizonDistanceRef / HorizonDistancePrev;
             SampleFraction *= SampleFraction;
             SampleFraction *= SampleFraction;
             /* This is the luminosity resolution rule */
 #if 0
-            SampleFraction = HorizonDistanceRef / HorizonDistance;
+            SampleFraction = HorizonDistanceRef / HorizonDistancePrev;
             SampleFraction *= (1 + ReferenceRedshift) / (1 + z);
             SampleFraction *= SampleFraction;
 
 #endif
         }
-        message(0,"RefRedeshit=%g, SampleFraction=%g HorizonDistance=%g\n", ReferenceRedshift, SampleFraction, HorizonDistance);
+        message(0,"RefRedeshit=%g, SampleFraction=%g HorizonDistance=%g to %g\n", ReferenceRedshift, SampleFraction, HorizonDistancePrev, HorizonDistance);
     } else {
         SampleFraction = 0;
     }
 }
 
-/* check crossing of the horizon, write the particle */
-static void lightcone_cross(int p, double ddrift) {
-    if(SampleFraction <= 0.0) return;
-    int i;
-    int k;
-    /* DM only */
-    if(P[p].Type != 1) return;
+/* Drift factor at which a particle starting at x0 with velocity v meets the horizon.
+ * The caller guarantees a sign change of |x0 + v D| - chi(D) between 0 and the end of the step.
+ * Newton iterations from the secant estimate, falling back to bisection of the bracket.
+ * The secant estimate is the old linear interpolation, so one or two iterations usually suffice.*/
+static double
+lightcone_solve_crossing(const double * x0, const double * v, const double r0, const double r1, const struct LightconeStep * step)
+{
+    const double * chi = step->chi;
+    const double d1 = step->ddrift;
+    double lo = 0, hi = d1;
+    const double f0 = r0 - chi[0];
+    const double f1 = r1 - (chi[0] + d1 * (chi[1] + d1 * chi[2]));
+    double D = f1 != f0 ? -f0 / (f1 - f0) * d1 : d1 / 2;
+    double xv = 0, vv = 0;
+    int k, it;
+    for(k = 0; k < 3; k++) {
+        xv += x0[k] * v[k];
+        vv += v[k] * v[k];
+    }
+    for(it = 0; it < 64; it++) {
+        const double r = sqrt(r0 * r0 + D * (2 * xv + D * vv));
+        const double f = r - (chi[0] + D * (chi[1] + D * chi[2]));
+        const double fp = (r > 0 ? (xv + D * vv) / r : 0) - (chi[1] + 2 * D * chi[2]);
+        if(fabs(f) <= 1e-10 * chi[0] || hi - lo <= 1e-14 * d1)
+            break;
+        if(f < 0)
+            lo = D;
+        else
+            hi = D;
+        double Dn = fp != 0 ? D - f / fp : (lo + hi) / 2;
+        if(!(Dn > lo && Dn < hi))
+            Dn = (lo + hi) / 2;
+        D = Dn;
+    }
+    return D;
+}
 
-    for(i = 0; i < Nreplica; i++) {
-        double r = get_random_number(P[p].ID + i);
-        if(r > SampleFraction) continue;
+/* check crossing of the horizon for the replicas in reps, add the particle to the thread buffer */
+static void lightcone_cross(int p, const int * reps, int nrep, const struct LightconeStep * step, double velfac, struct LightconeBuffer * buf) {
+    int ir;
+    int k;
+    const double ddrift = step->ddrift;
+    const double vmax = sqrt(P[p].Vel[0] * P[p].Vel[0] + P[p].Vel[1] * P[p].Vel[1] + P[p].Vel[2] * P[p].Vel[2]) * ddrift;
+    double v[3];
+    for(k = 0; k < 3; k ++)
+        v[k] = P[p].Vel[k];
 
+    for(ir = 0; ir < nrep; ir++) {
+        const int i = reps[ir];
         double pnew[3];
         double pold[3];
-        double p3[4];
         double dnew = 0, dold = 0;
         for(k = 0; k < 3; k ++) {
             pold[k] = P[p].Pos[k] + Reps[i][k] - PartManager->CurrentParticleOffset[k];
-            pnew[k] = P[p].Pos[k] + P[i].Vel[k] * ddrift - PartManager->CurrentParticleOffset[k];
-            dnew += pnew[k] * pnew[k];
             dold += pold[k] * pold[k];
         }
+        /* Fast path: the particle stays too far inside or outside the shell swept by the horizon*/
+        const double r0 = sqrt(dold);
+        if(r0 - vmax > HorizonDistancePrev || r0 + vmax < HorizonDistance)
+            continue;
+        for(k = 0; k < 3; k ++) {
+            pnew[k] = pold[k] + v[k] * ddrift;
+            dnew += pnew[k] * pnew[k];
+        }
         if(
             (dold <= HorizonDistance2Prev && dnew >= HorizonDistance2)
          ) {
-            double u1, u2;
-            if(dold != dnew) {
-                double cnew, cold;
-                dnew = sqrt(dnew);
-                dold = sqrt(dold);
-                cnew = dnew - HorizonDistance;
-                cold = dold - HorizonDistancePrev;
-                u1 = -cold / (cnew - cold);
-                u2 = cnew / (cnew - cold);
-            } else {
-                /* really should write all particles along the line:
-                 * this partilce is moving along the horizon! */
-                u1 = u2 = 0.5;
-            }
+            /* The random draw only depends on the particle and the replica, so it is done after the cheaper test*/
+            if(SampleFraction < 1 && get_random_number(P[p].ID + i) > SampleFraction)
+                continue;
+            const double D = lightcone_solve_crossing(pold, v, r0, sqrt(dnew), step);
 
-            /* write particle position */
+            if(buf->n == buf->size) {
+                buf->size = buf->size ? 2 * buf->size : 1024;
+                buf->part = realloc(buf->part, sizeof(struct LightconeParticle) * buf->size);
+                if(!buf->part)
+                    endrun(1, "Failed to allocate %ld lightcone crossings\n", buf->size);
+            }
+            struct LightconeParticle * out = &buf->part[buf->n++];
             for(k = 0; k < 3; k ++) {
-                p3[k] = pold[k] * u2 + pnew[k] * u1;
+                out->Pos[k] = pold[k] + v[k] * D;
+                out->Vel[k] = P[p].Vel[k] * velfac;
             }
-            p3[3] = SampleFraction;
-            fwrite(p3, sizeof(double), 4, fd_lightcone);
+            out->ID = P[p].ID;
+            out->Index = p;
         }
     }
 }
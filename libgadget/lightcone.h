@@ -1,7 +1,18 @@
 #ifndef LIGHTCONE_H
 #define LIGHTCONE_H
 
-/* Initialise the lightcone code module. */
-void lightcone_init(Cosmology * CP, double timeBegin);
-void lightcone_compute(double a, Cosmology * CP, inttime_t ti_curr, inttime_t ti_next);
+#include "domain.h"
+#include "utils/paramset.h"
+
+/* Set the parameters of the lightcone module*/
+void set_lightcone_params(ParameterSet * ps);
+
+/* Initialise the lightcone code module. On restart from a snapshot, RestartSnapNum >= 0,
+ * the maps of the shell in progress are read back from those saved with it. */
+void lightcone_init(Cosmology * CP, double timeBegin, int RestartSnapNum);
+/* Write the particles crossing the lightcone this step. The top leaves of the domain
+ * group the particles so that replicas can be culled for a whole leaf at once. */
+void lightcone_compute(double a, Cosmology * CP, inttime_t ti_curr, inttime_t ti_next, const DomainDecomp * ddecomp);
+/* Save the maps of the shell in progress with snapshot snapnum, for a restart from it. */
+void lightcone_save_maps(int snapnum);
 #endif
@@ -5,6 +5,10 @@
 #include <math.h>
 #include <string.h>
 #include <stdarg.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+#include <limits.h>
 
 #include <bigfile-mpi.h>
 
@@ -35,6 +39,16 @@ static struct petaio_params {
     int MinNumWriters;        /* Min Number of concurrent writers, this caps number of writers */
     int EnableAggregatedIO;  /* Enable aggregated IO policy for small files.*/
     size_t AggregatedIOThreshold; /* bytes per writer above which to use non-aggregated IO (avoid OOM)*/
+    int AsyncSnapshotWrite; /* Stage snapshots in memory and write them from a background thread */
+    double AsyncSnapshotMemSizePerNode; /* Memory budget for the staged snapshot, in MB per node */
+    int PipelineSnapshotBlocks; /* Fill the buffer of the next block on the other threads while the current block is written */
+    int RestartReadByKey; /* On restart, each rank reads a segment of the Peano curve from the spatial index */
+    int SnapshotCompression; /* 0: raw blocks, 1: shuffle and LZ compress blocks, 2: use zlib instead of LZ */
+    double CompressVelocityError; /* Absolute error bound of lossy velocity compression; 0 is lossless */
+    double CompressSphRelError; /* Relative error bound of lossy compression of SPH fields; 0 is lossless */
+    int IOCalibrate; /* Measure the file system at startup and pick NumWriters, BytesPerFile and aggregated IO */
+    size_t IOCalibrateBytes; /* Bytes written by each rank in each calibration trial */
+    double CalibratedGBps; /* Throughput of the chosen setting; 0 if not calibrated */
     /* Changes the comoving factors of the snapshot outputs. Set in the ICs.
      * If UsePeculiarVelocity = 1 then snapshots save to the velocity field the physical peculiar velocity, v = a dx/dt (where x is comoving distance).
      * If UsePeculiarVelocity = 0 then the velocity field is a * v = a^2 dx/dt in snapshots
@@ -57,6 +71,18 @@ set_petaio_params(ParameterSet * ps)
         IO.WritersPerFile = param_get_int(ps, "WritersPerFile");
         IO.AggregatedIOThreshold = param_get_int(ps, "AggregatedIOThreshold");
         IO.EnableAggregatedIO = param_get_int(ps, "EnableAggregatedIO");
+        IO.AsyncSnapshotWrite = param_get_int(ps, "AsyncSnapshotWrite");
+        IO.AsyncSnapshotMemSizePerNode = param_get_double(ps, "AsyncSnapshotMemSizePerNode");
+        if(IO.AsyncSnapshotMemSizePerNode <= 1)
+            IO.AsyncSnapshotMemSizePerNode *= get_physmem_bytes() / (1024. * 1024.);
+        IO.RestartReadByKey = param_get_int(ps, "RestartReadByKey");
+        IO.PipelineSnapshotBlocks = param_get_int(ps, "PipelineSnapshotBlocks");
+        IO.SnapshotCompression = param_get_int(ps, "SnapshotCompression");
+        IO.CompressVelocityError = param_get_double(ps, "CompressVelocityError");
+        IO.CompressSphRelError = param_get_double(ps, "CompressSphRelError");
+        IO.IOCalibrate = param_get_int(ps, "IOCalibrate");
+        IO.IOCalibrateBytes = param_get_int(ps, "IOCalibrateBytes");
+        IO.CalibratedGBps = 0;
 
     }
     MPI_Bcast(&IO, sizeof(struct petaio_params), MPI_BYTE, 0, MPI_COMM_WORLD);
@@ -69,6 +95,7 @@ int GetUsePeculiarVelocity(void)
 
 static void petaio_write_header(BigFile * bf, const int64_t * NTotal);
 static void petaio_read_header_internal(BigFile * bf);
+static int petaio_block_nfiles(const size_t size, const int elsize, int * NumWriters, int verbose);
 
 /* these are only used in reading in */
 void petaio_init(void) {
@@ -82,10 +109,148 @@ void petaio_init(void) {
     }
     if(IO.NumWriters == 0)
         MPI_Comm_size(MPI_COMM_WORLD, &IO.NumWriters);
+    if(IO.IOCalibrate)
+        petaio_calibrate(All.OutputDir);
+}
+
+/* One I/O configuration tried by the calibration*/
+struct IOSetting {
+    int NumWriters;
+    int EnableAggregatedIO;
+    size_t BytesPerFile;
+};
+
+static void
+petaio_apply_setting(const struct IOSetting * s)
+{
+    IO.NumWriters = s->NumWriters;
+    IO.EnableAggregatedIO = s->EnableAggregatedIO;
+    IO.BytesPerFile = s->BytesPerFile;
+    big_file_mpi_set_aggregated_threshold(s->EnableAggregatedIO ? IO.AggregatedIOThreshold : 0);
+}
+
+/* Remove the test file of the calibration: bigfile has no call for this.*/
+static void
+petaio_remove_calibration(const char * fname, const int maxfiles)
+{
+    char path[1024];
+    int i;
+    for(i = 0; i < maxfiles; i ++) {
+        snprintf(path, sizeof(path), "%s/Calibration/%06X", fname, i);
+        unlink(path);
+    }
+    snprintf(path, sizeof(path), "%s/Calibration/header", fname);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/Calibration/attr-v2", fname);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/Calibration", fname);
+    rmdir(path);
+    rmdir(fname);
+}
+
+/* Measure the write throughput of the file system for a few writer counts and file sizes,
+ * and keep the fastest setting. Each trial writes IOCalibrateBytes from every rank to a test
+ * file in OutputDir. Aggregated IO is only tried if it fits in the AggregatedIOThreshold
+ * memory budget of a writer. Collective.*/
+void
+petaio_calibrate(const char * OutputDir)
+{
+    int NTask, ThisTask;
+    MPI_Comm_size(MPI_COMM_WORLD, &NTask);
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+
+    const size_t bytes = IO.IOCalibrateBytes / 8 * 8;
+    if(bytes == 0)
+        return;
+
+    struct IOSetting trials[16];
+    int ntrial = 0;
+    int w;
+    /* Throttled IO, one file per writer*/
+    for(w = IO.NumWriters; w >= IO.MinNumWriters && w >= 1 && ntrial < 8; w /= 4) {
+        trials[ntrial].NumWriters = w;
+        trials[ntrial].EnableAggregatedIO = 0;
+        trials[ntrial].BytesPerFile = IO.BytesPerFile;
+        ntrial++;
+    }
+    /* Aggregated IO, which sets the number of files by their size*/
+    if(bytes <= IO.AggregatedIOThreshold) {
+        /* Start from at least one byte so the loop advances for tiny BytesPerFile*/
+        size_t bpf;
+        for(bpf = DMAX(IO.BytesPerFile / 4, 1); bpf <= IO.BytesPerFile * 4 && ntrial < 16; bpf *= 4) {
+            trials[ntrial].NumWriters = IO.NumWriters;
+            trials[ntrial].EnableAggregatedIO = 1;
+            trials[ntrial].BytesPerFile = bpf;
+            ntrial++;
+        }
+    }
+
+    char * fname = fastpm_strdup_printf("%s/IOCalibration", OutputDir);
+    BigFile bf = {0};
+    if(0 != big_file_mpi_create(&bf, fname, MPI_COMM_WORLD)) {
+        message(0, "Failed to create I/O calibration file at %s: %s. Keeping the I/O parameters.\n", fname,
+                    big_file_get_error_message());
+        myfree(fname);
+        return;
+    }
+
+    uint64_t * buf = mymalloc("IOCalibration", bytes);
+    size_t i;
+    for(i = 0; i < bytes / 8; i ++)
+        buf[i] = ThisTask * (bytes / 8) + i;
+    BigArray array = {0};
+    size_t dims[2] = {bytes / 8, 1};
+    ptrdiff_t strides[2] = {8, 8};
+    big_array_init(&array, buf, "u8", 2, dims, strides);
+
+    const struct IOSetting orig = {IO.NumWriters, IO.EnableAggregatedIO, IO.BytesPerFile};
+    struct IOSetting best = orig;
+    double bestgbps = 0;
+    int t, maxfiles = 0;
+    for(t = 0; t < ntrial; t++) {
+        petaio_apply_setting(&trials[t]);
+        int NumWriters;
+        const int NumFiles = petaio_block_nfiles(bytes * NTask / 8, 8, &NumWriters, 0);
+        maxfiles = NumFiles > maxfiles ? NumFiles : maxfiles;
+        MPI_Barrier(MPI_COMM_WORLD);
+        const double t0 = MPI_Wtime();
+        petaio_save_iotable_block(&bf, "Calibration", &array, NULL, 0);
+        MPI_Barrier(MPI_COMM_WORLD);
+        const double gbps = (double) bytes * NTask / DMAX(MPI_Wtime() - t0, 1e-6) / 1e9;
+        message(0, "I/O calibration: %d writers, %d files, aggregated %d: %g GB/s\n",
+                NumWriters, NumFiles, trials[t].EnableAggregatedIO, gbps);
+        if(gbps > bestgbps) {
+            bestgbps = gbps;
+            best = trials[t];
+        }
+    }
+    myfree(buf);
+
+    if(0 != big_file_mpi_close(&bf, MPI_COMM_WORLD)) {
+        endrun(0, "Failed to close I/O calibration file: %s\n", big_file_get_error_message());
+    }
+    if(ThisTask == 0)
+        petaio_remove_calibration(fname, maxfiles);
+    myfree(fname);
+
+    petaio_apply_setting(&best);
+    IO.CalibratedGBps = bestgbps;
+    message(0, "I/O calibration chose %d writers, aggregated IO %d, %td bytes per file: %g GB/s\n",
+            best.NumWriters, best.EnableAggregatedIO, best.BytesPerFile, bestgbps);
 }
 
 /* save a snapshot file */
 static void petaio_save_internal(char * fname, struct IOTable * IOTable, int verbose);
+static int petaio_save_async_internal(char * fname, struct IOTable * IOTable);
+static void petaio_fill_buffer(BigArray * array, IOTableEntry * ent, const int * selection, const int NumSelection, struct particle_data * Parts, struct slots_manager_type * SlotsManager);
+static void petaio_fill_rows(BigArray * array, IOTableEntry * ent, const int * selection, const int start, const int end, struct particle_data * Parts, struct slots_manager_type * SlotsManager);
+static int petaio_create_iotable_block(BigFile * bf, BigBlock * bb, char * blockname, BigArray * array, const IOTableEntry * ent, int * NumWriters, int verbose);
+static void petaio_write_iotable_block(BigBlock * bb, char * blockname, BigArray * array, const int NumFiles, const int NumWriters, int verbose);
+static void petaio_set_compression(BigBlock * bb, const IOTableEntry * ent);
+static void petaio_save_index(BigFile * bf, int ptype, const int * selection, const int NumSelection, struct particle_data * Parts);
+static int petaio_restart_regions(BigFile * bf, const int64_t * NTotal, const int MaxPart, struct PetaIORegion * regions, MPI_Comm Comm);
+static int petaio_read_region_throttled(BigFile * bf, char * blockname, const struct PetaIORegion * region, BigArray * array, int required, MPI_Comm Comm);
+static void GTPosition(int i, double * out, void * baseptr, void * smanptr);
 
 void
 petaio_save_snapshot(struct IOTable * IOTable, int verbose, const char *fmt, ...)
@@ -101,6 +266,241 @@ petaio_save_snapshot(struct IOTable * IOTable, int verbose, const char *fmt, ...
     myfree(fname);
 }
 
+/* A block of a snapshot being written in the background.
+ * The block is created and this rank's data staged before the writer thread starts.*/
+struct AsyncBlock {
+    BigBlock bb;
+    BigArray array;
+    /* Offset of the data from this rank in the block*/
+    int64_t offset;
+    /* Concurrent writers allowed for this block by the I/O parameters*/
+    int NumWriters;
+    /* Seconds this rank spent writing the block*/
+    double twrite;
+    char name[128];
+};
+
+/* The snapshot being written in the background, if any.
+ * Only the writer thread touches the blocks between petaio_save_snapshot_async and petaio_finish_async_write.
+ * Ranks write in waves of at most NumWriters, as big_block_mpi_write throttles the synchronous writes:
+ * the writer thread of a rank waits for its wave, which the main thread starts once every rank of the
+ * previous wave has written. wave and written are shared with the writer thread under lock.*/
+static struct {
+    int pending;
+    pthread_t thread;
+    BigFile bf;
+    char fname[4096];
+    struct AsyncBlock * blocks;
+    int nblocks;
+    /* Single allocation outside the main heap holding the data of all blocks*/
+    char * staging;
+    int wave;
+    int nwaves;
+    int mywave;
+    int written;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    /* Set by the writer thread on failure*/
+    int rt;
+    char error[512];
+} Async = {.lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER};
+
+/* Point array at buffer, which holds nrows for ent. Returns the bytes used.*/
+static size_t
+petaio_init_buffer(BigArray * array, char * buffer, const IOTableEntry * ent, const int nrows)
+{
+    const int elsize = dtype_itemsize(ent->dtype);
+    size_t dims[2] = {nrows, ent->items};
+    ptrdiff_t strides[2] = {elsize * ent->items, elsize};
+    big_array_init(array, buffer, ent->dtype, 2, dims, strides);
+    return dims[0] * dims[1] * elsize;
+}
+
+/* Point the array of ab at buffer and fill it with the selected particles for ent. Returns the bytes used.*/
+static size_t
+petaio_fill_async_block(struct AsyncBlock * ab, char * buffer, IOTableEntry * ent, const int * selection, const int NumSelection)
+{
+    const size_t bytes = petaio_init_buffer(&ab->array, buffer, ent, NumSelection);
+    petaio_fill_buffer(&ab->array, ent, selection, NumSelection, P, SlotsManager);
+    return bytes;
+}
+
+/* Create a block collectively for the rows of this rank in ab->array, compressed as set for ent,
+ * and find the offset of these rows in the block, so that they can be written without MPI calls.*/
+static void
+petaio_create_async_block(BigFile * bf, struct AsyncBlock * ab, const IOTableEntry * ent, int verbose)
+{
+    sprintf(ab->name, "%d/%s", ent->ptype, ent->name);
+    const int elsize = dtype_itemsize(ent->dtype);
+    const size_t size = count_sum(ab->array.dims[0]);
+    const int NumFiles = petaio_block_nfiles(size, elsize, &ab->NumWriters, verbose);
+    if(verbose && size > 0) {
+        message(0, "Will write %td particles to %d Files for %s\n", size, NumFiles, ab->name);
+    }
+    if(0 != big_file_mpi_create_block(bf, &ab->bb, ab->name, ent->dtype, ent->items, NumFiles, size, MPI_COMM_WORLD)) {
+        endrun(0, "Failed to create block at %s:%s\n", ab->name,
+                    big_file_get_error_message());
+    }
+    petaio_set_compression(&ab->bb, ent);
+    int64_t local = ab->array.dims[0];
+    ab->offset = 0;
+    MPI_Exscan(&local, &ab->offset, 1, MPI_INT64, MPI_SUM, MPI_COMM_WORLD);
+    /* MPI_Exscan leaves the first rank undefined */
+    int ThisTask;
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    if(ThisTask == 0)
+        ab->offset = 0;
+}
+
+/* Seek and write the rows of this rank to a block created by petaio_create_async_block.
+ * Makes no MPI calls and does not call endrun, so that it may run on a thread.
+ * Returns 0 on success, otherwise the message is in error.*/
+static int
+petaio_write_async_block(struct AsyncBlock * ab, char * error, const size_t errorlen)
+{
+    BigBlockPtr ptr;
+    if(ab->array.dims[0] == 0)
+        return 0;
+    if(0 != big_block_seek(&ab->bb, &ptr, ab->offset) ||
+       0 != big_block_write(&ab->bb, &ptr, &ab->array)) {
+        snprintf(error, errorlen, "%s: %s", ab->name, big_file_get_error_message());
+        return 1;
+    }
+    return 0;
+}
+
+/* Wall clock time in seconds, without the MPI call of second()*/
+static double
+petaio_thread_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+/* The writer thread waits for the wave of this rank, then only seeks and writes this rank's part of each block: no MPI calls.
+ * The blocks are closed, which sums their checksums over ranks, on the main thread.*/
+static void *
+petaio_async_writer(void * arg)
+{
+    int i;
+    pthread_mutex_lock(&Async.lock);
+    while(Async.wave < Async.mywave)
+        pthread_cond_wait(&Async.cond, &Async.lock);
+    pthread_mutex_unlock(&Async.lock);
+
+    for(i = 0; i < Async.nblocks; i++) {
+        const double t0 = petaio_thread_time();
+        Async.rt = petaio_write_async_block(&Async.blocks[i], Async.error, sizeof(Async.error));
+        Async.blocks[i].twrite = petaio_thread_time() - t0;
+        if(Async.rt)
+            break;
+    }
+
+    pthread_mutex_lock(&Async.lock);
+    Async.written = 1;
+    pthread_cond_broadcast(&Async.cond);
+    pthread_mutex_unlock(&Async.lock);
+    return NULL;
+}
+
+/* Let the writer threads of the next wave start*/
+static void
+petaio_async_next_wave(void)
+{
+    pthread_mutex_lock(&Async.lock);
+    Async.wave++;
+    pthread_cond_broadcast(&Async.cond);
+    pthread_mutex_unlock(&Async.lock);
+}
+
+void
+petaio_progress_async_write(void)
+{
+    if(!Async.pending || Async.wave >= Async.nwaves)
+        return;
+    pthread_mutex_lock(&Async.lock);
+    const int done = Async.wave != Async.mywave || Async.written;
+    pthread_mutex_unlock(&Async.lock);
+    if(!MPIU_Any(!done, MPI_COMM_WORLD))
+        petaio_async_next_wave();
+}
+
+int
+petaio_save_snapshot_async(struct IOTable * IOTable, const char *fmt, ...)
+{
+    va_list va;
+    va_start(va, fmt);
+
+    char * fname = fastpm_strdup_vprintf(fmt, va);
+    va_end(va);
+
+    /* Only one snapshot is in flight at a time*/
+    petaio_finish_async_write();
+
+    int started = 0;
+    if(IO.AsyncSnapshotWrite) {
+        message(0, "saving snapshot into %s in the background\n", fname);
+        started = petaio_save_async_internal(fname, IOTable);
+    }
+    if(!started) {
+        message(0, "saving snapshot into %s\n", fname);
+        petaio_save_internal(fname, IOTable, 1);
+    }
+    myfree(fname);
+    return started;
+}
+
+int
+petaio_finish_async_write(void)
+{
+    if(!Async.pending)
+        return 0;
+
+    double t0 = second();
+    while(Async.wave < Async.nwaves) {
+        pthread_mutex_lock(&Async.lock);
+        while(Async.wave == Async.mywave && !Async.written)
+            pthread_cond_wait(&Async.cond, &Async.lock);
+        pthread_mutex_unlock(&Async.lock);
+        MPI_Barrier(MPI_COMM_WORLD);
+        petaio_async_next_wave();
+    }
+    pthread_join(Async.thread, NULL);
+    if(Async.rt != 0)
+        endrun(1, "Failed to write snapshot %s in the background: %s\n", Async.fname, Async.error);
+    double t1 = second();
+
+    int NTask;
+    MPI_Comm_size(MPI_COMM_WORLD, &NTask);
+    int i;
+    for(i = 0; i < Async.nblocks; i++) {
+        struct AsyncBlock * ab = &Async.blocks[i];
+        /* The waves were spread over the run, so the wall clock time of the block means nothing.
+         * Report the throughput of NumWriters ranks writing at the mean rate of this block instead.*/
+        double twrite = ab->twrite;
+        MPI_Allreduce(MPI_IN_PLACE, &twrite, 1, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+        const double bytes = (double) ab->bb.size * dtype_itemsize(ab->array.dtype) * ab->array.dims[1];
+        double gbps = bytes * DMIN(ab->NumWriters, NTask) / DMAX(twrite, 1e-6) / 1e9;
+        if(0 != big_block_set_attr(&ab->bb, "WriteGBps", &gbps, "f8", 1)) {
+            endrun(0, "Failed to write attributes %s\n", big_file_get_error_message());
+        }
+        if(0 != big_block_mpi_close(&ab->bb, MPI_COMM_WORLD)) {
+            endrun(0, "Failed to close block at %s:%s\n", Async.blocks[i].name,
+                    big_file_get_error_message());
+        }
+    }
+    if(0 != big_file_mpi_close(&Async.bf, MPI_COMM_WORLD)) {
+        endrun(0, "Failed to close snapshot at %s:%s\n", Async.fname,
+                    big_file_get_error_message());
+    }
+    free(Async.blocks);
+    free(Async.staging);
+    Async.pending = 0;
+    message(0, "Finished background write of %s; waited %g seconds.\n", Async.fname, t1 - t0);
+    return 1;
+}
+
 /* Build a list of the first particle of each type on the current processor.
  * This assumes that all particles are sorted!*/
 /**
@@ -150,6 +550,82 @@ petaio_build_selection(int * selection,
     }
 }
 
+/* Index of the next particle block after i in the table*/
+static int
+petaio_next_particle_block(const struct IOTable * IOTable, int i)
+{
+    for(i = i + 1; i < IOTable->used; i++) {
+        const int ptype = IOTable->ent[i].ptype;
+        if(ptype < 6 && ptype >= 0)
+            break;
+    }
+    return i;
+}
+
+/* Rows filled at a time by a thread of the pipeline*/
+#define PIPELINE_CHUNK 4096
+
+/* Fill the selected rows of array in chunks of PIPELINE_CHUNK, claimed from the shared counter nextchunk.
+ * Called by every thread of a team, which need not arrive together.*/
+static void
+petaio_fill_chunks(BigArray * array, IOTableEntry * ent, const int * selection, const int NumSelection, int * nextchunk)
+{
+    while(1) {
+        int chunk;
+        #pragma omp atomic capture
+        chunk = (*nextchunk)++;
+        const int64_t start = (int64_t) chunk * PIPELINE_CHUNK;
+        if(start >= NumSelection)
+            break;
+        const int end = DMIN(start + PIPELINE_CHUNK, NumSelection);
+        petaio_fill_rows(array, ent, selection, start, end, P, SlotsManager);
+    }
+}
+
+/* Write the particle blocks, filling the buffer of the next block while the current one is written.
+ * The write is the collective big_block_mpi_write, throttled to NumWriters like every other block, made by the
+ * master thread of an OpenMP team: this is the thread which initialised MPI. The other threads of the team
+ * run the getters of the next block, and the master thread joins them once its write is done.
+ * The two buffers of maxbytes each are in pipeline.*/
+static void
+petaio_save_blocks_pipelined(BigFile * bf, struct IOTable * IOTable, const int * selection, const int * ptype_offset, const int * ptype_count, char * pipeline, const size_t maxbytes, int verbose)
+{
+    BigArray arrays[2];
+    int slot = 0;
+    int i = petaio_next_particle_block(IOTable, -1);
+    if(i < IOTable->used) {
+        const int ptype = IOTable->ent[i].ptype;
+        petaio_init_buffer(&arrays[slot], pipeline, &IOTable->ent[i], ptype_count[ptype]);
+        petaio_fill_buffer(&arrays[slot], &IOTable->ent[i], selection + ptype_offset[ptype], ptype_count[ptype], P, SlotsManager);
+    }
+    while(i < IOTable->used) {
+        char blockname[128];
+        sprintf(blockname, "%d/%s", IOTable->ent[i].ptype, IOTable->ent[i].name);
+        BigBlock bb;
+        int NumWriters;
+        const int NumFiles = petaio_create_iotable_block(bf, &bb, blockname, &arrays[slot], &IOTable->ent[i], &NumWriters, verbose);
+
+        const int next = petaio_next_particle_block(IOTable, i);
+        IOTableEntry * nextent = NULL;
+        int nextptype = 0;
+        if(next < IOTable->used) {
+            nextent = &IOTable->ent[next];
+            nextptype = nextent->ptype;
+            petaio_init_buffer(&arrays[1 - slot], pipeline + (1 - slot) * maxbytes, nextent, ptype_count[nextptype]);
+        }
+        int nextchunk = 0;
+        #pragma omp parallel
+        {
+            if(omp_get_thread_num() == 0)
+                petaio_write_iotable_block(&bb, blockname, &arrays[slot], NumFiles, NumWriters, verbose);
+            if(nextent)
+                petaio_fill_chunks(&arrays[1 - slot], nextent, selection + ptype_offset[nextptype], ptype_count[nextptype], &nextchunk);
+        }
+        slot = 1 - slot;
+        i = next;
+    }
+}
+
 static void petaio_save_internal(char * fname, struct IOTable * IOTable, int verbose) {
     BigFile bf = {0};
     if(0 != big_file_mpi_create(&bf, fname, MPI_COMM_WORLD)) {
@@ -169,22 +645,47 @@ static void petaio_save_internal(char * fname, struct IOTable * IOTable, int ver
 
     petaio_write_header(&bf, NTotal);
 
+    /* Two buffers of the largest block, if they fit*/
+    size_t maxbytes = 0;
     int i;
     for(i = 0; i < IOTable->used; i ++) {
-        /* only process the particle blocks */
-        char blockname[128];
-        int ptype = IOTable->ent[i].ptype;
-        BigArray array = {0};
-        /*This exclude FOF blocks*/
-        if(!(ptype < 6 && ptype >= 0)) {
+        const int ptype = IOTable->ent[i].ptype;
+        if(!(ptype < 6 && ptype >= 0))
             continue;
+        const size_t bytes = (size_t) ptype_count[ptype] * dtype_itemsize(IOTable->ent[i].dtype) * IOTable->ent[i].items;
+        if(bytes > maxbytes)
+            maxbytes = bytes;
+    }
+    /* The getters of the next block run on the threads not writing, so one thread has nothing to overlap*/
+    char * pipeline = NULL;
+    if(IO.PipelineSnapshotBlocks && omp_get_max_threads() > 1 && 2 * maxbytes + 4096 < mymalloc_freebytes())
+        pipeline = mymalloc2("PipelineBuffer", 2 * maxbytes + 1);
+
+    if(pipeline) {
+        petaio_save_blocks_pipelined(&bf, IOTable, selection, ptype_offset, ptype_count, pipeline, maxbytes, verbose);
+        myfree(pipeline);
+    }
+    else {
+        for(i = 0; i < IOTable->used; i ++) {
+            /* only process the particle blocks */
+            char blockname[128];
+            int ptype = IOTable->ent[i].ptype;
+            BigArray array = {0};
+            /*This exclude FOF blocks*/
+            if(!(ptype < 6 && ptype >= 0)) {
+                continue;
+            }
+            sprintf(blockname, "%d/%s", ptype, IOTable->ent[i].name);
+            petaio_build_buffer(&array, &IOTable->ent[i], selection + ptype_offset[ptype], ptype_count[ptype], P, SlotsManager);
+            petaio_save_iotable_block(&bf, blockname, &array, &IOTable->ent[i], verbose);
+            petaio_destroy_buffer(&array);
         }
-        sprintf(blockname, "%d/%s", ptype, IOTable->ent[i].name);
-        petaio_build_buffer(&array, &IOTable->ent[i], selection + ptype_offset[ptype], ptype_count[ptype], P, SlotsManager);
-        petaio_save_block(&bf, blockname, &array, verbose);
-        petaio_destroy_buffer(&array);
     }
 
+    int ptype;
+    for(ptype = 0; ptype < 6; ptype ++)
+        petaio_save_index(&bf, ptype, selection + ptype_offset[ptype], ptype_count[ptype], P);
+
     if(All.MassiveNuLinRespOn) {
         int ThisTask;
         MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
@@ -198,6 +699,109 @@ static void petaio_save_internal(char * fname, struct IOTable * IOTable, int ver
     myfree(selection);
 }
 
+/* Stage the particle blocks of a snapshot and start the writer thread.
+ * The file, header and blocks are created here, collectively, and the neutrino data is written directly.
+ * Returns 0, having written nothing, if any rank cannot allocate the staging memory.*/
+static int
+petaio_save_async_internal(char * fname, struct IOTable * IOTable)
+{
+    int ptype_offset[6]={0};
+    int ptype_count[6]={0};
+    int64_t NTotal[6]={0};
+    int i;
+
+    int * selection = mymalloc("Selection", sizeof(int) * PartManager->NumPart);
+
+    petaio_build_selection(selection, ptype_offset, ptype_count, P, PartManager->NumPart, NULL);
+
+    /* The staged data outlives this step, so it is allocated outside the main heap*/
+    size_t bytes = 0;
+    for(i = 0; i < IOTable->used; i ++) {
+        const int ptype = IOTable->ent[i].ptype;
+        if(!(ptype < 6 && ptype >= 0))
+            continue;
+        bytes += (size_t) ptype_count[ptype] * dtype_itemsize(IOTable->ent[i].dtype) * IOTable->ent[i].items;
+    }
+    /* With overcommit a successful malloc does not mean the memory exists, and the run would be
+     * killed while filling it. Budget the staging memory explicitly, and check that the node has
+     * it available now, on top of the part of the main heap which may not be resident yet.*/
+    int NTask, ThisTask;
+    MPI_Comm_size(MPI_COMM_WORLD, &NTask);
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    const double nodespertask = (double) cluster_get_num_hosts() / NTask;
+    const double budget = IO.AsyncSnapshotMemSizePerNode * 1024. * 1024. * nodespertask;
+    const double available = get_available_memory_bytes() * nodespertask - mymalloc_freebytes();
+    if(MPIU_Any(bytes > budget || bytes > available, MPI_COMM_WORLD)) {
+        message(0, "Staging the snapshot needs %td bytes on rank 0, over the budget of %g bytes or the %g bytes available. Writing synchronously.\n",
+                bytes, budget, available);
+        myfree(selection);
+        return 0;
+    }
+    char * staging = malloc(bytes + 1);
+    struct AsyncBlock * blocks = malloc(sizeof(struct AsyncBlock) * (IOTable->used + 1));
+    if(MPIU_Any(staging == NULL || blocks == NULL, MPI_COMM_WORLD)) {
+        message(0, "Could not allocate %td bytes outside the main heap to stage the snapshot. Writing synchronously.\n", bytes);
+        free(staging);
+        free(blocks);
+        myfree(selection);
+        return 0;
+    }
+
+    if(0 != big_file_mpi_create(&Async.bf, fname, MPI_COMM_WORLD)) {
+        endrun(0, "Failed to create snapshot at %s:%s\n", fname,
+                    big_file_get_error_message());
+    }
+
+    sumup_large_ints(6, ptype_count, NTotal);
+
+    petaio_write_header(&Async.bf, NTotal);
+
+    int nblocks = 0;
+    char * p = staging;
+    for(i = 0; i < IOTable->used; i ++) {
+        IOTableEntry * ent = &IOTable->ent[i];
+        const int ptype = ent->ptype;
+        if(!(ptype < 6 && ptype >= 0)) {
+            continue;
+        }
+        struct AsyncBlock * ab = &blocks[nblocks++];
+        p += petaio_fill_async_block(ab, p, ent, selection + ptype_offset[ptype], ptype_count[ptype]);
+        petaio_create_async_block(&Async.bf, ab, ent, 0);
+    }
+
+    /* The index is small, so it is written now*/
+    int ptype;
+    for(ptype = 0; ptype < 6; ptype ++)
+        petaio_save_index(&Async.bf, ptype, selection + ptype_offset[ptype], ptype_count[ptype], P);
+
+    if(All.MassiveNuLinRespOn) {
+        petaio_save_neutrinos(&Async.bf, ThisTask);
+    }
+
+    /* The fewest writers allowed for any block throttles the whole snapshot*/
+    int NumWriters = IO.NumWriters;
+    for(i = 0; i < nblocks; i ++)
+        if(blocks[i].bb.size > 0 && blocks[i].NumWriters < NumWriters)
+            NumWriters = blocks[i].NumWriters;
+    NumWriters = NumWriters < 1 ? 1 : NumWriters;
+
+    myfree(selection);
+
+    strncpy(Async.fname, fname, sizeof(Async.fname) - 1);
+    Async.blocks = blocks;
+    Async.nblocks = nblocks;
+    Async.staging = staging;
+    Async.rt = 0;
+    Async.wave = 0;
+    Async.nwaves = (NTask + NumWriters - 1) / NumWriters;
+    Async.mywave = ThisTask / NumWriters;
+    Async.written = 0;
+    if(0 != pthread_create(&Async.thread, NULL, petaio_async_writer, NULL))
+        endrun(1, "Failed to start the snapshot writer thread for %s\n", fname);
+    Async.pending = 1;
+    return 1;
+}
+
 void petaio_read_internal(char * fname, int ic, struct IOTable * IOTable, MPI_Comm Comm) {
     int ptype;
     int i;
@@ -231,11 +835,17 @@ void petaio_read_internal(char * fname, int ic, struct IOTable * IOTable, MPI_Co
     /*Allocate the particle memory*/
     particle_alloc_memory(MaxPart);
 
+    /* On restart, read particles close to where the domain decomposition will put them*/
+    struct PetaIORegion regions[6];
+    const int byregion = !ic && IO.RestartReadByKey && 0 == petaio_restart_regions(&bf, NTotal, MaxPart, regions, Comm);
+
     int NLocal[6];
     for(ptype = 0; ptype < 6; ptype ++) {
         int64_t start = ThisTask * NTotal[ptype] / NTask;
         int64_t end = (ThisTask + 1) * NTotal[ptype] / NTask;
         NLocal[ptype] = end - start;
+        if(byregion)
+            NLocal[ptype] = regions[ptype].nrows;
         PartManager->NumPart += NLocal[ptype];
     }
 
@@ -294,11 +904,20 @@ void petaio_read_internal(char * fname, int ic, struct IOTable * IOTable, MPI_Co
         }
         sprintf(blockname, "%d/%s", ptype, IOTable->ent[i].name);
         petaio_alloc_buffer(&array, &IOTable->ent[i], NLocal[ptype]);
-        if(0 == petaio_read_block(&bf, blockname, &array, IOTable->ent[i].required))
+        if(byregion) {
+            if(0 == petaio_read_region_throttled(&bf, blockname, &regions[ptype], &array, IOTable->ent[i].required, Comm))
+                petaio_readout_buffer(&array, &IOTable->ent[i]);
+        }
+        else if(0 == petaio_read_block(&bf, blockname, &array, IOTable->ent[i].required))
             petaio_readout_buffer(&array, &IOTable->ent[i]);
         petaio_destroy_buffer(&array);
     }
 
+    if(byregion) {
+        for(ptype = 5; ptype >= 0; ptype --)
+            petaio_free_region(&regions[ptype]);
+    }
+
     /*Read neutrinos from the snapshot if necessary*/
     if(All.MassiveNuLinRespOn) {
         /*Read the neutrino transfer function from the ICs*/
@@ -406,6 +1025,9 @@ static void petaio_write_header(BigFile * bf, const int64_t * NTotal) {
     }
 
     int dk = GetDensityKernelType();
+    /* The I/O setting, chosen by the calibration if IOCalibrate is set*/
+    int64_t bytesperfile = IO.BytesPerFile;
+    int64_t aggthreshold = IO.EnableAggregatedIO ? IO.AggregatedIOThreshold : 0;
     if(
     (0 != big_block_set_attr(&bh, "TotNumPart", NTotal, "u8", 6)) ||
     (0 != big_block_set_attr(&bh, "TotNumPartInit", All.NTotalInit, "u8", 6)) ||
@@ -425,7 +1047,11 @@ static void petaio_write_header(BigFile * bf, const int64_t * NTotal) {
     (0 != big_block_set_attr(&bh, "CodeVersion", GADGET_VERSION, "S1", strlen(GADGET_VERSION))) ||
     (0 != big_block_set_attr(&bh, "CompilerSettings", GADGET_COMPILER_SETTINGS, "S1", strlen(GADGET_COMPILER_SETTINGS))) ||
     (0 != big_block_set_attr(&bh, "DensityKernel", &dk, "i4", 1)) ||
-    (0 != big_block_set_attr(&bh, "HubbleParam", &All.CP.HubbleParam, "f8", 1)) ) {
+    (0 != big_block_set_attr(&bh, "HubbleParam", &All.CP.HubbleParam, "f8", 1)) ||
+    (0 != big_block_set_attr(&bh, "IONumWriters", &IO.NumWriters, "i4", 1)) ||
+    (0 != big_block_set_attr(&bh, "IOBytesPerFile", &bytesperfile, "i8", 1)) ||
+    (0 != big_block_set_attr(&bh, "IOAggregatedThreshold", &aggthreshold, "i8", 1)) ||
+    (0 != big_block_set_attr(&bh, "IOCalibratedGBps", &IO.CalibratedGBps, "f8", 1)) ) {
         endrun(0, "Failed to write attributes %s\n",
                     big_file_get_error_message());
     }
@@ -591,7 +1217,30 @@ petaio_build_buffer(BigArray * array, IOTableEntry * ent, const int * selection,
 
     /* don't forget to free buffer after its done*/
     petaio_alloc_buffer(array, ent, NumSelection);
+    petaio_fill_buffer(array, ent, selection, NumSelection, Parts, SlotsManager);
+}
 
+/* Fill the rows [start, end) of an allocated IO buffer for block from the selected particles. Serial.*/
+static void
+petaio_fill_rows(BigArray * array, IOTableEntry * ent, const int * selection, const int start, const int end, struct particle_data * Parts, struct slots_manager_type * SlotsManager)
+{
+    int i;
+    char * p = array->data;
+    p += array->strides[0] * start;
+    for(i = start; i < end; i ++) {
+        const int j = selection[i];
+        if(Parts[j].Type != ent->ptype) {
+            endrun(2, "Selection %d has type = %d != %d\n", j, Parts[j].Type, ent->ptype);
+        }
+        ent->getter(j, p, Parts, SlotsManager);
+        p += array->strides[0];
+    }
+}
+
+/* Fill an allocated IO buffer for block from the selected particles*/
+static void
+petaio_fill_buffer(BigArray * array, IOTableEntry * ent, const int * selection, const int NumSelection, struct particle_data * Parts, struct slots_manager_type * SlotsManager)
+{
     /* Fast code path if there are no such particles */
     if(NumSelection == 0) {
         return;
@@ -599,22 +1248,11 @@ petaio_build_buffer(BigArray * array, IOTableEntry * ent, const int * selection,
 
 #pragma omp parallel
     {
-        int i;
         const int tid = omp_get_thread_num();
         const int NT = omp_get_num_threads();
         const int start = NumSelection * (size_t) tid / NT;
         const int end = NumSelection * ((size_t) tid + 1) / NT;
-        /* fill the buffer */
-        char * p = array->data;
-        p += array->strides[0] * start;
-        for(i = start; i < end; i ++) {
-            const int j = selection[i];
-            if(Parts[j].Type != ent->ptype) {
-                endrun(2, "Selection %d has type = %d != %d\n", j, Parts[j].Type, ent->ptype);
-            }
-            ent->getter(j, p, Parts, SlotsManager);
-            p += array->strides[0];
-        }
+        petaio_fill_rows(array, ent, selection, start, end, Parts, SlotsManager);
     }
 }
 
@@ -648,64 +1286,602 @@ int petaio_read_block(BigFile * bf, char * blockname, BigArray * array, int requ
     return 0;
 }
 
+/* Compress a newly created block as set for its IOTable entry. Call on all ranks before writing.*/
+static void
+petaio_set_compression(BigBlock * bb, const IOTableEntry * ent)
+{
+    BigBlockCompression comp = {0};
+    if(ent && IO.SnapshotCompression) {
+        /* delta only acts on integers, so it is cheap to ask for it everywhere*/
+        comp.filters = BIG_BLOCK_FILTER_SHUFFLE | BIG_BLOCK_FILTER_DELTA;
+        comp.codec = IO.SnapshotCompression == 2 ? BIG_BLOCK_CODEC_ZLIB : BIG_BLOCK_CODEC_LZ;
+        if(ent->CompressError != 0) {
+            comp.filters |= BIG_BLOCK_FILTER_QUANTIZE;
+            comp.error = ent->CompressError;
+        }
+    }
+    if(0 != big_block_set_compression(bb, &comp)) {
+        endrun(0, "Failed to set compression of block %s: %s\n", bb->basename,
+                    big_file_get_error_message());
+    }
+}
+
 /* save a block to disk */
 void petaio_save_block(BigFile * bf, char * blockname, BigArray * array, int verbose)
 {
+    petaio_save_iotable_block(bf, blockname, array, NULL, verbose);
+}
 
-    BigBlock bb;
-    BigBlockPtr ptr;
-
+/* Create a block for the rows of array on all ranks, compressed as set for ent.
+ * Returns the number of files, and the number of concurrent writers in NumWriters. Collective.*/
+static int
+petaio_create_iotable_block(BigFile * bf, BigBlock * bb, char * blockname, BigArray * array, const IOTableEntry * ent, int * NumWriters, int verbose)
+{
     int elsize = big_file_dtype_itemsize(array->dtype);
 
-    int NumWriters = IO.NumWriters;
-
     size_t size = count_sum(array->dims[0]);
-    int NumFiles;
-
-    if(IO.EnableAggregatedIO) {
-        NumFiles = (size * elsize + IO.BytesPerFile - 1) / IO.BytesPerFile;
-        if(NumWriters > NumFiles * IO.WritersPerFile) {
-            NumWriters = NumFiles * IO.WritersPerFile;
-            message(0, "Throttling NumWriters to %d.\n", NumWriters);
-        }
-        if(NumWriters < IO.MinNumWriters) {
-            NumWriters = IO.MinNumWriters;
-            NumFiles = (NumWriters + IO.WritersPerFile - 1) / IO.WritersPerFile ;
-            message(0, "Throttling NumWriters to %d.\n", NumWriters);
-        }
-    } else {
-        NumFiles = NumWriters;
-    }
-    /*Do not write empty files*/
-    if(size == 0) {
-        NumFiles = 0;
-    }
+    int NumFiles = petaio_block_nfiles(size, elsize, NumWriters, 1);
 
     if(verbose && size > 0) {
         message(0, "Will write %td particles to %d Files for %s\n", size, NumFiles, blockname);
     }
     /* create the block */
     /* dims[1] is the number of members per item */
-    if(0 != big_file_mpi_create_block(bf, &bb, blockname, array->dtype, array->dims[1], NumFiles, size, MPI_COMM_WORLD)) {
+    if(0 != big_file_mpi_create_block(bf, bb, blockname, array->dtype, array->dims[1], NumFiles, size, MPI_COMM_WORLD)) {
         endrun(0, "Failed to create block at %s:%s\n", blockname,
                     big_file_get_error_message());
     }
-    if(0 != big_block_seek(&bb, &ptr, 0)) {
+    petaio_set_compression(bb, ent);
+    return NumFiles;
+}
+
+/* Write array to a block from petaio_create_iotable_block, NumWriters ranks at a time,
+ * record the throughput and close the block. Collective.*/
+static void
+petaio_write_iotable_block(BigBlock * bb, char * blockname, BigArray * array, const int NumFiles, const int NumWriters, int verbose)
+{
+    BigBlockPtr ptr;
+    int elsize = big_file_dtype_itemsize(array->dtype);
+    const size_t size = bb->size;
+
+    if(0 != big_block_seek(bb, &ptr, 0)) {
         endrun(0, "Failed to seek:%s\n", big_file_get_error_message());
     }
-    if(0 != big_block_mpi_write(&bb, &ptr, array, NumWriters, MPI_COMM_WORLD)) {
+    double twrite = MPI_Wtime();
+    if(0 != big_block_mpi_write(bb, &ptr, array, NumWriters, MPI_COMM_WORLD)) {
         endrun(0, "Failed to write :%s\n", big_file_get_error_message());
     }
+    twrite = MPI_Wtime() - twrite;
+    MPI_Allreduce(MPI_IN_PLACE, &twrite, 1, MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD);
+    /* Achieved throughput, to compare I/O settings between snapshots*/
+    double gbps = size * elsize * array->dims[1] / DMAX(twrite, 1e-6) / 1e9;
+    if(0 != big_block_set_attr(bb, "WriteGBps", &gbps, "f8", 1)) {
+        endrun(0, "Failed to write attributes %s\n", big_file_get_error_message());
+    }
 
     if(verbose && size > 0)
         message(0, "Done writing %td particles to %d Files\n", size, NumFiles);
 
-    if(0 != big_block_mpi_close(&bb, MPI_COMM_WORLD)) {
+    if(0 != big_block_mpi_close(bb, MPI_COMM_WORLD)) {
         endrun(0, "Failed to close block at %s:%s\n", blockname,
                 big_file_get_error_message());
     }
 }
 
+void
+petaio_save_iotable_block(BigFile * bf, char * blockname, BigArray * array, const IOTableEntry * ent, int verbose)
+{
+    BigBlock bb;
+    int NumWriters;
+    const int NumFiles = petaio_create_iotable_block(bf, &bb, blockname, array, ent, &NumWriters, verbose);
+    petaio_write_iotable_block(&bb, blockname, array, NumFiles, NumWriters, verbose);
+}
+
+/* Spatial index of the particle blocks.
+ * Every block of a type stores its rows in the same order, and the rows from one rank are
+ * in Peano order after slots_gc_sorted. For every PEANO_INDEX_CHUNK rows from a rank, the block
+ * "%d/PeanoKeyIndex" stores the first row, the number of rows and the smallest and largest
+ * Peano key of the saved positions, so that a sub-volume needs to read only the chunks overlapping it.*/
+#define PEANO_INDEX_CHUNK 32768
+
+static void
+petaio_save_index(BigFile * bf, int ptype, const int * selection, const int NumSelection, struct particle_data * Parts)
+{
+    const int64_t nchunk = (NumSelection + PEANO_INDEX_CHUNK - 1) / PEANO_INDEX_CHUNK;
+    int64_t local = NumSelection, offset = 0;
+    int ThisTask;
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    MPI_Exscan(&local, &offset, 1, MPI_INT64, MPI_SUM, MPI_COMM_WORLD);
+    /* MPI_Exscan leaves the first rank undefined */
+    if(ThisTask == 0)
+        offset = 0;
+
+    uint64_t * index = mymalloc("PeanoKeyIndex", sizeof(uint64_t) * 4 * (nchunk + 1));
+    int64_t c;
+    #pragma omp parallel for
+    for(c = 0; c < nchunk; c ++) {
+        const int start = c * PEANO_INDEX_CHUNK;
+        const int end = (c + 1) * PEANO_INDEX_CHUNK < NumSelection ? (c + 1) * PEANO_INDEX_CHUNK : NumSelection;
+        peano_t minkey = PEANOCELLS, maxkey = 0;
+        int i;
+        for(i = start; i < end; i ++) {
+            /* The key of the position as saved, without the random particle offset*/
+            double pos[3];
+            GTPosition(selection[i], pos, Parts, NULL);
+            const peano_t key = PEANO(pos, All.BoxSize);
+            if(key < minkey)
+                minkey = key;
+            if(key > maxkey)
+                maxkey = key;
+        }
+        index[4 * c] = offset + start;
+        index[4 * c + 1] = end - start;
+        index[4 * c + 2] = minkey;
+        index[4 * c + 3] = maxkey;
+    }
+
+    BigArray array = {0};
+    size_t dims[2] = {nchunk, 4};
+    big_array_init(&array, index, "u8", 2, dims, NULL);
+    char blockname[128];
+    sprintf(blockname, "%d/PeanoKeyIndex", ptype);
+    petaio_save_block(bf, blockname, &array, 0);
+    myfree(index);
+}
+
+static int
+order_by_minkey(const void * a, const void * b)
+{
+    const peano_t * ka = a, * kb = b;
+    return (ka[0] > kb[0]) - (ka[0] < kb[0]);
+}
+
+/* Read the spatial index of ptype with the serial bigfile API: 4 u8 per chunk.
+ * Returns NULL if there is no index. Free with myfree.*/
+static uint64_t *
+petaio_read_index(BigFile * bf, int ptype, int64_t * nchunk)
+{
+    char blockname[128];
+    BigBlock bb;
+    BigBlockPtr ptr;
+    sprintf(blockname, "%d/PeanoKeyIndex", ptype);
+    if(0 != big_file_open_block(bf, &bb, blockname))
+        return NULL;
+
+    *nchunk = bb.size;
+    uint64_t * index = mymalloc("PeanoKeyIndex", sizeof(uint64_t) * 4 * (*nchunk + 1));
+    BigArray array = {0};
+    size_t dims[2] = {*nchunk, 4};
+    big_array_init(&array, index, "u8", 2, dims, NULL);
+    if(0 != big_block_seek(&bb, &ptr, 0) || 0 != big_block_read(&bb, &ptr, &array)) {
+        endrun(1, "Failed to read %s: %s\n", blockname, big_file_get_error_message());
+    }
+    big_block_close(&bb);
+    return index;
+}
+
+/* Select the chunks of the index of ptype whose keys overlap any of the nkeys sorted,
+ * disjoint ranges in keys (pairs of smallest and largest key). Merges adjacent chunks.*/
+static int
+petaio_region_select(BigFile * bf, int ptype, const peano_t * keys, const int64_t nkeys, struct PetaIORegion * region)
+{
+    int64_t nchunk;
+    uint64_t * index = petaio_read_index(bf, ptype, &nchunk);
+    if(!index)
+        return 1;
+
+    region->nrange = 0;
+    region->nrows = 0;
+    /* The region lives longer than the index*/
+    region->start = mymalloc2("RegionStart", sizeof(int64_t) * (nchunk + 1));
+    region->count = mymalloc2("RegionCount", sizeof(int64_t) * (nchunk + 1));
+
+    /* Chunks from different ranks overlap in keys, but are in row order*/
+    int64_t c;
+    for(c = 0; c < nchunk; c ++) {
+        const peano_t minkey = index[4 * c + 2], maxkey = index[4 * c + 3];
+        /* First key range which does not end before the chunk starts*/
+        int64_t left = 0, right = nkeys;
+        while(right > left) {
+            int64_t mid = (left + right) / 2;
+            if(keys[2 * mid + 1] < minkey)
+                left = mid + 1;
+            else
+                right = mid;
+        }
+        if(left == nkeys || keys[2 * left] > maxkey || index[4 * c + 1] == 0)
+            continue;
+        const int64_t start = index[4 * c];
+        const int64_t count = index[4 * c + 1];
+        if(region->nrange > 0 && region->start[region->nrange - 1] + region->count[region->nrange - 1] == start) {
+            region->count[region->nrange - 1] += count;
+        } else {
+            region->start[region->nrange] = start;
+            region->count[region->nrange] = count;
+            region->nrange ++;
+        }
+        region->nrows += count;
+    }
+    myfree(index);
+    return 0;
+}
+
+int
+petaio_region_from_keys(BigFile * bf, int ptype, peano_t minkey, peano_t maxkey, struct PetaIORegion * region)
+{
+    const peano_t keys[2] = {minkey, maxkey};
+    return petaio_region_select(bf, ptype, keys, 1, region);
+}
+
+/* Most Peano cells enumerated to cover a box*/
+#define PEANO_REGION_MAXCELLS 4096
+
+int
+petaio_region_from_box(BigFile * bf, int ptype, const double low[3], const double high[3], struct PetaIORegion * region)
+{
+    BigBlock bh;
+    double BoxSize;
+    if(0 != big_file_open_block(bf, &bh, "Header"))
+        return 1;
+    if(0 != big_block_get_attr(&bh, "BoxSize", &BoxSize, "f8", 1))
+        endrun(1, "Failed to read BoxSize: %s\n", big_file_get_error_message());
+    big_block_close(&bh);
+
+    /* Cells of the keys of the corners, as in PEANO*/
+    const double fac = DomainFac(BoxSize * 1.001);
+    int ilow[3], ihigh[3];
+    int d;
+    for(d = 0; d < 3; d ++) {
+        const double lo = (DMAX(low[d], 0) + BoxSize / 2000) * fac;
+        const double hi = (DMIN(high[d], BoxSize) + BoxSize / 2000) * fac;
+        ilow[d] = DMIN(lo, (1 << BITS_PER_DIMENSION) - 1);
+        ihigh[d] = DMIN(hi, (1 << BITS_PER_DIMENSION) - 1);
+    }
+    /* The keys of a cell at level L are the keys starting with the L-bit key of the cell.
+     * Use the finest level that covers the box with few cells.*/
+    int level, shift = 0;
+    int64_t ncell = 1;
+    /* Always stops by level 4, which has 16 cells per side*/
+    for(level = BITS_PER_DIMENSION; level > 0; level --) {
+        shift = BITS_PER_DIMENSION - level;
+        ncell = 1;
+        for(d = 0; d < 3; d ++)
+            ncell *= (ihigh[d] >> shift) - (ilow[d] >> shift) + 1;
+        if(ncell <= PEANO_REGION_MAXCELLS)
+            break;
+    }
+
+    peano_t * keys = mymalloc("RegionKeys", sizeof(peano_t) * 2 * ncell);
+    int64_t nkeys = 0;
+    int x, y, z;
+    for(x = ilow[0] >> shift; x <= ihigh[0] >> shift; x ++)
+        for(y = ilow[1] >> shift; y <= ihigh[1] >> shift; y ++)
+            for(z = ilow[2] >> shift; z <= ihigh[2] >> shift; z ++) {
+                const peano_t key = peano_hilbert_key(x, y, z, level);
+                keys[2 * nkeys] = key << (3 * shift);
+                keys[2 * nkeys + 1] = ((key + 1) << (3 * shift)) - 1;
+                nkeys ++;
+            }
+    /* Sort and merge the key ranges of the cells*/
+    qsort(keys, nkeys, 2 * sizeof(peano_t), order_by_minkey);
+    int64_t i, nmerged = 0;
+    for(i = 0; i < nkeys; i ++) {
+        if(nmerged > 0 && keys[2 * i] <= keys[2 * (nmerged - 1) + 1] + 1) {
+            if(keys[2 * i + 1] > keys[2 * (nmerged - 1) + 1])
+                keys[2 * (nmerged - 1) + 1] = keys[2 * i + 1];
+            continue;
+        }
+        keys[2 * nmerged] = keys[2 * i];
+        keys[2 * nmerged + 1] = keys[2 * i + 1];
+        nmerged ++;
+    }
+    int rt = petaio_region_select(bf, ptype, keys, nmerged, region);
+    myfree(keys);
+    return rt;
+}
+
+int
+petaio_read_region(BigFile * bf, char * blockname, const struct PetaIORegion * region, BigArray * array)
+{
+    BigBlock bb;
+    BigBlockPtr ptr;
+    if(0 != big_file_open_block(bf, &bb, blockname))
+        return 1;
+    if(array->dims[0] != region->nrows)
+        endrun(1, "Buffer of %td rows for a region of %ld rows of %s\n", array->dims[0], region->nrows, blockname);
+
+    int64_t i;
+    char * p = array->data;
+    for(i = 0; i < region->nrange; i ++) {
+        BigArray sub = {0};
+        size_t dims[2] = {region->count[i], array->dims[1]};
+        ptrdiff_t strides[2] = {array->strides[0], array->strides[1]};
+        big_array_init(&sub, p, array->dtype, 2, dims, strides);
+        if(0 != big_block_seek(&bb, &ptr, region->start[i]) ||
+           0 != big_block_read(&bb, &ptr, &sub)) {
+            endrun(1, "Failed to read from block %s: %s\n", blockname, big_file_get_error_message());
+        }
+        p += region->count[i] * array->strides[0];
+    }
+    big_block_close(&bb);
+    return 0;
+}
+
+void
+petaio_free_region(struct PetaIORegion * region)
+{
+    myfree(region->count);
+    myfree(region->start);
+}
+
+/* A chunk of the spatial index, assigned to the rank which reads it on restart*/
+struct RestartChunk {
+    peano_t midkey;
+    int64_t start;
+    int64_t count;
+    int ptype;
+    int task;
+};
+
+static int
+order_by_midkey(const void * a, const void * b)
+{
+    const struct RestartChunk * ca = a, * cb = b;
+    return (ca->midkey > cb->midkey) - (ca->midkey < cb->midkey);
+}
+
+static int
+order_by_type_and_start(const void * a, const void * b)
+{
+    const struct RestartChunk * ca = a, * cb = b;
+    if(ca->ptype != cb->ptype)
+        return (ca->ptype > cb->ptype) - (ca->ptype < cb->ptype);
+    return (ca->start > cb->start) - (ca->start < cb->start);
+}
+
+/* Rank 0 reads the index of every type and assigns its chunks to ranks in Peano key order.
+ * Returns the number of chunks, or -1 if the index is missing or too coarse to balance the ranks
+ * within the memory petaio_read_internal reserves: MaxPart particles and the slots.*/
+static int64_t
+petaio_assign_restart_chunks(BigFile * bf, const int64_t * NTotal, const int MaxPart, struct RestartChunk ** chunks, const int NTask)
+{
+    int64_t tchunk[6] = {0};
+    int64_t nchunk = 0, ntot = 0;
+    int ptype;
+    for(ptype = 0; ptype < 6; ptype ++) {
+        char blockname[128];
+        BigBlock bb;
+        ntot += NTotal[ptype];
+        if(NTotal[ptype] == 0)
+            continue;
+        sprintf(blockname, "%d/PeanoKeyIndex", ptype);
+        if(0 != big_file_open_block(bf, &bb, blockname)) {
+            message(0, "Snapshot has no spatial index for type %d.\n", ptype);
+            return -1;
+        }
+        tchunk[ptype] = bb.size;
+        nchunk += bb.size;
+        big_block_close(&bb);
+    }
+
+    struct RestartChunk * ch = mymalloc("RestartChunks", sizeof(struct RestartChunk) * (nchunk + 1));
+    int64_t n = 0, c;
+    for(ptype = 0; ptype < 6; ptype ++) {
+        int64_t count = 0;
+        if(tchunk[ptype] == 0)
+            continue;
+        uint64_t * index = petaio_read_index(bf, ptype, &tchunk[ptype]);
+        for(c = 0; c < tchunk[ptype]; c ++) {
+            ch[n].start = index[4 * c];
+            ch[n].count = index[4 * c + 1];
+            ch[n].midkey = index[4 * c + 2] / 2 + index[4 * c + 3] / 2;
+            ch[n].ptype = ptype;
+            count += ch[n].count;
+            n ++;
+        }
+        myfree(index);
+        if(count != NTotal[ptype]) {
+            message(0, "Spatial index of type %d has %ld particles, not %ld.\n", ptype, count, NTotal[ptype]);
+            myfree(ch);
+            return -1;
+        }
+    }
+
+    /* All types share the split of the Peano curve, so that a rank gets all the particles of its segment*/
+    qsort_openmp(ch, nchunk, sizeof(struct RestartChunk), order_by_midkey);
+
+    /* Particles of each type read by each rank*/
+    int64_t * load = mymalloc("RestartLoad", sizeof(int64_t) * 6 * NTask);
+    memset(load, 0, sizeof(int64_t) * 6 * NTask);
+    int64_t cum = 0, maxload = 0, maxtype[6] = {0};
+    for(c = 0; c < nchunk; c ++) {
+        /* The rank of the middle particle of the chunk in an even split*/
+        int task = (cum + ch[c].count / 2) * NTask / ntot;
+        if(task >= NTask)
+            task = NTask - 1;
+        ch[c].task = task;
+        cum += ch[c].count;
+        load[6 * task + ch[c].ptype] += ch[c].count;
+    }
+    int task;
+    for(task = 0; task < NTask; task ++) {
+        int64_t tload = 0;
+        for(ptype = 0; ptype < 6; ptype ++) {
+            tload += load[6 * task + ptype];
+            if(load[6 * task + ptype] > maxtype[ptype])
+                maxtype[ptype] = load[6 * task + ptype];
+        }
+        if(tload > maxload)
+            maxload = tload;
+    }
+    myfree(load);
+
+    /* The particle table holds MaxPart particles. Keep half of the room beyond the mean
+     * for the exchange of the domain decomposition which follows the read.*/
+    const double mean = (double) ntot / NTask;
+    const double maxrows = mean + (MaxPart - mean) / 2;
+    /* Every rank reserves slots for PartAllocFactor times the largest count of each type on any rank,
+     * so an uneven split also costs slot memory on every rank. Bound it by the same factor,
+     * relative to the slots of the even split.*/
+    double slotbytes = 0, evenslotbytes = 0;
+    for(ptype = 0; ptype < 6; ptype ++) {
+        if(!SlotsManager->info[ptype].enabled)
+            continue;
+        slotbytes += (double) maxtype[ptype] * SlotsManager->info[ptype].elsize;
+        evenslotbytes += (double) ((NTotal[ptype] + NTask - 1) / NTask) * SlotsManager->info[ptype].elsize;
+    }
+    if(maxload > maxrows || slotbytes > maxrows / mean * evenslotbytes) {
+        message(0, "Spatial index is too coarse: a rank would read %ld particles (at most %g fit), the mean is %g; slots %g of %g bytes.\n",
+                maxload, maxrows, mean, slotbytes, maxrows / mean * evenslotbytes);
+        myfree(ch);
+        return -1;
+    }
+    *chunks = ch;
+    return nchunk;
+}
+
+/* On restart, split the particles among ranks by Peano key instead of by row: each rank reads the whole
+ * chunks of the spatial index of a compact segment of the Peano curve, the same segment for all types.
+ * The domain decomposition after the read then only exchanges the particles near the segment boundaries,
+ * instead of almost all of them. Collective.
+ * Returns 1 if the snapshot has no usable index, in which case the rows are split evenly.*/
+static int
+petaio_restart_regions(BigFile * bf, const int64_t * NTotal, const int MaxPart, struct PetaIORegion * regions, MPI_Comm Comm)
+{
+    int NTask, ThisTask;
+    MPI_Comm_size(Comm, &NTask);
+    MPI_Comm_rank(Comm, &ThisTask);
+
+    struct RestartChunk * chunks = NULL;
+    int64_t nchunk = 0;
+    if(ThisTask == 0)
+        nchunk = petaio_assign_restart_chunks(bf, NTotal, MaxPart, &chunks, NTask);
+    MPI_Bcast(&nchunk, 1, MPI_INT64, 0, Comm);
+    if(nchunk < 0)
+        return 1;
+
+    /* Send each rank only its own chunks. The tasks increase along the Peano order
+     * in which the chunks were assigned, so the chunks of a rank are contiguous.*/
+    int * sendcounts = NULL, * displs = NULL;
+    if(ThisTask == 0) {
+        if(nchunk >= INT_MAX)
+            endrun(1, "Spatial index has %ld chunks, too many to scatter.\n", nchunk);
+        sendcounts = ta_malloc("sendcounts", int, NTask);
+        displs = ta_malloc("displs", int, NTask);
+        memset(sendcounts, 0, sizeof(int) * NTask);
+        int64_t c;
+        for(c = 0; c < nchunk; c ++) {
+            if(c > 0 && chunks[c].task < chunks[c-1].task)
+                endrun(1, "Restart chunk %ld of task %d follows task %d\n", c, chunks[c].task, chunks[c-1].task);
+            sendcounts[chunks[c].task] ++;
+        }
+        displs[0] = 0;
+        int task;
+        for(task = 1; task < NTask; task ++)
+            displs[task] = displs[task - 1] + sendcounts[task - 1];
+    }
+    int nmine;
+    MPI_Scatter(sendcounts, 1, MPI_INT, &nmine, 1, MPI_INT, 0, Comm);
+
+    MPI_Datatype MPI_TYPE_CHUNK;
+    MPI_Type_contiguous(sizeof(struct RestartChunk), MPI_BYTE, &MPI_TYPE_CHUNK);
+    MPI_Type_commit(&MPI_TYPE_CHUNK);
+    /* The chunks of rank 0 come first, so it keeps them in place*/
+    if(ThisTask == 0) {
+        MPI_Scatterv(chunks, sendcounts, displs, MPI_TYPE_CHUNK, MPI_IN_PLACE, nmine, MPI_TYPE_CHUNK, 0, Comm);
+        myfree(displs);
+        myfree(sendcounts);
+    }
+    else {
+        chunks = mymalloc("RestartChunks", sizeof(struct RestartChunk) * (nmine + 1));
+        MPI_Scatterv(NULL, NULL, NULL, MPI_TYPE_CHUNK, chunks, nmine, MPI_TYPE_CHUNK, 0, Comm);
+    }
+    MPI_Type_free(&MPI_TYPE_CHUNK);
+
+    /* Keep our chunks in row order*/
+    qsort_openmp(chunks, nmine, sizeof(struct RestartChunk), order_by_type_and_start);
+
+    int64_t c;
+
+    int ptype;
+    c = 0;
+    for(ptype = 0; ptype < 6; ptype ++) {
+        struct PetaIORegion * region = &regions[ptype];
+        int64_t end = c;
+        while(end < nmine && chunks[end].ptype == ptype)
+            end ++;
+        region->nrange = 0;
+        region->nrows = 0;
+        region->start = mymalloc2("RegionStart", sizeof(int64_t) * (end - c + 1));
+        region->count = mymalloc2("RegionCount", sizeof(int64_t) * (end - c + 1));
+        for(; c < end; c ++) {
+            if(region->nrange > 0 && region->start[region->nrange - 1] + region->count[region->nrange - 1] == chunks[c].start) {
+                region->count[region->nrange - 1] += chunks[c].count;
+            } else {
+                region->start[region->nrange] = chunks[c].start;
+                region->count[region->nrange] = chunks[c].count;
+                region->nrange ++;
+            }
+            region->nrows += chunks[c].count;
+        }
+    }
+    myfree(chunks);
+    return 0;
+}
+
+/* Read the region of a block on every rank, with at most NumWriters ranks reading at once.
+ * Returns 1 if the block does not exist.*/
+static int
+petaio_read_region_throttled(BigFile * bf, char * blockname, const struct PetaIORegion * region, BigArray * array, int required, MPI_Comm Comm)
+{
+    int NTask, ThisTask;
+    MPI_Comm_size(Comm, &NTask);
+    MPI_Comm_rank(Comm, &ThisTask);
+    const int nwaves = (NTask + IO.NumWriters - 1) / IO.NumWriters;
+    int wave, rt = 0;
+    for(wave = 0; wave < nwaves; wave ++) {
+        if(ThisTask % nwaves == wave)
+            rt = petaio_read_region(bf, blockname, region, array);
+        MPI_Barrier(Comm);
+    }
+    if(MPIU_Any(rt, Comm)) {
+        if(required)
+            endrun(0, "Failed to open block at %s:%s\n", blockname, big_file_get_error_message());
+        return 1;
+    }
+    return 0;
+}
+
+/* Decide the number of files and of concurrent writers for a block of size items of elsize bytes*/
+static int
+petaio_block_nfiles(const size_t size, const int elsize, int * NumWriters, int verbose)
+{
+    int NumFiles;
+    *NumWriters = IO.NumWriters;
+
+    if(IO.EnableAggregatedIO) {
+        NumFiles = (size * elsize + IO.BytesPerFile - 1) / IO.BytesPerFile;
+        if(*NumWriters > NumFiles * IO.WritersPerFile) {
+            *NumWriters = NumFiles * IO.WritersPerFile;
+            if(verbose)
+                message(0, "Throttling NumWriters to %d.\n", *NumWriters);
+        }
+        if(*NumWriters < IO.MinNumWriters) {
+            *NumWriters = IO.MinNumWriters;
+            NumFiles = (*NumWriters + IO.WritersPerFile - 1) / IO.WritersPerFile ;
+            if(verbose)
+                message(0, "Throttling NumWriters to %d.\n", *NumWriters);
+        }
+    } else {
+        NumFiles = *NumWriters;
+    }
+    /*Do not write empty files*/
+    if(size == 0) {
+        NumFiles = 0;
+    }
+    return NumFiles;
+}
+
 /*
  * register an IO block of name for particle type ptype.
  *
@@ -744,9 +1920,17 @@ void io_register_io_block(char * name,
     ent->setter = setter;
     ent->items = items;
     ent->required = required;
+    ent->CompressError = 0;
     IOTable->used ++;
 }
 
+/* Allow lossy compression of the block registered last, within error (negative for a relative bound)*/
+static void
+io_lossy_compression(double error, struct IOTable * IOTable)
+{
+    IOTable->ent[IOTable->used - 1].CompressError = error;
+}
+
 static void GTPosition(int i, double * out, void * baseptr, void * smanptr) {
     /* Remove the particle offset before saving*/
     struct particle_data * part = (struct particle_data *) baseptr;
@@ -877,37 +2061,37 @@ static void GTBlackholeMinPotPos(int i, double * out, void * baseptr, void * sma
 /*This is only used if FoF is enabled*/
 SIMPLE_GETTER(GTGroupID, GrNr, uint32_t, 1, struct particle_data)
 static void GTNeutralHydrogenFraction(int i, float * out, void * baseptr, void * smanptr) {
-    double redshift = 1./All.Time - 1;
+    const struct GlobalUVBG * GlobalUVBG = get_global_uvbg_cache(1./All.Time - 1);
     struct particle_data * pl = ((struct particle_data *) baseptr)+i;
     int PI = pl->PI;
     struct slot_info * info = &(((struct slots_manager_type *) smanptr)->info[0]);
     struct sph_particle_data * sl = (struct sph_particle_data *) info->ptr;
-    *out = get_neutral_fraction_sfreff(redshift, pl, sl+PI);
+    *out = get_neutral_fraction_sfreff(GlobalUVBG, pl, sl+PI);
 }
 
 static void GTHeliumIFraction(int i, float * out, void * baseptr, void * smanptr) {
-    double redshift = 1./All.Time - 1;
+    const struct GlobalUVBG * GlobalUVBG = get_global_uvbg_cache(1./All.Time - 1);
     struct particle_data * pl = ((struct particle_data *) baseptr)+i;
     int PI = pl->PI;
     struct slot_info * info = &(((struct slots_manager_type *) smanptr)->info[0]);
     struct sph_particle_data * sl = (struct sph_particle_data *) info->ptr;
-    *out = get_helium_neutral_fraction_sfreff(0, redshift, pl, sl+PI);
+    *out = get_helium_neutral_fraction_sfreff(0, GlobalUVBG, pl, sl+PI);
 }
 static void GTHeliumIIFraction(int i, float * out, void * baseptr, void * smanptr) {
-    double redshift = 1./All.Time - 1;
+    const struct GlobalUVBG * GlobalUVBG = get_global_uvbg_cache(1./All.Time - 1);
     struct particle_data * pl = ((struct particle_data *) baseptr)+i;
     int PI = pl->PI;
     struct slot_info * info = &(((struct slots_manager_type *) smanptr)->info[0]);
     struct sph_particle_data * sl = (struct sph_particle_data *) info->ptr;
-    *out = get_helium_neutral_fraction_sfreff(1, redshift, pl, sl+PI);
+    *out = get_helium_neutral_fraction_sfreff(1, GlobalUVBG, pl, sl+PI);
 }
 static void GTHeliumIIIFraction(int i, float * out, void * baseptr, void * smanptr) {
-    double redshift = 1./All.Time - 1;
+    const struct GlobalUVBG * GlobalUVBG = get_global_uvbg_cache(1./All.Time - 1);
     struct particle_data * pl = ((struct particle_data *) baseptr)+i;
     int PI = pl->PI;
     struct slot_info * info = &(((struct slots_manager_type *) smanptr)->info[0]);
     struct sph_particle_data * sl = (struct sph_particle_data *) info->ptr;
-    *out = get_helium_neutral_fraction_sfreff(2, redshift, pl, sl+PI);
+    *out = get_helium_neutral_fraction_sfreff(2, GlobalUVBG, pl, sl+PI);
 }
 static void GTInternalEnergy(int i, float * out, void * baseptr, void * smanptr) {
     int PI = ((struct particle_data *) baseptr)[i].PI;
@@ -973,6 +2157,7 @@ void register_io_blocks(struct IOTable * IOTable, int WriteGroupID) {
         IO_REG(Mass,     "f4", 1, i, IOTable);
         IO_REG(Position, "f8", 3, i, IOTable);
         IO_REG(Velocity, "f4", 3, i, IOTable);
+        io_lossy_compression(IO.CompressVelocityError, IOTable);
         IO_REG(ID,       "u8", 1, i, IOTable);
         if(All.OutputPotential)
             IO_REG_WRONLY(Potential, "f4", 1, i, IOTable);
@@ -985,23 +2170,33 @@ void register_io_blocks(struct IOTable * IOTable, int WriteGroupID) {
     IO_REG(Generation,       "u1", 1, 5, IOTable);
     /* Bare Bone SPH*/
     IO_REG(SmoothingLength,  "f4", 1, 0, IOTable);
+    io_lossy_compression(-IO.CompressSphRelError, IOTable);
     IO_REG(Density,          "f4", 1, 0, IOTable);
+    io_lossy_compression(-IO.CompressSphRelError, IOTable);
 
-    if(DensityIndependentSphOn())
+    if(DensityIndependentSphOn()) {
         IO_REG(EgyWtDensity,          "f4", 1, 0, IOTable);
+        io_lossy_compression(-IO.CompressSphRelError, IOTable);
+    }
 
     /* On reload this sets the Entropy variable, need the densities.
      * Register this after Density and EgyWtDensity will ensure density is read
      * before this. */
     IO_REG(InternalEnergy,   "f4", 1, 0, IOTable);
+    io_lossy_compression(-IO.CompressSphRelError, IOTable);
 
     /* Cooling */
     IO_REG(ElectronAbundance,       "f4", 1, 0, IOTable);
+    io_lossy_compression(-IO.CompressSphRelError, IOTable);
     IO_REG_WRONLY(NeutralHydrogenFraction, "f4", 1, 0, IOTable);
+    io_lossy_compression(-IO.CompressSphRelError, IOTable);
     if(All.OutputHeliumFractions) {
         IO_REG_WRONLY(HeliumIFraction, "f4", 1, 0, IOTable);
+        io_lossy_compression(-IO.CompressSphRelError, IOTable);
         IO_REG_WRONLY(HeliumIIFraction, "f4", 1, 0, IOTable);
+        io_lossy_compression(-IO.CompressSphRelError, IOTable);
         IO_REG_WRONLY(HeliumIIIFraction, "f4", 1, 0, IOTable);
+        io_lossy_compression(-IO.CompressSphRelError, IOTable);
     }
     /* Marks whether a particle has been HeIII ionized yet*/
     IO_REG_NONFATAL(HeIIIIonized, "u1", 1, 0, IOTable);
@@ -20,6 +20,8 @@ typedef struct IOTableEntry {
     int required;
     property_getter getter;
     property_setter setter;
+    /* Error bound of the lossy compression of this block, see BigBlockCompression. 0 is lossless.*/
+    double CompressError;
 } IOTableEntry;
 
 struct IOTable {
@@ -40,16 +42,54 @@ void destroy_io_blocks(struct IOTable * IOTable);
 void set_petaio_params(ParameterSet *ps);
 int GetUsePeculiarVelocity(void);
 void petaio_init();
+/* Measure the file system throughput and pick the fastest I/O setting. Collective.*/
+void petaio_calibrate(const char * OutputDir);
 void petaio_alloc_buffer(BigArray * array, IOTableEntry * ent, int64_t npartLocal);
 void petaio_build_buffer(BigArray * array, IOTableEntry * ent, const int * selection, const int NumSelection, struct particle_data * Parts, struct slots_manager_type * SlotsManager);
 void petaio_readout_buffer(BigArray * array, IOTableEntry * ent);
 void petaio_destroy_buffer(BigArray * array);
 
 void petaio_save_block(BigFile * bf, char * blockname, BigArray * array, int verbose);
+/* Save a block registered in an IOTable, compressed as set by SnapshotCompression.*/
+void petaio_save_iotable_block(BigFile * bf, char * blockname, BigArray * array, const IOTableEntry * ent, int verbose);
 int petaio_read_block(BigFile * bf, char * blockname, BigArray * array, int required);
 
 void petaio_save_snapshot(struct IOTable * IOTable, int verbose, const char *fmt, ...);
+/* If AsyncSnapshotWrite is set, copy the snapshot to a staging buffer and write it from a background thread.
+ * Returns 1 if the write is in flight: petaio_finish_async_write must then be called before the snapshot is used.
+ * Returns 0 if the snapshot was written synchronously: this happens if there is not enough memory to stage it.*/
+int petaio_save_snapshot_async(struct IOTable * IOTable, const char *fmt, ...);
+/* Start the next wave of writers of a background snapshot write once the current wave is done on every rank.
+ * Collective and cheap: call it every timestep.*/
+void petaio_progress_async_write(void);
+/* Wait for a background snapshot write to finish and close the file.
+ * Collective. Returns 1 if a write was pending.*/
+int petaio_finish_async_write(void);
 void petaio_read_snapshot(int num, MPI_Comm Comm);
+/* Read the particles of the snapshot fname into a new particle table, with the blocks of IOTable.
+ * ic = 1 reads only the blocks needed from initial conditions. Collective.*/
+void petaio_read_internal(char * fname, int ic, struct IOTable * IOTable, MPI_Comm Comm);
+
+/* Rows of one particle type in a snapshot, selected with its spatial index.*/
+struct PetaIORegion {
+    int64_t nrange;
+    int64_t * start; /* First row of each range of rows, increasing*/
+    int64_t * count; /* Number of rows in each range*/
+    int64_t nrows; /* Total number of rows*/
+};
+
+/* Select the rows of particle type ptype which may have a Peano key (see PEANO) in [minkey, maxkey].
+ * These functions are not collective: each rank may read its own region.
+ * They return 1 if the snapshot has no spatial index.*/
+int petaio_region_from_keys(BigFile * bf, int ptype, peano_t minkey, peano_t maxkey, struct PetaIORegion * region);
+/* Select the rows of particle type ptype which may lie in the box [low, high] of the saved positions.
+ * Periodic boxes that wrap should be split.*/
+int petaio_region_from_box(BigFile * bf, int ptype, const double low[3], const double high[3], struct PetaIORegion * region);
+/* Read the rows of a region from a block into an array of region->nrows rows, eg from petaio_alloc_buffer.
+ * Returns 1 if the block does not exist.*/
+int petaio_read_region(BigFile * bf, char * blockname, const struct PetaIORegion * region, BigArray * array);
+/* Free a region. Buffers allocated after the region must be freed first.*/
+void petaio_free_region(struct PetaIORegion * region);
 void petaio_read_header(int num);
 
 void
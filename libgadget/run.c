@@ -126,7 +126,7 @@ int begrun(int RestartFlag, int RestartSnapNum)
     set_random_numbers(All.RandomSeed);
 
     if(All.LightconeOn)
-        lightcone_init(&All.CP, All.Time);
+        lightcone_init(&All.CP, All.Time, RestartSnapNum);
     return RestartSnapNum;
 }
 
@@ -171,6 +171,9 @@ run(int RestartSnapNum)
 
     while(1) /* main loop */
     {
+        /* Let the next ranks write their part of a snapshot being written in the background*/
+        petaio_progress_async_write();
+
         /* Find next synchronization point and the timebins active during this timestep.
          *
          * Note that on startup, P[i].TimeBin == 0 for all particles,
@@ -181,7 +184,7 @@ run(int RestartSnapNum)
 
         /* Compute the list of particles that cross a lightcone and write it to disc.*/
         if(All.LightconeOn)
-            lightcone_compute(All.Time, &All.CP, All.Ti_Current, Ti_Next);
+            lightcone_compute(All.Time, &All.CP, All.Ti_Current, Ti_Next, ddecomp);
 
         All.Ti_Current = Ti_Next;
 
@@ -301,8 +304,13 @@ run(int RestartSnapNum)
             if (is_PM && ((All.BlackHoleOn && All.Time >= TimeNextSeedingCheck) ||
                 (during_helium_reionization(1/All.Time - 1) && need_change_helium_ionization_fraction(All.Time)))) {
 
-                /* Seeding */
-                FOFGroups fof = fof_fof(&Tree, MPI_COMM_WORLD);
+                /* Seeding: the spherical overdensity properties are not needed,
+                 * and a density restricted FOF is enough unless the quasar bubbles also need the groups.*/
+                FOFGroups fof;
+                if(during_helium_reionization(1/All.Time - 1))
+                    fof = fof_fof(&Tree, NULL, All.Time, MPI_COMM_WORLD);
+                else
+                    fof = fof_fof_seed(&Tree, MPI_COMM_WORLD);
                 if(All.BlackHoleOn && All.Time >= TimeNextSeedingCheck) {
                     fof_seed(&fof, &Tree, &Act, MPI_COMM_WORLD);
                     TimeNextSeedingCheck = All.Time * All.TimeBetweenSeedingSearch;
@@ -370,7 +378,7 @@ run(int RestartSnapNum)
                 }
                 force_tree_rebuild(&Tree, ddecomp, All.BoxSize, HybridNuGrav, 0, All.OutputDir);
             }
-            fof = fof_fof(&Tree, MPI_COMM_WORLD);
+            fof = fof_fof(&Tree, &All.CP, All.Time, MPI_COMM_WORLD);
         }
 
         /* We don't need this timestep's tree anymore.*/
@@ -378,6 +386,9 @@ run(int RestartSnapNum)
 
         /* WriteFOF just reminds the checkpoint code to save GroupID*/
         write_checkpoint(SnapshotFileCount, WriteSnapshot, WriteFOF, All.Time, All.OutputDir, All.SnapshotFileBase, All.OutputDebugFields);
+        /* A run restarted from the snapshot carries on with the lightcone maps of the shell in progress*/
+        if(All.LightconeOn && WriteSnapshot)
+            lightcone_save_maps(SnapshotFileCount);
 
         /* Save FOF tables after checkpoint so that if there is a FOF save bug we have particle tables available to debug it*/
         if(WriteFOF) {
@@ -414,6 +425,9 @@ run(int RestartSnapNum)
         free_activelist(&Act);
     }
 
+    /* Do not exit with a snapshot still being written*/
+    finish_checkpoint();
+
     close_outputfiles();
 }
 
@@ -194,7 +194,7 @@ runfof(int RestartSnapNum)
     /*FoF needs a tree*/
     int HybridNuGrav = All.HybridNeutrinosOn && All.Time <= All.HybridNuPartTime;
     force_tree_rebuild(&Tree, ddecomp, All.BoxSize, HybridNuGrav, 0, All.OutputDir);
-    FOFGroups fof = fof_fof(&Tree, MPI_COMM_WORLD);
+    FOFGroups fof = fof_fof(&Tree, &All.CP, All.Time, MPI_COMM_WORLD);
     force_tree_free(&Tree);
     fof_save_groups(&fof, RestartSnapNum, MPI_COMM_WORLD);
     fof_finish(&fof);
@@ -74,12 +74,12 @@ int get_generations(void)
 }
 
 /*Cooling only: no star formation*/
-static void cooling_direct(int i, const double a3inv, const double hubble);
+static void cooling_direct(const int * queue, const int n, const double a3inv, const double hubble, const struct GlobalUVBG * GlobalUVBG);
 
-static void cooling_relaxed(int i, double dtime, const double a3inv, struct sfr_eeqos_data sfr_data);
+static void cooling_relaxed(int i, double dtime, const double a3inv, struct sfr_eeqos_data sfr_data, const struct GlobalUVBG * GlobalUVBG);
 
 static int make_particle_star(int child, int parent, int placement);
-static int starformation(int i, double *localsfr, double * sum_sm, MyFloat * GradRho, const double a3inv, const double hubble);
+static int starformation(int i, double *localsfr, double * sum_sm, MyFloat * GradRho, const double a3inv, const double hubble, const struct GlobalUVBG * GlobalUVBG);
 static int quicklyastarformation(int i, const double a3inv);
 static double get_sfr_factor_due_to_selfgravity(int i);
 static double get_sfr_factor_due_to_h2(int i, MyFloat * GradRho);
@@ -87,7 +87,7 @@ static double get_starformation_rate_full(int i, MyFloat * GradRho, struct sfr_e
 static double get_egyeff(double redshift, double dens, struct UVBG * uvbg);
 static double find_star_mass(int i);
 /*Get enough memory for new star slots. This may be excessively slow! Don't do it too often.*/
-static int * sfr_reserve_slots(ActiveParticles * act, int * NewStars, int NumNewStar, ForceTree * tt);
+static void sfr_reserve_slots(ActiveParticles * act, int NumNewStar, ForceTree * tt);
 
 /*Set the parameters of the SFR module*/
 void set_sfr_params(ParameterSet * ps)
@@ -124,6 +124,29 @@ void set_sfr_params(ParameterSet * ps)
 }
 
 
+/* Number of star slots a thread reserves from the pool at once*/
+#define STAR_SLOT_CHUNK 16
+
+/* Upper bound on the number of stars formed this step: each gas particle
+ * forms at most one star, and only above the star formation density thresholds.*/
+static int
+sfr_max_new_stars(ActiveParticles * act, const int nactive, const double a3inv)
+{
+    int i, nmax = 0;
+    #pragma omp parallel for reduction(+: nmax)
+    for(i = 0; i < nactive; i++) {
+        const int p_i = act->ActiveParticle ? act->ActiveParticle[i] : i;
+        if(P[p_i].Type != 0 || P[p_i].IsGarbage || P[p_i].Mass <= 0)
+            continue;
+        if(SPHP(p_i).Density < sfr_params.OverDensThresh)
+            continue;
+        if(sfr_params.QuickLymanAlphaProbability == 0 && SPHP(p_i).Density * a3inv < sfr_params.PhysDensThresh)
+            continue;
+        nmax++;
+    }
+    return nmax;
+}
+
 /* cooling and star formation routine.*/
 void
 cooling_and_starformation(ActiveParticles * act, ForceTree * tree, MyFloat * GradRho, FILE * FdSfr)
@@ -132,19 +155,32 @@ cooling_and_starformation(ActiveParticles * act, ForceTree * tree, MyFloat * Gra
         return;
 
     const int nthreads = omp_get_max_threads();
-    /*This is a queue for the new stars and their parents, so we can reallocate the slots after the main cooling loop.*/
+    /*This is a queue for the new stars, used by the wind model.*/
     int * NewStars = NULL;
-    int * NewParents = NULL;
     int NumNewStar = 0;
-    size_t *nqthrsfr = ta_malloc("nqthrsfr", size_t, nthreads);
-    int **thrqueuesfr = ta_malloc("thrqueuesfr", int *, nthreads);
-    int **thrqueueparent = ta_malloc("thrqueueparent", int *, nthreads);
 
     /*Need to capture this so that when NumActiveParticle increases during the loop
      * we don't add extra loop iterations on particles with invalid slots.*/
     const int nactive = act->NumActiveParticle;
     const double a3inv = 1./(All.Time * All.Time * All.Time);
     const double hubble = hubble_function(&All.CP, All.Time);
+    /* UV background for this step, shared by every particle*/
+    const struct GlobalUVBG * GlobalUVBG = get_global_uvbg_cache(1./All.Time - 1);
+
+    /* Grow the star slots so that every star which could form this step has one,
+     * including the partly used block of each thread. This must happen before anything
+     * else is allocated, as the tree and active list may need to move.*/
+    if(All.StarformationOn) {
+        int MaxNewStars = sfr_max_new_stars(act, nactive, a3inv) + nthreads * STAR_SLOT_CHUNK;
+        if(SlotsManager->info[4].size + MaxNewStars >= SlotsManager->info[4].maxsize)
+            sfr_reserve_slots(act, MaxNewStars, tree);
+    }
+
+    size_t *nqthrsfr = ta_malloc("nqthrsfr", size_t, nthreads);
+    int **thrqueuesfr = ta_malloc("thrqueuesfr", int *, nthreads);
+    /* Each thread takes star slots from its own block*/
+    struct slots_chunk * StarChunks = ta_malloc("StarChunks", struct slots_chunk, nthreads);
+    memset(StarChunks, 0, nthreads * sizeof(struct slots_chunk));
 
     if(All.StarformationOn) {
         /* Need 1 extra for non-integer part and 1 extra
@@ -152,21 +188,28 @@ cooling_and_starformation(ActiveParticles * act, ForceTree * tree, MyFloat * Gra
         int narr = nactive/nthreads+nthreads;
         NewStars = mymalloc("NewStars", narr * sizeof(int) * nthreads);
         gadget_setup_thread_arrays(NewStars, thrqueuesfr, nqthrsfr, narr, nthreads);
-        NewParents = mymalloc2("NewParents", narr * sizeof(int) * nthreads);
-        gadget_setup_thread_arrays(NewParents, thrqueueparent, nqthrsfr, narr, nthreads);
     }
 
+    /* Queue of the particles which are cooling, not forming stars.*/
+    int narrcool = nactive/nthreads+nthreads;
+    size_t *nqthrcool = ta_malloc("nqthrcool", size_t, nthreads);
+    int **thrqueuecool = ta_malloc("thrqueuecool", int *, nthreads);
+    int * CoolQueue = mymalloc2("CoolQueue", narrcool * sizeof(int) * nthreads);
+    gadget_setup_thread_arrays(CoolQueue, thrqueuecool, nqthrcool, narrcool, nthreads);
+
     double sum_sm = 0, sum_mass_stars = 0, localsfr = 0;
+    int stars_converted=0, stars_spawned=0;
 
-    /* First decide which stars are cooling and which starforming. If star forming we add them to a list.
-     * Note the dynamic scheduling: individual particles may have very different loop iteration lengths.
-     * Cooling is much slower than sfr. I tried splitting it into a separate loop instead, but this was faster.*/
-    #pragma omp parallel reduction(+:localsfr) reduction(+: sum_sm) reduction(+:sum_mass_stars)
+    /* First decide which stars are cooling and which starforming. Star forming particles
+     * are turned into stars straight away, using slots from the thread's own block.
+     * Cooling particles are added to a separate queue and cooled in batches afterwards.*/
+    #pragma omp parallel reduction(+:localsfr) reduction(+: sum_sm) reduction(+:sum_mass_stars) reduction(+:stars_converted) reduction(+:stars_spawned)
     {
         int i;
         const int tid = omp_get_thread_num();
 
-        for(i=tid; i < nactive; i+=nthreads)
+        #pragma omp for schedule(static)
+        for(i=0; i < nactive; i++)
         {
             /*Use raw particle number if active_set is null, otherwise use active_set*/
             const int p_i = act->ActiveParticle ? act->ActiveParticle[i] : i;
@@ -192,73 +235,59 @@ cooling_and_starformation(ActiveParticles * act, ForceTree * tree, MyFloat * Gra
                     newstar = p_i;
                     sum_sm += P[i].Mass;
                 } else {
-                    newstar = starformation(p_i, &localsfr, &sum_sm, GradRho, a3inv, hubble);
+                    newstar = starformation(p_i, &localsfr, &sum_sm, GradRho, a3inv, hubble, GlobalUVBG);
                 }
-                /*Add this particle to the stellar conversion queue if necessary.*/
+                /*Make the star and add it to the queue for the wind model.*/
                 if(newstar >= 0) {
-                    int tid = omp_get_thread_num();
+                    make_particle_star(newstar, p_i, slots_chunk_get(&StarChunks[tid], STAR_SLOT_CHUNK, 4, SlotsManager));
+                    sum_mass_stars += P[newstar].Mass;
+                    if(newstar == p_i)
+                        stars_converted++;
+                    else
+                        stars_spawned++;
                     thrqueuesfr[tid][nqthrsfr[tid]] = newstar;
-                    thrqueueparent[tid][nqthrsfr[tid]] = p_i;
                     nqthrsfr[tid]++;
                 }
             }
-            else
-                cooling_direct(p_i, a3inv, hubble);
+            else {
+                thrqueuecool[tid][nqthrcool[tid]] = p_i;
+                nqthrcool[tid]++;
+            }
         }
     }
 
+    /* Now cool the queued particles in contiguous batches.
+     * Note the dynamic scheduling: cooling iteration counts vary between particles.*/
+    int NumCool = gadget_compact_thread_arrays(CoolQueue, thrqueuecool, nqthrcool, nthreads);
+    int i;
+    #pragma omp parallel for schedule(dynamic)
+    for(i = 0; i < NumCool; i += COOLING_BATCH)
+        cooling_direct(CoolQueue + i, IMIN(COOLING_BATCH, NumCool - i), a3inv, hubble, GlobalUVBG);
+
+    myfree(CoolQueue);
+    ta_free(thrqueuecool);
+    ta_free(nqthrcool);
+
     report_memory_usage("SFR");
+
+    slots_chunk_release(StarChunks, nthreads, 4, PartManager, SlotsManager);
+
     /*Merge step for the queue.*/
     if(NewStars) {
         NumNewStar = gadget_compact_thread_arrays(NewStars, thrqueuesfr, nqthrsfr, nthreads);
-        int NumNewParent = gadget_compact_thread_arrays(NewParents, thrqueueparent, nqthrsfr, nthreads);
-        if(NumNewStar != NumNewParent)
-            endrun(3,"%d new stars, but %d new parents!\n",NumNewStar, NumNewParent);
         /*Shrink star memory as we keep it for the wind model*/
         NewStars = myrealloc(NewStars, sizeof(int) * NumNewStar);
     }
 
-    ta_free(thrqueueparent);
+    ta_free(StarChunks);
     ta_free(thrqueuesfr);
     ta_free(nqthrsfr);
 
     walltime_measure("/Cooling/Cooling");
 
-    /*Get some empty slots for the stars*/
-    int firststarslot = SlotsManager->info[4].size;
-    /* We ran out of slots! We must be forming a lot of stars.
-     * There are things in the way of extending the slot list, so we have to move them.
-     * The code in sfr_reserve_slots is not elegant, but I cannot think of a better way.*/
-    if(All.StarformationOn && (SlotsManager->info[4].size + NumNewStar >= SlotsManager->info[4].maxsize)) {
-        if(NewParents)
-            NewParents = myrealloc(NewParents, sizeof(int) * NumNewStar);
-        NewStars = sfr_reserve_slots(act, NewStars, NumNewStar, tree);
-    }
-    SlotsManager->info[4].size += NumNewStar;
-
-    int stars_converted=0, stars_spawned=0;
-    int i;
-
-    /*Now we turn the particles into stars*/
-    #pragma omp parallel for reduction(+:stars_converted) reduction(+:stars_spawned) reduction(+:sum_mass_stars)
-    for(i=0; i < NumNewStar; i++)
-    {
-        int child = NewStars[i];
-        int parent = NewParents[i];
-        make_particle_star(child, parent, firststarslot+i);
-        sum_mass_stars += P[child].Mass;
-        if(child == parent)
-            stars_converted++;
-        else
-            stars_spawned++;
-    }
-
     if(!All.StarformationOn)
         return;
 
-    /*Done with the parents*/
-    myfree(NewParents);
-
     int64_t tot_spawned=0, tot_converted=0;
     sumup_large_ints(1, &stars_spawned, &tot_spawned);
     sumup_large_ints(1, &stars_converted, &tot_converted);
@@ -305,21 +334,14 @@ cooling_and_starformation(ActiveParticles * act, ForceTree * tree, MyFloat * Gra
 /* Get enough memory for new star slots. This may be excessively slow! Don't do it too often.
  * It is also not elegant, but I couldn't think of a better way. May be fragile and need updating
  * if memory allocation patterns change. */
-static int *
-sfr_reserve_slots(ActiveParticles * act, int * NewStars, int NumNewStar, ForceTree * tree)
+static void
+sfr_reserve_slots(ActiveParticles * act, int NumNewStar, ForceTree * tree)
 {
         /* SlotsManager is below Nodes and ActiveParticleList,
          * so we need to move them out of the way before we extend Nodes.
          * This is quite slow, but need not be collective and is faster than a tree rebuild.
          * Try not to do this too often.*/
-        message(1, "Need %d star slots, more than %d available. Try increasing SlotsIncreaseFactor on restart.\n", SlotsManager->info[4].size, SlotsManager->info[4].maxsize);
-        /*Move the NewStar array to upper memory*/
-        int * new_star_tmp = NULL;
-        if(NewStars) {
-            new_star_tmp = mymalloc2("newstartmp", NumNewStar*sizeof(int));
-            memmove(new_star_tmp, NewStars, NumNewStar * sizeof(int));
-            myfree(NewStars);
-        }
+        message(1, "May need %d star slots, more than %d available. Try increasing SlotsIncreaseFactor on restart.\n", SlotsManager->info[4].size + NumNewStar, SlotsManager->info[4].maxsize);
         /*Move the tree to upper memory*/
         struct NODE * nodes_base_tmp=NULL;
         int *Father_tmp=NULL;
@@ -361,37 +383,47 @@ sfr_reserve_slots(ActiveParticles * act, int * NewStars, int NumNewStar, ForceTr
             /*Don't forget to update the Node pointer as well as Node_base!*/
             tree->Nodes = tree->Nodes_base - tree->firstnode;
         }
-        if(new_star_tmp) {
-            NewStars = mymalloc("NewStars", NumNewStar*sizeof(int));
-            memmove(NewStars, new_star_tmp, NumNewStar * sizeof(int));
-            myfree(new_star_tmp);
-        }
-        return NewStars;
 }
 
+/* Cool a batch of n <= COOLING_BATCH gas particles which are not forming stars*/
 static void
-cooling_direct(int i, const double a3inv, const double hubble)
+cooling_direct(const int * queue, const int n, const double a3inv, const double hubble, const struct GlobalUVBG * GlobalUVBG)
 {
-    /*  the actual time-step */
-    double dloga = get_dloga_for_bin(P[i].TimeBin);
-    double dtime = dloga / hubble;
-
-    double ne = SPHP(i).Ne;	/* electron abundance (gives ionization state and mean molecular weight) */
-
-    const double enttou = pow(SPH_EOMDensity(i) * a3inv, GAMMA_MINUS1) / GAMMA_MINUS1;
-
-    /* Current internal energy including adiabatic change*/
-    double uold = SPHP(i).Entropy * enttou;
+    double uold[COOLING_BATCH] = {0}, dens[COOLING_BATCH] = {0}, dtime[COOLING_BATCH] = {0}, enttou[COOLING_BATCH];
+    double ne[COOLING_BATCH], Z[COOLING_BATCH] = {0}, unew[COOLING_BATCH];
+    int HeIIIionized[COOLING_BATCH] = {0};
+    struct UVBG uvbg[COOLING_BATCH];
+
+    const double redshift = GlobalUVBG->redshift;
+    int k;
+    for(k = 0; k < n; k++) {
+        const int i = queue[k];
+        /*  the actual time-step */
+        double dloga = get_dloga_for_bin(P[i].TimeBin);
+        dtime[k] = dloga / hubble;
+
+        ne[k] = SPHP(i).Ne;	/* electron abundance (gives ionization state and mean molecular weight) */
+
+        enttou[k] = pow(SPH_EOMDensity(i) * a3inv, GAMMA_MINUS1) / GAMMA_MINUS1;
+
+        /* Current internal energy including adiabatic change*/
+        uold[k] = SPHP(i).Entropy * enttou[k];
+        dens[k] = SPHP(i).Density * a3inv;
+        Z[k] = SPHP(i).Metallicity;
+        HeIIIionized[k] = P[i].HeIIIionized;
+        uvbg[k] = get_local_UVBG(GlobalUVBG, P[i].Pos, PartManager->CurrentParticleOffset);
+    }
 
-    double redshift = 1./All.Time - 1;
-    struct UVBG uvbg = get_local_UVBG(redshift, P[i].Pos, PartManager->CurrentParticleOffset);
-    double unew = DoCooling(redshift, uold, SPHP(i).Density * a3inv, dtime, &uvbg, &ne, SPHP(i).Metallicity, All.MinEgySpec, P[i].HeIIIionized);
+    DoCoolingBatch(n, redshift, uold, dens, dtime, uvbg, ne, Z, All.MinEgySpec, HeIIIionized, unew);
 
-    SPHP(i).Ne = ne;
-    /* Update the entropy. This is done after synchronizing kicks and drifts, as per run.c.*/
-    SPHP(i).Entropy = unew / enttou;
-    /* Cooling gas is not forming stars*/
-    SPHP(i).Sfr = 0;
+    for(k = 0; k < n; k++) {
+        const int i = queue[k];
+        SPHP(i).Ne = ne[k];
+        /* Update the entropy. This is done after synchronizing kicks and drifts, as per run.c.*/
+        SPHP(i).Entropy = unew[k] / enttou[k];
+        /* Cooling gas is not forming stars*/
+        SPHP(i).Sfr = 0;
+    }
 }
 
 /* returns 1 if the particle is on the effective equation of state,
@@ -420,7 +452,8 @@ sfreff_on_eeqos(const struct sph_particle_data * sph, const double a3inv)
     if(flag == 1 && sfr_params.BHFeedbackUseTcool == 2) {
         //Redshift is the argument
         double redshift = pow(a3inv, 1./3.)-1;
-        struct UVBG uvbg = get_global_UVBG(redshift);
+        /* The uniform background: no per-particle table interpolation*/
+        struct UVBG uvbg = get_global_uvbg_cache(redshift)->uvbg;
         double egyeff = get_egyeff(redshift, sph->Density, &uvbg);
         const double enttou = pow(sph->EgyWtDensity * a3inv, GAMMA_MINUS1) / GAMMA_MINUS1;
         double unew = sph->Entropy * enttou;
@@ -432,10 +465,10 @@ sfreff_on_eeqos(const struct sph_particle_data * sph, const double a3inv)
 }
 
 /*Get the neutral fraction of a particle correctly, accounting for being on the star-forming equation of state*/
-double get_neutral_fraction_sfreff(double redshift, struct particle_data * partdata, struct sph_particle_data * sphdata)
+double get_neutral_fraction_sfreff(const struct GlobalUVBG * GlobalUVBG, struct particle_data * partdata, struct sph_particle_data * sphdata)
 {
     double nh0;
-    struct UVBG uvbg = get_local_UVBG(redshift, partdata->Pos, PartManager->CurrentParticleOffset);
+    struct UVBG uvbg = get_local_UVBG(GlobalUVBG, partdata->Pos, PartManager->CurrentParticleOffset);
     double physdens = sphdata->Density * All.cf.a3inv;
 
     if(!All.StarformationOn || sfr_params.QuickLymanAlphaProbability > 0 || !sfreff_on_eeqos(sphdata, All.cf.a3inv)) {
@@ -452,7 +485,7 @@ double get_neutral_fraction_sfreff(double redshift, struct particle_data * partd
          * fraction than the hot gas*/
         double dloga = get_dloga_for_bin(partdata->TimeBin);
         double dtime = dloga / All.cf.hubble;
-        struct sfr_eeqos_data sfr_data = get_sfr_eeqos(partdata, sphdata, dtime, All.cf.a3inv);
+        struct sfr_eeqos_data sfr_data = get_sfr_eeqos(partdata, sphdata, dtime, All.cf.a3inv, GlobalUVBG);
         double nh0cold = GetNeutralFraction(sfr_params.EgySpecCold, physdens, &uvbg, sfr_data.ne);
         double nh0hot = GetNeutralFraction(sfr_data.egyhot, physdens, &uvbg, sfr_data.ne);
         nh0 =  nh0cold * sfr_data.cloudfrac + (1-sfr_data.cloudfrac) * nh0hot;
@@ -460,10 +493,10 @@ double get_neutral_fraction_sfreff(double redshift, struct particle_data * partd
     return nh0;
 }
 
-double get_helium_neutral_fraction_sfreff(int ion, double redshift, struct particle_data * partdata, struct sph_particle_data * sphdata)
+double get_helium_neutral_fraction_sfreff(int ion, const struct GlobalUVBG * GlobalUVBG, struct particle_data * partdata, struct sph_particle_data * sphdata)
 {
     double helium;
-    struct UVBG uvbg = get_local_UVBG(redshift, partdata->Pos, PartManager->CurrentParticleOffset);
+    struct UVBG uvbg = get_local_UVBG(GlobalUVBG, partdata->Pos, PartManager->CurrentParticleOffset);
     double physdens = sphdata->Density * All.cf.a3inv;
 
     if(!All.StarformationOn || sfr_params.QuickLymanAlphaProbability > 0 || !sfreff_on_eeqos(sphdata, All.cf.a3inv)) {
@@ -480,7 +513,7 @@ double get_helium_neutral_fraction_sfreff(int ion, double redshift, struct parti
          * fraction than the hot gas*/
         double dloga = get_dloga_for_bin(partdata->TimeBin);
         double dtime = dloga / All.cf.hubble;
-        struct sfr_eeqos_data sfr_data = get_sfr_eeqos(partdata, sphdata, dtime, All.cf.a3inv);
+        struct sfr_eeqos_data sfr_data = get_sfr_eeqos(partdata, sphdata, dtime, All.cf.a3inv, GlobalUVBG);
         double nh0cold = GetHeliumIonFraction(ion, sfr_params.EgySpecCold, physdens, &uvbg, sfr_data.ne);
         double nh0hot = GetHeliumIonFraction(ion, sfr_data.egyhot, physdens, &uvbg, sfr_data.ne);
         helium =  nh0cold * sfr_data.cloudfrac + (1-sfr_data.cloudfrac) * nh0hot;
@@ -513,7 +546,7 @@ static int make_particle_star(int child, int parent, int placement)
 
 /* This function cools gas on the effective equation of state*/
 static void
-cooling_relaxed(int i, double dtime, const double a3inv, struct sfr_eeqos_data sfr_data)
+cooling_relaxed(int i, double dtime, const double a3inv, struct sfr_eeqos_data sfr_data, const struct GlobalUVBG * GlobalUVBG)
 {
     const double egyeff = sfr_params.EgySpecCold * sfr_data.cloudfrac + (1 - sfr_data.cloudfrac) * sfr_data.egyhot;
     const double Density = SPH_EOMDensity(i);
@@ -524,11 +557,10 @@ cooling_relaxed(int i, double dtime, const double a3inv, struct sfr_eeqos_data s
     {
         if(egycurrent > egyeff)
         {
-            double redshift = 1./All.Time - 1;
-            struct UVBG uvbg = get_local_UVBG(redshift, P[i].Pos, PartManager->CurrentParticleOffset);
+            struct UVBG uvbg = get_local_UVBG(GlobalUVBG, P[i].Pos, PartManager->CurrentParticleOffset);
             double ne = SPHP(i).Ne;
             /* In practice tcool << trelax*/
-            double tcool = GetCoolingTime(redshift, egycurrent, SPHP(i).Density * All.cf.a3inv, &uvbg, &ne, SPHP(i).Metallicity);
+            double tcool = GetCoolingTime(GlobalUVBG->redshift, egycurrent, SPHP(i).Density * All.cf.a3inv, &uvbg, &ne, SPHP(i).Metallicity);
 
             /* The point of the star-forming equation of state is to pressurize the gas. However,
              * when the gas has been heated above the equation of state it is pressurized and does not cool successfully.
@@ -576,14 +608,14 @@ quicklyastarformation(int i, const double a3inv)
  * The star slot is not actually created here, but a particle for it is.
  */
 static int
-starformation(int i, double *localsfr, double * sum_sm, MyFloat * GradRho, const double a3inv, const double hubble)
+starformation(int i, double *localsfr, double * sum_sm, MyFloat * GradRho, const double a3inv, const double hubble, const struct GlobalUVBG * GlobalUVBG)
 {
     /*  the proper time-step */
     double dloga = get_dloga_for_bin(P[i].TimeBin);
     double dtime = dloga / hubble;
     int newstar = -1;
 
-    struct sfr_eeqos_data sfr_data = get_sfr_eeqos(&P[i], &SPHP(i), dtime, a3inv);
+    struct sfr_eeqos_data sfr_data = get_sfr_eeqos(&P[i], &SPHP(i), dtime, a3inv, GlobalUVBG);
 
     double smr = get_starformation_rate_full(i, GradRho, sfr_data, a3inv);
 
@@ -602,7 +634,7 @@ starformation(int i, double *localsfr, double * sum_sm, MyFloat * GradRho, const
 
     /* upon start-up, we need to protect against dloga ==0 */
     if(dloga > 0 && P[i].TimeBin)
-        cooling_relaxed(i, dtime, a3inv, sfr_data);
+        cooling_relaxed(i, dtime, a3inv, sfr_data, GlobalUVBG);
 
     double mass_of_star = find_star_mass(i);
     double prob = P[i].Mass / mass_of_star * (1 - exp(-p));
@@ -632,7 +664,7 @@ starformation(int i, double *localsfr, double * sum_sm, MyFloat * GradRho, const
 
 /* Get the parameters of the basic effective
  * equation of state model for a particle.*/
-struct sfr_eeqos_data get_sfr_eeqos(struct particle_data * part, struct sph_particle_data * sph, double dtime, const double a3inv)
+struct sfr_eeqos_data get_sfr_eeqos(struct particle_data * part, struct sph_particle_data * sph, double dtime, const double a3inv, const struct GlobalUVBG * GlobalUVBG)
 {
     struct sfr_eeqos_data data;
     /* Initialise data to something, just in case.*/
@@ -655,15 +687,14 @@ struct sfr_eeqos_data get_sfr_eeqos(struct particle_data * part, struct sph_part
     if(data.tsfr < dtime)
         data.tsfr = dtime;
 
-    double redshift = 1./All.Time - 1;
-    struct UVBG uvbg = get_local_UVBG(redshift, part->Pos, PartManager->CurrentParticleOffset);
+    struct UVBG uvbg = get_local_UVBG(GlobalUVBG, part->Pos, PartManager->CurrentParticleOffset);
 
     double factorEVP = pow(sph->Density * a3inv / sfr_params.PhysDensThresh, -0.8) * sfr_params.FactorEVP;
 
     data.egyhot = sfr_params.EgySpecSN / (1 + factorEVP) + sfr_params.EgySpecCold;
     data.egycold = sfr_params.EgySpecCold;
 
-    double tcool = GetCoolingTime(redshift, data.egyhot, sph->Density * a3inv, &uvbg, &data.ne, sph->Metallicity);
+    double tcool = GetCoolingTime(GlobalUVBG->redshift, data.egyhot, sph->Density * a3inv, &uvbg, &data.ne, sph->Metallicity);
     double y = data.tsfr / tcool * data.egyhot / (sfr_params.FactorSN * sfr_params.EgySpecSN - (1 - sfr_params.FactorSN) * sfr_params.EgySpecCold);
 
     data.cloudfrac = 1 + 1 / (2 * y) - sqrt(1 / y + 1 / (4 * y * y));
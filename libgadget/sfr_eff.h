@@ -6,6 +6,7 @@
 #include "timestep.h"
 #include "partmanager.h"
 #include "slotsmanager.h"
+#include "cooling.h"
 
 #define  METAL_YIELD       0.02	/*!< effective metal yield for star formation */
 
@@ -31,12 +32,12 @@ void cooling_and_starformation(ActiveParticles * act, ForceTree * tree, MyFloat
 /*Get the neutral fraction of a particle correctly, even when on the star-forming equation of state.
  * This calls the cooling routines for the current internal energy when off the equation of state, but
  * when on the equation of state calls them separately for the cold and hot gas.*/
-double get_neutral_fraction_sfreff(double redshift, struct particle_data * partdata, struct sph_particle_data * sphdata);
+double get_neutral_fraction_sfreff(const struct GlobalUVBG * GlobalUVBG, struct particle_data * partdata, struct sph_particle_data * sphdata);
 
 /*Get the helium ionic fraction of a particle correctly, even when on the star-forming equation of state.
  * This calls the cooling routines for the current internal energy when off the equation of state, but
  * when on the equation of state calls them separately for the cold and hot gas.*/
-double get_helium_neutral_fraction_sfreff(int ion, double redshift, struct particle_data * partdata, struct sph_particle_data * sphdata);
+double get_helium_neutral_fraction_sfreff(int ion, const struct GlobalUVBG * GlobalUVBG, struct particle_data * partdata, struct sph_particle_data * sphdata);
 
 /* Return whether we are using a star formation model that needs grad rho computed for the gas particles*/
 int sfr_need_to_compute_sph_grad_rho(void);
@@ -65,6 +66,6 @@ struct sfr_eeqos_data
 };
 
 /* Computes properties of the gas on star forming equation of state*/
-struct sfr_eeqos_data get_sfr_eeqos(struct particle_data * part, struct sph_particle_data * sph, double dtime, const double a3inv);
+struct sfr_eeqos_data get_sfr_eeqos(struct particle_data * part, struct sph_particle_data * sph, double dtime, const double a3inv, const struct GlobalUVBG * GlobalUVBG);
 
 #endif
@@ -83,6 +83,44 @@ slots_convert(int parent, int ptype, int placement, struct part_manager_type * p
     return parent;
 }
 
+int
+slots_chunk_get(struct slots_chunk * chunk, int chunksize, int ptype, struct slots_manager_type * sman)
+{
+    if(chunk->next >= chunk->end) {
+        chunk->next = atomic_fetch_and_add(&sman->info[ptype].size, chunksize);
+        chunk->end = chunk->next + chunksize;
+        if(chunk->end > sman->info[ptype].maxsize)
+            endrun(1, "Tried to reserve slots %d - %d of type %d, beyond %d allocated\n", chunk->next, chunk->end, ptype, sman->info[ptype].maxsize);
+    }
+    return chunk->next++;
+}
+
+void
+slots_chunk_release(struct slots_chunk * chunks, int nchunk, int ptype, struct part_manager_type * pman, struct slots_manager_type * sman)
+{
+    int c, changed;
+    /* Shrink the slot list while its last block is unused. Repeat as
+     * freeing one block may expose the unused part of another.*/
+    do {
+        changed = 0;
+        for(c = 0; c < nchunk; c++) {
+            if(chunks[c].next < chunks[c].end && chunks[c].end == sman->info[ptype].size) {
+                sman->info[ptype].size = chunks[c].next;
+                chunks[c].end = chunks[c].next;
+                changed = 1;
+            }
+        }
+    } while(changed);
+
+    /* The remaining holes are garbage, removed by the next slots_gc*/
+    for(c = 0; c < nchunk; c++) {
+        int i;
+        for(i = chunks[c].next; i < chunks[c].end; i++)
+            BASESLOT_PI(i, ptype, sman)->ReverseLink = pman->MaxPart + 100;
+        chunks[c].end = chunks[c].next;
+    }
+}
+
 /* This will split a new particle out from an existing one, conserving mass.
  * The type is the same and the slot PI on the new particle is set to -1.
  * You should call slots_convert on the child afterwards to create a new slot.
@@ -124,6 +124,20 @@ void slots_setup_topology(struct part_manager_type * pman, int * NLocal, struct
 void slots_setup_id(const struct part_manager_type * pman, struct slots_manager_type * sman);
 int slots_split_particle(int parent, double childmass, struct part_manager_type * pman);
 int slots_convert(int parent, int ptype, int placement, struct part_manager_type * pman, struct slots_manager_type * sman);
+
+/* A block of slots of one type owned by a single thread,
+ * so that it can create new slots without contending on the shared slot counter.
+ * Zero-initialise before use.*/
+struct slots_chunk {
+    int next; /* Next free slot in the block*/
+    int end; /* One past the last slot in the block*/
+};
+/* Get a free slot of type ptype from the chunk, first reserving chunksize slots if the chunk is used up.
+ * The slots must already be allocated by slots_reserve: endrun is called if they run out.*/
+int slots_chunk_get(struct slots_chunk * chunk, int chunksize, int ptype, struct slots_manager_type * sman);
+/* Give back the unused slots in nchunk chunks, once no thread is using them.
+ * Unused slots at the end of the slot list are returned; those below a slot in use are marked as garbage.*/
+void slots_chunk_release(struct slots_chunk * chunks, int nchunk, int ptype, struct part_manager_type * pman, struct slots_manager_type * sman);
 int slots_gc(int * compact_slots, struct part_manager_type * pman, struct slots_manager_type * sman);
 void slots_gc_sorted(struct part_manager_type * pman, struct slots_manager_type * sman);
 size_t slots_reserve(int where, int atleast[6], struct slots_manager_type * sman);
@@ -55,7 +55,7 @@ struct state_of_system compute_global_quantities_of_system(const double Time,  s
     a2 = Time * Time;
     a3 = Time * Time * Time;
 
-    double redshift = 1. / Time - 1;
+    const struct GlobalUVBG * GlobalUVBG = get_global_uvbg_cache(1. / Time - 1);
     memset(&sys, 0, sizeof(sys));
 
     #pragma omp parallel for
@@ -73,7 +73,7 @@ struct state_of_system compute_global_quantities_of_system(const double Time,  s
 
         if(P[i].Type == 0)
         {
-            struct UVBG uvbg = get_local_UVBG(redshift, P[i].Pos, PartManager->CurrentParticleOffset);
+            struct UVBG uvbg = get_local_UVBG(GlobalUVBG, P[i].Pos, PartManager->CurrentParticleOffset);
             entr = SPHP(i).Entropy;
             egyspec = entr / (GAMMA_MINUS1) * pow(SPH_EOMDensity(i) / a3, GAMMA_MINUS1);
             sys.EnergyIntComp[0] += P[i].Mass * egyspec;
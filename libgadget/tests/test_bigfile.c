@@ -0,0 +1,393 @@
+/* This file tests the compressed block storage of bigfile:
+ * data is written in several frames per physical file and read back in ranges crossing them.
+ * Each rank has its own prefix, except for the collective write.*/
+#define _XOPEN_SOURCE 700
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <ftw.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <mpi.h>
+#include <gsl/gsl_rng.h>
+#include <bigfile.h>
+#include <bigfile-mpi.h>
+#include "stub.h"
+
+#include <libgadget/utils/endrun.h>
+
+static char prefix[1024] = "bigfile-test-XXXXXX";
+
+/* Elements in each frame: the writes are done in pieces of this size*/
+#define FRAME 128
+/* Two physical files, which do not begin or end on a frame boundary*/
+#define NFILE 2
+static const size_t fsize[NFILE] = {700, 1300};
+#define NELEM 2000
+#define NMEMB 3
+
+/* Write nelem elements of data to a new block, in calls to big_block_write of FRAME elements.*/
+static void
+write_block(const char * blockname, const char * dtype, void * data, const BigBlockCompression * compression)
+{
+    BigFile bf = {0};
+    BigBlock bb = {0};
+    BigBlockPtr ptr = {0};
+    const size_t felsize = big_file_dtype_itemsize(dtype) * NMEMB;
+    /* The filters work in place, so write a copy*/
+    char * copy = malloc(NELEM * felsize);
+    memcpy(copy, data, NELEM * felsize);
+
+    assert_int_equal(big_file_create(&bf, prefix), 0);
+    assert_int_equal(big_file_create_block(&bf, &bb, blockname, dtype, NMEMB, NFILE, fsize), 0);
+    assert_int_equal(big_block_set_compression(&bb, compression), 0);
+    assert_true(big_block_is_compressed(&bb));
+    size_t start;
+    for(start = 0; start < NELEM; start += FRAME) {
+        size_t dims[2] = {FRAME, NMEMB};
+        if(start + FRAME > NELEM)
+            dims[0] = NELEM - start;
+        BigArray array = {0};
+        big_array_init(&array, copy + start * felsize, dtype, 2, dims, NULL);
+        assert_int_equal(big_block_seek(&bb, &ptr, start), 0);
+        assert_int_equal(big_block_write(&bb, &ptr, &array), 0);
+    }
+    assert_int_equal(big_block_close(&bb), 0);
+    assert_int_equal(big_file_close(&bf), 0);
+    free(copy);
+}
+
+/* Read the elements [start, start + size) of a block, which must be compressed.*/
+static void *
+read_block(const char * blockname, ptrdiff_t start, ptrdiff_t size)
+{
+    BigFile bf = {0};
+    BigBlock bb = {0};
+    BigArray array = {0};
+    assert_int_equal(big_file_open(&bf, prefix), 0);
+    assert_int_equal(big_file_open_block(&bf, &bb, blockname), 0);
+    assert_true(big_block_is_compressed(&bb));
+    assert_int_equal(big_block_read_simple(&bb, start, size, &array, NULL), 0);
+    assert_int_equal(big_block_close(&bb), 0);
+    assert_int_equal(big_file_close(&bf), 0);
+    return array.data;
+}
+
+/* The frame table of a block: rows of fileid, roffset, nelem and the byte offset in the data file*/
+static uint64_t *
+frame_table(const char * dir, const char * blockname, size_t * nframes)
+{
+    BigFile bf = {0};
+    BigBlock bb = {0};
+    assert_int_equal(big_file_open(&bf, dir), 0);
+    assert_int_equal(big_file_open_block(&bf, &bb, blockname), 0);
+    BigAttr * attr = big_block_lookup_attr(&bb, "BigFileFrames");
+    assert_non_null(attr);
+    assert_int_equal(attr->nmemb % 4, 0);
+    uint64_t * table = malloc(attr->nmemb * sizeof(uint64_t));
+    assert_int_equal(big_block_get_attr(&bb, "BigFileFrames", table, "u8", attr->nmemb), 0);
+    *nframes = attr->nmemb / 4;
+    assert_int_equal(big_block_close(&bb), 0);
+    assert_int_equal(big_file_close(&bf), 0);
+    return table;
+}
+
+/* Bytes of a frame, header included, read from the frame header at offset of a data file*/
+static size_t
+frame_bytes(const char * dir, const char * blockname, int fileid, uint64_t offset)
+{
+    char filename[2048];
+    unsigned char header[6 * 8];
+    snprintf(filename, sizeof(filename), "%s/%s/%06X", dir, blockname, fileid);
+    FILE * fp = fopen(filename, "r");
+    assert_non_null(fp);
+    assert_int_equal(fseek(fp, offset, SEEK_SET), 0);
+    assert_int_equal(fread(header, sizeof(header), 1, fp), 1);
+    fclose(fp);
+    uint64_t fields[6] = {0};
+    int i, b;
+    for(i = 0; i < 6; i++)
+        for(b = 0; b < 8; b++)
+            fields[i] |= ((uint64_t) header[i * 8 + b]) << (8 * b);
+    /* The magic number BFZ1*/
+    assert_int_equal(fields[0], 0x315a4642);
+    return sizeof(header) + fields[5];
+}
+
+/* Size of the frame holding the elements of file fileid from roffset*/
+static size_t
+frame_size(const char * blockname, int fileid, size_t roffset)
+{
+    size_t nframes, i;
+    uint64_t * table = frame_table(prefix, blockname, &nframes);
+    for(i = 0; i < nframes; i++)
+        if(table[4 * i] == fileid && table[4 * i + 1] == roffset)
+            break;
+    assert_true(i < nframes);
+    const size_t bytes = frame_bytes(prefix, blockname, fileid, table[4 * i + 3]);
+    free(table);
+    return bytes;
+}
+
+/* The frames are packed in the data files, which are the only files of the block
+ * besides the header and the attributes, and cover each file once*/
+static void
+check_packed(const char * dir, const char * blockname, const size_t * sizes, int nfile)
+{
+    char dirname[2048];
+    snprintf(dirname, sizeof(dirname), "%s/%s", dir, blockname);
+    DIR * d = opendir(dirname);
+    assert_non_null(d);
+    struct dirent * ent;
+    int nent = 0;
+    while((ent = readdir(d)))
+        nent += ent->d_name[0] != '.';
+    closedir(d);
+    assert_int_equal(nent, nfile + 2);
+
+    size_t nframes, i;
+    uint64_t * table = frame_table(dir, blockname, &nframes);
+    int fileid;
+    for(fileid = 0; fileid < nfile; fileid++) {
+        size_t bytes = 0, nelem = 0;
+        for(i = 0; i < nframes; i++) {
+            if(table[4 * i] != fileid)
+                continue;
+            /* Sorted by offset within the file, without gaps or overlaps*/
+            assert_int_equal(table[4 * i + 1], nelem);
+            nelem += table[4 * i + 2];
+            bytes += frame_bytes(dir, blockname, fileid, table[4 * i + 3]);
+        }
+        assert_int_equal(nelem, sizes[fileid]);
+        char filename[2048];
+        struct stat st;
+        snprintf(filename, sizeof(filename), "%s/%s/%06X", dir, blockname, fileid);
+        assert_int_equal(stat(filename, &st), 0);
+        assert_int_equal(st.st_size, bytes);
+    }
+    free(table);
+}
+
+/* Ranges starting and ending inside frames, crossing frames, and crossing the files*/
+static const ptrdiff_t ranges[][2] = {
+    {0, NELEM}, {0, 1}, {5, 100}, {100, 300}, {FRAME, FRAME}, {650, 100}, {690, 20}, {1999, 1}, {300, 1500},
+};
+
+static void
+check_lossless(const char * dtype, void * data, const BigBlockCompression * compression)
+{
+    const size_t felsize = big_file_dtype_itemsize(dtype) * NMEMB;
+    char blockname[64];
+    snprintf(blockname, sizeof(blockname), "%s-%d-%d", dtype, compression->filters, compression->codec);
+    write_block(blockname, dtype, data, compression);
+    check_packed(prefix, blockname, fsize, NFILE);
+    int i;
+    for(i = 0; i < sizeof(ranges) / sizeof(ranges[0]); i++) {
+        char * out = read_block(blockname, ranges[i][0], ranges[i][1]);
+        assert_memory_equal(out, (char *) data + ranges[i][0] * felsize, ranges[i][1] * felsize);
+        free(out);
+    }
+}
+
+/* Integer and float columns round-trip exactly, with the lossless filters and either codec*/
+static void
+test_bigfile_lossless(void ** state)
+{
+    gsl_rng * r = gsl_rng_alloc(gsl_rng_mt19937);
+    int64_t * i8 = malloc(NELEM * NMEMB * sizeof(int64_t));
+    uint64_t * u8 = malloc(NELEM * NMEMB * sizeof(uint64_t));
+    float * f4 = malloc(NELEM * NMEMB * sizeof(float));
+    double * f8 = malloc(NELEM * NMEMB * sizeof(double));
+    int i;
+    for(i = 0; i < NELEM * NMEMB; i++) {
+        /* Slowly varying, like sorted IDs and positions, but with negative and very large values*/
+        i8[i] = (i / NMEMB) * 3 - 1000 + (int64_t) (gsl_rng_get(r) % 4) - (i % NMEMB == 2) * ((int64_t) 1 << 50);
+        u8[i] = ((uint64_t) 1 << 63) + (uint64_t) i * 7 + gsl_rng_get(r) % 16;
+        f4[i] = 100 * sin(i * 0.01) + gsl_rng_uniform(r);
+        f8[i] = 1e5 * cos(i * 0.001) + gsl_rng_uniform(r);
+    }
+    BigBlockCompression compression[3] = {
+        {BIG_BLOCK_FILTER_DELTA | BIG_BLOCK_FILTER_SHUFFLE, BIG_BLOCK_CODEC_LZ, 0},
+        {BIG_BLOCK_FILTER_SHUFFLE, BIG_BLOCK_CODEC_ZLIB, 0},
+        {BIG_BLOCK_FILTER_DELTA, BIG_BLOCK_CODEC_NONE, 0},
+    };
+    for(i = 0; i < 3; i++) {
+        check_lossless("i8", i8, &compression[i]);
+        check_lossless("u8", u8, &compression[i]);
+        check_lossless("f4", f4, &compression[i]);
+        check_lossless("f8", f8, &compression[i]);
+    }
+    /* Slowly varying data compresses. Frames begin at every write and at the start of each file.*/
+    assert_true(frame_size("i8-6-1", 0, 0) < FRAME * NMEMB * sizeof(int64_t));
+    assert_true(frame_size("u8-6-1", 1, 1280 - 700) < FRAME * NMEMB * sizeof(uint64_t));
+    free(f8);
+    free(f4);
+    free(u8);
+    free(i8);
+    gsl_rng_free(r);
+}
+
+/* Random bytes do not compress, and are stored as is after the frame header*/
+static void
+test_bigfile_incompressible(void ** state)
+{
+    gsl_rng * r = gsl_rng_alloc(gsl_rng_mt19937);
+    uint64_t * u8 = malloc(NELEM * NMEMB * sizeof(uint64_t));
+    int i;
+    for(i = 0; i < NELEM * NMEMB; i++)
+        u8[i] = ((uint64_t) gsl_rng_get(r) << 32) ^ gsl_rng_get(r);
+    BigBlockCompression compression = {BIG_BLOCK_FILTER_SHUFFLE, BIG_BLOCK_CODEC_LZ, 0};
+    check_lossless("u8", u8, &compression);
+    const size_t header = 6 * sizeof(uint64_t);
+    assert_int_equal(frame_size("u8-4-1", 0, 0), header + FRAME * NMEMB * sizeof(uint64_t));
+    /* The last frame of the first file is cut short by the end of the file*/
+    assert_int_equal(frame_size("u8-4-1", 0, 640), header + (700 - 640) * NMEMB * sizeof(uint64_t));
+    free(u8);
+    gsl_rng_free(r);
+}
+
+/* The quantize filter keeps every value within the error bound, absolute or relative*/
+static void
+check_quantize(const char * dtype, double error)
+{
+    gsl_rng * r = gsl_rng_alloc(gsl_rng_mt19937);
+    const int itemsize = big_file_dtype_itemsize(dtype);
+    double * data = malloc(NELEM * NMEMB * sizeof(double));
+    void * typed = malloc(NELEM * NMEMB * itemsize);
+    int i;
+    /* Values over many decades and of both signs, some exactly zero*/
+    for(i = 0; i < NELEM * NMEMB; i++) {
+        data[i] = (gsl_rng_uniform(r) < 0.5 ? -1 : 1) * pow(10, 12 * gsl_rng_uniform(r) - 6);
+        if(i % 97 == 0)
+            data[i] = 0;
+        if(itemsize == 4) {
+            ((float *) typed)[i] = data[i];
+            data[i] = ((float *) typed)[i];
+        }
+        else
+            ((double *) typed)[i] = data[i];
+    }
+    char blockname[64];
+    snprintf(blockname, sizeof(blockname), "%s-quantize-%g", dtype, error);
+    BigBlockCompression compression = {BIG_BLOCK_FILTER_QUANTIZE | BIG_BLOCK_FILTER_SHUFFLE, BIG_BLOCK_CODEC_LZ, error};
+    write_block(blockname, dtype, typed, &compression);
+    free(typed);
+    int nchanged = 0;
+    for(i = 0; i < sizeof(ranges) / sizeof(ranges[0]); i++) {
+        void * out = read_block(blockname, ranges[i][0], ranges[i][1]);
+        int j;
+        for(j = 0; j < ranges[i][1] * NMEMB; j++) {
+            const double orig = data[ranges[i][0] * NMEMB + j];
+            const double got = itemsize == 4 ? ((float *) out)[j] : ((double *) out)[j];
+            if(error > 0)
+                assert_true(fabs(got - orig) <= error);
+            else
+                assert_true(fabs(got - orig) <= -error * fabs(orig));
+            nchanged += got != orig;
+        }
+        free(out);
+    }
+    /* The filter did round the values*/
+    assert_true(nchanged > 0);
+    free(data);
+    gsl_rng_free(r);
+}
+
+static void
+test_bigfile_quantize(void ** state)
+{
+    check_quantize("f8", 1e-3);
+    check_quantize("f8", -1e-4);
+    check_quantize("f4", 1e-3);
+    check_quantize("f4", -1e-4);
+}
+
+/* Ranks writing to the same files at once append their frames to them,
+ * and the frame tables of the ranks merge on close*/
+static void
+test_bigfile_mpi_write(void ** state)
+{
+    int ThisTask, NTask;
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    MPI_Comm_size(MPI_COMM_WORLD, &NTask);
+    /* The block is in the prefix of the first rank*/
+    char dir[1024];
+    strncpy(dir, prefix, sizeof(dir));
+    MPI_Bcast(dir, sizeof(dir), MPI_CHAR, 0, MPI_COMM_WORLD);
+
+    const size_t start = (size_t) NELEM * ThisTask / NTask;
+    const size_t nlocal = (size_t) NELEM * (ThisTask + 1) / NTask - start;
+    int64_t * i8 = malloc(nlocal * NMEMB * sizeof(int64_t) + 1);
+    int64_t * out = malloc(nlocal * NMEMB * sizeof(int64_t) + 1);
+    size_t i;
+    for(i = 0; i < nlocal * NMEMB; i++)
+        i8[i] = (int64_t) (start * NMEMB + i) * 5 - 3000;
+
+    BigFile bf = {0};
+    BigBlock bb = {0};
+    BigBlockPtr ptr = {0};
+    BigArray array = {0};
+    size_t sizes[NFILE];
+    BigBlockCompression compression = {BIG_BLOCK_FILTER_DELTA | BIG_BLOCK_FILTER_SHUFFLE, BIG_BLOCK_CODEC_LZ, 0};
+    assert_int_equal(big_file_mpi_create(&bf, dir, MPI_COMM_WORLD), 0);
+    assert_int_equal(big_file_mpi_create_block(&bf, &bb, "mpi-i8", "i8", NMEMB, NFILE, NELEM, MPI_COMM_WORLD), 0);
+    assert_int_equal(big_block_set_compression(&bb, &compression), 0);
+    memcpy(sizes, bb.fsize, sizeof(sizes));
+    /* The filters work in place, so write a copy*/
+    memcpy(out, i8, nlocal * NMEMB * sizeof(int64_t));
+    big_array_init(&array, out, "i8", 2, (size_t[]){nlocal, NMEMB}, NULL);
+    assert_int_equal(big_block_seek(&bb, &ptr, 0), 0);
+    /* All ranks write at once*/
+    assert_int_equal(big_block_mpi_write(&bb, &ptr, &array, NTask, MPI_COMM_WORLD), 0);
+    assert_int_equal(big_block_mpi_close(&bb, MPI_COMM_WORLD), 0);
+
+    /* Each rank reads its part back*/
+    memset(out, 0, nlocal * NMEMB * sizeof(int64_t));
+    assert_int_equal(big_file_mpi_open_block(&bf, &bb, "mpi-i8", MPI_COMM_WORLD), 0);
+    assert_true(big_block_is_compressed(&bb));
+    assert_int_equal(big_block_seek(&bb, &ptr, 0), 0);
+    assert_int_equal(big_block_mpi_read(&bb, &ptr, &array, NTask, MPI_COMM_WORLD), 0);
+    assert_int_equal(big_block_mpi_close(&bb, MPI_COMM_WORLD), 0);
+    assert_int_equal(big_file_mpi_close(&bf, MPI_COMM_WORLD), 0);
+    assert_memory_equal(out, i8, nlocal * NMEMB * sizeof(int64_t));
+
+    if(ThisTask == 0)
+        check_packed(dir, "mpi-i8", sizes, NFILE);
+    MPI_Barrier(MPI_COMM_WORLD);
+    free(out);
+    free(i8);
+}
+
+static int
+remove_entry(const char * path, const struct stat * st, int flag, struct FTW * ftw)
+{
+    return remove(path);
+}
+
+static int setup(void ** state)
+{
+    char * ret = mkdtemp(prefix);
+    message(0, "UsingPrefix : '%s'\n", prefix);
+    return !ret;
+}
+
+static int teardown(void ** state)
+{
+    return nftw(prefix, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+int main(void) {
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_bigfile_lossless),
+        cmocka_unit_test(test_bigfile_incompressible),
+        cmocka_unit_test(test_bigfile_quantize),
+        cmocka_unit_test(test_bigfile_mpi_write),
+    };
+    return cmocka_run_group_tests_mpi(tests, setup, teardown);
+}
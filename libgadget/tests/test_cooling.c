@@ -152,8 +152,9 @@ static double tcool_table[NSTEP * NSTEP] = {
 
 struct part_manager_type PartManager[1];
 /* Check that DoCooling and GetCoolingTime both return
- * a stable value over a wide range of internal energies and densities.*/
-static void test_DoCooling(void ** state)
+ * a stable value over a wide range of internal energies and densities.
+ * If RateTableOn, the rates are interpolated from the table.*/
+static void do_DoCooling_test(int RateTableOn, double utol, double tcooltol)
 {
     int i, j;
     struct cooling_params coolpar;
@@ -170,6 +171,8 @@ static void test_DoCooling(void ** state)
     coolpar.HeliumHeatThresh = 10;
     coolpar.UVRedshiftThreshold = -1;
     coolpar.HydrogenHeatAmp = 0;
+    coolpar.RateTableOn = RateTableOn;
+    coolpar.RateTableRedshiftTol = 0.01;
     coolpar.rho_crit_baryon = 0.045 * 3.0 * pow(0.7*HUBBLE,2.0) /(8.0*M_PI*GRAVITY);
 
     char * TreeCool = GADGET_TESTDATA_ROOT "/examples/TREECOOL_ep_2018p";
@@ -199,6 +202,7 @@ static void test_DoCooling(void ** state)
     set_coolpar(coolpar);
     init_cooling(TreeCool, MetalCool, NULL, coolunits, &CP);
     struct UVBG uvbg = get_global_UVBG(0);
+    update_heatingcooling_table(0, &uvbg);
     assert_true(fabs(uvbg.epsH0/3.65296e-25 -1) < 1e-5);
     assert_true(fabs(uvbg.epsHe0/3.98942e-25 -1) < 1e-5);
     assert_true(fabs(uvbg.epsHep/3.33253e-26 -1) < 1e-5);
@@ -217,6 +221,10 @@ static void test_DoCooling(void ** state)
     for(i=0; i < NSTEP; i++)
     {
         double dens = exp(log(dmin) +  i * (log(dmax) - log(dmin)) / 1. /NSTEP);
+        /* Inputs and results for cooling the whole row as one batch*/
+        double urow[NSTEP], unewrow[NSTEP], densrow[NSTEP], dtrow[NSTEP], nerow[NSTEP], Zrow[NSTEP];
+        int HeIIIrow[NSTEP];
+        struct UVBG uvbgrow[NSTEP];
         for (j = 0; j<NSTEP; j++)
         {
             double ne=1.0, ne2=1.0;
@@ -224,21 +232,47 @@ static void test_DoCooling(void ** state)
             double tcool = GetCoolingTime(0, uu, dens, &uvbg, &ne2, 0);
             double unew = DoCooling(0, uu, dens, dt, &uvbg, &ne, 0, MinEgySpec, 1);
             assert_false(isnan(unew));
+            urow[j] = uu;
+            unewrow[j] = unew;
+            densrow[j] = dens;
+            dtrow[j] = dt;
+            nerow[j] = 1.0;
+            Zrow[j] = 0;
+            HeIIIrow[j] = 1;
+            uvbgrow[j] = uvbg;
 //             message(0, "d = %g u = %g tcool = %g tcool_table = %g unew = %g ne_after = %g unew_table = %g\n", dens, uu, tcool, tcool_table[i*NSTEP + j], unew, ne, unew_table[i*NSTEP+j]);
-            assert_true(fabs(unew/unew_table[i*NSTEP + j] - 1) < 5e-3);
-            assert_true(fabs(1/(1e-20 + tcool) - 1./(1e-20 + tcool_table[i*NSTEP + j])) < 1 || fabs((1e-20 + tcool)/(1e-20 + tcool_table[i*NSTEP + j]) - 1) < 2e-2);
+            assert_true(fabs(unew/unew_table[i*NSTEP + j] - 1) < utol);
+            assert_true(fabs(1/(1e-20 + tcool) - 1./(1e-20 + tcool_table[i*NSTEP + j])) < 1 || fabs((1e-20 + tcool)/(1e-20 + tcool_table[i*NSTEP + j]) - 1) < tcooltol);
             /*Make the tables*/
             //printf("%g , ", unew);
            //printf("%g , ", tcool);
 
         }
+        /* The batched solver should take the same steps as DoCooling,
+         * so the answers differ only by round-off*/
+        double unewbatch[NSTEP];
+        DoCoolingBatch(NSTEP, 0, urow, densrow, dtrow, uvbgrow, nerow, Zrow, MinEgySpec, HeIIIrow, unewbatch);
+        for (j = 0; j<NSTEP; j++)
+            assert_true(fabs(unewbatch[j] - unewrow[j]) <= 1e-12 * fabs(unewrow[j]));
     }
 //    printf("\n");
 }
 
+static void test_DoCooling(void ** state)
+{
+    do_DoCooling_test(0, 5e-3, 2e-2);
+}
+
+/* Same, with the rates interpolated from the table*/
+static void test_DoCooling_table(void ** state)
+{
+    do_DoCooling_test(1, 5e-3, 3e-2);
+}
+
 int main(void) {
     const struct CMUnitTest tests[] = {
         cmocka_unit_test(test_DoCooling),
+        cmocka_unit_test(test_DoCooling_table),
 
     };
     return cmocka_run_group_tests_mpi(tests, NULL, NULL);
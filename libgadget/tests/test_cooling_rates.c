@@ -8,6 +8,7 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <libgadget/physconst.h>
 #include <libgadget/cooling_rates.h>
 #include <libgadget/config.h>
@@ -113,6 +114,16 @@ static void test_uvbg_loader(void ** state)
     assert_true(fabs(uvbg.gJHe0/4.759025257653999e-13 -1) < 1e-5);
     assert_true(fabs(uvbg.gJHep/2.270599708640625e-16 -1) < 1e-5);
     assert_true(fabs(uvbg.self_shield_dens/0.007691709693529007 - 1) < 1e-5);
+    /*The per-step cache should hold the same rates, and without a UV fluctuation table
+     * every particle should see the uniform background*/
+    set_global_uvbg(3.);
+    const struct GlobalUVBG * GlobalUVBG = get_global_uvbg_cache(3.);
+    assert_true(GlobalUVBG->uniform);
+    assert_true(GlobalUVBG->redshift == 3.);
+    assert_true(memcmp(&GlobalUVBG->uvbg, &uvbg, sizeof(struct UVBG)) == 0);
+    const double Pos[3] = {1, 2, 3}, PosOffset[3] = {0};
+    struct UVBG local = get_local_UVBG(GlobalUVBG, Pos, PosOffset);
+    assert_true(memcmp(&local, &uvbg, sizeof(struct UVBG)) == 0);
 }
 
 /* Simple tests for the rate network */
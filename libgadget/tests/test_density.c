@@ -179,7 +179,7 @@ static void test_density_flat(void ** state) {
         P[i].Pos[1] = (BoxSize/ncbrt) * ((i/ncbrt) % ncbrt);
         P[i].Pos[2] = (BoxSize/ncbrt) * (i % ncbrt);
     }
-    do_density_test(state, numpart, 0.501747, 1e-4);
+    do_density_test(state, numpart, 0.501875, 1e-4);
 }
 
 static void test_density_close(void ** state) {
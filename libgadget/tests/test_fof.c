@@ -0,0 +1,442 @@
+/*Tests for the FOF group finder, compared against a direct search.*/
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <math.h>
+#include <mpi.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <gsl/gsl_rng.h>
+
+#include "stub.h"
+
+#include <libgadget/utils/mymalloc.h>
+#include <libgadget/utils/system.h>
+#include <libgadget/utils/endrun.h>
+#include <libgadget/partmanager.h>
+#include <libgadget/slotsmanager.h>
+#include <libgadget/walltime.h>
+#include <libgadget/domain.h>
+#include <libgadget/forcetree.h>
+#include <libgadget/fof.h>
+#include <libgadget/cosmology.h>
+
+static struct ClockTable CT;
+
+#define BOXSIZE 8.
+#define LINKLENGTH 0.2
+#define MINLENGTH 8
+
+static int
+compare_int(const void * a, const void * b)
+{
+    return (*(const int *) a > *(const int *) b) - (*(const int *) a < *(const int *) b);
+}
+
+static int
+find_root(int * Head, int i)
+{
+    while(Head[i] != i)
+        i = Head[i] = Head[Head[i]];
+    return i;
+}
+
+/* Directly link every pair of particles closer than the linking length
+ * and return the sorted lengths of the groups with at least MINLENGTH members.*/
+static int
+fof_direct(double (*pos)[3], const int npart, int * lengths)
+{
+    int * Head = mymalloc("Head", npart * sizeof(int));
+    int * count = mymalloc("count", npart * sizeof(int));
+    int i, j;
+    for(i = 0; i < npart; i++) {
+        Head[i] = i;
+        count[i] = 0;
+    }
+    for(i = 0; i < npart; i++)
+        for(j = i + 1; j < npart; j++) {
+            double r2 = 0;
+            int d;
+            for(d = 0; d < 3; d++) {
+                double dx = pos[i][d] - pos[j][d];
+                if(dx > BOXSIZE / 2)
+                    dx -= BOXSIZE;
+                if(dx < -BOXSIZE / 2)
+                    dx += BOXSIZE;
+                r2 += dx * dx;
+            }
+            if(r2 > LINKLENGTH * LINKLENGTH)
+                continue;
+            int ri = find_root(Head, i), rj = find_root(Head, j);
+            if(ri != rj)
+                Head[ri] = rj;
+        }
+    for(i = 0; i < npart; i++)
+        count[find_root(Head, i)]++;
+    int ngroups = 0;
+    for(i = 0; i < npart; i++)
+        if(count[i] >= MINLENGTH)
+            lengths[ngroups++] = count[i];
+    qsort(lengths, ngroups, sizeof(int), compare_int);
+    myfree(count);
+    myfree(Head);
+    return ngroups;
+}
+
+static void
+test_fof(void ** state)
+{
+    gsl_rng * r = (gsl_rng *) *state;
+    int ThisTask, NTask;
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    MPI_Comm_size(MPI_COMM_WORLD, &NTask);
+
+    const int numpart = 2048;
+    particle_alloc_memory(4 * numpart);
+    /* Every rank has the same clump centres, so that the clumps are split between ranks*/
+    const int nclump = 16;
+    double centre[16][3];
+    int i, j;
+    gsl_rng_set(r, 17);
+    for(i = 0; i < nclump; i++)
+        for(j = 0; j < 3; j++)
+            centre[i][j] = BOXSIZE * gsl_rng_uniform(r);
+    gsl_rng_set(r, 100 + ThisTask);
+    for(i = 0; i < numpart; i++) {
+        for(j = 0; j < 3; j++) {
+            /* Half of the particles are in filamentary clumps, half are a uniform background*/
+            double x;
+            if(i % 2) {
+                const int c = i % nclump;
+                x = centre[c][j] + (j == 0 ? 1.5 : 0.15) * (gsl_rng_uniform(r) - 0.5);
+            }
+            else
+                x = BOXSIZE * gsl_rng_uniform(r);
+            P[i].Pos[j] = x - BOXSIZE * floor(x / BOXSIZE);
+        }
+        P[i].Type = 1;
+        P[i].Mass = 1;
+        P[i].ID = (MyIDType) (NTask - ThisTask) * numpart + i;
+        P[i].Key = PEANO(P[i].Pos, BOXSIZE);
+    }
+    PartManager->NumPart = numpart;
+
+    /* Gather the particles for the direct search*/
+    double (*allpos)[3] = mymalloc("allpos", NTask * numpart * sizeof(allpos[0]));
+    double (*mypos)[3] = mymalloc("mypos", numpart * sizeof(mypos[0]));
+    for(i = 0; i < numpart; i++)
+        for(j = 0; j < 3; j++)
+            mypos[i][j] = P[i].Pos[j];
+    MPI_Allgather(mypos, 3 * numpart, MPI_DOUBLE, allpos, 3 * numpart, MPI_DOUBLE, MPI_COMM_WORLD);
+    myfree(mypos);
+    int * direct = mymalloc("direct", NTask * numpart * sizeof(int));
+    const int ndirect = fof_direct(allpos, NTask * numpart, direct);
+
+    DomainDecomp ddecomp = {0};
+    domain_decompose_full(&ddecomp);
+    ForceTree Tree = {0};
+    force_tree_rebuild(&Tree, &ddecomp, BOXSIZE, 0, 1, NULL);
+
+    FOFGroups fof = fof_fof(&Tree, NULL, 1, MPI_COMM_WORLD);
+    message(0, "Found %ld groups, direct search found %d\n", fof.TotNgroups, ndirect);
+    assert_int_equal(fof.TotNgroups, ndirect);
+
+    int * lengths = mymalloc("lengths", (fof.Ngroups + 1) * sizeof(int));
+    for(i = 0; i < fof.Ngroups; i++)
+        lengths[i] = fof.Group[i].Length;
+    int * counts = ta_malloc("counts", int, 2 * NTask);
+    int * offsets = counts + NTask;
+    MPI_Allgather(&fof.Ngroups, 1, MPI_INT, counts, 1, MPI_INT, MPI_COMM_WORLD);
+    offsets[0] = 0;
+    for(i = 1; i < NTask; i++)
+        offsets[i] = offsets[i-1] + counts[i-1];
+    int * alllengths = mymalloc("alllengths", (fof.TotNgroups + 1) * sizeof(int));
+    MPI_Allgatherv(lengths, fof.Ngroups, MPI_INT, alllengths, counts, offsets, MPI_INT, MPI_COMM_WORLD);
+    qsort(alllengths, fof.TotNgroups, sizeof(int), compare_int);
+    for(i = 0; i < ndirect; i++)
+        assert_int_equal(alllengths[i], direct[i]);
+    myfree(alllengths);
+    ta_free(counts);
+    myfree(lengths);
+
+    fof_finish(&fof);
+    force_tree_free(&Tree);
+    domain_free(&ddecomp);
+    /* The exchange allocates slots only when particles move between ranks*/
+    if(SlotsManager->Base) {
+        slots_free(SlotsManager);
+        SlotsManager->Base = NULL;
+    }
+    myfree(direct);
+    myfree(allpos);
+    myfree(P);
+}
+
+/* Set the FOF parameters, with links only from particles above SeedMinOverDensity in the seeding FOF*/
+static void
+set_fof_testpar(double SeedMinOverDensity, double MeanSeparation)
+{
+    ParameterSet * ps = parameter_set_new();
+    param_declare_int(ps, "FOFSaveParticles", OPTIONAL, 1, "");
+    param_declare_double(ps, "FOFHaloLinkingLength", OPTIONAL, LINKLENGTH, "");
+    param_declare_int(ps, "FOFHaloMinLength", OPTIONAL, MINLENGTH, "");
+    param_declare_double(ps, "MinFoFMassForNewSeed", OPTIONAL, 2, "");
+    param_declare_double(ps, "FOFSeedMinOverDensity", OPTIONAL, SeedMinOverDensity, "");
+    char * error;
+    param_parse(ps, "", &error);
+    set_fof_params(ps);
+    fof_init(MeanSeparation, 1.);
+}
+
+/* Store the group number of every particle in the grnr array, which is indexed by ID. Particles in no group have -1.*/
+static void
+gather_grnr(int64_t * grnr, const int ntot)
+{
+    int i;
+    for(i = 0; i < ntot; i++)
+        grnr[i] = -1;
+    for(i = 0; i < PartManager->NumPart; i++)
+        grnr[P[i].ID] = P[i].GrNr;
+    MPI_Allreduce(MPI_IN_PLACE, grnr, ntot, MPI_INT64, MPI_MAX, MPI_COMM_WORLD);
+}
+
+/* Run the seeding FOF and check that every group it finds lies within one full FOF group.
+ * Returns the fraction of the mass in full FOF groups which is not in a seeding group.*/
+static double
+seed_lost_fraction(ForceTree * tree, const int64_t * full, int64_t * seed, const int ntot, double SeedMinOverDensity, double MeanSeparation)
+{
+    int i;
+    set_fof_testpar(SeedMinOverDensity, MeanSeparation);
+    FOFGroups fof = fof_fof_seed(tree, MPI_COMM_WORLD);
+    gather_grnr(seed, ntot);
+    const int64_t nseed = fof.TotNgroups;
+    fof_finish(&fof);
+
+    /* host[g] is the full group containing seeding group g + 1: group numbers start at 1*/
+    int64_t * host = mymalloc("host", (nseed + 1) * sizeof(int64_t));
+    for(i = 0; i < nseed; i++)
+        host[i] = -1;
+    int64_t fullmass = 0, seedmass = 0;
+    for(i = 0; i < ntot; i++) {
+        if(full[i] >= 1)
+            fullmass++;
+        if(seed[i] < 1)
+            continue;
+        seedmass++;
+        assert_true(seed[i] <= nseed);
+        assert_true(full[i] >= 1);
+        if(host[seed[i] - 1] < 0)
+            host[seed[i] - 1] = full[i];
+        assert_true(host[seed[i] - 1] == full[i]);
+    }
+    myfree(host);
+    assert_true(seedmass > 0);
+    const double lost = 1 - (double) seedmass / fullmass;
+    message(0, "Seeding FOF above overdensity %g found %ld groups with %ld particles, full FOF groups have %ld particles: lost fraction %g\n",
+            SeedMinOverDensity, nseed, seedmass, fullmass, lost);
+    return lost;
+}
+
+/* The seeding FOF links only from particles in overdense tree leaves.
+ * Check that each of its groups is part of one full FOF group,
+ * and that little of the mass of the full FOF groups is lost.*/
+static void
+test_fof_seed(void ** state)
+{
+    gsl_rng * r = (gsl_rng *) *state;
+    int ThisTask, NTask;
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    MPI_Comm_size(MPI_COMM_WORLD, &NTask);
+
+    const int numpart = 4096;
+    const int ntot = NTask * numpart;
+    particle_alloc_memory(4 * numpart);
+    /* Halos with an isothermal profile, so that the FOF boundary is in the outskirts*/
+    const int nclump = 8;
+    const double rclump = 1.;
+    double centre[8][3];
+    int i, j;
+    gsl_rng_set(r, 23);
+    for(i = 0; i < nclump; i++)
+        for(j = 0; j < 3; j++)
+            centre[i][j] = BOXSIZE * gsl_rng_uniform(r);
+    gsl_rng_set(r, 200 + ThisTask);
+    for(i = 0; i < numpart; i++) {
+        double dir[3] = {1, 1, 1}, dir2 = 3;
+        while(dir2 > 1 || dir2 == 0) {
+            dir2 = 0;
+            for(j = 0; j < 3; j++) {
+                dir[j] = 2 * gsl_rng_uniform(r) - 1;
+                dir2 += dir[j] * dir[j];
+            }
+        }
+        const double rad = rclump * gsl_rng_uniform(r) / sqrt(dir2);
+        for(j = 0; j < 3; j++) {
+            double x;
+            if(i % 2)
+                x = centre[i % nclump][j] + rad * dir[j];
+            else
+                x = BOXSIZE * gsl_rng_uniform(r);
+            P[i].Pos[j] = x - BOXSIZE * floor(x / BOXSIZE);
+        }
+        P[i].Type = 1;
+        P[i].Mass = 1;
+        P[i].ID = (MyIDType) ThisTask * numpart + i;
+        P[i].Key = PEANO(P[i].Pos, BOXSIZE);
+    }
+    PartManager->NumPart = numpart;
+
+    DomainDecomp ddecomp = {0};
+    domain_decompose_full(&ddecomp);
+    ForceTree Tree = {0};
+    force_tree_rebuild(&Tree, &ddecomp, BOXSIZE, 0, 1, NULL);
+
+    int64_t * full = mymalloc("full", ntot * sizeof(int64_t));
+    int64_t * seed = mymalloc("seed", ntot * sizeof(int64_t));
+    /* Linking length of 0.2 mean separations, for which the FOF boundary is at an overdensity of ~80*/
+    const double MeanSeparation = BOXSIZE / cbrt(ntot);
+
+    set_fof_testpar(0, MeanSeparation);
+    FOFGroups fof = fof_fof(&Tree, NULL, 1, MPI_COMM_WORLD);
+    gather_grnr(full, ntot);
+    fof_finish(&fof);
+
+    /* Well below the FOF boundary density almost no mass is lost*/
+    const double lost = seed_lost_fraction(&Tree, full, seed, ntot, 10, MeanSeparation);
+    assert_true(lost < 0.01);
+    /* At the FOF boundary density the outskirts are lost, but the groups are still parts of full groups*/
+    const double lostboundary = seed_lost_fraction(&Tree, full, seed, ntot, 80, MeanSeparation);
+    assert_true(lostboundary >= lost);
+    set_fof_testpar(0, 1.);
+
+    myfree(seed);
+    myfree(full);
+    force_tree_free(&Tree);
+    domain_free(&ddecomp);
+    if(SlotsManager->Base) {
+        slots_free(SlotsManager);
+        SlotsManager->Base = NULL;
+    }
+    myfree(P);
+}
+
+/* A singular isothermal sphere of unit mass and radius, with enclosed mass M(<r) = r,
+ * has a mean enclosed density of 3 / (4 pi r^2). Check the spherical overdensity
+ * masses and radii computed around its centre against the analytic values.*/
+static void
+test_fof_so(void ** state)
+{
+    gsl_rng * r = (gsl_rng *) *state;
+    int ThisTask, NTask;
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    MPI_Comm_size(MPI_COMM_WORLD, &NTask);
+
+    const int numpart = 16384;
+    const int64_t ntot = (int64_t) NTask * numpart;
+    particle_alloc_memory(4 * numpart);
+    const double centre[3] = {BOXSIZE / 2, BOXSIZE / 2, BOXSIZE / 2};
+    int i, j;
+    gsl_rng_set(r, 300 + ThisTask);
+    for(i = 0; i < numpart; i++) {
+        double dir[3] = {1, 1, 1}, dir2 = 3;
+        while(dir2 > 1 || dir2 == 0) {
+            dir2 = 0;
+            for(j = 0; j < 3; j++) {
+                dir[j] = 2 * gsl_rng_uniform(r) - 1;
+                dir2 += dir[j] * dir[j];
+            }
+        }
+        /* A uniform radius gives M(<r) proportional to r*/
+        const double rad = gsl_rng_uniform(r);
+        for(j = 0; j < 3; j++)
+            P[i].Pos[j] = centre[j] + rad * dir[j] / sqrt(dir2);
+        P[i].Type = 1;
+        P[i].Mass = 1. / ntot;
+        /* Only the position of the minimum matters*/
+        P[i].Potential = rad;
+        P[i].ID = (MyIDType) ThisTask * numpart + i;
+        P[i].Key = PEANO(P[i].Pos, BOXSIZE);
+    }
+    PartManager->NumPart = numpart;
+
+    DomainDecomp ddecomp = {0};
+    domain_decompose_full(&ddecomp);
+    ForceTree Tree = {0};
+    force_tree_rebuild(&Tree, &ddecomp, BOXSIZE, 0, 1, NULL);
+
+    /* With G = 1 and a = 1 the critical density is 3 H^2 / (8 pi) = 3 / (200 pi), so R200c = 1/2.
+     * The mean density is half of that, so no SO radius is outside the sphere.*/
+    Cosmology CP = {0};
+    CP.Hubble = 0.2;
+    CP.Omega0 = 0.5;
+    CP.OmegaCDM = 0.5;
+    CP.OmegaLambda = 0.5;
+    const double rhocrit = 3 * CP.Hubble * CP.Hubble / (8 * M_PI);
+    double rhoso[FOF_SO_NDEF];
+    rhoso[FOF_SO_CRIT200] = 200 * rhocrit;
+    rhoso[FOF_SO_MEAN200] = 200 * CP.Omega0 * rhocrit;
+    rhoso[FOF_SO_CRIT500] = 500 * rhocrit;
+
+    /* The linking length is larger than the particle separation at the edge of the sphere*/
+    FOFGroups fof = fof_fof(&Tree, &CP, 1, MPI_COMM_WORLD);
+    assert_int_equal(fof.TotNgroups, 1);
+    for(i = 0; i < fof.Ngroups; i++) {
+        assert_true(fabs(fof.Group[i].Mass - 1) < 1e-6);
+        for(j = 0; j < FOF_SO_NDEF; j++) {
+            /* The expected SO mass M(<rso) is also rso*/
+            const double rso = sqrt(3 / (4 * M_PI * rhoso[j]));
+            message(1, "SO definition %d: radius %g mass %g, expected %g\n", j, fof.Group[i].SORadius[j], fof.Group[i].SOMass[j], rso);
+            /* Poisson noise in the enclosed mass of ~10^4 particles*/
+            assert_true(fabs(fof.Group[i].SORadius[j] / rso - 1) < 0.02);
+            assert_true(fabs(fof.Group[i].SOMass[j] / rso - 1) < 0.06);
+        }
+    }
+
+    fof_finish(&fof);
+    force_tree_free(&Tree);
+    domain_free(&ddecomp);
+    if(SlotsManager->Base) {
+        slots_free(SlotsManager);
+        SlotsManager->Base = NULL;
+    }
+    myfree(P);
+}
+
+static int
+setup_fof(void **state)
+{
+    walltime_init(&CT);
+    slots_init(0.01, SlotsManager);
+    struct DomainParams dp = {0};
+    dp.DomainOverDecompositionFactor = 2;
+    dp.DomainUseGlobalSorting = 0;
+    dp.TopNodeAllocFactor = 1.;
+    dp.SetAsideFactor = 1;
+    set_domain_par(dp);
+    init_forcetree_params(2);
+
+    set_fof_testpar(0, 1.);
+
+    gsl_rng * r = gsl_rng_alloc(gsl_rng_mt19937);
+    *state = (void *) r;
+    return 0;
+}
+
+static int
+teardown_fof(void **state)
+{
+    gsl_rng_free((gsl_rng *) *state);
+    return 0;
+}
+
+int main(void) {
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_fof),
+        cmocka_unit_test(test_fof_seed),
+        cmocka_unit_test(test_fof_so),
+    };
+    return cmocka_run_group_tests_mpi(tests, setup_fof, teardown_fof);
+}
@@ -0,0 +1,222 @@
+/*Tests for the SPH hydro force: the symmetric pair evaluation is compared to evaluating each particle separately.*/
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <math.h>
+#include <mpi.h>
+#include <stdio.h>
+#include <string.h>
+#include <gsl/gsl_rng.h>
+
+#include "stub.h"
+
+#include <libgadget/utils/mymalloc.h>
+#include <libgadget/utils/system.h>
+#include <libgadget/utils/endrun.h>
+#include <libgadget/partmanager.h>
+#include <libgadget/slotsmanager.h>
+#include <libgadget/walltime.h>
+#include <libgadget/domain.h>
+#include <libgadget/forcetree.h>
+#include <libgadget/treewalk.h>
+#include <libgadget/density.h>
+#include <libgadget/hydra.h>
+#include <libgadget/gravity.h>
+
+static struct ClockTable CT;
+
+#define BOXSIZE 8.
+
+struct hydro_result {
+    double Acc[3];
+    double DtEntropy;
+    double MaxSignalVel;
+};
+
+static void
+run_hydro(int SymmetricPairs, size_t MaxExport, ForceTree * tree, struct sph_pred_data * sph_pred, struct hydro_result * res)
+{
+    struct hydro_params hp = {0};
+    hp.ArtBulkViscConst = 0.75;
+    hp.DensityContrastLimit = 100;
+    hp.SymmetricPairs = SymmetricPairs;
+    hp.PackedNeighbours = 0;
+    set_hydropar(hp);
+    treewalk_set_max_export_buffer(MaxExport);
+
+    ActiveParticles act = {0};
+    act.NumActiveParticle = PartManager->NumPart;
+    hydro_force(&act, 0, 1, 0.1, 1, sph_pred, tree);
+    treewalk_set_max_export_buffer(0);
+
+    int i, k;
+    for(i = 0; i < PartManager->NumPart; i++) {
+        for(k = 0; k < 3; k++)
+            res[i].Acc[k] = SPHP(i).HydroAccel[k];
+        res[i].DtEntropy = SPHP(i).DtEntropy;
+        res[i].MaxSignalVel = SPHP(i).MaxSignalVel;
+    }
+}
+
+/* The node hmax bounds how far the smoothing lengths of the particles in a node reach outside it,
+ * and is not exact. Set it to the largest smoothing length, so that the one-sided neighbour search
+ * of the reference evaluation finds every pair found by the symmetric evaluation.*/
+static void
+set_tree_max_hmax(ForceTree * tree)
+{
+    int i;
+    double maxhsml = 0;
+    for(i = 0; i < PartManager->NumPart; i++)
+        if(P[i].Hsml > maxhsml)
+            maxhsml = P[i].Hsml;
+    MPI_Allreduce(MPI_IN_PLACE, &maxhsml, 1, MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD);
+    for(i = tree->firstnode; i < tree->firstnode + tree->numnodes; i++)
+        tree->Nodes[i].mom.hmax = maxhsml;
+}
+
+/* Check that the symmetric evaluation gives the same forces up to round-off*/
+static void
+compare_hydro(const struct hydro_result * ref, const struct hydro_result * res)
+{
+    int i, k;
+    double maxdtentropy = 0;
+    for(i = 0; i < PartManager->NumPart; i++)
+        if(fabs(ref[i].DtEntropy) > maxdtentropy)
+            maxdtentropy = fabs(ref[i].DtEntropy);
+    MPI_Allreduce(MPI_IN_PLACE, &maxdtentropy, 1, MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD);
+
+    double maxerr = 0;
+    for(i = 0; i < PartManager->NumPart; i++) {
+        double acc = 0, err = 0;
+        for(k = 0; k < 3; k++) {
+            acc += ref[i].Acc[k] * ref[i].Acc[k];
+            err += (res[i].Acc[k] - ref[i].Acc[k]) * (res[i].Acc[k] - ref[i].Acc[k]);
+        }
+        assert_true(sqrt(err) <= 1e-9 * sqrt(acc));
+        assert_true(fabs(res[i].DtEntropy - ref[i].DtEntropy) <= 1e-9 * maxdtentropy);
+        assert_true(fabs(res[i].MaxSignalVel - ref[i].MaxSignalVel) <= 1e-12 * ref[i].MaxSignalVel);
+        if(acc > 0 && sqrt(err / acc) > maxerr)
+            maxerr = sqrt(err / acc);
+    }
+    MPI_Allreduce(MPI_IN_PLACE, &maxerr, 1, MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD);
+    message(0, "Max relative error in the symmetric hydro acceleration: %g\n", maxerr);
+}
+
+static void
+test_hydro_symmetric(void ** state)
+{
+    gsl_rng * r = (gsl_rng *) *state;
+    int ThisTask, NTask;
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    MPI_Comm_size(MPI_COMM_WORLD, &NTask);
+
+    const int numpart = 4096;
+    particle_alloc_memory(4 * numpart);
+    int NType[6] = {0};
+    NType[0] = numpart;
+    slots_reserve(1, NType, SlotsManager);
+    slots_setup_topology(PartManager, NType, SlotsManager);
+    PartManager->NumPart = numpart;
+
+    gsl_rng_set(r, 100 + ThisTask);
+    int i, j;
+    for(i = 0; i < numpart; i++) {
+        for(j = 0; j < 3; j++) {
+            /* Half of the particles are in a dense clump, so the smoothing lengths vary*/
+            double x;
+            if(i % 2)
+                x = BOXSIZE / 2 + BOXSIZE / 8 * (gsl_rng_uniform(r) - 0.5);
+            else
+                x = BOXSIZE * gsl_rng_uniform(r);
+            P[i].Pos[j] = x - BOXSIZE * floor(x / BOXSIZE);
+            /* A converging flow, so that the artificial viscosity is on*/
+            P[i].Vel[j] = -(P[i].Pos[j] - BOXSIZE / 2) + 0.3 * (gsl_rng_uniform(r) - 0.5);
+        }
+        P[i].Mass = 1;
+        P[i].ID = (MyIDType) ThisTask * numpart + i;
+        P[i].Key = PEANO(P[i].Pos, BOXSIZE);
+        P[i].Hsml = BOXSIZE / cbrt(NTask * numpart);
+        memset(&SPHP(i), 0, sizeof(struct sph_particle_data));
+        SPHP(i).Entropy = 1 + gsl_rng_uniform(r);
+    }
+    slots_setup_id(PartManager, SlotsManager);
+
+    DomainDecomp ddecomp = {0};
+    domain_decompose_full(&ddecomp);
+    ForceTree Tree = {0};
+    force_tree_rebuild(&Tree, &ddecomp, BOXSIZE, 0, 1, NULL);
+
+    ActiveParticles act = {0};
+    act.NumActiveParticle = PartManager->NumPart;
+    struct sph_pred_data sph_pred = slots_allocate_sph_pred_data(SlotsManager->info[0].size);
+    density(&act, 1, 0, 0, 1, 0, 1, &sph_pred, NULL, &Tree);
+    force_update_hmax(NULL, PartManager->NumPart, &Tree, &ddecomp);
+    set_tree_max_hmax(&Tree);
+
+    struct hydro_result * ref = mymalloc2("ref", PartManager->NumPart * sizeof(struct hydro_result));
+    struct hydro_result * res = mymalloc2("res", PartManager->NumPart * sizeof(struct hydro_result));
+
+    run_hydro(0, 0, &Tree, &sph_pred, ref);
+    run_hydro(1, 0, &Tree, &sph_pred, res);
+    compare_hydro(ref, res);
+    /* With a small export buffer the treewalk runs in several iterations,
+     * and some particles are walked more than once.*/
+    run_hydro(1, 128, &Tree, &sph_pred, res);
+    compare_hydro(ref, res);
+
+    myfree(res);
+    myfree(ref);
+    slots_free_sph_pred_data(&sph_pred);
+    force_tree_free(&Tree);
+    domain_free(&ddecomp);
+    slots_free(SlotsManager);
+    myfree(P);
+}
+
+static int
+setup_hydro(void **state)
+{
+    walltime_init(&CT);
+    slots_init(0.01, SlotsManager);
+    slots_set_enabled(0, sizeof(struct sph_particle_data), SlotsManager);
+    struct DomainParams dp = {0};
+    dp.DomainOverDecompositionFactor = 2;
+    dp.DomainUseGlobalSorting = 0;
+    dp.TopNodeAllocFactor = 1.;
+    dp.SetAsideFactor = 1;
+    set_domain_par(dp);
+    init_forcetree_params(2);
+
+    struct density_params dens = {0};
+    dens.DensityResolutionEta = 1.;
+    dens.BlackHoleNgbFactor = 2;
+    dens.MaxNumNgbDeviation = 0.5;
+    dens.DensityKernelType = DENSITY_KERNEL_CUBIC_SPLINE;
+    dens.MinGasHsmlFractional = 0.006;
+    dens.BlackHoleMaxAccretionRadius = 99999.;
+    set_densitypar(dens);
+    struct gravshort_tree_params tree_params = {0};
+    tree_params.FractionalGravitySoftening = 1;
+    set_gravshort_treepar(tree_params);
+    gravshort_set_softenings(0.01);
+
+    gsl_rng * r = gsl_rng_alloc(gsl_rng_mt19937);
+    *state = (void *) r;
+    return 0;
+}
+
+static int
+teardown_hydro(void **state)
+{
+    gsl_rng_free((gsl_rng *) *state);
+    return 0;
+}
+
+int main(void) {
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_hydro_symmetric),
+    };
+    return cmocka_run_group_tests_mpi(tests, setup_hydro, teardown_hydro);
+}
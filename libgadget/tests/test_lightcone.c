@@ -0,0 +1,439 @@
+/* Tests for the lightcone: the HEALPix pixels of the maps,
+ * the mass binned into the maps of a shell, also across a restart,
+ * and the drift factor at which a particle meets the horizon during a step.*/
+#define _XOPEN_SOURCE 700
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <ftw.h>
+#include <mpi.h>
+#include <bigfile.h>
+#include <gsl/gsl_rng.h>
+#include "stub.h"
+
+/* The functions tested are static*/
+#include <libgadget/lightcone.c>
+
+static char prefix[1024] = "lightcone-test-XXXXXX";
+
+/* Centre of a pixel in the RING scheme, following pix2ang_ring of the HEALPix library*/
+static void
+pix2vec_ring(const int64_t nside, const int64_t pix, double * vec)
+{
+    const int64_t ncap = 2 * nside * (nside - 1);
+    const int64_t npix = 12 * nside * nside;
+    double z, phi;
+    if(pix < ncap) {
+        /* North polar cap: ring i has 4 i pixels*/
+        int64_t i = (1 + (int64_t) sqrt(1 + 2 * pix)) / 2;
+        while(2 * i * (i - 1) > pix)
+            i--;
+        while(2 * (i + 1) * i <= pix)
+            i++;
+        const int64_t iphi = pix + 1 - 2 * i * (i - 1);
+        z = 1 - (double) (i * i) / (3 * nside * nside);
+        phi = (iphi - 0.5) * M_PI / (2 * i);
+    } else if(pix < npix - ncap) {
+        /* Equatorial belt: rings of 4 nside pixels, every other one shifted by half a pixel*/
+        const int64_t ip = pix - ncap;
+        const int64_t i = ip / (4 * nside) + nside;
+        const int64_t iphi = ip % (4 * nside) + 1;
+        const double fodd = ((i + nside) & 1) ? 1 : 0.5;
+        z = (2 * nside - i) * 2. / (3 * nside);
+        phi = (iphi - fodd) * M_PI / (2 * nside);
+    } else {
+        /* South polar cap, counting rings from the south pole*/
+        const int64_t ip = npix - pix;
+        int64_t i = (1 + (int64_t) sqrt(2 * ip - 1)) / 2;
+        while(2 * i * (i - 1) >= ip)
+            i--;
+        while(2 * (i + 1) * i < ip)
+            i++;
+        const int64_t iphi = 4 * i + 1 - (ip - 2 * i * (i - 1));
+        z = -1 + (double) (i * i) / (3 * nside * nside);
+        phi = (iphi - 0.5) * M_PI / (2 * i);
+    }
+    const double sintheta = sqrt((1 - z) * (1 + z));
+    vec[0] = sintheta * cos(phi);
+    vec[1] = sintheta * sin(phi);
+    vec[2] = z;
+}
+
+/* Direction of colatitude cos(theta) = z and azimuth phi, with a length which should not matter*/
+static int64_t
+pix_of(const int64_t nside, const double z, const double phi)
+{
+    const double sintheta = sqrt((1 - z) * (1 + z));
+    const double vec[3] = {3 * sintheta * cos(phi), 3 * sintheta * sin(phi), 3 * z};
+    return healpix_vec2pix_ring(nside, vec);
+}
+
+static void
+test_healpix_pixels(void ** state)
+{
+    /* The base pixels of nside 1: a ring of 4 around each pole, and 4 centred on the equator
+     * at azimuths 0, pi/2, pi and 3 pi / 2*/
+    const double px[3] = {1, 0, 0}, py[3] = {0, 1, 0}, mx[3] = {-1, 0, 0}, my[3] = {0, -1, 0};
+    assert_int_equal(healpix_vec2pix_ring(1, px), 4);
+    assert_int_equal(healpix_vec2pix_ring(1, py), 5);
+    assert_int_equal(healpix_vec2pix_ring(1, mx), 6);
+    assert_int_equal(healpix_vec2pix_ring(1, my), 7);
+    assert_int_equal(pix_of(1, 0.9, M_PI / 4), 0);
+    assert_int_equal(pix_of(1, -0.9, 7 * M_PI / 4), 11);
+
+    int64_t nside;
+    for(nside = 1; nside <= 64; nside *= 4) {
+        const int64_t npix = 12 * nside * nside;
+        /* The poles are in the first pixel of the first ring and the first pixel of the last ring*/
+        const double north[3] = {0, 0, 1}, south[3] = {0, 0, -2};
+        assert_int_equal(healpix_vec2pix_ring(nside, north), 0);
+        assert_int_equal(healpix_vec2pix_ring(nside, south), npix - 4);
+        /* The azimuth wraps: just below 2 pi is the last pixel of a ring, just above 0 the first*/
+        const double zcap = 1 - 1. / (3 * nside * nside);
+        assert_int_equal(pix_of(nside, zcap, -1e-6), 3);
+        assert_int_equal(pix_of(nside, zcap, 2 * M_PI - 1e-6), 3);
+        assert_int_equal(pix_of(nside, zcap, 1e-6), 0);
+        assert_int_equal(pix_of(nside, -zcap, -1e-6), npix - 1);
+        /* Equatorial ring 2 nside - 1. Its first pixel is centred at azimuth 0,
+         * unless the ring is shifted by half a pixel, when it starts there.
+         * Test a quarter of a pixel from azimuth 0 on each side.*/
+        const int64_t first = 2 * nside * (nside - 1) + (nside - 1) * 4 * nside;
+        double vec[3];
+        pix2vec_ring(nside, first, vec);
+        const double phifirst = atan2(vec[1], vec[0]);
+        const double quarter = M_PI / (8 * nside);
+        assert_int_equal(pix_of(nside, vec[2], quarter), first);
+        if(fabs(phifirst) < 1e-12) {
+            assert_int_equal(pix_of(nside, vec[2], -quarter), first);
+            assert_int_equal(pix_of(nside, vec[2], 2 * M_PI - quarter), first);
+        } else {
+            assert_int_equal(pix_of(nside, vec[2], -quarter), first + 4 * nside - 1);
+            assert_int_equal(pix_of(nside, vec[2], 2 * M_PI - quarter), first + 4 * nside - 1);
+        }
+
+        /* Every pixel centre is in its pixel, including those with azimuths beyond pi, which atan2 returns negative*/
+        int64_t pix;
+        for(pix = 0; pix < npix; pix++) {
+            double vec[3];
+            pix2vec_ring(nside, pix, vec);
+            assert_int_equal(healpix_vec2pix_ring(nside, vec), pix);
+        }
+    }
+}
+
+/* Particles at random radii around the horizon, moving radially,
+ * with a shell swept from radius 1100 down to 1000 during a step of unit drift factor*/
+#define NPART 4000
+#define CHI0 1100.
+#define CHI1 1000.
+
+static void
+setup_crossing_particles(void)
+{
+    int ThisTask;
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    particle_alloc_memory(NPART);
+    gsl_rng * r = gsl_rng_alloc(gsl_rng_ranlxd1);
+    gsl_rng_set(r, 1234 + ThisTask);
+    int i, k;
+    for(i = 0; i < NPART; i++) {
+        double dir[3], len = 0;
+        for(k = 0; k < 3; k++) {
+            dir[k] = gsl_rng_uniform(r) - 0.5;
+            len += dir[k] * dir[k];
+        }
+        len = sqrt(len);
+        const double rad = 900 + 300 * gsl_rng_uniform(r);
+        const double vel = 300 * (gsl_rng_uniform(r) - 0.5);
+        for(k = 0; k < 3; k++) {
+            P[i].Pos[k] = rad * dir[k] / len;
+            P[i].Vel[k] = vel * dir[k] / len;
+        }
+        P[i].Mass = 1 + gsl_rng_uniform(r);
+        P[i].Type = 1;
+        P[i].ID = (MyIDType) ThisTask * NPART + i;
+    }
+    PartManager->NumPart = NPART;
+    gsl_rng_free(r);
+
+    Nreplica = 1;
+    Reps[0][0] = Reps[0][1] = Reps[0][2] = 0;
+    HorizonDistancePrev = CHI0;
+    HorizonDistance2Prev = CHI0 * CHI0;
+    HorizonDistance = CHI1;
+    HorizonDistance2 = CHI1 * CHI1;
+    Step.ddrift = 1;
+    Step.chi[0] = CHI0;
+    Step.chi[1] = CHI1 - CHI0;
+    Step.chi[2] = 0;
+    SampleFraction = 0.5;
+}
+
+/* Find the crossings of the particles from start to end and bin them into the maps.
+ * Returns the mass of the particles which crossed and were sampled, summed over ranks.*/
+static double
+bin_crossings(int start, int end)
+{
+    struct LightconeBuffer buffers[6];
+    memset(buffers, 0, sizeof(buffers));
+    const int rep = 0;
+    double mass = 0;
+    int i;
+    for(i = start; i < end; i++) {
+        lightcone_cross(i, &rep, 1, &Step, 1, &buffers[1]);
+        double r0 = 0, r1 = 0;
+        int k;
+        for(k = 0; k < 3; k++) {
+            r0 += P[i].Pos[k] * P[i].Pos[k];
+            r1 += (P[i].Pos[k] + P[i].Vel[k]) * (P[i].Pos[k] + P[i].Vel[k]);
+        }
+        if(sqrt(r0) <= CHI0 && sqrt(r1) >= CHI1 && get_random_number(P[i].ID) <= SampleFraction)
+            mass += P[i].Mass;
+    }
+    struct IOTable IOTable = {0};
+    lightcone_write_type(1, buffers, 1, &IOTable, 0, 0.5);
+    MPI_Allreduce(MPI_IN_PLACE, &mass, 1, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+    return mass;
+}
+
+/* Sum of the mass map of a shell in the lightcone file*/
+static double
+read_mass_map(int shell)
+{
+    char blockname[128];
+    snprintf(blockname, sizeof(blockname), "Maps/%04d/Mass", shell);
+    BigBlock bb = {0};
+    BigBlockPtr ptr = {0};
+    assert_int_equal(big_file_mpi_open_block(&lightcone_bf, &bb, blockname, MPI_COMM_WORLD), 0);
+    assert_int_equal(bb.size, LightconeMaps.npix);
+    double * map = malloc(sizeof(double) * bb.size);
+    BigArray array = {0};
+    size_t dims[2] = {bb.size, 1};
+    big_array_init(&array, map, "f8", 2, dims, NULL);
+    assert_int_equal(big_block_seek(&bb, &ptr, 0), 0);
+    assert_int_equal(big_block_read(&bb, &ptr, &array), 0);
+    double sum = 0;
+    int64_t i;
+    for(i = 0; i < (int64_t) bb.size; i++)
+        sum += map[i];
+    assert_int_equal(big_block_mpi_close(&bb, MPI_COMM_WORLD), 0);
+    free(map);
+    return sum;
+}
+
+static void
+open_maps(const char * name, int shell)
+{
+    char fname[2048];
+    snprintf(fname, sizeof(fname), "%s/%s", prefix, name);
+    assert_int_equal(big_file_mpi_create(&lightcone_bf, fname, MPI_COMM_WORLD), 0);
+    LightconeParams.Types = 2;
+    LightconeParams.WriteParticles = 0;
+    LightconeParams.MapNside = 8;
+    LightconeParams.MapShellWidth = 1000;
+    LightconeParams.MapFields.NFields = 0;
+    LightconeMaps.npix = 12 * LightconeParams.MapNside * LightconeParams.MapNside;
+    LightconeMaps.nmaps = 1;
+    LightconeMaps.map = calloc(LightconeMaps.npix, sizeof(double));
+    LightconeMaps.shell = shell;
+    LightconeMaps.TimeFirst = LightconeMaps.TimeLast = 0.5;
+}
+
+static void
+close_maps(void)
+{
+    free(LightconeMaps.map);
+    LightconeMaps.map = NULL;
+    assert_int_equal(big_file_mpi_close(&lightcone_bf, MPI_COMM_WORLD), 0);
+    myfree(P);
+}
+
+/* The mass map of a shell holds the mass of the sampled crossings divided by SampleFraction*/
+static void
+test_shell_mass(void ** state)
+{
+    setup_crossing_particles();
+    open_maps("mass", 1);
+    const double mass = bin_crossings(0, NPART);
+    assert_true(mass > 0);
+    lightcone_flush_maps();
+    const double sum = read_mass_map(1);
+    assert_true(fabs(sum - mass / SampleFraction) <= 1e-10 * sum);
+    close_maps();
+}
+
+/* The maps of the shell in progress are saved with a snapshot, and a run restarted
+ * from it carries on with them*/
+static void
+test_restart_maps(void ** state)
+{
+    setup_crossing_particles();
+    open_maps("restart", 2);
+    LightconeMaps.TimeFirst = 0.4;
+    double mass = bin_crossings(0, NPART / 2);
+    lightcone_save_maps(7);
+
+    /* The restarted run starts with empty maps*/
+    memset(LightconeMaps.map, 0, sizeof(double) * LightconeMaps.npix);
+    LightconeMaps.shell = -1;
+    lightcone_restore_maps(8);
+    assert_int_equal(LightconeMaps.shell, -1);
+    lightcone_restore_maps(7);
+    assert_int_equal(LightconeMaps.shell, 2);
+    assert_true(LightconeMaps.TimeFirst == 0.4);
+
+    mass += bin_crossings(NPART / 2, NPART);
+    lightcone_flush_maps();
+    const double sum = read_mass_map(2);
+    assert_true(fabs(sum - mass / SampleFraction) <= 1e-10 * sum);
+    close_maps();
+}
+
+/* A flat LCDM cosmology in the default units, with the horizon table from a = 0.1*/
+static void
+setup_cosmology(Cosmology * CP)
+{
+    memset(CP, 0, sizeof(Cosmology));
+    CP->Hubble = 0.1;
+    CP->Omega0 = 0.3;
+    CP->OmegaCDM = 0.3;
+    CP->OmegaLambda = 0.7;
+    All.UnitLength_in_cm = 3.085678e21;
+    All.TimeIC = 0.1;
+    All.TimeMax = 1;
+    setup_sync_points(All.TimeIC, 0);
+    int i;
+    dloga = (0.0 - log(All.TimeIC)) / (NENTRY - 1);
+    for(i = 0; i < NENTRY; i++)
+        lightcone_init_entry(CP, i);
+}
+
+/* The horizon model of a step at drift factor D*/
+static double
+step_horizon(const struct LightconeStep * step, double D)
+{
+    return step->chi[0] + D * (step->chi[1] + D * step->chi[2]);
+}
+
+/* The horizon of a step is exact at its ends and close to the horizon table in between*/
+static void
+test_lightcone_step(void ** state)
+{
+    Cosmology CP;
+    setup_cosmology(&CP);
+    const inttime_t ti0 = ti_from_loga(log(0.5)), ti1 = ti_from_loga(log(0.52));
+    Step.ti0 = Step.ti1 = -1;
+    lightcone_set_step(&CP, ti0, ti1);
+    assert_true(Step.ti0 == ti0 && Step.ti1 == ti1);
+    assert_true(fabs(Step.ddrift / get_exact_drift_factor(&CP, ti0, ti1) - 1) < 1e-12);
+
+    const double chi0 = lightcone_get_horizon(exp(loga_from_ti(ti0)));
+    const double chi1 = lightcone_get_horizon(exp(loga_from_ti(ti1)));
+    assert_true(chi1 < chi0);
+    assert_true(fabs(step_horizon(&Step, 0) - chi0) <= 1e-10 * chi0);
+    assert_true(fabs(step_horizon(&Step, Step.ddrift) - chi1) <= 1e-10 * chi0);
+    int q;
+    for(q = 1; q < 8; q++) {
+        const inttime_t ti = ti0 + (ti1 - ti0) / 8 * q;
+        const double D = get_exact_drift_factor(&CP, ti0, ti);
+        const double chi = lightcone_get_horizon(exp(loga_from_ti(ti)));
+        assert_true(fabs(step_horizon(&Step, D) - chi) <= 1e-4 * (chi0 - chi1));
+    }
+}
+
+/* The drift factor of the crossing is in the step, and there the particle is on the horizon.
+ * Particles at rest, slow and fast ones, moving outwards, inwards and across the line of sight.*/
+static void
+test_lightcone_solve_crossing(void ** state)
+{
+    Cosmology CP;
+    setup_cosmology(&CP);
+    const inttime_t ti0 = ti_from_loga(log(0.5)), ti1 = ti_from_loga(log(0.52));
+    Step.ti0 = Step.ti1 = -1;
+    lightcone_set_step(&CP, ti0, ti1);
+    const double d1 = Step.ddrift;
+    const double chi0 = step_horizon(&Step, 0);
+    const double dchi = chi0 - step_horizon(&Step, d1);
+    /* Radial and tangential unit vectors*/
+    const double er[3] = {1 / sqrt(3), 1 / sqrt(3), 1 / sqrt(3)};
+    const double et[3] = {1 / sqrt(2), -1 / sqrt(2), 0};
+    /* Starting distance inside the horizon in units of dchi,
+     * and radial and tangential velocities in units of dchi / ddrift*/
+    const double cases[][3] = {
+        {0.3, 0, 0},
+        {1e-6, 0, 0},
+        {0.5, 0.01, 0},
+        {0.6, 0, 0.02},
+        {0.01, -0.5, 0},
+        /* Fast: crosses in a small part of the step*/
+        {0.9, 30, 0},
+        {0.2, 6, 8},
+        {0.1, 0.5, 40},
+    };
+    int c, k;
+    for(c = 0; c < (int) (sizeof(cases) / sizeof(cases[0])); c++) {
+        double x0[3], v[3], x1[3];
+        for(k = 0; k < 3; k++) {
+            x0[k] = (chi0 - cases[c][0] * dchi) * er[k];
+            v[k] = (cases[c][1] * er[k] + cases[c][2] * et[k]) * dchi / d1;
+            x1[k] = x0[k] + v[k] * d1;
+        }
+        const double r0 = sqrt(x0[0] * x0[0] + x0[1] * x0[1] + x0[2] * x0[2]);
+        const double r1 = sqrt(x1[0] * x1[0] + x1[1] * x1[1] + x1[2] * x1[2]);
+        /* As checked by lightcone_cross*/
+        assert_true(r0 <= chi0 && r1 >= step_horizon(&Step, d1));
+        const double D = lightcone_solve_crossing(x0, v, r0, r1, &Step);
+        assert_true(D >= 0 && D <= d1);
+        double r = 0;
+        for(k = 0; k < 3; k++)
+            r += (x0[k] + v[k] * D) * (x0[k] + v[k] * D);
+        assert_true(fabs(sqrt(r) - step_horizon(&Step, D)) <= 1e-8 * chi0);
+    }
+}
+
+static int
+remove_entry(const char * path, const struct stat * st, int flag, struct FTW * ftw)
+{
+    return remove(path);
+}
+
+static int
+setup_lightcone(void ** state)
+{
+    set_random_numbers(42);
+    int ThisTask;
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    int fail = 0;
+    if(ThisTask == 0)
+        fail = !mkdtemp(prefix);
+    MPI_Bcast(prefix, sizeof(prefix), MPI_CHAR, 0, MPI_COMM_WORLD);
+    MPI_Bcast(&fail, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    return fail;
+}
+
+static int
+teardown_lightcone(void ** state)
+{
+    int ThisTask;
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    if(ThisTask == 0)
+        return nftw(prefix, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+    return 0;
+}
+
+int main(void) {
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_healpix_pixels),
+        cmocka_unit_test(test_shell_mass),
+        cmocka_unit_test(test_restart_maps),
+        cmocka_unit_test(test_lightcone_step),
+        cmocka_unit_test(test_lightcone_solve_crossing),
+    };
+    return cmocka_run_group_tests_mpi(tests, setup_lightcone, teardown_lightcone);
+}
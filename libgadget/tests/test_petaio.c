@@ -0,0 +1,575 @@
+/* Tests for reading a restart snapshot: the rows of each type are split between ranks
+ * either evenly or by the Peano key segments of the spatial index.
+ * Also tests writing a snapshot with PipelineSnapshotBlocks and AsyncSnapshotWrite,
+ * and reading the particles of a sub-volume through the spatial index.*/
+#define _XOPEN_SOURCE 700
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <ftw.h>
+#include <mpi.h>
+#include <bigfile.h>
+#include "stub.h"
+
+#include <libgadget/utils/mymalloc.h>
+#include <libgadget/utils/endrun.h>
+#include <libgadget/utils/paramset.h>
+#include <libgadget/allvars.h>
+#include <libgadget/partmanager.h>
+#include <libgadget/slotsmanager.h>
+#include <libgadget/petaio.h>
+#include <libgadget/utils/peano.h>
+
+static char prefix[1024] = "petaio-test-XXXXXX";
+
+/* Gas, dark matter and a few black holes. Only gas has slots.*/
+static const int64_t NTotal[6] = {3000, 5000, 0, 0, 0, 40};
+#define KEYSPAN (1L << 40)
+
+/* The Peano key of each row: types span the same keys, but the dark matter is denser at small keys,
+ * so a split by key differs from the even split of the rows of each type.*/
+static uint64_t
+row_key(int ptype, int64_t row)
+{
+    const double x = (double) row / NTotal[ptype];
+    return (uint64_t) (KEYSPAN * (ptype == 1 ? x * sqrt(x) : x));
+}
+
+/* First ID of each type*/
+static int64_t
+id_offset(int ptype)
+{
+    int64_t off = 0;
+    int t;
+    for(t = 0; t < ptype; t++)
+        off += NTotal[t];
+    return off;
+}
+
+static void
+write_u8_block(BigFile * bf, const char * blockname, int nmemb, uint64_t * data, size_t nrows)
+{
+    BigBlock bb = {0};
+    BigBlockPtr ptr = {0};
+    BigArray array = {0};
+    size_t dims[2] = {nrows, nmemb};
+    assert_int_equal(big_file_create_block(bf, &bb, blockname, "u8", nmemb, 1, &nrows), 0);
+    big_array_init(&array, data, "u8", 2, dims, NULL);
+    assert_int_equal(big_block_seek(&bb, &ptr, 0), 0);
+    assert_int_equal(big_block_write(&bb, &ptr, &array), 0);
+    assert_int_equal(big_block_close(&bb), 0);
+}
+
+/* Write a snapshot with IDs and a spatial index of chunkrows rows per chunk on the first rank*/
+static void
+write_snapshot(const char * fname, int64_t chunkrows)
+{
+    int ThisTask;
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    if(ThisTask == 0) {
+        BigFile bf = {0};
+        BigBlock bh = {0};
+        assert_int_equal(big_file_create(&bf, fname), 0);
+        assert_int_equal(big_file_create_block(&bf, &bh, "Header", NULL, 0, 0, NULL), 0);
+        assert_int_equal(big_block_set_attr(&bh, "TotNumPart", NTotal, "u8", 6), 0);
+        assert_int_equal(big_block_close(&bh), 0);
+        int ptype;
+        for(ptype = 0; ptype < 6; ptype++) {
+            if(NTotal[ptype] == 0)
+                continue;
+            char blockname[128];
+            int64_t i, c;
+            uint64_t * id = malloc(NTotal[ptype] * sizeof(uint64_t));
+            for(i = 0; i < NTotal[ptype]; i++)
+                id[i] = id_offset(ptype) + i;
+            snprintf(blockname, sizeof(blockname), "%d/ID", ptype);
+            write_u8_block(&bf, blockname, 1, id, NTotal[ptype]);
+            free(id);
+
+            const int64_t nchunk = (NTotal[ptype] + chunkrows - 1) / chunkrows;
+            uint64_t * index = malloc(4 * nchunk * sizeof(uint64_t));
+            for(c = 0; c < nchunk; c++) {
+                const int64_t start = c * chunkrows;
+                const int64_t end = DMIN(start + chunkrows, NTotal[ptype]);
+                index[4 * c] = start;
+                index[4 * c + 1] = end - start;
+                index[4 * c + 2] = row_key(ptype, start);
+                index[4 * c + 3] = row_key(ptype, end - 1);
+            }
+            snprintf(blockname, sizeof(blockname), "%d/PeanoKeyIndex", ptype);
+            write_u8_block(&bf, blockname, 4, index, nchunk);
+            free(index);
+        }
+        assert_int_equal(big_file_close(&bf), 0);
+    }
+    MPI_Barrier(MPI_COMM_WORLD);
+}
+
+static void
+get_id(int i, uint64_t * out, struct particle_data * Parts, struct slots_manager_type * SlotsManager)
+{
+    *out = Parts[i].ID;
+}
+
+static void
+set_id(int i, uint64_t * in, struct particle_data * Parts, struct slots_manager_type * SlotsManager)
+{
+    Parts[i].ID = *in;
+}
+
+static void
+get_pos(int i, double * out, struct particle_data * Parts, struct slots_manager_type * SlotsManager)
+{
+    int d;
+    for(d = 0; d < 3; d++)
+        out[d] = Parts[i].Pos[d];
+}
+
+/* Read the snapshot and check that every row is read by exactly one rank.
+ * Returns 1 if the rows of each type on this rank are those of the even split.*/
+static int
+read_and_check(const char * fname)
+{
+    int NTask, ThisTask;
+    MPI_Comm_size(MPI_COMM_WORLD, &NTask);
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+
+    struct IOTable IOTable = {0};
+    IOTable.allocated = 6;
+    IOTable.ent = mymalloc2("IOTable", IOTable.allocated * sizeof(IOTableEntry));
+    int ptype;
+    for(ptype = 0; ptype < 6; ptype++)
+        io_register_io_block("ID", "u8", 1, ptype, (property_getter) get_id, (property_setter) set_id, 1, &IOTable);
+
+    char name[2048];
+    snprintf(name, sizeof(name), "%s", fname);
+    petaio_read_internal(name, 0, &IOTable, MPI_COMM_WORLD);
+
+    /* The read fits the particle table with room for the domain exchange*/
+    const double mean = (double) All.TotNumPartInit / NTask;
+    assert_true(PartManager->NumPart <= mean + (PartManager->MaxPart - mean) / 2);
+
+    /* The rows of each type on this rank are one range of the block*/
+    int64_t NLocal[6] = {0}, minrow[6], maxrow[6];
+    int i;
+    for(ptype = 0; ptype < 6; ptype++) {
+        minrow[ptype] = NTotal[ptype];
+        maxrow[ptype] = -1;
+    }
+    for(i = 0; i < PartManager->NumPart; i++) {
+        const int t = P[i].Type;
+        const int64_t row = P[i].ID - id_offset(t);
+        assert_true(row >= 0 && row < NTotal[t]);
+        NLocal[t]++;
+        minrow[t] = DMIN(minrow[t], row);
+        maxrow[t] = DMAX(maxrow[t], row);
+    }
+    int even = 1;
+    for(ptype = 0; ptype < 6; ptype++) {
+        if(NLocal[ptype] > 0)
+            assert_int_equal(maxrow[ptype] - minrow[ptype] + 1, NLocal[ptype]);
+        const int64_t start = ThisTask * NTotal[ptype] / NTask;
+        const int64_t end = (ThisTask + 1) * NTotal[ptype] / NTask;
+        if(NLocal[ptype] != end - start || (NLocal[ptype] > 0 && minrow[ptype] != start))
+            even = 0;
+    }
+    /* The counts of each type add up to the header*/
+    MPI_Allreduce(MPI_IN_PLACE, NLocal, 6, MPI_INT64, MPI_SUM, MPI_COMM_WORLD);
+    for(ptype = 0; ptype < 6; ptype++)
+        assert_int_equal(NLocal[ptype], NTotal[ptype]);
+
+    /* The IDs read are those of the even split: each row once*/
+    const int64_t ntot = All.TotNumPartInit;
+    int * nread = mymalloc("nread", ntot * sizeof(int));
+    memset(nread, 0, ntot * sizeof(int));
+    for(i = 0; i < PartManager->NumPart; i++)
+        nread[P[i].ID]++;
+    MPI_Allreduce(MPI_IN_PLACE, nread, ntot, MPI_INT, MPI_SUM, MPI_COMM_WORLD);
+    for(i = 0; i < ntot; i++)
+        assert_int_equal(nread[i], 1);
+    myfree(nread);
+
+    MPI_Allreduce(MPI_IN_PLACE, &even, 1, MPI_INT, MPI_LAND, MPI_COMM_WORLD);
+    slots_free(SlotsManager);
+    SlotsManager->Base = NULL;
+    myfree(P);
+    destroy_io_blocks(&IOTable);
+    return even;
+}
+
+/* The blocks written by petaio record the throughput achieved*/
+static void
+check_write_gbps(const char * fname)
+{
+    BigFile bf = {0};
+    BigBlock bb = {0};
+    double gbps = 0;
+    assert_int_equal(big_file_open(&bf, fname), 0);
+    assert_int_equal(big_file_open_block(&bf, &bb, "1/Position"), 0);
+    assert_int_equal(big_block_get_attr(&bb, "WriteGBps", &gbps, "f8", 1), 0);
+    assert_true(gbps > 0);
+    assert_int_equal(big_block_close(&bb), 0);
+    assert_int_equal(big_file_close(&bf), 0);
+}
+
+static void
+test_restart_read_by_key(void ** state)
+{
+    int NTask;
+    MPI_Comm_size(MPI_COMM_WORLD, &NTask);
+    char fname[2048];
+    snprintf(fname, sizeof(fname), "%s/fine", prefix);
+    write_snapshot(fname, 100);
+    const int even = read_and_check(fname);
+    /* With several ranks the split follows the keys: the dark matter is denser at small keys*/
+    if(NTask > 1)
+        assert_false(even);
+    else
+        assert_true(even);
+}
+
+/* With one index chunk per type the split by key cannot balance the ranks, so the rows are split evenly*/
+static void
+test_restart_read_coarse_index(void ** state)
+{
+    char fname[2048];
+    snprintf(fname, sizeof(fname), "%s/coarse", prefix);
+    write_snapshot(fname, 1 << 20);
+    assert_true(read_and_check(fname));
+}
+
+static void
+set_io_params(int PipelineSnapshotBlocks, int AsyncSnapshotWrite, int NumWriters)
+{
+    ParameterSet * ps = parameter_set_new();
+    param_declare_int(ps, "BytesPerFile", OPTIONAL, 1024 * 1024 * 1024, "");
+    param_declare_int(ps, "NumWriters", OPTIONAL, NumWriters, "");
+    param_declare_int(ps, "MinNumWriters", OPTIONAL, 1, "");
+    param_declare_int(ps, "WritersPerFile", OPTIONAL, 8, "");
+    param_declare_int(ps, "AggregatedIOThreshold", OPTIONAL, 1024 * 1024 * 256, "");
+    param_declare_int(ps, "EnableAggregatedIO", OPTIONAL, 0, "");
+    param_declare_int(ps, "AsyncSnapshotWrite", OPTIONAL, AsyncSnapshotWrite, "");
+    param_declare_double(ps, "AsyncSnapshotMemSizePerNode", OPTIONAL, 0.2, "");
+    param_declare_int(ps, "RestartReadByKey", OPTIONAL, 1, "");
+    param_declare_int(ps, "PipelineSnapshotBlocks", OPTIONAL, PipelineSnapshotBlocks, "");
+    param_declare_int(ps, "SnapshotCompression", OPTIONAL, 0, "");
+    param_declare_double(ps, "CompressVelocityError", OPTIONAL, 0, "");
+    param_declare_double(ps, "CompressSphRelError", OPTIONAL, 0, "");
+    param_declare_int(ps, "IOCalibrate", OPTIONAL, 0, "");
+    param_declare_int(ps, "IOCalibrateBytes", OPTIONAL, 0, "");
+    char * error;
+    param_parse(ps, "", &error);
+    set_petaio_params(ps);
+}
+
+static int
+setup_petaio(void ** state)
+{
+    set_io_params(0, 0, 2);
+
+    int ptype;
+    All.TotNumPartInit = 0;
+    for(ptype = 0; ptype < 6; ptype++)
+        All.TotNumPartInit += NTotal[ptype];
+    All.PartAllocFactor = 2;
+    All.MassiveNuLinRespOn = 0;
+    All.BoxSize = 1;
+    All.cf.a = 1;
+    All.cf.hubble = 1;
+
+    slots_init(0.01, SlotsManager);
+    slots_set_enabled(0, sizeof(struct sph_particle_data), SlotsManager);
+
+    int ThisTask;
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    int fail = 0;
+    if(ThisTask == 0) {
+        fail = !mkdtemp(prefix);
+        message(0, "UsingPrefix : '%s'\n", prefix);
+    }
+    MPI_Bcast(prefix, sizeof(prefix), MPI_CHAR, 0, MPI_COMM_WORLD);
+    MPI_Bcast(&fail, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    return fail;
+}
+
+/* Make particles with the rows of each type split evenly between ranks, in row order*/
+static void
+make_even_particles(void)
+{
+    int NTask, ThisTask;
+    MPI_Comm_size(MPI_COMM_WORLD, &NTask);
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    int NLocal[6];
+    int ptype, i = 0;
+    int64_t row;
+    for(ptype = 0; ptype < 6; ptype++)
+        NLocal[ptype] = (ThisTask + 1) * NTotal[ptype] / NTask - ThisTask * NTotal[ptype] / NTask;
+    particle_alloc_memory(2 * All.TotNumPartInit / NTask + 1);
+    slots_reserve(1, NLocal, SlotsManager);
+    slots_setup_topology(PartManager, NLocal, SlotsManager);
+    for(ptype = 0; ptype < 6; ptype++) {
+        for(row = ThisTask * NTotal[ptype] / NTask; row < (ThisTask + 1) * NTotal[ptype] / NTask; row++, i++) {
+            P[i].ID = id_offset(ptype) + row;
+            int d;
+            for(d = 0; d < 3; d++)
+                P[i].Pos[d] = (row + 0.5) / NTotal[ptype];
+        }
+    }
+    PartManager->NumPart = i;
+    slots_setup_id(PartManager, SlotsManager);
+}
+
+static void
+free_particles(void)
+{
+    slots_free(SlotsManager);
+    SlotsManager->Base = NULL;
+    myfree(P);
+}
+
+/* Several blocks per type, so that each pipeline buffer is filled while another block is written*/
+static void
+register_write_blocks(struct IOTable * IOTable)
+{
+    int ptype;
+    IOTable->used = 0;
+    IOTable->allocated = 12;
+    IOTable->ent = mymalloc2("IOTable", IOTable->allocated * sizeof(IOTableEntry));
+    for(ptype = 0; ptype < 6; ptype++) {
+        io_register_io_block("ID", "u8", 1, ptype, (property_getter) get_id, (property_setter) set_id, 1, IOTable);
+        io_register_io_block("Position", "f8", 3, ptype, (property_getter) get_pos, NULL, 1, IOTable);
+    }
+}
+
+/* Write a snapshot with the buffers of the next block filled while the current block is written,
+ * from rows split evenly between ranks, and read it back.*/
+static void
+test_pipelined_write(void ** state)
+{
+    set_io_params(1, 0, 2);
+    make_even_particles();
+    struct IOTable IOTable = {0};
+    register_write_blocks(&IOTable);
+    petaio_save_snapshot(&IOTable, 1, "%s/pipelined", prefix);
+    destroy_io_blocks(&IOTable);
+    free_particles();
+    set_io_params(0, 0, 2);
+
+    char fname[2048];
+    snprintf(fname, sizeof(fname), "%s/pipelined", prefix);
+    check_write_gbps(fname);
+    read_and_check(fname);
+}
+
+/* Write a snapshot in the background with one writer at a time, so that each rank is a wave of its own,
+ * and read it back. The particles are freed before the write finishes.*/
+static void
+test_async_write(void ** state)
+{
+    int NTask;
+    MPI_Comm_size(MPI_COMM_WORLD, &NTask);
+    set_io_params(0, 1, 1);
+    make_even_particles();
+    struct IOTable IOTable = {0};
+    register_write_blocks(&IOTable);
+    assert_true(petaio_save_snapshot_async(&IOTable, "%s/async", prefix));
+    destroy_io_blocks(&IOTable);
+    free_particles();
+    /* As in the run loop, but fewer steps than waves: the rest are started by petaio_finish_async_write*/
+    int step;
+    for(step = 0; step < NTask / 2; step++)
+        petaio_progress_async_write();
+    assert_true(petaio_finish_async_write());
+    assert_false(petaio_finish_async_write());
+    set_io_params(0, 0, 2);
+
+    char fname[2048];
+    snprintf(fname, sizeof(fname), "%s/async", prefix);
+    check_write_gbps(fname);
+    read_and_check(fname);
+}
+
+/* A grid of GRIDN^3 dark matter particles, more than one chunk of the spatial index per rank*/
+#define GRIDN 64
+
+struct GridKey {
+    peano_t key;
+    int64_t id;
+};
+
+static int
+order_by_key(const void * a, const void * b)
+{
+    const struct GridKey * ka = a, * kb = b;
+    return (ka->key > kb->key) - (ka->key < kb->key);
+}
+
+static void
+grid_pos(int64_t id, double * pos)
+{
+    pos[0] = (id / (GRIDN * GRIDN) + 0.5) / GRIDN;
+    pos[1] = (id / GRIDN % GRIDN + 0.5) / GRIDN;
+    pos[2] = (id % GRIDN + 0.5) / GRIDN;
+}
+
+static int
+in_box(const double * pos, const double * low, const double * high)
+{
+    int d;
+    for(d = 0; d < 3; d++)
+        if(pos[d] < low[d] || pos[d] > high[d])
+            return 0;
+    return 1;
+}
+
+/* Read the IDs and positions of a region, and check that the rows of the particles which
+ * pass select are exactly the particles of the grid which pass it*/
+static void
+check_region(BigFile * bf, const struct PetaIORegion * region, int (*select)(const double * pos, const void * data), const void * data)
+{
+    const int64_t ntot = GRIDN * GRIDN * GRIDN;
+    int64_t nexpected = 0, i;
+    for(i = 0; i < ntot; i++) {
+        double pos[3];
+        grid_pos(i, pos);
+        nexpected += select(pos, data);
+    }
+    assert_true(nexpected > 0);
+    /* The index narrows the read down*/
+    assert_true(region->nrows < ntot / 2);
+
+    uint64_t * id = malloc(sizeof(uint64_t) * (region->nrows + 1));
+    double * pos = malloc(sizeof(double) * 3 * (region->nrows + 1));
+    BigArray idarray = {0}, posarray = {0};
+    size_t iddims[2] = {region->nrows, 1}, posdims[2] = {region->nrows, 3};
+    big_array_init(&idarray, id, "u8", 2, iddims, NULL);
+    big_array_init(&posarray, pos, "f8", 2, posdims, NULL);
+    assert_int_equal(petaio_read_region(bf, "1/ID", region, &idarray), 0);
+    assert_int_equal(petaio_read_region(bf, "1/Position", region, &posarray), 0);
+
+    char * seen = calloc(ntot, 1);
+    int64_t nfound = 0;
+    for(i = 0; i < region->nrows; i++) {
+        double gpos[3];
+        assert_true(id[i] < (uint64_t) ntot);
+        /* Each row once, with the position of its particle*/
+        assert_int_equal(seen[id[i]], 0);
+        seen[id[i]] = 1;
+        grid_pos(id[i], gpos);
+        assert_true(gpos[0] == pos[3 * i] && gpos[1] == pos[3 * i + 1] && gpos[2] == pos[3 * i + 2]);
+        nfound += select(&pos[3 * i], data);
+    }
+    assert_int_equal(nfound, nexpected);
+    free(seen);
+    free(pos);
+    free(id);
+}
+
+static int
+select_box(const double * pos, const void * data)
+{
+    const double * box = data;
+    return in_box(pos, box, box + 3);
+}
+
+static int
+select_keys(const double * pos, const void * data)
+{
+    const peano_t * keys = data;
+    double p[3] = {pos[0], pos[1], pos[2]};
+    const peano_t key = PEANO(p, 1);
+    return key >= keys[0] && key <= keys[1];
+}
+
+/* Write a snapshot of a grid of particles in Peano order with petaio_save_snapshot, which saves
+ * the spatial index, then read the particles of a box and of a range of keys.*/
+static void
+test_region_read(void ** state)
+{
+    int NTask, ThisTask;
+    MPI_Comm_size(MPI_COMM_WORLD, &NTask);
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    const int64_t ntot = GRIDN * GRIDN * GRIDN;
+
+    /* The rows of a rank are in Peano order, as after slots_gc_sorted*/
+    struct GridKey * grid = malloc(sizeof(struct GridKey) * ntot);
+    int64_t i;
+    for(i = 0; i < ntot; i++) {
+        double pos[3];
+        grid_pos(i, pos);
+        grid[i].key = PEANO(pos, 1);
+        grid[i].id = i;
+    }
+    qsort(grid, ntot, sizeof(struct GridKey), order_by_key);
+
+    const int64_t start = ThisTask * ntot / NTask, end = (ThisTask + 1) * ntot / NTask;
+    int NLocal[6] = {0};
+    NLocal[1] = end - start;
+    particle_alloc_memory(NLocal[1] + 1);
+    slots_reserve(1, NLocal, SlotsManager);
+    slots_setup_topology(PartManager, NLocal, SlotsManager);
+    for(i = start; i < end; i++) {
+        P[i - start].ID = grid[i].id;
+        grid_pos(grid[i].id, P[i - start].Pos);
+    }
+    PartManager->NumPart = end - start;
+    slots_setup_id(PartManager, SlotsManager);
+    free(grid);
+
+    struct IOTable IOTable = {0};
+    register_write_blocks(&IOTable);
+    petaio_save_snapshot(&IOTable, 0, "%s/region", prefix);
+    destroy_io_blocks(&IOTable);
+    free_particles();
+
+    char fname[2048];
+    snprintf(fname, sizeof(fname), "%s/region", prefix);
+    BigFile bf = {0};
+    assert_int_equal(big_file_open(&bf, fname), 0);
+
+    const double box[6] = {0.05, 0.3, 0.1, 0.35, 0.45, 0.4};
+    struct PetaIORegion region = {0};
+    assert_int_equal(petaio_region_from_box(&bf, 1, box, box + 3, &region), 0);
+    check_region(&bf, &region, select_box, box);
+    petaio_free_region(&region);
+
+    /* The third eighth of the curve*/
+    const peano_t keys[2] = {PEANOCELLS / 4, PEANOCELLS / 4 + PEANOCELLS / 8 - 1};
+    assert_int_equal(petaio_region_from_keys(&bf, 1, keys[0], keys[1], &region), 0);
+    check_region(&bf, &region, select_keys, keys);
+    petaio_free_region(&region);
+    assert_int_equal(big_file_close(&bf), 0);
+}
+
+static int
+remove_entry(const char * path, const struct stat * st, int flag, struct FTW * ftw)
+{
+    return remove(path);
+}
+
+static int
+teardown_petaio(void ** state)
+{
+    int ThisTask;
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    if(ThisTask == 0)
+        return nftw(prefix, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+    return 0;
+}
+
+int main(void) {
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_restart_read_by_key),
+        cmocka_unit_test(test_restart_read_coarse_index),
+        cmocka_unit_test(test_pipelined_write),
+        cmocka_unit_test(test_async_write),
+        cmocka_unit_test(test_region_read),
+    };
+    return cmocka_run_group_tests_mpi(tests, setup_petaio, teardown_petaio);
+}
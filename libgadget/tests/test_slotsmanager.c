@@ -220,6 +220,37 @@ test_slots_convert(void **state)
     return;
 }
 
+static void
+test_slots_chunk(void **state)
+{
+    setup_particles(state);
+    struct slots_chunk chunks[2] = {0};
+    /* Two interleaved blocks of star slots: the first thread converts 3 particles, the second 1.*/
+    int i;
+    for(i = 0; i < 3; i ++)
+        slots_convert(i, 4, slots_chunk_get(&chunks[0], 4, 4, SlotsManager), PartManager, SlotsManager);
+    slots_convert(3, 4, slots_chunk_get(&chunks[1], 4, 4, SlotsManager), PartManager, SlotsManager);
+
+    assert_int_equal(P[0].PI, 128);
+    assert_int_equal(P[2].PI, 130);
+    assert_int_equal(P[3].PI, 132);
+    assert_int_equal(SlotsManager->info[4].size, 136);
+
+    /* The top block is trimmed, the unused slot in the lower block becomes garbage*/
+    slots_chunk_release(chunks, 2, 4, PartManager, SlotsManager);
+    assert_int_equal(SlotsManager->info[4].size, 133);
+    assert_true(BASESLOT_PI(131, 4, SlotsManager)->ReverseLink > PartManager->MaxPart);
+
+    int compact[6] = {0, 0, 0, 0, 1, 0};
+    slots_gc(compact, PartManager, SlotsManager);
+    assert_int_equal(SlotsManager->info[4].size, 132);
+    assert_int_equal(P[3].PI, 131);
+    slots_check_id_consistency(PartManager, SlotsManager);
+
+    teardown_particles(state);
+    return;
+}
+
 int main(void) {
     const struct CMUnitTest tests[] = {
         cmocka_unit_test(test_slots_gc),
@@ -228,6 +259,7 @@ int main(void) {
         cmocka_unit_test(test_slots_fork),
         cmocka_unit_test(test_slots_convert),
         cmocka_unit_test(test_slots_zero),
+        cmocka_unit_test(test_slots_chunk),
     };
     return cmocka_run_group_tests_mpi(tests, NULL, NULL);
 }
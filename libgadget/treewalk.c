@@ -36,6 +36,8 @@ struct TreeWalkThreadLocals
 
 /*!< Memory factor to leave for (N imported particles) > (N exported particles). */
 static int ImportBufferBoost;
+/* Maximum number of particles exported in one iteration. 0 means limited only by memory.*/
+static size_t MaxExportBufferSize;
 
 static struct data_nodelist
 {
@@ -69,6 +71,13 @@ void set_treewalk_params(ParameterSet * ps)
     MPI_Bcast(&ImportBufferBoost, 1, MPI_INT, 0, MPI_COMM_WORLD);
 }
 
+/* Limit the size of the export buffer, so that the tests can exercise the code path for a full buffer*/
+void
+treewalk_set_max_export_buffer(size_t maxexport)
+{
+    MaxExportBufferSize = maxexport;
+}
+
 static void ev_init_thread(const struct TreeWalkThreadLocals export, TreeWalk * const tw, LocalTreeWalk * lv);
 static void ev_begin(TreeWalk * tw, int * active_set, const size_t size);
 static void ev_finish(TreeWalk * tw);
@@ -201,6 +210,9 @@ ev_begin(TreeWalk * tw, int * active_set, const size_t size)
     if(tw->BunchSize < 100)
         endrun(2,"Only enough free memory to export %d elements.\n", tw->BunchSize);
 
+    if(MaxExportBufferSize > 0 && tw->BunchSize > MaxExportBufferSize)
+        tw->BunchSize = MaxExportBufferSize;
+
     DataIndexTable =
         (struct data_index *) mymalloc("DataIndexTable", tw->BunchSize * sizeof(struct data_index));
     DataNodeList =
@@ -856,6 +868,49 @@ static void fill_task_queue (TreeWalk * tw, struct ev_task * tq, int * pq, int l
 }
 #endif
 
+/* Check whether a candidate particle is a neighbour of the query, and if so call ngbiter on it.*/
+static inline void
+treewalk_ngbiter_candidate(TreeWalkQueryBase * I, TreeWalkResultBase * O, TreeWalkNgbIterBase * iter, const int other, const double BoxSize, LocalTreeWalk * lv)
+{
+    /* Skip garbage*/
+    if(P[other].IsGarbage)
+        return;
+
+    /* must be the correct type */
+    if(!((1<<P[other].Type) & iter->mask))
+        return;
+
+    /* must be the correct time bin */
+    if(lv->tw->type == TREEWALK_SPLIT && !(BINMASK(P[other].TimeBin) & lv->tw->bgmask))
+        return;
+
+    double dist;
+
+    if(iter->symmetric == NGB_TREEFIND_SYMMETRIC) {
+        dist = DMAX(P[other].Hsml, iter->Hsml);
+    } else {
+        dist = iter->Hsml;
+    }
+
+    double r2 = 0;
+    int d;
+    double h2 = dist * dist;
+    for(d = 0; d < 3; d ++) {
+        /* the distance vector points to 'other' */
+        iter->dist[d] = NEAREST(I->Pos[d] - P[other].Pos[d], BoxSize);
+        r2 += iter->dist[d] * iter->dist[d];
+        if(r2 > h2) break;
+    }
+    if(r2 > h2) return;
+
+    /* update the iter and call the iteration function*/
+    iter->r2 = r2;
+    iter->r = sqrt(r2);
+    iter->other = other;
+
+    lv->tw->ngbiter(I, O, iter, lv);
+}
+
 /**********
  *
  * This particular TreeWalkVisitFunction that uses the nbgiter memeber of
@@ -897,47 +952,8 @@ int treewalk_visit_ngbiter(TreeWalkQueryBase * I,
          * filter out all of the candidates that are actually outside. */
         int numngb;
 
-        for(numngb = 0; numngb < numcand; numngb ++) {
-            int other = lv->ngblist[numngb];
-
-            /* Skip garbage*/
-            if(P[other].IsGarbage)
-                continue;
-
-            /* must be the correct type */
-            if(!((1<<P[other].Type) & iter->mask))
-                continue;
-
-            /* must be the correct time bin */
-            if(lv->tw->type == TREEWALK_SPLIT && !(BINMASK(P[other].TimeBin) & lv->tw->bgmask))
-                continue;
-
-            double dist;
-
-            if(iter->symmetric == NGB_TREEFIND_SYMMETRIC) {
-                dist = DMAX(P[other].Hsml, iter->Hsml);
-            } else {
-                dist = iter->Hsml;
-            }
-
-            double r2 = 0;
-            int d;
-            double h2 = dist * dist;
-            for(d = 0; d < 3; d ++) {
-                /* the distance vector points to 'other' */
-                iter->dist[d] = NEAREST(I->Pos[d] - P[other].Pos[d], BoxSize);
-                r2 += iter->dist[d] * iter->dist[d];
-                if(r2 > h2) break;
-            }
-            if(r2 > h2) continue;
-
-            /* update the iter and call the iteration function*/
-            iter->r2 = r2;
-            iter->r = sqrt(r2);
-            iter->other = other;
-
-            lv->tw->ngbiter(I, O, iter, lv);
-        }
+        for(numngb = 0; numngb < numcand; numngb ++)
+            treewalk_ngbiter_candidate(I, O, iter, lv->ngblist[numngb], BoxSize, lv);
 
         ninteractions += numngb;
     }
@@ -1073,3 +1089,260 @@ ngb_treefind_threads(TreeWalkQueryBase * I,
     return numcand;
 }
 
+/* Walk the whole local tree for one query, calling ngbiter on each local neighbour.
+ * Pseudo particles are skipped: every rank sees every query, so nothing is exported.
+ * Candidates are visited as soon as they are found, so no neighbour list is needed.*/
+static void
+treewalk_visit_ngbiter_local(TreeWalkQueryBase * I, TreeWalkResultBase * O, LocalTreeWalk * lv)
+{
+    TreeWalkNgbIterBase * iter = alloca(lv->tw->ngbiter_type_elsize);
+
+    /* Kick-start the iteration with other == -1 */
+    iter->other = -1;
+    lv->tw->ngbiter(I, O, iter, lv);
+
+    const ForceTree * tree = lv->tw->tree;
+    const double BoxSize = tree->BoxSize;
+    int no = tree->firstnode;
+
+    while(no >= 0)
+    {
+        struct NODE *current = &tree->Nodes[no];
+
+        if(0 == cull_node(I, iter, current, BoxSize) || current->f.ChildType == PSEUDO_NODE_TYPE) {
+            no = current->sibling;
+            continue;
+        }
+
+        if(current->f.ChildType == PARTICLE_NODE_TYPE) {
+            int i;
+            for (i = 0; i < current->s.noccupied; i++)
+                treewalk_ngbiter_candidate(I, O, iter, current->s.suns[i], BoxSize, lv);
+            lv->Ninteractions += current->s.noccupied;
+            no = current->sibling;
+            continue;
+        }
+        /* ok, we need to open the node */
+        no = current->s.suns[0];
+    }
+}
+
+void
+treewalk_visit_local(TreeWalk * tw, char * queries, char * results, const size_t nquery)
+{
+    #pragma omp parallel
+    {
+        size_t j;
+        LocalTreeWalk lv[1] = {{0}};
+        lv->tw = tw;
+        lv->mode = 1;
+        lv->target = -1;
+        #pragma omp for schedule(dynamic, 8)
+        for(j = 0; j < nquery; j++) {
+            TreeWalkQueryBase * input = (TreeWalkQueryBase*) (queries + j * tw->query_type_elsize);
+            TreeWalkResultBase * output = (TreeWalkResultBase*)(results + j * tw->result_type_elsize);
+            treewalk_init_result(tw, output, input);
+            if(tw->visit == (TreeWalkVisitFunction) treewalk_visit_ngbiter)
+                treewalk_visit_ngbiter_local(input, output, lv);
+            else
+                tw->visit(input, output, lv);
+        }
+    }
+}
+
+/* Run a treewalk on the local tree only. Each particle is visited once in mode 0,
+ * pseudo particles are skipped and nothing is exported or communicated.*/
+void
+treewalk_run_local(TreeWalk * tw, int * active_set, size_t size)
+{
+    if(!force_tree_allocated(tw->tree)) {
+        endrun(0, "Tree has been freed before this treewalk.\n");
+    }
+    GDB_current_ev = tw;
+
+    tw->NThread = omp_get_max_threads();
+
+    treewalk_build_queue(tw, active_set, size, 0);
+
+    if(tw->preprocess) {
+        int i;
+        #pragma omp parallel for
+        for(i = 0; i < tw->WorkSetSize; i ++) {
+            const int p_i = tw->WorkSet ? tw->WorkSet[i] : i;
+            tw->preprocess(p_i, tw);
+        }
+    }
+
+    double tstart, tend;
+    tstart = second();
+    #pragma omp parallel
+    {
+        int k;
+        LocalTreeWalk lv[1] = {{0}};
+        lv->tw = tw;
+        lv->mode = 0;
+        TreeWalkQueryBase * input = alloca(tw->query_type_elsize);
+        TreeWalkResultBase * output = alloca(tw->result_type_elsize);
+        #pragma omp for schedule(dynamic, 64)
+        for(k = 0; k < tw->WorkSetSize; k++) {
+            const int i = tw->WorkSet ? tw->WorkSet[k] : k;
+            lv->target = i;
+            treewalk_init_query(tw, input, i, NULL);
+            treewalk_init_result(tw, output, input);
+            if(tw->visit == (TreeWalkVisitFunction) treewalk_visit_ngbiter)
+                treewalk_visit_ngbiter_local(input, output, lv);
+            else
+                tw->visit(input, output, lv);
+            treewalk_reduce_result(tw, output, i, TREEWALK_PRIMARY);
+        }
+    }
+    tend = second();
+    tw->timecomp1 += timediff(tstart, tend);
+
+    tstart = second();
+    if(tw->postprocess) {
+        int i;
+        #pragma omp parallel for
+        for(i = 0; i < tw->WorkSetSize; i ++) {
+            const int p_i = tw->WorkSet ? tw->WorkSet[i] : i;
+            tw->postprocess(p_i, tw);
+        }
+    }
+    tend = second();
+    tw->timecomp3 = timediff(tstart, tend);
+
+    if(!tw->work_set_stolen_from_active)
+        myfree(tw->WorkSet);
+}
+
+/* Run a neighbour treewalk by giving every query to every rank.
+ *
+ * Each rank walks its local tree for all queries in one threaded pass,
+ * and the partial results are sent back to the rank owning the query.
+ * This avoids the export buffers, node lists and repeated
+ * communication rounds of treewalk_run, at the cost of walking
+ * the whole query set on every rank. It is faster when the global
+ * number of queries is small, such as for black holes.
+ *
+ * The owning rank's partial result is reduced with TREEWALK_PRIMARY, the others with TREEWALK_GHOSTS.
+ * Ghost evaluations have lv->mode == 1, including those of local queries.
+ * tw->visit must be treewalk_visit_ngbiter.*/
+void
+treewalk_run_allgather(TreeWalk * tw, int * active_set, size_t size)
+{
+    if(!force_tree_allocated(tw->tree)) {
+        endrun(0, "Tree has been freed before this treewalk.\n");
+    }
+    GDB_current_ev = tw;
+
+    int ThisTask;
+    MPI_Comm_size(MPI_COMM_WORLD, &tw->NTask);
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    tw->NThread = omp_get_max_threads();
+    const int NTask = tw->NTask;
+
+    treewalk_build_queue(tw, active_set, size, 0);
+
+    if(tw->preprocess) {
+        int i;
+        #pragma omp parallel for
+        for(i = 0; i < tw->WorkSetSize; i ++) {
+            const int p_i = tw->WorkSet ? tw->WorkSet[i] : i;
+            tw->preprocess(p_i, tw);
+        }
+    }
+
+    double tstart, tend;
+    tstart = second();
+
+    MPI_Datatype query_type, result_type;
+    MPI_Type_contiguous(tw->query_type_elsize, MPI_BYTE, &query_type);
+    MPI_Type_commit(&query_type);
+    MPI_Type_contiguous(tw->result_type_elsize, MPI_BYTE, &result_type);
+    MPI_Type_commit(&result_type);
+
+    int * Query_count = ta_malloc("Query_count", int, 4 * NTask);
+    int * Query_offset = Query_count + NTask;
+    int * Result_count = Query_count + 2 * NTask;
+    int * Result_offset = Query_count + 3 * NTask;
+
+    MPI_Allgather(&tw->WorkSetSize, 1, MPI_INT, Query_count, 1, MPI_INT, MPI_COMM_WORLD);
+    int i;
+    size_t Nquery = 0;
+    for(i = 0; i < NTask; i++) {
+        Query_offset[i] = Nquery;
+        Nquery += Query_count[i];
+        Result_count[i] = tw->WorkSetSize;
+        Result_offset[i] = i * tw->WorkSetSize;
+    }
+    tw->Nimport = Nquery;
+    tw->Nexport = tw->WorkSetSize;
+
+    tw->dataget = mymalloc("EvDataGet", Nquery * tw->query_type_elsize);
+    char * sendbuf = mymalloc("EvDataIn", tw->WorkSetSize * tw->query_type_elsize);
+
+    #pragma omp parallel for
+    for(i = 0; i < tw->WorkSetSize; i++) {
+        const int p_i = tw->WorkSet ? tw->WorkSet[i] : i;
+        treewalk_init_query(tw, (TreeWalkQueryBase *) (sendbuf + i * tw->query_type_elsize), p_i, NULL);
+    }
+
+    MPI_Allgatherv(sendbuf, tw->WorkSetSize, query_type, tw->dataget, Query_count, Query_offset, query_type, MPI_COMM_WORLD);
+    myfree(sendbuf);
+    tend = second();
+    tw->timecommsumm1 += timediff(tstart, tend);
+
+    tstart = second();
+    tw->dataresult = mymalloc("EvDataResult", Nquery * tw->result_type_elsize);
+    treewalk_visit_local(tw, tw->dataget, tw->dataresult, Nquery);
+    tend = second();
+    tw->timecomp2 += timediff(tstart, tend);
+
+    tstart = second();
+    /* Send each partial result back to the rank which owns the query*/
+    char * recvbuf = mymalloc("EvDataOut", NTask * tw->WorkSetSize * tw->result_type_elsize);
+    MPI_Alltoallv(tw->dataresult, Query_count, Query_offset, result_type,
+            recvbuf, Result_count, Result_offset, result_type, MPI_COMM_WORLD);
+    tend = second();
+    tw->timecommsumm2 += timediff(tstart, tend);
+
+    tstart = second();
+    #pragma omp parallel for
+    for(i = 0; i < tw->WorkSetSize; i++) {
+        const int p_i = tw->WorkSet ? tw->WorkSet[i] : i;
+        /* The result from this rank goes first, as the primary reduction overwrites.*/
+        TreeWalkResultBase * output = (TreeWalkResultBase*) (recvbuf + (Result_offset[ThisTask] + i) * tw->result_type_elsize);
+        treewalk_reduce_result(tw, output, p_i, TREEWALK_PRIMARY);
+        int task;
+        for(task = 0; task < NTask; task++) {
+            if(task == ThisTask)
+                continue;
+            output = (TreeWalkResultBase*) (recvbuf + (Result_offset[task] + i) * tw->result_type_elsize);
+            treewalk_reduce_result(tw, output, p_i, TREEWALK_GHOSTS);
+        }
+    }
+    myfree(recvbuf);
+    myfree(tw->dataresult);
+    myfree(tw->dataget);
+    ta_free(Query_count);
+    MPI_Type_free(&result_type);
+    MPI_Type_free(&query_type);
+    tw->Niterations ++;
+    tw->Nexport_sum += tw->Nexport;
+    tend = second();
+    tw->timecomp1 += timediff(tstart, tend);
+
+    tstart = second();
+    if(tw->postprocess) {
+        #pragma omp parallel for
+        for(i = 0; i < tw->WorkSetSize; i ++) {
+            const int p_i = tw->WorkSet ? tw->WorkSet[i] : i;
+            tw->postprocess(p_i, tw);
+        }
+    }
+    tend = second();
+    tw->timecomp3 = timediff(tstart, tend);
+
+    if(!tw->work_set_stolen_from_active)
+        myfree(tw->WorkSet);
+}
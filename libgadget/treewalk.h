@@ -152,11 +152,40 @@ struct TreeWalk {
 /*Initialise treewalk parameters on first run*/
 void set_treewalk_params(ParameterSet * ps);
 
+/* Limit the number of particles exported in each iteration of treewalk_run.
+ * 0 (the default) means the export buffer uses all free memory.
+ * Used by the tests to force the export buffer to fill.*/
+void treewalk_set_max_export_buffer(size_t maxexport);
+
 /* Do the distributed tree walking. Warning: as this is a threaded treewalk,
  * it may call tw->visit on particles more than once and in a noneterministic order.
  * Your module should behave correctly in this case! */
 void treewalk_run(TreeWalk * tw, int * active_set, size_t size);
 
+/* As treewalk_run, but every rank evaluates every query against its local particles,
+ * instead of exporting queries to the ranks they overlap. Use for small query sets, such as black holes.
+ * treewalk_visit_ngbiter walks the local tree directly; any other visit function is called
+ * once per query with lv->mode == 1 and must only touch local particles.
+ * During the walk the queries of all ranks are stored in rank order in tw->dataget.*/
+void treewalk_run_allgather(TreeWalk * tw, int * active_set, size_t size);
+
+/* As treewalk_run, but only the local tree is walked: neighbours on other ranks are not found
+ * and nothing is exported. Visit functions see lv->mode == 0 and results are reduced with TREEWALK_PRIMARY.
+ * A visit function other than treewalk_visit_ngbiter must not export.*/
+void treewalk_run_local(TreeWalk * tw, int * active_set, size_t size);
+
+/* Evaluate nquery queries, stored contiguously in queries, against the local tree,
+ * writing the results to results. Visit functions see lv->mode == 1 and lv->target == -1,
+ * as in treewalk_run_allgather. No reduction is done.*/
+void treewalk_visit_local(TreeWalk * tw, char * queries, char * results, const size_t nquery);
+
+/* Index of a query in the gathered query array of treewalk_run_allgather.*/
+static inline size_t
+treewalk_allgather_index(const TreeWalk * tw, const TreeWalkQueryBase * I)
+{
+    return ((const char *) I - tw->dataget) / tw->query_type_elsize;
+}
+
 int treewalk_visit_ngbiter(TreeWalkQueryBase * I,
             TreeWalkResultBase * O,
             LocalTreeWalk * lv);
@@ -523,6 +523,32 @@ get_physmem_bytes(void)
     return 64 * 1024 * 1024;
 }
 
+double
+get_available_memory_bytes(void)
+{
+    /* MemAvailable on linux also counts the page cache which can be reclaimed*/
+    FILE * fd = fopen("/proc/meminfo", "r");
+    if(fd) {
+        char line[256];
+        double kb = -1;
+        while(fgets(line, sizeof(line), fd))
+            if(1 == sscanf(line, "MemAvailable: %lf kB", &kb))
+                break;
+        fclose(fd);
+        if(kb >= 0)
+            return kb * 1024;
+    }
+#if defined _SC_AVPHYS_PAGES && defined _SC_PAGESIZE
+    {
+        double pages = sysconf (_SC_AVPHYS_PAGES);
+        double pagesize = sysconf (_SC_PAGESIZE);
+        if (0 <= pages && 0 <= pagesize)
+            return pages * pagesize;
+    }
+#endif
+    return get_physmem_bytes();
+}
+
 /**
  * A fancy MPI barrier (use MPIU_Barrier macro)
  *
@@ -23,6 +23,8 @@ void enable_core_dumps_and_fpu_exceptions(void);
 
 int cluster_get_num_hosts(void);
 double get_physmem_bytes(void);
+/* Memory the node can give to new allocations now, in bytes*/
+double get_available_memory_bytes(void);
 
 /* Gets a random number in the range [0, 1). Only the low bits of the id are used,
  * and random deviates are drawn from a pre-seeded table so that they are independent of processor.*/
@@ -25,6 +25,8 @@ static struct WindParams
     /* used in OFJT10*/
     double WindSigma0;
     double WindSpeedFactor;
+    /* Gather the new stars on every rank if there are at most this many*/
+    int WindAllgatherMax;
 } wind_params;
 
 
@@ -73,6 +75,7 @@ void set_winds_params(ParameterSet * ps)
 
         wind_params.WindFreeTravelLength = param_get_double(ps, "WindFreeTravelLength");
         wind_params.WindFreeTravelDensFac = param_get_double(ps, "WindFreeTravelDensFac");
+        wind_params.WindAllgatherMax = param_get_int(ps, "WindAllgatherMax");
     }
     MPI_Bcast(&wind_params, sizeof(struct WindParams), MPI_BYTE, 0, MPI_COMM_WORLD);
 }
@@ -141,6 +144,11 @@ sfr_wind_feedback_ngbiter(TreeWalkQueryWind * I,
         TreeWalkNgbIterWind * iter,
         LocalTreeWalk * lv);
 
+static int
+sfr_wind_feedback_visit_cached(TreeWalkQueryWind * I,
+        TreeWalkResultWind * O,
+        LocalTreeWalk * lv);
+
 struct winddata {
     double DMRadius;
     double Left;
@@ -154,6 +162,14 @@ struct winddata {
     int Ngb;
 };
 
+/* Maximum number of gas neighbours of one star cached on one rank*/
+#define WIND_NGB_CACHE 128
+
+struct WindNgb {
+    int other;
+    double r;
+};
+
 struct WindPriv {
     double Time;
     double hubble;
@@ -164,6 +180,12 @@ struct WindPriv {
     size_t * NPLeft;
     int** NPRedo;
     struct SpinLocks * spin;
+    /* Gas neighbours of each gathered star, WIND_NGB_CACHE per star.
+     * NgbCacheCount is -1 if a star has too many to cache.*/
+    struct WindNgb * NgbCache;
+    int * NgbCacheCount;
+    /* If true, the weight walk fills the neighbour cache*/
+    int RecordNgb;
 };
 
 #define WIND_GET_PRIV(tw) ((struct WindPriv *) (tw->priv))
@@ -197,16 +219,27 @@ winds_and_feedback(int * NewStars, int NumNewStars, const double Time, const dou
     tw->haswork = NULL;
     tw->visit = (TreeWalkVisitFunction) treewalk_visit_ngbiter;
     tw->postprocess = (TreeWalkProcessFunction) sfr_wind_weight_postprocess;
-    struct WindPriv priv[1];
+    struct WindPriv priv[1] = {0};
     priv[0].Time = Time;
     priv[0].hubble = hubble;
     tw->priv = priv;
 
     int64_t totalleft = 0;
     sumup_large_ints(1, &NumNewStars, &totalleft);
+    /* With few new stars, gather them on every rank. The gas neighbours found
+     * by the first weight walk are then kept for the feedback walk, which does
+     * not need to walk the tree again.*/
+    const int64_t NumGathered = totalleft;
+    const int allgather = NumGathered <= wind_params.WindAllgatherMax;
     priv->NPLeft = ta_malloc("NPLeft", size_t, NumThreads);
     priv->NPRedo = ta_malloc("NPRedo", int *, NumThreads);
     priv->Winddata = (struct winddata * ) mymalloc("WindExtraData", SlotsManager->info[4].size * sizeof(struct winddata));
+    if(allgather) {
+        priv->NgbCacheCount = (int *) mymalloc("WindNgbCount", NumGathered * sizeof(int));
+        priv->NgbCache = (struct WindNgb *) mymalloc("WindNgbCache", NumGathered * WIND_NGB_CACHE * sizeof(struct WindNgb));
+        memset(priv->NgbCacheCount, 0, NumGathered * sizeof(int));
+        priv->RecordNgb = 1;
+    }
 
     int i;
     /*Initialise the WINDP array*/
@@ -237,7 +270,12 @@ winds_and_feedback(int * NewStars, int NumNewStars, const double Time, const dou
         }
         gadget_setup_thread_arrays(ReDoQueue, WIND_GET_PRIV(tw)->NPRedo, WIND_GET_PRIV(tw)->NPLeft, size, NumThreads);
 
-        treewalk_run(tw, CurQueue, size);
+        if(allgather)
+            treewalk_run_allgather(tw, CurQueue, size);
+        else
+            treewalk_run(tw, CurQueue, size);
+        /* Only the first walk sees every star*/
+        priv->RecordNgb = 0;
 
         /* Now done with the current queue*/
         if(iter > 0)
@@ -283,7 +321,19 @@ winds_and_feedback(int * NewStars, int NumNewStars, const double Time, const dou
     message(0, "Starting feedback treewalk\n");
 
     priv->spin = init_spinlocks(SlotsManager->info[0].size);
-    treewalk_run(tw, NewStars, NumNewStars);
+    if(allgather) {
+        /* The stars are gathered in the same order as in the first weight walk,
+         * so the cached neighbours can be used unless some star overflowed the cache here.*/
+        int overflow = 0;
+        #pragma omp parallel for reduction(+: overflow)
+        for(i = 0; i < NumGathered; i++)
+            overflow += priv->NgbCacheCount[i] < 0;
+        if(!overflow)
+            tw->visit = (TreeWalkVisitFunction) sfr_wind_feedback_visit_cached;
+        treewalk_run_allgather(tw, NewStars, NumNewStars);
+    }
+    else
+        treewalk_run(tw, NewStars, NumNewStars);
     free_spinlocks(priv->spin);
     myfree(priv->StarID);
 
@@ -308,6 +358,10 @@ winds_and_feedback(int * NewStars, int NumNewStars, const double Time, const dou
 
     myfree(priv->StarDistance);
     myfree(priv->StarKickVelocity);
+    if(allgather) {
+        myfree(priv->NgbCache);
+        myfree(priv->NgbCacheCount);
+    }
     myfree(priv->Winddata);
     walltime_measure("/Cooling/Wind");
 }
@@ -396,6 +450,7 @@ sfr_wind_copy(int place, TreeWalkQueryWind * input, TreeWalk * tw)
     double dtime = get_dloga_for_bin(P[place].TimeBin) / WIND_GET_PRIV(tw)->hubble;
     struct winddata * Windd = WIND_GET_PRIV(tw)->Winddata;
 
+    input->ID = P[place].ID;
     input->Dt = dtime;
     input->Mass = P[place].Mass;
     input->Hsml = P[place].Hsml;
@@ -436,6 +491,20 @@ sfr_wind_weight_ngbiter(TreeWalkQueryWind * I,
         //double wk = density_kernel_wk(&kernel, r);
         double wk = 1.0;
         O->TotalWeight += wk * P[other].Mass;
+
+        /* Remember the gas neighbour for the feedback walk*/
+        struct WindPriv * priv = WIND_GET_PRIV(lv->tw);
+        if(priv->RecordNgb) {
+            const size_t j = treewalk_allgather_index(lv->tw, &I->base);
+            const int n = priv->NgbCacheCount[j];
+            if(n >= WIND_NGB_CACHE)
+                priv->NgbCacheCount[j] = -1;
+            else if(n >= 0) {
+                priv->NgbCache[j * WIND_NGB_CACHE + n].other = other;
+                priv->NgbCache[j * WIND_NGB_CACHE + n].r = r;
+                priv->NgbCacheCount[j] = n + 1;
+            }
+        }
     }
 
     if(P[other].Type == 1) {
@@ -474,6 +543,46 @@ get_wind_dir(int i, double dir[3]) {
     return 0;
 }
 
+/* Decide whether gas particle other, at distance r, is kicked by the star in I.*/
+static void
+sfr_wind_feedback_kick(TreeWalkQueryWind * I, const int other, const double r, TreeWalk * tw)
+{
+    /* No eligible gas particles not in wind*/
+    if(I->TotalWeight == 0) return;
+
+    double windeff=0;
+    double v=0;
+    if(HAS(wind_params.WindModel, WIND_FIXED_EFFICIENCY)) {
+        windeff = wind_params.WindEfficiency;
+        v = wind_params.WindSpeed * WIND_GET_PRIV(tw)->Time;
+    } else if(HAS(wind_params.WindModel, WIND_USE_HALO)) {
+        windeff = 1.0 / (I->Vdisp / WIND_GET_PRIV(tw)->Time / wind_params.WindSigma0);
+        windeff *= windeff;
+        v = wind_params.WindSpeedFactor * I->Vdisp;
+    } else {
+        endrun(1, "WindModel = 0x%X is strange. This shall not happen.\n", wind_params.WindModel);
+    }
+
+    double p = windeff * I->Mass / I->TotalWeight;
+    double random = get_random_number(I->ID + P[other].ID);
+
+    if (random < p) {
+        int PI = P[other].PI;
+        /* If this is the closest star, do the kick*/
+        lock_spinlock(PI, WIND_GET_PRIV(tw)->spin);
+        if(WIND_GET_PRIV(tw)->StarDistance[PI] > r ||
+            /* Break ties with ID*/
+            ((WIND_GET_PRIV(tw)->StarDistance[PI] == r) &&
+            (WIND_GET_PRIV(tw)->StarID[PI] < I->ID))
+        ) {
+            WIND_GET_PRIV(tw)->StarDistance[PI] = r;
+            WIND_GET_PRIV(tw)->StarID[PI] = I->ID;
+            WIND_GET_PRIV(tw)->StarKickVelocity[PI] = v;
+        }
+        unlock_spinlock(PI, WIND_GET_PRIV(tw)->spin);
+    }
+}
+
 static void
 sfr_wind_feedback_ngbiter(TreeWalkQueryWind * I,
         TreeWalkResultWind * O,
@@ -499,40 +608,24 @@ sfr_wind_feedback_ngbiter(TreeWalkQueryWind * I,
     /* skip earlier wind particles */
     if(SPHP(other).DelayTime > 0) return;
 
-    /* No eligible gas particles not in wind*/
-    if(I->TotalWeight == 0) return;
-
-    double windeff=0;
-    double v=0;
-    if(HAS(wind_params.WindModel, WIND_FIXED_EFFICIENCY)) {
-        windeff = wind_params.WindEfficiency;
-        v = wind_params.WindSpeed * WIND_GET_PRIV(lv->tw)->Time;
-    } else if(HAS(wind_params.WindModel, WIND_USE_HALO)) {
-        windeff = 1.0 / (I->Vdisp / WIND_GET_PRIV(lv->tw)->Time / wind_params.WindSigma0);
-        windeff *= windeff;
-        v = wind_params.WindSpeedFactor * I->Vdisp;
-    } else {
-        endrun(1, "WindModel = 0x%X is strange. This shall not happen.\n", wind_params.WindModel);
-    }
-
-    double p = windeff * I->Mass / I->TotalWeight;
-    double random = get_random_number(I->ID + P[other].ID);
+    sfr_wind_feedback_kick(I, other, r, lv->tw);
+}
 
-    if (random < p) {
-        int PI = P[other].PI;
-        /* If this is the closest star, do the kick*/
-        lock_spinlock(PI, WIND_GET_PRIV(lv->tw)->spin);
-        if(WIND_GET_PRIV(lv->tw)->StarDistance[PI] > r ||
-            /* Break ties with ID*/
-            ((WIND_GET_PRIV(lv->tw)->StarDistance[PI] == r) &&
-            (WIND_GET_PRIV(lv->tw)->StarID[PI] < I->ID))
-        ) {
-            WIND_GET_PRIV(lv->tw)->StarDistance[PI] = r;
-            WIND_GET_PRIV(lv->tw)->StarID[PI] = I->ID;
-            WIND_GET_PRIV(lv->tw)->StarKickVelocity[PI] = v;
-        }
-        unlock_spinlock(PI, WIND_GET_PRIV(lv->tw)->spin);
+/* Blow wind from a gathered star using the gas neighbours cached by the weight walk,
+ * which already skipped distant gas and earlier wind particles.*/
+static int
+sfr_wind_feedback_visit_cached(TreeWalkQueryWind * I,
+        TreeWalkResultWind * O,
+        LocalTreeWalk * lv)
+{
+    struct WindPriv * priv = WIND_GET_PRIV(lv->tw);
+    const size_t j = treewalk_allgather_index(lv->tw, &I->base);
+    int n;
+    for(n = 0; n < priv->NgbCacheCount[j]; n++) {
+        struct WindNgb * ngb = &priv->NgbCache[j * WIND_NGB_CACHE + n];
+        sfr_wind_feedback_kick(I, ngb->other, ngb->r, lv->tw);
     }
+    return 0;
 }
 
 int